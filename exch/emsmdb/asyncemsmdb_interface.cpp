@@ -23,6 +23,8 @@
 #include "emsmdb_interface.h"
 #include "emsmdb_ndr.h"
 #define WAITING_INTERVAL						300
+/* expiry wheel, one-second ticks; must span more than WAITING_INTERVAL */
+#define WHEEL_SLOTS								512
 
 #define FLAG_NOTIFICATION_PENDING				0x00000001
 
@@ -31,8 +33,8 @@ using namespace gromox;
 namespace {
 
 struct ASYNC_WAIT {
-	DOUBLE_LIST_NODE node;
-	time_t wait_time;
+	DOUBLE_LIST_NODE node, tnode; /* wakeup list, expiry wheel */
+	time_t expire_time;
 	char username[UADDR_SIZE];
 	uint16_t cxr;
 	uint32_t async_id;
@@ -55,6 +57,13 @@ static size_t g_tag_hash_max;
 static std::mutex g_list_lock, g_async_lock;
 static std::condition_variable g_waken_cond;
 static std::unordered_map<int, ASYNC_WAIT *> g_async_hash;
+/*
+ * Waits are additionally hung into the wheel slot of their expiry second, so
+ * that the scanner only looks at the waits that are actually due instead of
+ * at every pending one. Protected by g_async_lock, like the hashes.
+ */
+static DOUBLE_LIST g_wheel[WHEEL_SLOTS];
+static time_t g_wheel_tick; /* last second processed by the scanner */
 static alloc_limiter<ASYNC_WAIT> g_wait_allocator{"emsmdb.g_wait_allocator.d"};
 
 static void *aemsi_scanwork(void *);
@@ -73,6 +82,19 @@ void asyncemsmdb_interface_init(unsigned int threads_num)
 	g_threads_num = threads_num;
 	g_thread_ids.reserve(threads_num);
 	double_list_init(&g_wakeup_list);
+	for (auto &slot : g_wheel)
+		double_list_init(&slot);
+}
+
+static void aemsi_wheel_add(ASYNC_WAIT *pwait)
+{
+	pwait->tnode.pdata = pwait;
+	double_list_append_as_tail(&g_wheel[pwait->expire_time % WHEEL_SLOTS], &pwait->tnode);
+}
+
+static void aemsi_wheel_del(ASYNC_WAIT *pwait)
+{
+	double_list_remove(&g_wheel[pwait->expire_time % WHEEL_SLOTS], &pwait->tnode);
 }
 
 int asyncemsmdb_interface_run()
@@ -83,6 +105,7 @@ int asyncemsmdb_interface_run()
 	g_wait_allocator = alloc_limiter<ASYNC_WAIT>(2 * context_num,
 	                   "wait_allocator", "http.cfg:context_num");
 	g_tag_hash_max = context_num;
+	g_wheel_tick = time(nullptr);
 	g_notify_stop = false;
 	auto ret = pthread_create4(&g_scan_id, nullptr, aemsi_scanwork, nullptr);
 	if (ret != 0) {
@@ -113,6 +136,8 @@ void asyncemsmdb_interface_stop()
 {
 	if (!g_notify_stop) {
 		g_notify_stop = true;
+		std::unique_lock ll_hold(g_list_lock);
+		ll_hold.unlock();
 		g_waken_cond.notify_all();
 		if (!pthread_equal(g_scan_id, {})) {
 			pthread_kill(g_scan_id, SIGALRM);
@@ -126,11 +151,16 @@ void asyncemsmdb_interface_stop()
 	g_thread_ids.clear();
 	g_tag_hash.clear();
 	g_async_hash.clear();
+	for (auto &slot : g_wheel)
+		while (double_list_pop_front(&slot) != nullptr)
+			/* nothing */;
 }
 
 void asyncemsmdb_interface_free()
 {
 	double_list_free(&g_wakeup_list);
+	for (auto &slot : g_wheel)
+		double_list_free(&slot);
 }
 
 int asyncemsmdb_interface_async_wait(uint32_t async_id,
@@ -161,7 +191,8 @@ int asyncemsmdb_interface_async_wait(uint32_t async_id,
 	pwait->node.pdata = pwait;
 	pwait->async_id = async_id;
 	HX_strlower(pwait->username);
-	pwait->wait_time = time(nullptr);
+	/* expired by the scanner once more than WAITING_INTERVAL-3 seconds passed */
+	pwait->expire_time = time(nullptr) + WAITING_INTERVAL - 2;
 	if (async_id == 0)
 		pwait->out_payload.context_id = pout->flags_out;
 	else
@@ -185,8 +216,10 @@ int asyncemsmdb_interface_async_wait(uint32_t async_id,
 	}
 	try {
 		if (g_tag_hash.size() < g_tag_hash_max &&
-		    g_tag_hash.emplace(tmp_tag, pwait).second)
+		    g_tag_hash.emplace(tmp_tag, pwait).second) {
+			aemsi_wheel_add(pwait);
 			return DISPATCH_PENDING;
+		}
 	} catch (const std::bad_alloc &) {
 		mlog(LV_WARN, "W-1540: ENOMEM");
 	}
@@ -213,6 +246,7 @@ void asyncemsmdb_interface_reclaim(uint32_t async_id)
 	HX_strlower(tmp_tag);
 	g_tag_hash.erase(tmp_tag);
 	g_async_hash.erase(async_id);
+	aemsi_wheel_del(pwait);
 	as_hold.unlock();
 	g_wait_allocator.put(pwait);
 }
@@ -236,6 +270,7 @@ void asyncemsmdb_interface_remove(ACXH *pacxh)
 	if (pwait->async_id != 0)
 		g_async_hash.erase(pwait->async_id);
 	g_tag_hash.erase(iter);
+	aemsi_wheel_del(pwait);
 	as_hold.unlock();
 	g_wait_allocator.put(pwait);
 }
@@ -268,6 +303,7 @@ void asyncemsmdb_interface_wakeup(const char *username, uint16_t cxr)
 	g_tag_hash.erase(iter);
 	if (pwait->async_id != 0)
 		g_async_hash.erase(pwait->async_id);
+	aemsi_wheel_del(pwait);
 	as_hold.unlock();
 	std::unique_lock ll_hold(g_list_lock);
 	double_list_append_as_tail(&g_wakeup_list, &pwait->node);
@@ -278,51 +314,66 @@ void asyncemsmdb_interface_wakeup(const char *username, uint16_t cxr)
 static void *aemsi_thrwork(void *param)
 {
 	DOUBLE_LIST_NODE *pnode;
-	std::mutex g_cond_mutex;
 	
 	while (!g_notify_stop) {
-		std::unique_lock cm_hold(g_cond_mutex);
-		g_waken_cond.wait(cm_hold);
-		cm_hold.unlock();
- NEXT_WAKEUP:
+		/*
+		 * Wait on the list itself, so that wakeups queued while all
+		 * workers were busy are not left waiting for the next signal.
+		 */
+		std::unique_lock ll_hold(g_list_lock);
+		g_waken_cond.wait(ll_hold, []() {
+			return g_notify_stop || double_list_get_nodes_num(&g_wakeup_list) > 0;
+		});
 		if (g_notify_stop)
 			break;
-		std::unique_lock ll_hold(g_list_lock);
 		pnode = double_list_pop_front(&g_wakeup_list);
 		ll_hold.unlock();
-		if (pnode == nullptr)
-			continue;
-		asyncemsmdb_interface_activate(static_cast<ASYNC_WAIT *>(pnode->pdata), TRUE);
-		goto NEXT_WAKEUP;
+		if (pnode != nullptr)
+			asyncemsmdb_interface_activate(static_cast<ASYNC_WAIT *>(pnode->pdata), TRUE);
 	}
 	return nullptr;
 }
 
 static void *aemsi_scanwork(void *param)
 {
-	DOUBLE_LIST temp_list;
+	DOUBLE_LIST temp_list, keep_list;
 	DOUBLE_LIST_NODE *pnode;
 	
 	double_list_init(&temp_list);
+	double_list_init(&keep_list);
 	while (!g_notify_stop) {
 		sleep(1);
 		auto cur_time = time(nullptr);
 		std::unique_lock as_hold(g_async_lock);
-		for (auto iter = g_tag_hash.cbegin(); iter != g_tag_hash.end(); ){
-			auto pwait = iter->second;
-			if (cur_time - pwait->wait_time <= WAITING_INTERVAL - 3) {
-				++iter;
-				continue;
+		/* Visit only the slots of the seconds elapsed since the last run. */
+		if (cur_time - g_wheel_tick > WHEEL_SLOTS)
+			g_wheel_tick = cur_time - WHEEL_SLOTS;
+		for (; g_wheel_tick < cur_time; ++g_wheel_tick) {
+			auto &slot = g_wheel[(g_wheel_tick + 1) % WHEEL_SLOTS];
+			while ((pnode = double_list_pop_front(&slot)) != nullptr) {
+				auto pwait = static_cast<ASYNC_WAIT *>(pnode->pdata);
+				if (pwait->expire_time > cur_time) {
+					/* not yet (clock went backwards) */
+					double_list_append_as_tail(&keep_list, pnode);
+					continue;
+				}
+				char tmp_tag[TAG_SIZE];
+				snprintf(tmp_tag, std::size(tmp_tag), "%s:%d",
+				         pwait->username, static_cast<int>(pwait->cxr));
+				HX_strlower(tmp_tag);
+				g_tag_hash.erase(tmp_tag);
+				if (pwait->async_id != 0)
+					g_async_hash.erase(pwait->async_id);
+				double_list_append_as_tail(&temp_list, &pwait->node);
 			}
-			iter = g_tag_hash.erase(iter);
-			if (pwait->async_id != 0)
-				g_async_hash.erase(pwait->async_id);
-			double_list_append_as_tail(&temp_list, &pwait->node);
+			double_list_append_list(&slot, &keep_list);
+			double_list_init(&keep_list);
 		}
 		as_hold.unlock();
 		while ((pnode = double_list_pop_front(&temp_list)) != nullptr)
 			asyncemsmdb_interface_activate(static_cast<ASYNC_WAIT *>(pnode->pdata), FALSE);
 	}
 	double_list_free(&temp_list);
+	double_list_free(&keep_list);
 	return nullptr;
 }
@@ -1,8 +1,10 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 #include <cassert>
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <climits>
+#include <condition_variable>
 #include <csignal>
 #include <cstdint>
 #include <cstdio>
@@ -68,6 +70,9 @@ struct HANDLE_DATA {
 	char username[UADDR_SIZE]{};
 	BOOL b_processing = false; /* if the handle is processing rops */
 	BOOL b_occupied = false; /* if the notify list is locked */
+	/* threads waiting for either flag to clear; blocks removal */
+	unsigned int waiters = 0;
+	std::condition_variable cv;
 	time_point last_time;
 	uint32_t last_handle = 0;
 	int rop_num = 0;
@@ -83,16 +88,35 @@ struct NOTIFY_ITEM {
 	GUID guid{};
 };
 
+struct handle_shard {
+	std::mutex lock;
+	std::unordered_map<GUID, HANDLE_DATA> hash;
+};
+
+struct wait_stat {
+	std::atomic<uint64_t> count{0}, usec{0};
+	void add(time_duration d) {
+		++count;
+		usec += std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+	}
+};
+
 }
 
 static constexpr auto HANDLE_VALID_INTERVAL = std::chrono::seconds(2000);
-static constexpr size_t TAG_SIZE = 256;
+static constexpr size_t TAG_SIZE = 256, HANDLE_SHARDS = 16;
 static time_point g_start_time;
 static pthread_t g_scan_id;
-static std::mutex g_lock, g_notify_lock;
+static std::mutex g_user_lock, g_notify_lock;
 static gromox::atomic_bool g_notify_stop{true};
 static thread_local HANDLE_DATA *g_handle_key;
-static std::unordered_map<GUID, HANDLE_DATA> g_handle_hash;
+/*
+ * Sessions are spread over several maps so that unrelated clients do not
+ * contend on one mutex. Lock order: g_user_lock before a shard lock.
+ */
+static handle_shard g_handle_shards[HANDLE_SHARDS];
+static std::atomic<size_t> g_handle_count;
+static wait_stat g_rop_wait, g_notify_wait;
 static std::unordered_map<std::string, std::vector<HANDLE_DATA *>> g_user_hash;
 static std::unordered_map<std::string, NOTIFY_ITEM> g_notify_hash;
 size_t ems_max_active_sessions, ems_max_active_users, ems_max_active_notifh;
@@ -102,10 +126,45 @@ static size_t ems_high_active_notifh, ems_high_pending_sesnotif;
 
 static void *emsi_scanwork(void *);
 
+static handle_shard &emsmdb_interface_shard(const GUID &guid)
+{
+	return g_handle_shards[std::hash<GUID>{}(guid) % HANDLE_SHARDS];
+}
+
+static HANDLE_DATA *emsmdb_interface_find(handle_shard &sh, const GUID &guid)
+{
+	auto iter = sh.hash.find(guid);
+	return iter != sh.hash.end() ? &iter->second : nullptr;
+}
+
+/**
+ * Block (@hold being the lock of the handle's shard) until @flag is clear
+ * on @h. The handle cannot be removed while it has waiters.
+ */
+static void emsmdb_interface_wait_clear(std::unique_lock<std::mutex> &hold,
+    HANDLE_DATA *h, BOOL HANDLE_DATA::*flag, wait_stat &st)
+{
+	if (!(h->*flag))
+		return;
+	auto start = std::chrono::steady_clock::now();
+	++h->waiters;
+	h->cv.wait(hold, [&]() { return !(h->*flag); });
+	--h->waiters;
+	st.add(std::chrono::steady_clock::now() - start);
+}
+
+static void emsmdb_interface_release(HANDLE_DATA *h, BOOL HANDLE_DATA::*flag)
+{
+	auto &sh = emsmdb_interface_shard(h->guid);
+	std::lock_guard hold(sh.lock);
+	h->*flag = false;
+	h->cv.notify_all();
+}
+
 void emsmdb_report()
 {
 	size_t sessions = 0, logons = 0, pend_notif = 0;
-	std::unique_lock gl_hold(g_lock);
+	std::unique_lock gl_hold(g_user_lock);
 	mlog(LV_INFO, "EMSMDB Sessions:");
 	mlog(LV_INFO, "%-32s  %-32s  CXR CPID LCID #NF", "GUID", "USERNAME");
 	mlog(LV_INFO, "LOGON  %-32s  MBOXUSER", "MBOXGUID");
@@ -114,6 +173,7 @@ void emsmdb_report()
 	for (const auto &e1 : g_user_hash) {
 	for (const auto hp : e1.second) {
 		auto &h = *hp;
+		std::lock_guard sh_hold(emsmdb_interface_shard(h.guid).lock);
 		auto &ei = h.info;
 		auto pn = double_list_get_nodes_num(&h.notify_list);
 		mlog(LV_INFO, "%-32s  %-32s  /%-2u %-4u %-4u %3zu",
@@ -140,9 +200,13 @@ void emsmdb_report()
 	}
 	mlog(LV_INFO, "Mailboxes %zu/%zu, EMSMDB ses %zu/%zu/%zu, ROPLogons %zu",
 		g_user_hash.size(), ems_high_active_users,
-		sessions, g_handle_hash.size(), ems_high_active_sessions,
+		sessions, g_handle_count.load(), ems_high_active_sessions,
 		logons);
 	gl_hold.unlock();
+	using LLU = unsigned long long;
+	mlog(LV_INFO, "Session waits: ROP %llu (%llu ms), notify list %llu (%llu ms)",
+		LLU{g_rop_wait.count.load()}, LLU{g_rop_wait.usec.load() / 1000},
+		LLU{g_notify_wait.count.load()}, LLU{g_notify_wait.usec.load() / 1000});
 	std::lock_guard gl2(g_notify_lock);
 	mlog(LV_INFO, "NotifyHandles %zu/%zu, NotifyPending %zu/%zu",
 		g_notify_hash.size(), ems_high_active_notifh,
@@ -169,11 +233,11 @@ BOOL emsmdb_interface_check_acxh(ACXH *pacxh,
 {
 	if (pacxh->handle_type != HANDLE_EXCHANGE_ASYNCEMSMDB)
 		return FALSE;
-	std::lock_guard gl_hold(g_lock);
-	auto iter = g_handle_hash.find(pacxh->guid);
-	if (iter == g_handle_hash.end())
+	auto &sh = emsmdb_interface_shard(pacxh->guid);
+	std::lock_guard sh_hold(sh.lock);
+	auto phandle = emsmdb_interface_find(sh, pacxh->guid);
+	if (phandle == nullptr)
 		return false;
-	auto phandle = &iter->second;
 	if (b_touch)
 		phandle->last_time = tp_now();
 	strcpy(username, phandle->username);
@@ -185,11 +249,11 @@ BOOL emsmdb_interface_check_notify(ACXH *pacxh)
 {
 	if (pacxh->handle_type != HANDLE_EXCHANGE_ASYNCEMSMDB)
 		return FALSE;
-	std::lock_guard gl_hold(g_lock);
-	auto iter = g_handle_hash.find(pacxh->guid);
-	if (iter == g_handle_hash.end())
+	auto &sh = emsmdb_interface_shard(pacxh->guid);
+	std::lock_guard sh_hold(sh.lock);
+	auto phandle = emsmdb_interface_find(sh, pacxh->guid);
+	if (phandle == nullptr)
 		return false;
-	auto phandle = &iter->second;
 	return double_list_get_nodes_num(&phandle->notify_list) > 0 ? TRUE : false;
 }
 
@@ -199,62 +263,51 @@ void emsmdb_interface_touch_handle(const CXH &cxh)
 	auto pcxh = &cxh;
 	if (pcxh->handle_type != HANDLE_EXCHANGE_EMSMDB)
 		return;
-	std::lock_guard gl_hold(g_lock);
-	auto iter = g_handle_hash.find(pcxh->guid);
-	if (iter != g_handle_hash.end())
-		iter->second.last_time = tp_now();
+	auto &sh = emsmdb_interface_shard(pcxh->guid);
+	std::lock_guard sh_hold(sh.lock);
+	auto phandle = emsmdb_interface_find(sh, pcxh->guid);
+	if (phandle != nullptr)
+		phandle->last_time = tp_now();
 }
 
 static HANDLE_DATA* emsmdb_interface_get_handle_data(CXH *pcxh)
 {
 	if (pcxh->handle_type != HANDLE_EXCHANGE_EMSMDB)
 		return NULL;
-	while (true) {
-		std::unique_lock gl_hold(g_lock);
-		auto iter = g_handle_hash.find(pcxh->guid);
-		if (iter == g_handle_hash.end())
-			return NULL;
-		auto phandle = &iter->second;
-		if (phandle->b_processing) {
-			gl_hold.unlock();
-			usleep(100000);
-		} else {
-			phandle->b_processing = TRUE;
-			return phandle;
-		}
-	}
+	auto &sh = emsmdb_interface_shard(pcxh->guid);
+	std::unique_lock sh_hold(sh.lock);
+	auto phandle = emsmdb_interface_find(sh, pcxh->guid);
+	if (phandle == nullptr)
+		return NULL;
+	emsmdb_interface_wait_clear(sh_hold, phandle,
+		&HANDLE_DATA::b_processing, g_rop_wait);
+	phandle->b_processing = TRUE;
+	return phandle;
 }
 
 static void emsmdb_interface_put_handle_data(HANDLE_DATA *phandle)
 {
-	std::lock_guard gl_hold(g_lock);
-	phandle->b_processing = FALSE;
+	emsmdb_interface_release(phandle, &HANDLE_DATA::b_processing);
 }
 
 static HANDLE_DATA* emsmdb_interface_get_handle_notify_list(CXH *pcxh)
 {
 	if (pcxh->handle_type != HANDLE_EXCHANGE_EMSMDB)
 		return NULL;
-	while (true) {
-		std::unique_lock gl_hold(g_lock);
-		auto iter = g_handle_hash.find(pcxh->guid);
-		if (iter == g_handle_hash.end())
-			return NULL;
-		auto phandle = &iter->second;
-		if (phandle->b_occupied) {
-			gl_hold.unlock();
-			usleep(100000);
-		} else {
-			phandle->b_occupied = TRUE;
-			return phandle;
-		}
-	}
+	auto &sh = emsmdb_interface_shard(pcxh->guid);
+	std::unique_lock sh_hold(sh.lock);
+	auto phandle = emsmdb_interface_find(sh, pcxh->guid);
+	if (phandle == nullptr)
+		return NULL;
+	emsmdb_interface_wait_clear(sh_hold, phandle,
+		&HANDLE_DATA::b_occupied, g_notify_wait);
+	phandle->b_occupied = TRUE;
+	return phandle;
 }
 
 static void emsmdb_interface_put_handle_notify_list(HANDLE_DATA *phandle)
 {
-	std::lock_guard gl_hold(g_lock);
-	phandle->b_occupied = FALSE;
+	emsmdb_interface_release(phandle, &HANDLE_DATA::b_occupied);
 }
 
 static BOOL emsmdb_interface_alloc_cxr(std::vector<HANDLE_DATA *> &plist,
@@ -313,10 +366,10 @@ static BOOL emsmdb_interface_create_handle(const char *username,
 	temp_handle.info.client_mode = client_mode;
 	gx_strlcpy(temp_handle.username, username, std::size(temp_handle.username));
 	HX_strlower(temp_handle.username);
-	std::unique_lock gl_hold(g_lock);
+	std::unique_lock gl_hold(g_user_lock);
 	if (ems_max_active_sessions > 0 &&
-	    g_handle_hash.size() >= ems_max_active_sessions) {
-		mlog(LV_WARN, "W-2300: g_handle_hash full (%zu handles)",
+	    g_handle_count >= ems_max_active_sessions) {
+		mlog(LV_WARN, "W-2300: EMSMDB session table full (%zu handles)",
 			ems_max_active_sessions);
 		return FALSE;
 	}
@@ -325,22 +378,30 @@ static BOOL emsmdb_interface_create_handle(const char *username,
 		return false;
 
 	HANDLE_DATA *phandle;
-
+	auto guid = temp_handle.guid;
+	auto &sh = emsmdb_interface_shard(guid);
 	try {
-		auto xp = g_handle_hash.emplace(temp_handle.guid, std::move(temp_handle));
-		ems_high_active_sessions = std::max(ems_high_active_sessions, g_handle_hash.size());
+		std::lock_guard sh_hold(sh.lock);
+		auto xp = sh.hash.emplace(guid, std::move(temp_handle));
 		phandle = &xp.first->second;
 	} catch (const std::bad_alloc &) {
 		mlog(LV_ERR, "E-1578: ENOMEM");
 		return false;
 	}
+	ems_high_active_sessions = std::max(ems_high_active_sessions, ++g_handle_count);
+	/* Nobody knows the GUID yet, so nobody else can be using the handle */
+	auto unpublish = [&]() {
+		std::lock_guard sh_hold(sh.lock);
+		sh.hash.erase(guid);
+		--g_handle_count;
+	};
 	auto uh_iter = g_user_hash.find(phandle->username);
 	if (uh_iter == g_user_hash.end()) {
 		if (ems_max_active_users > 0 &&
 		    g_user_hash.size() >= ems_max_active_users) {
 			mlog(LV_WARN, "W-2301: g_user_hash full (%zu handles)",
 				ems_max_active_users);
-			g_handle_hash.erase(phandle->guid);
+			unpublish();
 			gl_hold.unlock();
 			return FALSE;
 		}
@@ -349,7 +410,7 @@ static BOOL emsmdb_interface_create_handle(const char *username,
 			ems_high_active_users = std::max(ems_high_active_users, g_user_hash.size());
 			uh_iter = xp.first;
 		} catch (const std::bad_alloc &) {
-			g_handle_hash.erase(phandle->guid);
+			unpublish();
 			gl_hold.unlock();
 			mlog(LV_ERR, "E-1579: ENOMEM");
 			return FALSE;
@@ -359,7 +420,7 @@ static BOOL emsmdb_interface_create_handle(const char *username,
 		    uh_iter->second.size() >= emsmdb_max_cxh_per_user) {
 			mlog(LV_WARN, "W-1580: user %s reached maximum CXH (%u)",
 			        phandle->username, emsmdb_max_cxh_per_user);
-			g_handle_hash.erase(phandle->guid);
+			unpublish();
 			gl_hold.unlock();
 			return FALSE;
 		}
@@ -367,14 +428,14 @@ static BOOL emsmdb_interface_create_handle(const char *username,
 	if (!emsmdb_interface_alloc_cxr(uh_iter->second, phandle)) {
 		if (uh_iter->second.empty())
 			g_user_hash.erase(phandle->username);
-		g_handle_hash.erase(phandle->guid);
+		unpublish();
 		gl_hold.unlock();
 		return FALSE;
 	}
 	*pcxr = phandle->cxr;
 	gl_hold.unlock();
 	pcxh->handle_type = HANDLE_EXCHANGE_EMSMDB;
-	pcxh->guid = phandle->guid;
+	pcxh->guid = guid;
 	return TRUE;
 }
 
@@ -386,22 +447,27 @@ static void emsmdb_interface_remove_handle(const CXH &cxh)
 	
 	if (pcxh->handle_type != HANDLE_EXCHANGE_EMSMDB)
 		return;
-	std::unique_lock gl_hold(g_lock);
-	while (true) {
-		auto iter = g_handle_hash.find(pcxh->guid);
-		if (iter == g_handle_hash.end())
-			return;
-		phandle = &iter->second;
-		if (phandle->b_processing)
-			/* this means handle is being processed
-			   in emsmdb_interface_rpc_ext2 by another
-			   rpc connection, can not be released! */
-			return;
-		if (!phandle->b_occupied)
-			break;
-		gl_hold.unlock();
-		usleep(100000);
-	}
+	auto &sh = emsmdb_interface_shard(pcxh->guid);
+	std::unique_lock sh_hold(sh.lock);
+	phandle = emsmdb_interface_find(sh, pcxh->guid);
+	if (phandle == nullptr)
+		return;
+	/*
+	 * b_processing means the handle is being processed in
+	 * emsmdb_interface_rpc_ext2 by another rpc connection; waiters are
+	 * about to do so. Either way, it can not be released!
+	 */
+	if (phandle->b_processing || phandle->waiters > 0)
+		return;
+	emsmdb_interface_wait_clear(sh_hold, phandle,
+		&HANDLE_DATA::b_occupied, g_notify_wait);
+	if (phandle->b_processing || phandle->waiters > 0)
+		return;
+	auto node = sh.hash.extract(pcxh->guid);
+	--g_handle_count;
+	sh_hold.unlock();
+	/* extract() keeps the element in place, so the g_user_hash pointer still matches */
+	std::unique_lock gl_hold(g_user_lock);
 	auto uh_iter = g_user_hash.find(phandle->username);
 	if (uh_iter != g_user_hash.end()) {
 		auto &uhv = uh_iter->second;
@@ -409,14 +475,12 @@ static void emsmdb_interface_remove_handle(const CXH &cxh)
 		if (uhv.empty())
 			g_user_hash.erase(phandle->username);
 	}
+	gl_hold.unlock();
 	while ((pnode = double_list_pop_front(&phandle->notify_list)) != nullptr) {
 		delete static_cast<notify_response *>(static_cast<ROP_RESPONSE *>(pnode->pdata)->ppayload);
 		free(pnode->pdata);
 		free(pnode);
 	}
-	auto plogmap = std::move(phandle->info.plogmap);
-	g_handle_hash.erase(pcxh->guid);
-	gl_hold.unlock();
 }
 
 void emsmdb_interface_init()
@@ -448,7 +512,9 @@ void emsmdb_interface_stop()
 	}
 	g_notify_hash.clear();
 	g_user_hash.clear();
-	g_handle_hash.clear();
+	for (auto &sh : g_handle_shards)
+		sh.hash.clear();
+	g_handle_count = 0;
 }
 
 int emsmdb_interface_disconnect(CXH &cxh)
@@ -738,16 +804,12 @@ DOUBLE_LIST* emsmdb_interface_get_notify_list()
 	auto phandle = g_handle_key;
 	if (phandle == nullptr)
 		return NULL;
-	while (true) {
-		std::unique_lock gl_hold(g_lock);
-		if (phandle->b_occupied) {
-			gl_hold.unlock();
-			usleep(100000);
-		} else {
-			phandle->b_occupied = TRUE;
-			return &phandle->notify_list;
-		}
-	}
+	/* b_processing is held by this thread, so the handle stays */
+	std::unique_lock sh_hold(emsmdb_interface_shard(phandle->guid).lock);
+	emsmdb_interface_wait_clear(sh_hold, phandle,
+		&HANDLE_DATA::b_occupied, g_notify_wait);
+	phandle->b_occupied = TRUE;
+	return &phandle->notify_list;
 }
 
 void emsmdb_interface_put_notify_list()
@@ -1146,19 +1208,21 @@ static void *emsi_scanwork(void *pparam)
 	while (!g_notify_stop) {
 		std::vector<GUID> temp_list;
 		auto cur_time = tp_now();
-		std::unique_lock gl_hold(g_lock);
-		for (const auto &[guid, handle] : g_handle_hash) {
-			auto phandle = &handle;
-			if (phandle->b_processing || phandle->b_occupied)
-				continue;
-			if (cur_time - phandle->last_time > HANDLE_VALID_INTERVAL) try {
-				temp_list.push_back(guid);
-			} catch (const std::bad_alloc &) {
-				mlog(LV_ERR, "E-1624: ENOMEM");
-				continue;
+		for (auto &sh : g_handle_shards) {
+			std::lock_guard sh_hold(sh.lock);
+			for (const auto &[guid, handle] : sh.hash) {
+				auto phandle = &handle;
+				if (phandle->b_processing || phandle->b_occupied ||
+				    phandle->waiters > 0)
+					continue;
+				if (cur_time - phandle->last_time > HANDLE_VALID_INTERVAL) try {
+					temp_list.push_back(guid);
+				} catch (const std::bad_alloc &) {
+					mlog(LV_ERR, "E-1624: ENOMEM");
+					continue;
+				}
 			}
 		}
-		gl_hold.unlock();
 		for (auto &&guid : temp_list)
 			emsmdb_interface_remove_handle({HANDLE_EXCHANGE_EMSMDB, std::move(guid)});
 		sleep(3);
@@ -11,14 +11,68 @@
 #include <gromox/util.hpp>
 #include "attachment_object.h"
 #include "common_util.h"
+#include "exmdb_client.h"
 #include "folder_object.h"
 #include "message_object.h"
 #include "rop_processor.h"
 #include "stream_object.h"
 #define STREAM_INIT_BUFFER_LENGTH						4096
+/* Matches the frame size of seekable CID files */
+#define STREAM_WINDOW									(256U << 10)
+#define STREAM_RANGED_MIN								(4 * STREAM_WINDOW)
 
 using namespace gromox;
 
+static bool so_parent_instance(const stream_object *pstream,
+    const char **pdir, uint32_t *pinstance_id, DOUBLE_LIST **ppending)
+{
+	if (pstream->object_type == ems_objtype::attach) {
+		auto pattachment = static_cast<attachment_object *>(pstream->pparent);
+		*pdir = pattachment->pparent->plogon->get_dir();
+		*pinstance_id = pattachment->get_instance_id();
+		*ppending = &pattachment->stream_list;
+		return true;
+	} else if (pstream->object_type == ems_objtype::message) {
+		auto pmessage = static_cast<message_object *>(pstream->pparent);
+		*pdir = pmessage->plogon->get_dir();
+		*pinstance_id = pmessage->get_instance_id();
+		*ppending = &pmessage->stream_list;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Decide whether @pstream can be served piecewise. Returns false if the
+ * property should be loaded in full as before.
+ */
+static bool so_open_ranged(stream_object *pstream)
+{
+	const char *dir;
+	uint32_t instance_id;
+	DOUBLE_LIST *pending;
+	if (pstream->open_flags != MAPI_READONLY ||
+	    (PROP_TYPE(pstream->proptag) != PT_BINARY &&
+	    PROP_TYPE(pstream->proptag) != PT_OBJECT) ||
+	    !so_parent_instance(pstream, &dir, &instance_id, &pending))
+		return false;
+	/* Unsaved writes from another stream are only visible via the parent */
+	for (auto pnode = double_list_get_head(pending); pnode != nullptr;
+	     pnode = double_list_get_after(pending, pnode))
+		if (static_cast<stream_object *>(pnode->pdata)->get_proptag() == pstream->proptag)
+			return false;
+	uint32_t total = 0;
+	BINARY bin{};
+	if (!exmdb_client::read_instance_range(dir, instance_id,
+	    pstream->proptag, 0, 0, &total, &bin) ||
+	    total == UINT32_MAX || total < STREAM_RANGED_MIN ||
+	    total >= g_max_mail_len)
+		return false;
+	pstream->b_ranged = true;
+	pstream->ranged_length = total;
+	return true;
+}
+
 std::unique_ptr<stream_object> stream_object::create(void *pparent,
     ems_objtype object_type, uint32_t open_flags, uint32_t proptag, uint32_t max_length)
 {
@@ -37,6 +91,8 @@ std::unique_ptr<stream_object> stream_object::create(void *pparent,
 	pstream->open_flags = open_flags;
 	pstream->proptag = proptag;
 	pstream->max_length = max_length;
+	if (so_open_ranged(pstream.get()))
+		return pstream;
 	switch (object_type) {
 	case ems_objtype::message: {
 		proptags.count = 2;
@@ -127,9 +183,67 @@ std::unique_ptr<stream_object> stream_object::create(void *pparent,
 	}
 }
 
+bool stream_object::fetch_window()
+{
+	const char *dir;
+	uint32_t instance_id, total = 0;
+	DOUBLE_LIST *pending;
+	BINARY bin{};
+	auto offset = seek_ptr / STREAM_WINDOW * STREAM_WINDOW;
+	if (!so_parent_instance(this, &dir, &instance_id, &pending) ||
+	    !exmdb_client::read_instance_range(dir, instance_id, proptag,
+	    offset, STREAM_WINDOW, &total, &bin) || bin.cb == 0)
+		return false;
+	try {
+		window.assign(bin.pb, bin.pb + bin.cb);
+	} catch (const std::bad_alloc &) {
+		return false;
+	}
+	window_offset = offset;
+	return true;
+}
+
+/* Switch from piecewise to whole-content operation */
+BOOL stream_object::load_ranged()
+{
+	if (!b_ranged)
+		return TRUE;
+	const char *dir;
+	uint32_t instance_id, total = 0;
+	DOUBLE_LIST *pending;
+	BINARY bin{};
+	if (!so_parent_instance(this, &dir, &instance_id, &pending) ||
+	    !exmdb_client::read_instance_range(dir, instance_id, proptag,
+	    0, ranged_length, &total, &bin) || bin.cb != ranged_length)
+		return FALSE;
+	content_bin.pv = malloc(bin.cb + 1);
+	if (content_bin.pv == nullptr)
+		return FALSE;
+	memcpy(content_bin.pv, bin.pv, bin.cb);
+	content_bin.cb = bin.cb;
+	b_ranged = false;
+	window = {};
+	return TRUE;
+}
+
 uint32_t stream_object::read(void *pbuff, uint32_t buf_len)
 {
 	auto pstream = this;
+	if (b_ranged) {
+		uint32_t done = 0;
+		while (done < buf_len && seek_ptr < ranged_length) {
+			if ((seek_ptr < window_offset ||
+			    seek_ptr - window_offset >= window.size()) && !fetch_window())
+				break;
+			auto n = std::min(buf_len - done, static_cast<uint32_t>(
+			         window_offset + window.size() - seek_ptr));
+			memcpy(static_cast<uint8_t *>(pbuff) + done,
+			       &window[seek_ptr-window_offset], n);
+			done += n;
+			seek_ptr += n;
+		}
+		return done;
+	}
 	if (pstream->content_bin.cb <= pstream->seek_ptr)
 		return 0;
 	auto length = std::min(buf_len, pstream->content_bin.cb - pstream->seek_ptr);
@@ -175,6 +289,8 @@ void *stream_object::get_content()
 	void *pcontent;
 	uint32_t length;
 	
+	if (!load_ranged())
+		return nullptr;
 	switch (PROP_TYPE(pstream->proptag)) {
 	case PT_BINARY:
 		return &pstream->content_bin;
@@ -224,14 +340,14 @@ ec_error_t stream_object::seek(uint8_t opt, int64_t offset)
 	switch (opt) {
 	case STREAM_SEEK_SET: origin = 0; break;
 	case STREAM_SEEK_CUR: origin = pstream->seek_ptr; break;
-	case STREAM_SEEK_END: origin = pstream->content_bin.cb; break;
+	case STREAM_SEEK_END: origin = pstream->get_length(); break;
 	default: return STG_E_INVALIDPARAMETER;
 	}
 	int8_t clamped = 0;
 	auto newpos = safe_add_s(origin, offset, &clamped);
 	if (clamped > 1)
 		return StreamSeekError;
-	if (newpos > pstream->content_bin.cb) {
+	if (newpos > pstream->get_length()) {
 		auto ret = set_length(newpos);
 		if (ret != ecSuccess)
 			return ret;
@@ -243,6 +359,8 @@ ec_error_t stream_object::seek(uint8_t opt, int64_t offset)
 BOOL stream_object::copy(stream_object *pstream_src, uint32_t *plength)
 {
 	auto pstream_dst = this;
+	if (!pstream_src->load_ranged())
+		return FALSE;
 	if (pstream_src->seek_ptr >=
 		pstream_src->content_bin.cb) {
 		*plength = 0;
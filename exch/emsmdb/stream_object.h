@@ -2,6 +2,7 @@
 #include <cstdint>
 #include <memory>
 #include <utility>
+#include <vector>
 #include <gromox/mapi_types.hpp>
 #include "rop_processor.h"
 #define MAX_LENGTH_FOR_FOLDER						64*1024
@@ -14,7 +15,7 @@ struct stream_object {
 	public:
 	~stream_object();
 	static std::unique_ptr<stream_object> create(void *parent, ems_objtype, uint32_t open_flags, uint32_t proptag, uint32_t max_length);
-	BOOL check() const { return content_bin.pb != nullptr ? TRUE : false; }
+	BOOL check() const { return b_ranged || content_bin.pb != nullptr ? TRUE : false; }
 	uint32_t get_max_length() const { return max_length; }
 	uint32_t read(void *buf, uint32_t len);
 	std::pair<uint16_t, ec_error_t> write(void *buf, uint16_t len);
@@ -22,12 +23,14 @@ struct stream_object {
 	ems_objtype get_parent_type() const { return object_type; }
 	uint32_t get_proptag() const { return proptag; }
 	void* get_content();
-	uint32_t get_length() const { return content_bin.cb; }
+	uint32_t get_length() const { return b_ranged ? ranged_length : content_bin.cb; }
 	ec_error_t set_length(uint32_t len);
 	ec_error_t seek(uint8_t opt, int64_t offset);
 	uint32_t get_seek_position() const { return seek_ptr; }
 	BOOL copy(stream_object *src, uint32_t *len);
 	BOOL commit();
+	BOOL load_ranged();
+	bool fetch_window();
 
 	void *pparent = nullptr;
 	ems_objtype object_type = ems_objtype::none;
@@ -36,4 +39,12 @@ struct stream_object {
 	BINARY content_bin{};
 	BOOL b_touched = false;
 	uint32_t max_length = 0;
+	/*
+	 * Large read-only binary properties are not copied in at open time,
+	 * but fetched from exmdb in STREAM_WINDOW-sized pieces as the client
+	 * reads them.
+	 */
+	bool b_ranged = false;
+	uint32_t ranged_length = 0, window_offset = 0;
+	std::vector<uint8_t> window;
 };
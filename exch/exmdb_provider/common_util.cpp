@@ -16,11 +16,16 @@
 #include <fcntl.h>
 #include <iconv.h>
 #include <memory>
+#include <mutex>
 #include <new>
 #include <pthread.h>
 #include <string>
 #include <string_view>
+#include <system_error>
+#include <thread>
 #include <unistd.h>
+#include <unordered_map>
+#include <vector>
 #ifdef HAVE_XXHASH
 	/* xxh3 must come first in 0.7.0, or everything breaks apart */
 #	include <xxh3.h>
@@ -42,6 +47,7 @@
 #include <gromox/mapidefs.h>
 #include <gromox/pcl.hpp>
 #include <gromox/propval.hpp>
+#include <gromox/restriction.hpp>
 #include <gromox/rop_util.hpp>
 #include <gromox/scope.hpp>
 #include <gromox/svc_common.h>
@@ -82,6 +88,9 @@ static thread_local prepared_statements *g_opt_key;
 static thread_local const char *g_opt_key_src;
 unsigned int g_max_rule_num, g_max_extrule_num;
 unsigned int g_cid_compression = 0; /* disabled(0), specific_level(n) */
+bool g_cid_usedict;
+static std::mutex g_cid_domain_lock;
+static std::unordered_map<std::string, unsigned int> g_cid_domain_cache;
 static std::atomic<unsigned int> g_sequence_id;
 
 #define E(s) decltype(common_util_ ## s) common_util_ ## s;
@@ -1790,6 +1799,9 @@ static GP_RESULT gp_folderprop(uint32_t tag, TAGGED_PROPVAL &pv,
 static GP_RESULT gp_msgprop(uint32_t tag, TAGGED_PROPVAL &pv, sqlite3 *db,
     uint64_t id, cpid_t cpid)
 {
+	/* The switch below must not handle anything beyond that list */
+	if (!msgprop_computed(tag))
+		return GP_UNHANDLED;
 	switch (tag) {
 	case PR_ENTRYID:
 		pv.pvalue = cu_mid_to_entryid(db, id);
@@ -2785,6 +2797,45 @@ void fhash::hexify(const unsigned char *digest, unsigned int bytes)
 	}
 }
 
+/* Dictionaries only make a difference for small objects */
+#define CID_DICT_MAXSIZE (128U << 10)
+
+static unsigned int cu_maildir_to_domain(const char *maildir)
+{
+	std::unique_lock lk(g_cid_domain_lock);
+	auto it = g_cid_domain_cache.find(maildir);
+	if (it != g_cid_domain_cache.end())
+		return it->second;
+	lk.unlock();
+	unsigned int user_id = 0, domain_id = 0;
+	char username[UADDR_SIZE];
+	if (!common_util_get_id_from_maildir(maildir, &user_id) ||
+	    !common_util_get_username_from_id(user_id, username, std::size(username)) ||
+	    !common_util_get_user_ids(username, &user_id, &domain_id, nullptr))
+		if (!common_util_get_id_from_homedir(maildir, &domain_id))
+			domain_id = 0;
+	lk.lock();
+	g_cid_domain_cache.emplace(maildir, domain_id);
+	return domain_id;
+}
+
+/**
+ * Pick a trained dictionary for a new object: the one of the store's domain,
+ * else the global one, else none.
+ */
+static uint32_t cu_cid_dict(const char *maildir, size_t size)
+{
+	if (!g_cid_usedict || g_cid_compression == 0 || size > CID_DICT_MAXSIZE)
+		return 0;
+	auto domain_id = cu_maildir_to_domain(maildir);
+	if (domain_id != 0) {
+		auto id = gx_zdict_lookup(("domain-" + std::to_string(domain_id)).c_str());
+		if (id != 0)
+			return id;
+	}
+	return gx_zdict_lookup("default");
+}
+
 /**
  * @data:	[in] attachment/body
  * @cid:	[out] generated CID string for the database
@@ -2829,7 +2880,8 @@ static errno_t cu_cid_writeout(const char *maildir, std::string_view data,
 	 * even if the overall compressibility in a file is low, there may
 	 * still be a block where it is comparatively high.
 	 */
-	auto err = gx_compress_tofd(data, tmf, g_cid_compression);
+	auto err = gx_compress_tofd(data, tmf, g_cid_compression,
+	           cu_cid_dict(maildir, data.size()));
 	if (err != 0) {
 		mlog(LV_ERR, "E-5319: zstd routines have failed for object %s", path.c_str());
 		return err;
@@ -2853,6 +2905,89 @@ static errno_t cu_cid_writeout(const char *maildir, std::string_view data,
 	return ENOMEM;
 }
 
+static void cu_cid_collect(cpid_t cpid, const TPROPVAL_ARRAY &props,
+    std::vector<std::string_view> &out)
+{
+	for (size_t i = 0; i < props.count; ++i) {
+		const auto &pv = props.ppropval[i];
+		if (pv.pvalue == nullptr)
+			continue;
+		switch (pv.proptag) {
+		case PR_BODY_A:
+		case PR_TRANSPORT_MESSAGE_HEADERS_A:
+			/* anything else gets converted before the writeout */
+			if (cpid != CP_ACP)
+				break;
+			[[fallthrough]];
+		case PR_BODY:
+		case PR_TRANSPORT_MESSAGE_HEADERS:
+			out.emplace_back(static_cast<const char *>(pv.pvalue));
+			break;
+		case PR_HTML:
+		case PR_RTF_COMPRESSED:
+		case PR_ATTACH_DATA_BIN:
+		case PR_ATTACH_DATA_OBJ: {
+			auto bv = static_cast<const BINARY *>(pv.pvalue);
+			out.emplace_back(bv->pc, bv->cb);
+			break;
+		}
+		}
+	}
+}
+
+static void cu_cid_collect(cpid_t cpid, const MESSAGE_CONTENT &mc,
+    std::vector<std::string_view> &out)
+{
+	cu_cid_collect(cpid, mc.proplist, out);
+	auto atl = mc.children.pattachments;
+	if (atl == nullptr)
+		return;
+	for (size_t i = 0; i < atl->count; ++i) {
+		cu_cid_collect(cpid, atl->pplist[i]->proplist, out);
+		if (atl->pplist[i]->pembedded != nullptr)
+			cu_cid_collect(cpid, *atl->pplist[i]->pembedded, out);
+	}
+}
+
+/**
+ * Since CID files are named by content hash, the writeouts for a batch of
+ * messages can be done concurrently and ahead of the database transaction.
+ * cu_cid_writeout will later find the files present and skip compression.
+ * Errors are ignored here; the regular writeout reports them.
+ */
+void cu_cid_prewrite(const char *dir, cpid_t cpid, size_t count,
+    const MESSAGE_CONTENT *msgs) try
+{
+	std::vector<std::string_view> objs;
+	for (size_t i = 0; i < count; ++i)
+		cu_cid_collect(cpid, msgs[i], objs);
+	if (objs.size() < 2)
+		return;
+	std::atomic<size_t> next{0};
+	auto worker = [&]() {
+		std::string cid, path;
+		for (size_t i; (i = next++) < objs.size(); )
+			cu_cid_writeout(dir, objs[i], cid, path);
+	};
+	auto nthr = std::min(static_cast<size_t>(std::max(std::thread::hardware_concurrency(), 1U)),
+	            std::min(objs.size(), static_cast<size_t>(8)));
+	std::vector<std::thread> thr;
+	thr.reserve(nthr);
+	for (size_t i = 1; i < nthr; ++i) {
+		try {
+			thr.emplace_back(worker);
+		} catch (const std::system_error &e) {
+			mlog(LV_WARN, "W-2407: cid prewrite: %s", e.what());
+			break;
+		}
+	}
+	worker();
+	for (auto &t : thr)
+		t.join();
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2408: ENOMEM");
+}
+
 static BOOL common_util_set_message_body(sqlite3 *psqlite, cpid_t cpid,
     uint64_t message_id, const TAGGED_PROPVAL *ppropval)
 {
@@ -4447,6 +4582,59 @@ bool cu_eval_msg_restriction(sqlite3 *psqlite,
 	return FALSE;
 }
 
+namespace {
+struct cu_eval_param {
+	sqlite3 *psqlite;
+	cpid_t cpid;
+	uint64_t id;
+};
+}
+
+static BOOL cu_eval_get_folder_prop(void *pp, uint32_t proptag, void **pvalue)
+{
+	auto p = static_cast<const cu_eval_param *>(pp);
+	return cu_get_property(MAPI_FOLDER, p->id, p->cpid, p->psqlite,
+	       proptag, pvalue);
+}
+
+static bool cu_eval_folder_fallback(void *pp, const RESTRICTION &res)
+{
+	auto p = static_cast<const cu_eval_param *>(pp);
+	return cu_eval_folder_restriction(p->psqlite, p->id, &res);
+}
+
+static BOOL cu_eval_get_msg_prop(void *pp, uint32_t proptag, void **pvalue)
+{
+	auto p = static_cast<const cu_eval_param *>(pp);
+	/* PR_PARENT_{SVREID,ENTRYID} comparisons go through the fallback */
+	return cu_get_property(MAPI_MESSAGE, p->id, p->cpid, p->psqlite,
+	       proptag, pvalue);
+}
+
+static bool cu_eval_msg_fallback(void *pp, const RESTRICTION &res)
+{
+	auto p = static_cast<const cu_eval_param *>(pp);
+	return cu_eval_msg_restriction(p->psqlite, p->cpid, p->id, &res);
+}
+
+/**
+ * Same as the RESTRICTION-based variant, but for callers that evaluate one
+ * restriction against many folders and have compiled it beforehand.
+ */
+bool cu_eval_folder_restriction(sqlite3 *psqlite, uint64_t folder_id,
+    const res_program &prog)
+{
+	cu_eval_param p{psqlite, CP_ACP, folder_id};
+	return prog.eval(&p, cu_eval_get_folder_prop, cu_eval_folder_fallback);
+}
+
+bool cu_eval_msg_restriction(sqlite3 *psqlite, cpid_t cpid,
+    uint64_t message_id, const res_program &prog)
+{
+	cu_eval_param p{psqlite, cpid, message_id};
+	return prog.eval(&p, cu_eval_get_msg_prop, cu_eval_msg_fallback);
+}
+
 BOOL common_util_check_search_result(sqlite3 *psqlite,
 	uint64_t folder_id, uint64_t message_id, BOOL *pb_exist)
 {
@@ -5260,6 +5448,12 @@ static uint32_t cu_get_cid_length(const char *cid, uint16_t proptype)
 	return node_stat.st_size;
 }
 
+static uint32_t cu_get_embedded_size(const char *ref)
+{
+	auto p = strchr(ref, ':');
+	return p != nullptr ? strtoul(p + 1, nullptr, 10) : 0;
+}
+
 uint32_t common_util_calculate_message_size(
 	const MESSAGE_CONTENT *pmsgctnt)
 {
@@ -5323,6 +5517,9 @@ uint32_t common_util_calculate_message_size(
 					message_size += cu_get_cid_length(cid, PT_BINARY);
 					break;
 				}
+				case ID_TAG_EMBEDDED:
+					message_size += cu_get_embedded_size(static_cast<const char *>(ppropval->pvalue));
+					break;
 				default:
 					message_size += propval_size(PROP_TYPE(ppropval->proptag), ppropval->pvalue);
 				}
@@ -5353,6 +5550,9 @@ uint32_t common_util_calculate_attachment_size(
 			attachment_size += cu_get_cid_length(cid, PT_BINARY);
 			break;
 		}
+		case ID_TAG_EMBEDDED:
+			attachment_size += cu_get_embedded_size(static_cast<const char *>(ppropval->pvalue));
+			break;
 		default:
 			attachment_size += propval_size(PROP_TYPE(ppropval->proptag), ppropval->pvalue);
 		}
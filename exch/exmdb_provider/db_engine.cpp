@@ -257,6 +257,8 @@ db_item_ptr db_engine_get_db(const char *path)
 		return db_item_ptr(pdb);
 	}
 	gx_sql_exec(pdb->psqlite, "PRAGMA foreign_keys=ON");
+	pdb->b_hotcols = dbop_sqlite_schemaversion(pdb->psqlite,
+	                 exmdb_server::is_private() ? sqlite_kind::pvt : sqlite_kind::pub) >= 14;
 	if (exmdb_server::is_private())
 		db_engine_load_dynamic_list(pdb);
 	return db_item_ptr(pdb);
@@ -303,7 +305,8 @@ BOOL db_engine_unload_db(const char *path)
 
 dynamic_node::dynamic_node(dynamic_node &&o) noexcept :
 	folder_id(o.folder_id), search_flags(o.search_flags),
-	prestriction(o.prestriction), folder_ids(o.folder_ids)
+	prestriction(o.prestriction), prog(std::move(o.prog)),
+	folder_ids(o.folder_ids)
 {
 	o.prestriction = nullptr;
 	o.folder_ids = {};
@@ -322,6 +325,7 @@ dynamic_node &dynamic_node::operator=(dynamic_node &&o) noexcept
 	folder_id = o.folder_id;
 	search_flags = o.search_flags;
 	std::swap(prestriction, o.prestriction);
+	std::swap(prog, o.prog);
 	folder_ids.count = o.folder_ids.count;
 	o.folder_ids.count = 0;
 	std::swap(folder_ids.pll, o.folder_ids.pll);
@@ -332,7 +336,7 @@ table_node::table_node(const table_node &o, clone_t) :
 	table_id(o.table_id), table_flags(o.table_flags), cpid(o.cpid),
 	type(o.type), cloned(true), remote_id(o.remote_id), username(o.username),
 	folder_id(o.folder_id), handle_guid(o.handle_guid),
-	prestriction(o.prestriction), psorts(o.psorts),
+	prestriction(o.prestriction), prog(o.prog), psorts(o.psorts),
 	instance_tag(o.instance_tag), extremum_tag(o.extremum_tag),
 	header_id(o.header_id), b_search(o.b_search), b_hint(o.b_hint)
 {}
@@ -428,7 +432,7 @@ static bool db_reload(db_item_ptr &pdb, const char *dir)
 }
 
 static BOOL db_engine_search_folder(const char *dir, cpid_t cpid,
-    uint64_t search_fid, uint64_t scope_fid, const RESTRICTION *prestriction)
+    uint64_t search_fid, uint64_t scope_fid, const res_program &prog)
 {
 	char sql_string[128];
 	auto pdb = db_engine_get_db(dir);
@@ -471,7 +475,7 @@ static BOOL db_engine_search_folder(const char *dir, cpid_t cpid,
 			count = 0;
 		}
 		if (!cu_eval_msg_restriction(pdb->psqlite,
-		    cpid, pmessage_ids->pids[i], prestriction))
+		    cpid, pmessage_ids->pids[i], prog))
 			continue;
 		snprintf(sql_string, std::size(sql_string), "REPLACE INTO search_result "
 		         "(folder_id, message_id) VALUES (%llu, %llu)",
@@ -636,12 +640,15 @@ static void *mdpeng_thrwork(void *param)
 			    psearch->b_recursive, psearch->folder_ids.pll[i], pfolder_ids))
 				goto NEXT_SEARCH;
 		}
+		res_program prog;
+		if (!prog.compile(*psearch->prestriction))
+			goto NEXT_SEARCH;
 		for (size_t i = 0; i < pfolder_ids->count; ++i) {
 			if (g_notify_stop)
 				break;
 			if (!db_engine_search_folder(psearch->dir.c_str(),
 			    psearch->cpid, psearch->folder_id,
-			    pfolder_ids->pids[i], psearch->prestriction))
+			    pfolder_ids->pids[i], prog))
 				break;	
 		}
 		if (g_notify_stop)
@@ -790,7 +797,7 @@ void db_engine_update_dynamic(db_item_ptr &pdb, uint64_t folder_id,
 	dn.folder_id    = folder_id;
 	dn.search_flags = search_flags;
 	dn.prestriction = restriction_dup(prestriction);
-	if (dn.prestriction == nullptr)
+	if (dn.prestriction == nullptr || !dn.prog.compile(*dn.prestriction))
 		return;
 	dn.folder_ids.count = pfolder_ids->count;
 	dn.folder_ids.pll   = me_alloc<uint64_t>(pfolder_ids->count);
@@ -862,7 +869,7 @@ static void dbeng_dynevt_1(db_item_ptr &pdb, cpid_t cpid, uint64_t id1,
 			continue;
 		}
 		if (!cu_eval_msg_restriction(pdb->psqlite,
-		    cpid, message_id, pdynamic->prestriction))
+		    cpid, message_id, pdynamic->prog))
 			return;
 		snprintf(sql_string, std::size(sql_string), "INSERT INTO search_result "
 			"(folder_id, message_id) VALUES (%llu, %llu)",
@@ -906,7 +913,7 @@ static void dbeng_dynevt_2(db_item_ptr &pdb, cpid_t cpid, dynamic_event event_ty
 		if (b_exist)
 			return;
 		if (!cu_eval_msg_restriction(pdb->psqlite,
-		    cpid, id2, pdynamic->prestriction))
+		    cpid, id2, pdynamic->prog))
 			return;
 		snprintf(sql_string, std::size(sql_string), "INSERT INTO search_result "
 			"(folder_id, message_id) VALUES (%llu, %llu)",
@@ -946,7 +953,7 @@ static void dbeng_dynevt_2(db_item_ptr &pdb, cpid_t cpid, dynamic_event event_ty
 			return;
 		}
 		if (cu_eval_msg_restriction(
-			pdb->psqlite, cpid, id2, pdynamic->prestriction)) {
+			pdb->psqlite, cpid, id2, pdynamic->prog)) {
 			if (b_exist) {
 				db_engine_notify_content_table_modify_row(
 					pdb, pdynamic->folder_id, id2);
@@ -1260,7 +1267,7 @@ static void db_engine_notify_content_table_add_row(db_item_ptr &pdb,
 			continue;
 		if (ptable->prestriction != nullptr &&
 		    !cu_eval_msg_restriction(pdb->psqlite,
-		    ptable->cpid, message_id, ptable->prestriction))
+		    ptable->cpid, message_id, ptable->prog))
 			continue;
 		if (pdb->tables.b_batch) {
 			ptable->b_hint = TRUE;
@@ -1900,11 +1907,27 @@ void db_engine_notify_new_mail(db_item_ptr &pdb, uint64_t folder_id,
 	mlog(LV_ERR, "E-2120: ENOMEM");
 }
 
+/* Queue a message for re-expansion in its folder's busy-interval index. */
+static void db_engine_fbidx_touch(db_item_ptr &pdb, uint64_t folder_id,
+    uint64_t message_id)
+{
+	auto it = pdb->fb_indices.find(folder_id);
+	if (it == pdb->fb_indices.end())
+		return;
+	try {
+		it->second.dirty.insert(message_id);
+	} catch (const std::bad_alloc &) {
+		/* Cannot track the change; have the index rebuilt instead. */
+		pdb->fb_indices.erase(it);
+	}
+}
+
 void db_engine_notify_message_creation(db_item_ptr &pdb, uint64_t folder_id,
     uint64_t message_id) try
 {
 	DB_NOTIFY_DATAGRAM datagram;
 	auto dir = exmdb_server::get_dir();
+	db_engine_fbidx_touch(pdb, folder_id, message_id);
 	auto parrays = db_engine_classify_id_array(pdb,
 	               NF_OBJECT_CREATED, folder_id, 0);
 	if (!parrays.has_value())
@@ -1995,7 +2018,7 @@ static void db_engine_notify_hierarchy_table_add_row(db_item_ptr &pdb,
 		}
 		if (ptable->prestriction != nullptr &&
 		    !cu_eval_folder_restriction(pdb->psqlite,
-		    folder_id, ptable->prestriction))
+		    folder_id, ptable->prog))
 			continue;
 		if (NULL == padded_row) {
 			datagram.db_notify.type = db_notify_type::hierarchy_table_row_added;
@@ -2649,6 +2672,7 @@ void db_engine_notify_message_deletion(db_item_ptr &pdb, uint64_t folder_id,
 {
 	DB_NOTIFY_DATAGRAM datagram;
 	auto dir = exmdb_server::get_dir();
+	db_engine_fbidx_touch(pdb, folder_id, message_id);
 	auto parrays = db_engine_classify_id_array(pdb,
 	               NF_OBJECT_DELETED, folder_id, message_id);
 	if (!parrays.has_value())
@@ -2778,6 +2802,7 @@ void db_engine_notify_folder_deletion(db_item_ptr &pdb, uint64_t parent_id,
 {
 	DB_NOTIFY_DATAGRAM datagram;
 	auto dir = exmdb_server::get_dir();
+	pdb->fb_indices.erase(folder_id);
 	auto parrays = db_engine_classify_id_array(pdb,
 	               NF_OBJECT_DELETED, parent_id, 0);
 	if (!parrays.has_value())
@@ -3388,6 +3413,7 @@ void db_engine_notify_message_modification(db_item_ptr &pdb, uint64_t folder_id,
 {
 	DB_NOTIFY_DATAGRAM datagram;
 	auto dir = exmdb_server::get_dir();
+	db_engine_fbidx_touch(pdb, folder_id, message_id);
 	auto parrays = db_engine_classify_id_array(pdb,
 	               NF_OBJECT_MODIFIED, folder_id, message_id);
 	if (!parrays.has_value())
@@ -3455,7 +3481,7 @@ static void db_engine_notify_hierarchy_table_modify_row(db_item_ptr &pdb,
 			pstmt.finalize();
 			if (NULL != ptable->prestriction &&
 			    cu_eval_folder_restriction(
-				pdb->psqlite, folder_id, ptable->prestriction)) {
+				pdb->psqlite, folder_id, ptable->prog)) {
 				if (NULL == padded_row) {
 					datagram2.db_notify.type = db_notify_type::hierarchy_table_row_added;
 					padded_row = cu_alloc<DB_NOTIFY_HIERARCHY_TABLE_ROW_ADDED>();
@@ -3498,7 +3524,7 @@ static void db_engine_notify_hierarchy_table_modify_row(db_item_ptr &pdb,
 		pstmt.finalize();
 		if (NULL != ptable->prestriction &&
 		    !cu_eval_folder_restriction(pdb->psqlite,
-		    folder_id, ptable->prestriction)) {
+		    folder_id, ptable->prog)) {
 			snprintf(sql_string, std::size(sql_string), "DELETE FROM t%u WHERE "
 			        "folder_id=%llu", ptable->table_id, LLU{folder_id});
 			if (gx_sql_exec(pdb->tables.psqlite, sql_string) != SQLITE_OK)
@@ -3600,6 +3626,10 @@ void db_engine_notify_message_movecopy(db_item_ptr &pdb,
 	auto dir = exmdb_server::get_dir();
 	std::vector<ID_NODE> tmp_list;
 
+	db_engine_fbidx_touch(pdb, folder_id, message_id);
+	if (!b_copy)
+		db_engine_fbidx_touch(pdb, old_fid, old_mid);
+
 	for (const auto &sub : pdb->nsub_list) {
 		auto pnsub = &sub;
 		if (b_copy) {
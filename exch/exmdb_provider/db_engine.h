@@ -1,13 +1,19 @@
 #pragma once
 #include <atomic>
 #include <cstdint>
+#include <ctime>
 #include <list>
 #include <memory>
 #include <mutex>
 #include <sqlite3.h>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <gromox/element_data.hpp>
 #include <gromox/mapi_types.hpp>
+#include <gromox/restriction.hpp>
+#include <gromox/rule_actions.hpp>
 #define CONTENT_ROW_HEADER						1
 #define CONTENT_ROW_MESSAGE						2
 
@@ -30,6 +36,7 @@ struct dynamic_node {
 	uint64_t folder_id = 0;
 	uint32_t search_flags = 0;
 	RESTRICTION *prestriction = nullptr;
+	gromox::res_program prog; /* compiled from @prestriction */
 	LONGLONG_ARRAY folder_ids{};
 };
 using DYNAMIC_NODE = dynamic_node;
@@ -58,6 +65,7 @@ struct table_node {
 	uint64_t folder_id = 0;
 	GUID handle_guid{};
 	RESTRICTION *prestriction = nullptr;
+	gromox::res_program prog; /* compiled from @prestriction */
 	SORTORDER_SET *psorts = nullptr;
 	uint32_t instance_tag = 0, extremum_tag = 0, header_id = 0;
 	BOOL b_search = false;
@@ -94,6 +102,73 @@ struct instance_node {
 };
 using INSTANCE_NODE = instance_node;
 
+/* One busy interval; strings are indices into fb_appt::strtab. */
+struct fb_span {
+	static constexpr uint16_t npos = UINT16_MAX;
+	time_t start_time = 0, end_time = 0;
+	uint32_t busy_status = 0;
+	uint16_t id = npos, subject = npos, location = npos;
+	bool is_meeting = false, is_recurring = false, is_exception = false;
+	bool is_reminderset = false, is_private = false;
+};
+
+struct fb_appt {
+	std::vector<std::string> strtab;
+	std::vector<fb_span> spans;
+};
+
+struct fb_ref {
+	time_t start_time = 0, end_time = 0;
+	const fb_appt *appt = nullptr;
+	const fb_span *span = nullptr;
+};
+
+/*
+ * Busy-interval index of one calendar folder: all appointments expanded over
+ * [win_start, win_end]. db_engine queues touched messages in @dirty; they are
+ * re-expanded on the next query.
+ */
+struct fb_index {
+	time_t win_start = 0, win_end = 0, built = 0, max_span = 0;
+	std::unordered_map<uint64_t, fb_appt> appts; /* by message_id */
+	std::unordered_set<uint64_t> dirty;
+	std::vector<fb_ref> sorted; /* by start_time */
+	bool b_sorted = false;
+
+	/* Whether a query over [start, end] can be answered from this index */
+	bool covers(time_t start, time_t end) const
+	{
+		return built != 0 && start >= win_start && end <= win_end;
+	}
+};
+
+struct rule_cache_del {
+	void operator()(RESTRICTION *r) const { restriction_free(r); }
+	void operator()(RULE_ACTIONS *a) const { rule_actions_free(a); }
+};
+
+/*
+ * Server-side rules of one folder as used by delivery (message.cpp), with
+ * conditions parsed and named property IDs resolved. Standard rules are
+ * invalidated by whoever writes the rules table; extended rules live in FAI
+ * messages and are checked against @fai_count/@fai_cn on use.
+ */
+struct rule_cache_node {
+	int32_t sequence = 0;
+	uint32_t state = 0;
+	uint64_t id = 0;
+	std::string provider;
+	bool extended = false;
+	std::unique_ptr<RESTRICTION, rule_cache_del> cond;
+	gromox::res_program prog; /* compiled from @cond */
+	std::unique_ptr<RULE_ACTIONS, rule_cache_del> actions; /* standard rules only */
+};
+
+struct rule_cache {
+	uint64_t fai_count = 0, fai_cn = 0;
+	std::vector<rule_cache_node> rules; /* sorted by sequence */
+};
+
 struct DB_ITEM {
 	DB_ITEM() = default;
 	~DB_ITEM();
@@ -104,9 +179,12 @@ struct DB_ITEM {
 	time_t last_time = 0;
 	std::timed_mutex giant_lock; /* should be broken up */
 	sqlite3 *psqlite = nullptr;
+	bool b_hotcols = false; /* messages has the schema E-14 property copies */
 	std::vector<dynamic_node> dynamic_list; /* dynamic searches */
 	std::vector<nsub_node> nsub_list;
 	std::vector<instance_node> instance_list;
+	std::unordered_map<uint64_t, fb_index> fb_indices; /* by folder_id */
+	std::unordered_map<uint64_t, std::shared_ptr<const rule_cache>> rule_caches; /* by folder_id */
 
 	/* memory database for holding rop table objects instance */
 	struct {
@@ -153,6 +231,7 @@ extern void db_engine_begin_batch_mode(db_item_ptr &);
 /* pdb will also be put */
 extern void db_engine_commit_batch_mode(db_item_ptr &&);
 extern void db_engine_cancel_batch_mode(db_item_ptr &);
+extern BOOL instance_materialize_embedded(db_item_ptr &);
 
 extern unsigned int g_exmdb_schema_upgrades, g_exmdb_search_pacing;
 extern unsigned int g_exmdb_search_yield, g_exmdb_search_nice;
@@ -54,8 +54,8 @@ ROUTER_CONNECTION::~ROUTER_CONNECTION()
 {
 	if (sockd >= 0)
 		close(sockd);
-	for (auto &&bin : datagram_list)
-		free(bin.pb);
+	for (auto &&dg : datagram_list)
+		free(dg.bin.pb);
 }
 
 void exmdb_parser_init(size_t max_threads, size_t max_routers)
@@ -5,6 +5,7 @@
 #include <mutex>
 #include <pthread.h>
 #include <string>
+#include <unordered_map>
 #include <gromox/atomic.hpp>
 #include <gromox/common_types.hpp>
 
@@ -20,6 +21,21 @@ class EXMDB_CONNECTION : public std::enable_shared_from_this<EXMDB_CONNECTION> {
 	int sockd = -1;
 };
 
+enum class dg_kind : uint8_t {
+	plain, table_row, table_reload, idempotent,
+};
+
+struct router_datagram {
+	BINARY bin{}; /* manual (de)allocation of .pb */
+	dg_kind kind = dg_kind::plain;
+	std::string key; /* coalescing key, see notification_agent.cpp */
+};
+
+struct dg_pending {
+	unsigned int count = 0;
+	bool reload = false;
+};
+
 struct ROUTER_CONNECTION {
 	ROUTER_CONNECTION() = default;
 	NOMOVE(ROUTER_CONNECTION);
@@ -32,7 +48,8 @@ struct ROUTER_CONNECTION {
 	time_t last_time = 0;
 	std::mutex lock, cond_mutex;
 	std::condition_variable waken_cond;
-	std::list<BINARY> datagram_list; /* manual (de)allocation of .pb */
+	std::list<router_datagram> datagram_list;
+	std::unordered_map<std::string, dg_pending> pending;
 };
 
 extern void exmdb_parser_init(size_t max_threads, size_t max_routers);
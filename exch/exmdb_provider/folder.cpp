@@ -867,6 +867,8 @@ BOOL exmdb_server::delete_folder(const char *dir, cpid_t cpid,
 		db_engine_delete_dynamic(pdb, fid_val);
 	}
 	auto parent_id = common_util_get_folder_parent_fid(pdb->psqlite, fid_val);
+	if (!instance_materialize_embedded(pdb))
+		return FALSE;
 	auto sql_transact = gx_sql_begin_trans(pdb->psqlite);
 	if (!sql_transact)
 		return false;
@@ -947,6 +949,8 @@ BOOL exmdb_server::empty_folder(const char *dir, cpid_t cpid,
 	auto fid_val = rop_util_get_gc_value(folder_id);
 	uint32_t message_count = 0, folder_count = 0;
 	uint64_t normal_size = 0, fai_size = 0;
+	if (!instance_materialize_embedded(pdb))
+		return FALSE;
 	auto sql_transact = gx_sql_begin_trans(pdb->psqlite);
 	if (!sql_transact)
 		return false;
@@ -2126,10 +2130,12 @@ BOOL exmdb_server::empty_folder_rule(const char *dir, uint64_t folder_id)
 	auto pdb = db_engine_get_db(dir);
 	if (pdb == nullptr || pdb->psqlite == nullptr)
 		return FALSE;
+	auto fid_val = rop_util_get_gc_value(folder_id);
 	snprintf(sql_string, 1024, "DELETE FROM rules WHERE "
-	         "folder_id=%llu", LLU{rop_util_get_gc_value(folder_id)});
+	         "folder_id=%llu", LLU{fid_val});
 	if (gx_sql_exec(pdb->psqlite, sql_string) != SQLITE_OK)
 		return FALSE;
+	pdb->rule_caches.erase(fid_val);
 	return TRUE;
 }
 
@@ -2148,6 +2154,7 @@ BOOL exmdb_server::update_folder_rule(const char *dir, uint64_t folder_id,
 	if (pdb == nullptr || pdb->psqlite == nullptr)
 		return FALSE;
 	auto fid_val = rop_util_get_gc_value(folder_id);
+	pdb->rule_caches.erase(fid_val);
 	snprintf(sql_string, std::size(sql_string), "SELECT count(*) "
 	          "FROM rules WHERE folder_id=%llu", LLU{fid_val});
 	auto pstmt = gx_sql_prep(pdb->psqlite, sql_string);
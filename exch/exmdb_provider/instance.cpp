@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2020–2021 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
 #include <cerrno>
 #include <cstdint>
 #include <cstdio>
@@ -49,6 +50,41 @@ static BOOL instance_identify_message(MESSAGE_CONTENT *pmsgctnt);
 static constexpr uint32_t dummy_rcpttype = MAPI_TO;
 static constexpr char dummy_addrtype[] = "NONE", dummy_string[] = "";
 
+namespace {
+
+/**
+ * Value of ID_TAG_EMBEDDED. The change number pins the stored embedded
+ * message that the instance was opened on.
+ */
+struct embedded_ref {
+	bool parse(const char *);
+	std::string serialize() const;
+
+	uint64_t mid = 0, cn = 0;
+	uint32_t size = 0;
+};
+
+}
+
+bool embedded_ref::parse(const char *s)
+{
+	char *end;
+	mid = strtoull(s, &end, 10);
+	if (*end != ':')
+		return false;
+	size = strtoul(end + 1, &end, 10);
+	if (*end != ':')
+		return false;
+	cn = strtoull(end + 1, &end, 10);
+	return *end == '\0';
+}
+
+std::string embedded_ref::serialize() const
+{
+	return std::to_string(mid) + ":" + std::to_string(size) + ":" +
+	       std::to_string(cn);
+}
+
 instance_node::instance_node(instance_node &&o) noexcept :
 	instance_id(o.instance_id), parent_id(o.parent_id),
 	folder_id(o.folder_id), last_id(o.last_id), cpid(o.cpid),
@@ -234,8 +270,8 @@ static BOOL instance_load_message(sqlite3 *psqlite,
 	pstmt = gx_sql_prep(psqlite, sql_string);
 	if (pstmt == nullptr)
 		return FALSE;
-	auto pstmt1 = gx_sql_prep(psqlite, "SELECT message_id"
-	         " FROM messages WHERE parent_attid=?");
+	auto pstmt1 = gx_sql_prep(psqlite, "SELECT message_id, message_size,"
+	         " change_number FROM messages WHERE parent_attid=?");
 	if (pstmt1 == nullptr)
 		return FALSE;
 	while (pstmt.step() == SQLITE_ROW) {
@@ -282,15 +318,20 @@ static BOOL instance_load_message(sqlite3 *psqlite,
 			}
 			}
 		}
+		/*
+		 * Embedded messages are only loaded when something looks at
+		 * them (instance_load_embedded), so that opening a message
+		 * with many forwarded mails does not read all of them.
+		 */
 		sqlite3_bind_int64(pstmt1, 1, attachment_id);
 		if (pstmt1.step() == SQLITE_ROW) {
-			uint64_t message_id1 = pstmt1.col_uint64(0);
-			uint32_t last_id = 0;
-			message_content *pmsgctnt1 = nullptr;
-			if (!instance_load_message(psqlite, message_id1,
-			    &last_id, &pmsgctnt1))
+			embedded_ref ref;
+			ref.mid  = pstmt1.col_uint64(0);
+			ref.size = pstmt1.col_uint64(1);
+			ref.cn   = pstmt1.col_uint64(2);
+			if (pattachment->proplist.set(ID_TAG_EMBEDDED,
+			    ref.serialize().c_str()) != 0)
 				return FALSE;
-			pattachment->set_embedded_internal(pmsgctnt1);
 		}
 		sqlite3_reset(pstmt1);
 	}
@@ -298,6 +339,84 @@ static BOOL instance_load_message(sqlite3 *psqlite,
 	return TRUE;
 }
 
+/**
+ * Resolve a deferred embedded message. Writers materialize all deferred
+ * messages before they touch stored ones (instance_materialize_embedded),
+ * so a vanished or rewritten source is a bug, but it is reported as
+ * ecObjectDeleted rather than silently handing out the new content.
+ */
+static ec_error_t instance_load_embedded(sqlite3 *psqlite,
+    ATTACHMENT_CONTENT *pattachment)
+{
+	auto str = pattachment->proplist.get<const char>(ID_TAG_EMBEDDED);
+	if (str == nullptr)
+		return ecSuccess;
+	embedded_ref ref;
+	if (!ref.parse(str))
+		return ecError;
+	auto pstmt = gx_sql_prep(psqlite, "SELECT change_number"
+	             " FROM messages WHERE message_id=?");
+	if (pstmt == nullptr)
+		return ecError;
+	sqlite3_bind_int64(pstmt, 1, ref.mid);
+	if (pstmt.step() != SQLITE_ROW || pstmt.col_uint64(0) != ref.cn)
+		return ecObjectDeleted;
+	pstmt.finalize();
+	uint32_t last_id = 0;
+	message_content *pmsgctnt = nullptr;
+	if (!instance_load_message(psqlite, ref.mid, &last_id, &pmsgctnt))
+		return ecError;
+	pattachment->proplist.erase(ID_TAG_EMBEDDED);
+	pattachment->set_embedded_internal(pmsgctnt);
+	return ecSuccess;
+}
+
+static ec_error_t instance_load_embedded_all(sqlite3 *, MESSAGE_CONTENT *);
+
+static ec_error_t instance_load_embedded_all(sqlite3 *psqlite,
+    ATTACHMENT_CONTENT *pattachment)
+{
+	auto ret = instance_load_embedded(psqlite, pattachment);
+	if (ret != ecSuccess || pattachment->pembedded == nullptr)
+		return ret;
+	return instance_load_embedded_all(psqlite, pattachment->pembedded);
+}
+
+/* Needed whenever the content leaves the instance (RPC reply, store write) */
+static ec_error_t instance_load_embedded_all(sqlite3 *psqlite,
+    MESSAGE_CONTENT *pmsgctnt)
+{
+	if (pmsgctnt->children.pattachments == nullptr)
+		return ecSuccess;
+	auto pattachments = pmsgctnt->children.pattachments;
+	for (size_t i = 0; i < pattachments->count; ++i) {
+		auto ret = instance_load_embedded_all(psqlite, pattachments->pplist[i]);
+		if (ret != ecSuccess)
+			return ret;
+	}
+	return ecSuccess;
+}
+
+/**
+ * Open instances are snapshots of the store. Anything that rewrites or
+ * deletes stored messages must call this first, so that embedded messages
+ * which instances have not looked at yet are read while still there.
+ */
+BOOL instance_materialize_embedded(db_item_ptr &pdb)
+{
+	for (auto &inst : pdb->instance_list) {
+		auto ret = inst.type == instance_type::message ?
+		           instance_load_embedded_all(pdb->psqlite, static_cast<MESSAGE_CONTENT *>(inst.pcontent)) :
+		           instance_load_embedded_all(pdb->psqlite, static_cast<ATTACHMENT_CONTENT *>(inst.pcontent));
+		if (ret != ecSuccess) {
+			mlog(LV_ERR, "E-2421: cannot load embedded message of instance %u: %s",
+			        inst.instance_id, mapi_strerror(ret));
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
 static uint32_t next_instance_id(db_item_ptr &db)
 {
 	if (db->instance_list.empty())
@@ -404,7 +523,10 @@ BOOL exmdb_server::load_embedded_instance(const char *dir, BOOL b_new,
 	auto pinstance1 = instance_get_instance_c(pdb, attachment_instance_id);
 	if (pinstance1 == nullptr || pinstance1->type != instance_type::attachment)
 		return FALSE;
-	auto pmsgctnt = static_cast<ATTACHMENT_CONTENT *>(pinstance1->pcontent)->pembedded;
+	auto patx = static_cast<ATTACHMENT_CONTENT *>(pinstance1->pcontent);
+	if (instance_load_embedded(pdb->psqlite, patx) != ecSuccess)
+		return FALSE;
+	auto pmsgctnt = patx->pembedded;
 	if (NULL == pmsgctnt) {
 		if (!b_new) {
 			*pinstance_id = 0;
@@ -517,6 +639,8 @@ BOOL exmdb_server::reload_message_instance(const char *dir,
 		if (pinstance1 == nullptr || pinstance1->type != instance_type::attachment)
 			return FALSE;
 		auto atx = static_cast<ATTACHMENT_CONTENT *>(pinstance1->pcontent);
+		if (instance_load_embedded(pdb->psqlite, atx) != ecSuccess)
+			return FALSE;
 		if (atx->pembedded == nullptr) {
 			*pb_result = FALSE;
 			return TRUE;	
@@ -685,6 +809,35 @@ void *instance_read_cid_content(const char *cid, uint32_t *plen, uint32_t tag) t
 	return nullptr;
 }
 
+/**
+ * Read a byte range of a binary CID object. Only v3 objects with a seek
+ * table can be read partially. For anything else (and when the object is
+ * missing), *ptotal stays at UINT32_MAX so that the caller loads the
+ * property in full once, instead of having every range decode the whole
+ * object again.
+ */
+static BOOL instance_read_cid_range(const char *cid, uint32_t offset,
+    uint32_t length, uint32_t *ptotal, BINARY *pbin)
+{
+	*ptotal = UINT32_MAX;
+	*pbin = {};
+	if (strchr(cid, '/') == nullptr || g_dbg_synth_content == 2)
+		return TRUE;
+	auto path = cu_cid_path(nullptr, cid, 0);
+	uint64_t total = 0;
+	auto ret = gx_decompress_range(path.c_str(), offset, length, *pbin,
+	           common_util_alloc, &total);
+	if (ret == ESPIPE || ret == ENOENT || (ret == 0 && total >= UINT32_MAX)) {
+		*pbin = {};
+		return TRUE;
+	} else if (ret != 0) {
+		errno = ret;
+		return FALSE;
+	}
+	*ptotal = total;
+	return TRUE;
+}
+
 static BOOL instance_read_attachment(
 	const ATTACHMENT_CONTENT *pattachment1,
 	ATTACHMENT_CONTENT *pattachment)
@@ -935,7 +1088,10 @@ BOOL exmdb_server::read_message_instance(const char *dir,
 	auto pinstance = instance_get_instance_c(pdb, instance_id);
 	if (pinstance == nullptr || pinstance->type != instance_type::message)
 		return FALSE;
-	return instance_read_message(static_cast<MESSAGE_CONTENT *>(pinstance->pcontent), pmsgctnt);
+	auto ict = static_cast<MESSAGE_CONTENT *>(pinstance->pcontent);
+	if (instance_load_embedded_all(pdb->psqlite, ict) != ecSuccess)
+		return FALSE;
+	return instance_read_message(ict, pmsgctnt);
 }
 
 static BOOL instance_identify_rcpts(TARRAY_SET *prcpts)
@@ -1214,7 +1370,10 @@ BOOL exmdb_server::read_attachment_instance(const char *dir,
 	auto pinstance = instance_get_instance_c(pdb, instance_id);
 	if (pinstance == nullptr || pinstance->type != instance_type::attachment)
 		return FALSE;
-	return instance_read_attachment(static_cast<ATTACHMENT_CONTENT *>(pinstance->pcontent), pattctnt);
+	auto iat = static_cast<ATTACHMENT_CONTENT *>(pinstance->pcontent);
+	if (instance_load_embedded_all(pdb->psqlite, iat) != ecSuccess)
+		return FALSE;
+	return instance_read_attachment(iat, pattctnt);
 }
 
 BOOL exmdb_server::write_attachment_instance(const char *dir,
@@ -1274,6 +1433,9 @@ BOOL exmdb_server::write_attachment_instance(const char *dir,
 		if (pproplist->set(pattctnt->proplist.ppropval[i]) != 0)
 			return FALSE;
 	}
+	if (pattctnt->pembedded != nullptr &&
+	    instance_load_embedded(pdb->psqlite, static_cast<ATTACHMENT_CONTENT *>(pinstance->pcontent)) != ecSuccess)
+		return FALSE;
 	if (pattctnt->pembedded != nullptr &&
 	    (!b_force || static_cast<ATTACHMENT_CONTENT *>(pinstance->pcontent)->pembedded == nullptr)) {
 		auto pmsgctnt = pattctnt->pembedded->dup();
@@ -1427,6 +1589,11 @@ BOOL exmdb_server::flush_instance(const char *dir, uint32_t instance_id,
 		*pe_result = ecSuccess;
 		return TRUE;
 	}
+	auto ret = instance_load_embedded_all(pdb->psqlite, ict);
+	if (ret != ecSuccess) {
+		*pe_result = ret;
+		return TRUE;
+	}
 	auto pmsgctnt = ict->dup();
 	if (pmsgctnt == nullptr)
 		return FALSE;	
@@ -1558,9 +1725,12 @@ static BOOL giat_attachment(ATTACHMENT_CONTENT *pattachment, PROPTAG_ARRAY *ppro
 		pproptags->count = 0;
 		return FALSE;
 	}
-	for (unsigned int i = 0; i < pattachment->proplist.count; ++i)
-		pproptags->pproptag[i] = atx_idtopr(pattachment->proplist.ppropval[i].proptag);
-	pproptags->count = pattachment->proplist.count;
+	pproptags->count = 0;
+	for (unsigned int i = 0; i < pattachment->proplist.count; ++i) {
+		auto tag = pattachment->proplist.ppropval[i].proptag;
+		if (tag != ID_TAG_EMBEDDED)
+			pproptags->pproptag[pproptags->count++] = atx_idtopr(tag);
+	}
 	pproptags->emplace_back(PR_ATTACH_SIZE);
 	return TRUE;
 }
@@ -2137,6 +2307,58 @@ BOOL exmdb_server::get_instance_properties(const char *dir,
 	return TRUE;
 }
 
+/**
+ * Ranged read of a binary stream-type property (PR_ATTACH_DATA_BIN/OBJ,
+ * PR_HTML, PR_RTF_COMPRESSED) of an instance, so that emsmdb need not
+ * transfer (or the server decompress) a whole object to serve a ReadStream.
+ * @total_size is UINT32_MAX if the property is absent or not eligible; the
+ * caller should then use get_instance_properties.
+ */
+BOOL exmdb_server::read_instance_range(const char *dir, uint32_t instance_id,
+    uint32_t proptag, uint32_t offset, uint32_t length, uint32_t *ptotal,
+    BINARY *pbin)
+{
+	*ptotal = UINT32_MAX;
+	*pbin = {};
+	auto pdb = db_engine_get_db(dir);
+	if (pdb == nullptr || pdb->psqlite == nullptr)
+		return FALSE;
+	auto pinstance = instance_get_instance_c(pdb, instance_id);
+	if (pinstance == nullptr)
+		return FALSE;
+	const TPROPVAL_ARRAY *props;
+	uint32_t idtag;
+	if (pinstance->type == instance_type::attachment) {
+		props = &static_cast<ATTACHMENT_CONTENT *>(pinstance->pcontent)->proplist;
+		idtag = proptag == PR_ATTACH_DATA_BIN ? ID_TAG_ATTACHDATABINARY :
+		        proptag == PR_ATTACH_DATA_OBJ ? ID_TAG_ATTACHDATAOBJECT : 0;
+	} else {
+		props = &static_cast<MESSAGE_CONTENT *>(pinstance->pcontent)->proplist;
+		idtag = proptag == PR_HTML ? ID_TAG_HTML :
+		        proptag == PR_RTF_COMPRESSED ? ID_TAG_RTFCOMPRESSED : 0;
+	}
+	if (idtag == 0)
+		return TRUE;
+	/* Set since the instance was loaded: still in memory */
+	auto bv = props->get<const BINARY>(proptag);
+	if (bv != nullptr) {
+		*ptotal = bv->cb;
+		if (offset >= bv->cb)
+			return TRUE;
+		/* Copy; the instance may change before the reply is sent */
+		pbin->cb = std::min(length, bv->cb - offset);
+		pbin->pv = common_util_alloc(pbin->cb);
+		if (pbin->pv == nullptr)
+			return FALSE;
+		memcpy(pbin->pv, &bv->pb[offset], pbin->cb);
+		return TRUE;
+	}
+	auto cid = props->get<const char>(idtag);
+	if (cid == nullptr)
+		return TRUE;
+	return instance_read_cid_range(cid, offset, length, ptotal, pbin);
+}
+
 /* A duplicate implementation is in common_util_set_message_subject. */
 static BOOL xns_set_msg_subj(TPROPVAL_ARRAY &msgprop,
     const TPROPVAL_ARRAY &nuprop, size_t subj_id, cpid_t cpid)
@@ -2958,7 +3180,8 @@ BOOL exmdb_server::set_message_instance_conflict(const char *dir,
 	if (num != nullptr && *num & MSGSTATUS_IN_CONFLICT)
 		b_inconflict = TRUE;
 	if (!b_inconflict) {
-		if (!instance_read_message(pmsg, &msgctnt))
+		if (instance_load_embedded_all(pdb->psqlite, pmsg) != ecSuccess ||
+		    !instance_read_message(pmsg, &msgctnt))
 			return FALSE;
 		if (NULL == pmsg->children.pattachments) {
 			pattachments = attachment_list_init();
@@ -16,6 +16,7 @@
 #include <gromox/exmdb_provider_client.hpp>
 #include <gromox/exmdb_rpc.hpp>
 #include <gromox/exmdb_server.hpp>
+#include <gromox/fileio.h>
 #include <gromox/paths.h>
 #include <gromox/svc_common.h>
 #include <gromox/textmaps.hpp>
@@ -38,6 +39,7 @@ static constexpr cfg_directive exmdb_cfg_defaults[] = {
 	{"enable_dam", "1", CFG_BOOL},
 	{"exmdb_body_autosynthesis", "1", CFG_BOOL},
 	{"exmdb_file_compression", "zstd-6"},
+	{"exmdb_file_compression_dict", PKGSTATEDIR "/zdict"},
 	{"exmdb_hosts_allow", ""}, /* ::1 default set later during startup */
 	{"exmdb_listen_port", "5000"},
 	{"exmdb_pf_read_per_user", "1"},
@@ -174,6 +176,10 @@ static BOOL svc_exmdb_provider(int reason, void **ppdata) try
 			mlog(LV_INFO, "Content File Compression: off");
 		else
 			mlog(LV_INFO, "Content File Compression: zstd-%d", g_cid_compression);
+		/* Reading always consults the (default) directory */
+		str = pconfig->get_value("exmdb_file_compression_dict");
+		gx_zdict_setdir(str);
+		g_cid_usedict = str != nullptr && *str != '\0';
 
 		common_util_init(org_name, max_msg_count, max_rule, max_ext_rule);
 		db_engine_init(table_size, cache_interval, populating_num);
@@ -55,6 +55,9 @@ struct rule_node {
 	uint64_t id = 0;
 	std::string provider;
 	bool extended = false;
+	/* owned by the folder's rule_cache */
+	const res_program *cond = nullptr;
+	const RULE_ACTIONS *actions = nullptr;
 
 	bool operator<(const rule_node &o) const { return sequence < o.sequence; }
 };
@@ -77,6 +80,7 @@ struct rulexec_in {
 	sqlite3 *sqlite = nullptr;
 	uint64_t folder_id = 0, message_id = 0;
 	std::optional<Json::Value> digest;
+	DB_ITEM *db = nullptr;
 };
 
 struct seen_list {
@@ -141,6 +145,8 @@ BOOL exmdb_server::movecopy_message(const char *dir, int32_t account_id,
 	if (pstmt.step() == SQLITE_ROW)
 		return TRUE;
 	pstmt.finalize();
+	if (!instance_materialize_embedded(pdb))
+		return FALSE;
 	auto sql_transact = gx_sql_begin_trans(pdb->psqlite);
 	if (!sql_transact)
 		return false;
@@ -286,6 +292,8 @@ BOOL exmdb_server::movecopy_messages(const char *dir, int32_t account_id,
 		if (b_batch)
 			db_engine_cancel_batch_mode(pdb);
 	});
+	if (!instance_materialize_embedded(pdb))
+		return FALSE;
 	auto sql_transact = gx_sql_begin_trans(pdb->psqlite);
 	if (!sql_transact)
 		return false;
@@ -505,6 +513,8 @@ BOOL exmdb_server::delete_messages(const char *dir, int32_t account_id,
 		if (b_batch)
 			db_engine_cancel_batch_mode(pdb);
 	});
+	if (!instance_materialize_embedded(pdb))
+		return FALSE;
 	auto sql_transact = gx_sql_begin_trans(pdb->psqlite);
 	if (!sql_transact)
 		return false;
@@ -2039,32 +2049,51 @@ static BOOL message_write_message(BOOL b_internal, sqlite3 *psqlite,
 	       PR_LOCAL_COMMIT_TIME_MAX, &nt_time, &b_result);
 }
 
-static BOOL message_load_folder_rules(const rulexec_in &rp,
-    std::vector<rule_node> &plist) try
+static bool rc_usable(uint32_t state)
+{
+	if (state & (ST_PARSE_ERROR | ST_ERROR))
+		return false;
+	return state & (ST_ENABLED | ST_ONLY_WHEN_OOF);
+}
+
+static BOOL message_load_folder_rules(sqlite3 *psqlite, uint64_t folder_id,
+    rule_cache &rc) try
 {
 	char sql_string[256];
 	
 	snprintf(sql_string, std::size(sql_string), "SELECT state, rule_id, "
 	         "sequence, provider FROM rules WHERE folder_id=%lld "
-	         "AND provider IS NOT NULL", LLU{rp.folder_id});
-	auto pstmt = gx_sql_prep(rp.sqlite, sql_string);
+	         "AND provider IS NOT NULL", LLU{folder_id});
+	auto pstmt = gx_sql_prep(psqlite, sql_string);
 	if (pstmt == nullptr)
 		return FALSE;
 	while (pstmt.step() == SQLITE_ROW) {
 		uint32_t state = sqlite3_column_int64(pstmt, 0);
-		if (state & (ST_PARSE_ERROR | ST_ERROR))
-			continue;
-		if (state & ST_ENABLED) {
-			/* do nothing */
-		} else if (state & ST_ONLY_WHEN_OOF) {
-			if (!rp.oof)
-				continue;
-		} else {
+		if (!rc_usable(state))
 			continue;
+		rule_cache_node rule;
+		rule.state = state;
+		rule.id = sqlite3_column_int64(pstmt, 1);
+		rule.sequence = pstmt.col_int64(2);
+		rule.provider = pstmt.col_text(3);
+		void *pvalue = nullptr;
+		if (!common_util_get_rule_property(rule.id, psqlite,
+		    PR_RULE_CONDITION, &pvalue))
+			return false;
+		if (pvalue != nullptr) {
+			rule.cond.reset(restriction_dup(static_cast<RESTRICTION *>(pvalue)));
+			if (rule.cond == nullptr || !rule.prog.compile(*rule.cond))
+				return false;
+		}
+		if (!common_util_get_rule_property(rule.id, psqlite,
+		    PR_RULE_ACTIONS, &pvalue))
+			return false;
+		if (pvalue != nullptr) {
+			rule.actions.reset(rule_actions_dup(static_cast<RULE_ACTIONS *>(pvalue)));
+			if (rule.actions == nullptr)
+				return false;
 		}
-		uint64_t msg_id = sqlite3_column_int64(pstmt, 1);
-		int32_t seq = pstmt.col_int64(2);
-		plist.push_back(RULE_NODE{seq, state, msg_id, pstmt.col_text(3)});
+		rc.rules.push_back(std::move(rule));
 	}
 	return TRUE;
 } catch (const std::bad_alloc &) {
@@ -2072,8 +2101,10 @@ static BOOL message_load_folder_rules(const rulexec_in &rp,
 	return false;
 }
 
-static BOOL message_load_folder_ext_rules(const rulexec_in &rp,
-    std::vector<rule_node> &plist) try
+static BOOL message_replace_restriction_propid(sqlite3 *, NAMEDPROPERTY_INFO *, RESTRICTION *);
+
+static BOOL message_load_folder_ext_rules(sqlite3 *psqlite, uint64_t folder_id,
+    rule_cache &rc) try
 {
 	size_t num_rules = 0;
 	auto qstr = fmt::format(
@@ -2090,26 +2121,43 @@ static BOOL message_load_folder_ext_rules(const rulexec_in &rp,
 		"ON m.message_id=p3.message_id AND p3.proptag={} "
 		"LEFT JOIN message_properties AS p4 "
 		"ON m.message_id=p4.message_id AND p4.proptag={}",
-		rp.folder_id, PR_MESSAGE_CLASS, PR_RULE_MSG_STATE,
+		folder_id, PR_MESSAGE_CLASS, PR_RULE_MSG_STATE,
 		PR_RULE_MSG_SEQUENCE, PR_RULE_MSG_PROVIDER);
-	auto pstmt = gx_sql_prep(rp.sqlite, qstr.c_str());
+	auto pstmt = gx_sql_prep(psqlite, qstr.c_str());
 	if (pstmt == nullptr)
 		return FALSE;
 	while (pstmt.step() == SQLITE_ROW) {
-		uint64_t message_id = sqlite3_column_int64(pstmt, 0);
 		uint32_t state = pstmt.col_uint64(1);
-		if (state & (ST_PARSE_ERROR | ST_ERROR))
-			continue;
-		if (state & ST_ENABLED) {
-			/* do nothing */
-		} else if (state & ST_ONLY_WHEN_OOF) {
-			if (!rp.oof)
-				continue;
-		} else {
+		if (!rc_usable(state))
 			continue;
+		rule_cache_node rule;
+		rule.state = state;
+		rule.id = sqlite3_column_int64(pstmt, 0);
+		rule.sequence = pstmt.col_int64(2);
+		rule.provider = znul(pstmt.col_text(3));
+		rule.extended = true;
+		void *pvalue = nullptr;
+		if (!cu_get_property(MAPI_MESSAGE, rule.id, CP_ACP, psqlite,
+		    PR_EXTENDED_RULE_MSG_CONDITION, &pvalue))
+			return false;
+		auto bv = static_cast<BINARY *>(pvalue);
+		if (bv != nullptr && bv->cb != 0) {
+			EXT_PULL ext_pull;
+			ext_pull.init(bv->pb, bv->cb, common_util_alloc,
+				EXT_FLAG_WCOUNT | EXT_FLAG_UTF16);
+			NAMEDPROPERTY_INFO propname_info;
+			RESTRICTION restriction;
+			if (ext_pull.g_namedprop_info(&propname_info) == EXT_ERR_SUCCESS &&
+			    ext_pull.g_restriction(&restriction) == EXT_ERR_SUCCESS) {
+				if (!message_replace_restriction_propid(psqlite,
+				    &propname_info, &restriction))
+					return false;
+				rule.cond.reset(restriction_dup(&restriction));
+				if (rule.cond == nullptr || !rule.prog.compile(*rule.cond))
+					return false;
+			}
 		}
-		int32_t seq = pstmt.col_int64(2);
-		plist.push_back(RULE_NODE{seq, state, message_id, pstmt.col_text(3), true});
+		rc.rules.push_back(std::move(rule));
 		if (++num_rules >= g_max_extrule_num)
 			break;
 	}
@@ -2119,6 +2167,54 @@ static BOOL message_load_folder_ext_rules(const rulexec_in &rp,
 	return false;
 }
 
+/*
+ * Extended rules are FAI messages; any change to one of them moves the
+ * count or the highest change number of the folder's FAI.
+ */
+static bool message_rule_fai_stamp(sqlite3 *psqlite, uint64_t folder_id,
+    uint64_t &count, uint64_t &cn)
+{
+	char sql_string[160];
+	snprintf(sql_string, std::size(sql_string), "SELECT COUNT(*), "
+	         "MAX(change_number) FROM messages WHERE parent_fid=%llu "
+	         "AND is_associated=1 AND is_deleted=0", LLU{folder_id});
+	auto pstmt = gx_sql_prep(psqlite, sql_string);
+	if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
+		return false;
+	count = pstmt.col_uint64(0);
+	cn    = pstmt.col_uint64(1);
+	return true;
+}
+
+static std::shared_ptr<const rule_cache> message_rule_cache(const rulexec_in &rp) try
+{
+	uint64_t fai_count = 0, fai_cn = 0;
+	if (!message_rule_fai_stamp(rp.sqlite, rp.folder_id, fai_count, fai_cn))
+		return nullptr;
+	if (rp.db != nullptr) {
+		auto it = rp.db->rule_caches.find(rp.folder_id);
+		if (it != rp.db->rule_caches.end() &&
+		    it->second->fai_count == fai_count && it->second->fai_cn == fai_cn)
+			return it->second;
+	}
+	auto rc = std::make_shared<rule_cache>();
+	rc->fai_count = fai_count;
+	rc->fai_cn    = fai_cn;
+	if (!message_load_folder_rules(rp.sqlite, rp.folder_id, *rc) ||
+	    !message_load_folder_ext_rules(rp.sqlite, rp.folder_id, *rc))
+		return nullptr;
+	std::stable_sort(rc->rules.begin(), rc->rules.end(),
+		[](const rule_cache_node &a, const rule_cache_node &b) {
+			return a.sequence < b.sequence;
+		});
+	if (rp.db != nullptr)
+		rp.db->rule_caches[rp.folder_id] = rc;
+	return rc;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2413: ENOMEM");
+	return nullptr;
+}
+
 static BOOL message_get_real_propid(sqlite3 *psqlite,
     NAMEDPROPERTY_INFO *ppropname_info, uint32_t *pproptag, BOOL *pb_replaced)
 {
@@ -2312,13 +2408,16 @@ static BOOL message_make_dem(const char *username,
 	return false;
 }
 
-static ec_error_t message_disable_rule(sqlite3 *psqlite,
+static ec_error_t message_disable_rule(const rulexec_in &rp,
 	BOOL b_extended, uint64_t id)
 {
 	void *pvalue;
 	BOOL b_result;
 	char sql_string[128];
+	auto psqlite = rp.sqlite;
 	
+	if (rp.db != nullptr)
+		rp.db->rule_caches.clear();
 	if (!b_extended) {
 		snprintf(sql_string, std::size(sql_string), "UPDATE rules SET state=state|%u "
 		         "WHERE rule_id=%llu", ST_ERROR, LLU{id});
@@ -2867,7 +2966,7 @@ static ec_error_t op_move_same(const rulexec_in &rp,
 			rp.sqlite, rp.folder_id, rp.message_id, rule.id,
 			RULE_ERROR_MOVECOPY, block.type,
 			act_idx, rule.provider.c_str(), seen);
-		return message_disable_rule(rp.sqlite, false, rule.id);
+		return message_disable_rule(rp, false, rule.id);
 	}
 	unsigned int tmp_id = 0, tmp_id1 = 0;
 	auto is_pvt = exmdb_server::is_private();
@@ -2943,7 +3042,7 @@ static ec_error_t op_reply(const rulexec_in &rp, seen_list &seen,
 	message_make_dem(rp.ev_to, rp.sqlite, rp.folder_id,
 		rp.message_id, rule.id, RULE_ERROR_RETRIEVE_TEMPLATE,
 		block.type, act_idx, rule.provider.c_str(), seen);
-	return message_disable_rule(rp.sqlite, false, rule.id);
+	return message_disable_rule(rp, false, rule.id);
 }
 
 static ec_error_t op_defer(const rulexec_in &rp, const rule_node &rule,
@@ -2973,7 +3072,7 @@ static ec_error_t op_forward(const rulexec_in &rp, seen_list &seen,
 		message_make_dem(rp.ev_to, rp.sqlite, rp.folder_id,
 			rp.message_id, rule.id, RULE_ERROR_TOO_MANY_RCPTS,
 			block.type, act_idx, rule.provider.c_str(), seen);
-		return message_disable_rule(rp.sqlite, false, rule.id);
+		return message_disable_rule(rp, false, rule.id);
 	}
 	std::vector<std::string> rcpt_list;
 	if (!msg_rcpt_blocks_to_list(*pfwddlgt, rcpt_list))
@@ -2992,7 +3091,7 @@ static ec_error_t op_delegate(const rulexec_in &rp, seen_list &seen,
 		message_make_dem(rp.ev_to, rp.sqlite, rp.folder_id,
 			rp.message_id, rule.id, RULE_ERROR_TOO_MANY_RCPTS,
 			block.type, act_idx, rule.provider.c_str(), seen);
-		return message_disable_rule(rp.sqlite, false, rule.id);
+		return message_disable_rule(rp, false, rule.id);
 	}
 
 	char essdn_buff[1280], display_name[1024];
@@ -3145,19 +3244,12 @@ static ec_error_t op_process(const rulexec_in &rp,
 {
 	if (b_exit && !(rule.state & ST_ONLY_WHEN_OOF))
 		return ecSuccess;
-	void *pvalue = nullptr;
-	if (!common_util_get_rule_property(rule.id, rp.sqlite,
-	    PR_RULE_CONDITION, &pvalue))
-		return ecError;
-	if (pvalue == nullptr || !cu_eval_msg_restriction(rp.sqlite,
-	    CP_ACP, rp.message_id, static_cast<RESTRICTION *>(pvalue)))
+	if (rule.cond == nullptr || !cu_eval_msg_restriction(rp.sqlite,
+	    CP_ACP, rp.message_id, *rule.cond))
 		return ecSuccess;
 	if (rule.state & ST_EXIT_LEVEL)
 		b_exit = TRUE;
-	RULE_ACTIONS *pactions = nullptr;
-	if (!common_util_get_rule_property(rule.id, rp.sqlite,
-	    PR_RULE_ACTIONS, reinterpret_cast<void **>(&pactions)))
-		return ecError;
+	auto pactions = rule.actions;
 	if (pactions == nullptr)
 		return ecSuccess;
 	for (size_t i = 0; i < pactions->count; ++i) {
@@ -3169,25 +3261,27 @@ static ec_error_t op_process(const rulexec_in &rp,
 	return ecSuccess;
 }
 
-static ec_error_t opx_move_private(const char *account, sqlite3 *psqlite,
+static ec_error_t opx_move_private(const rulexec_in &rp,
     const rule_node &rule, const EXT_MOVECOPY_ACTION *pextmvcp)
 {
+	auto account = rp.ev_to;
 	if (pextmvcp->folder_eid.folder_type != EITLT_PRIVATE_FOLDER)
-		return message_disable_rule(psqlite, TRUE, rule.id);
+		return message_disable_rule(rp, TRUE, rule.id);
 	unsigned int tmp_id = 0;
 	if (!common_util_get_id_from_username(account, &tmp_id))
 		return ecSuccess;
 	auto tmp_guid = rop_util_make_user_guid(tmp_id);
 	if (tmp_guid != pextmvcp->folder_eid.database_guid)
-		return message_disable_rule(psqlite, TRUE, rule.id);
+		return message_disable_rule(rp, TRUE, rule.id);
 	return ecSuccess;
 }
 
-static ec_error_t opx_move_public(const char *account, sqlite3 *psqlite,
+static ec_error_t opx_move_public(const rulexec_in &rp,
     const rule_node &rule, const EXT_MOVECOPY_ACTION *pextmvcp)
 {
+	auto account = rp.ev_to;
 	if (pextmvcp->folder_eid.folder_type != EITLT_PUBLIC_FOLDER)
-		return message_disable_rule(psqlite, TRUE, rule.id);
+		return message_disable_rule(rp, TRUE, rule.id);
 	const char *pc = strchr(account, '@'); /* CONST-STRCHR-MARKER */
 	if (pc == nullptr)
 		pc = account;
@@ -3198,7 +3292,7 @@ static ec_error_t opx_move_public(const char *account, sqlite3 *psqlite,
 		return ecSuccess;
 	auto tmp_guid = rop_util_make_domain_guid(tmp_id);
 	if (tmp_guid != pextmvcp->folder_eid.database_guid)
-		return message_disable_rule(psqlite, TRUE, rule.id);
+		return message_disable_rule(rp, TRUE, rule.id);
 	return ecSuccess;
 }
 
@@ -3208,8 +3302,8 @@ static ec_error_t opx_move(const rulexec_in &rp,
 {
 	auto pextmvcp = static_cast<EXT_MOVECOPY_ACTION *>(block.pdata);
 	auto ec = exmdb_server::is_private() ?
-	          opx_move_private(rp.ev_to, rp.sqlite, rule, pextmvcp) :
-	          opx_move_public(rp.ev_to, rp.sqlite, rule, pextmvcp);
+	          opx_move_private(rp, rule, pextmvcp) :
+	          opx_move_public(rp, rule, pextmvcp);
 	if (ec != ecSuccess)
 		return ec;
 	auto dst_fid = rop_util_gc_to_value(
@@ -3221,7 +3315,7 @@ static ec_error_t opx_move(const rulexec_in &rp,
 	if (!common_util_check_folder_id(rp.sqlite, dst_fid, &b_exist))
 		return ecError;
 	if (!b_exist)
-		return message_disable_rule(rp.sqlite, TRUE, rule.id);
+		return message_disable_rule(rp, TRUE, rule.id);
 	unsigned int tmp_id = 0, tmp_id1 = 0;
 	auto is_pvt = exmdb_server::is_private();
 	if (is_pvt) {
@@ -3285,7 +3379,7 @@ static ec_error_t opx_reply(const rulexec_in &rp, const rule_node &rule,
 			return ecSuccess;
 		auto tmp_guid = rop_util_make_user_guid(tmp_id);
 		if (tmp_guid != pextreply->message_eid.message_database_guid)
-			return message_disable_rule(rp.sqlite, TRUE, rule.id);
+			return message_disable_rule(rp, TRUE, rule.id);
 	} else {
 		auto pc = strchr(rp.ev_to, '@');
 		if (pc == nullptr)
@@ -3296,7 +3390,7 @@ static ec_error_t opx_reply(const rulexec_in &rp, const rule_node &rule,
 			return ecSuccess;
 		auto tmp_guid = rop_util_make_domain_guid(tmp_id);
 		if (tmp_guid != pextreply->message_eid.message_database_guid)
-			return message_disable_rule(rp.sqlite, TRUE, rule.id);
+			return message_disable_rule(rp, TRUE, rule.id);
 	}
 	auto dst_mid = rop_util_gc_to_value(
 		       pextreply->message_eid.message_global_counter);
@@ -3305,7 +3399,7 @@ static ec_error_t opx_reply(const rulexec_in &rp, const rule_node &rule,
 	    dst_mid, pextreply->template_guid, &b_result))
 		return ecError;
 	if (!b_result)
-		return message_disable_rule(rp.sqlite, TRUE, rule.id);
+		return message_disable_rule(rp, TRUE, rule.id);
 	return ecSuccess;
 }
 
@@ -3317,7 +3411,7 @@ static ec_error_t opx_delegate(const rulexec_in &rp, const rule_node &rule,
 	    pextfwddlgt->count == 0)
 		return ecSuccess;
 	if (pextfwddlgt->count > MAX_RULE_RECIPIENTS)
-		return message_disable_rule(rp.sqlite, TRUE, rule.id);
+		return message_disable_rule(rp, TRUE, rule.id);
 
 	char essdn_buff[1280], display_name[1024];
 	BINARY searchkey_bin;
@@ -3427,7 +3521,7 @@ static ec_error_t opx_switch(const rulexec_in &rp,
 	case OP_FORWARD: {
 		auto pextfwddlgt = static_cast<EXT_FORWARDDELEGATE_ACTION *>(block.pdata);
 		if (pextfwddlgt->count > MAX_RULE_RECIPIENTS)
-			return message_disable_rule(rp.sqlite, TRUE, rule.id);
+			return message_disable_rule(rp, TRUE, rule.id);
 		std::vector<std::string> rcpt_list;
 		if (!msg_rcpt_blocks_to_list(*pextfwddlgt, rcpt_list))
 			return ecError;
@@ -3468,32 +3562,21 @@ static ec_error_t opx_process(const rulexec_in &rp,
 {
 	if (b_exit && !(rule.state & ST_ONLY_WHEN_OOF))
 		return ecSuccess;
-	void *pvalue = nullptr;
-	if (!cu_get_property(MAPI_MESSAGE, rule.id, CP_ACP, rp.sqlite,
-	    PR_EXTENDED_RULE_MSG_CONDITION, &pvalue))
-		return ecError;
-	auto bv = static_cast<BINARY *>(pvalue);
-	if (pvalue == nullptr || bv->cb == 0)
-		return ecSuccess;
-	EXT_PULL ext_pull;
-	ext_pull.init(bv->pb, bv->cb, common_util_alloc,
-		EXT_FLAG_WCOUNT | EXT_FLAG_UTF16);
-	NAMEDPROPERTY_INFO propname_info;
-	RESTRICTION restriction;
-	if (ext_pull.g_namedprop_info(&propname_info) != EXT_ERR_SUCCESS ||
-	    ext_pull.g_restriction(&restriction) != EXT_ERR_SUCCESS)
-		return ecSuccess;
-	if (!message_replace_restriction_propid(rp.sqlite, &propname_info, &restriction))
-		return ecError;
-	if (!cu_eval_msg_restriction(rp.sqlite, CP_ACP, rp.message_id, &restriction))
+	if (rule.cond == nullptr ||
+	    !cu_eval_msg_restriction(rp.sqlite, CP_ACP, rp.message_id, *rule.cond))
 		return ecSuccess;
 	if (rule.state & ST_EXIT_LEVEL)
 		b_exit = TRUE;
+	/* Actions are only needed for matching rules and are not cached. */
+	void *pvalue = nullptr;
 	if (!cu_get_property(MAPI_MESSAGE, rule.id, CP_ACP, rp.sqlite,
 	    PR_EXTENDED_RULE_MSG_ACTIONS, &pvalue))
 		return ecError;
-	if (pvalue == nullptr)
+	auto bv = static_cast<BINARY *>(pvalue);
+	if (bv == nullptr)
 		return ecSuccess;
+	EXT_PULL ext_pull;
+	NAMEDPROPERTY_INFO propname_info;
 	ext_pull.init(bv->pb, bv->cb, common_util_alloc,
 		EXT_FLAG_WCOUNT | EXT_FLAG_UTF16);
 	EXT_RULE_ACTIONS ext_actions;
@@ -3520,10 +3603,17 @@ static ec_error_t message_rule_new_message(const rulexec_in &rp, seen_list &seen
 	std::vector<rule_node> rule_list;
 	std::list<DAM_NODE> dam_list;
 	
-	if (!message_load_folder_rules(rp, rule_list) ||
-	    !message_load_folder_ext_rules(rp, rule_list))
+	/* Keeps the conditions/actions alive even if the cache is dropped meanwhile */
+	auto rc = message_rule_cache(rp);
+	if (rc == nullptr)
 		return ecError;
-	std::sort(rule_list.begin(), rule_list.end());
+	for (const auto &r : rc->rules) {
+		if (!(r.state & ST_ENABLED) && !rp.oof)
+			continue;
+		rule_list.push_back(rule_node{r.sequence, r.state, r.id,
+			r.provider, r.extended, r.cond != nullptr ? &r.prog : nullptr,
+			r.actions.get()});
+	}
 	BOOL b_del = false, b_exit = false;
 	for (const auto &rnode : rule_list) {
 		auto ec = rnode.extended ?
@@ -3720,7 +3810,8 @@ BOOL exmdb_server::deliver_message(const char *dir, const char *from_address,
 		partial ? " (partial only)" : "");
 	if (dlflags & DELIVERY_DO_RULES) {
 		auto ec = message_rule_new_message({from_address, account, cpid, b_oof,
-		          pdb->psqlite, fid_val, message_id, std::move(digest)}, seen);
+		          pdb->psqlite, fid_val, message_id, std::move(digest),
+		          pdb.get()}, seen);
 		if (ec != ecSuccess)
 			return FALSE;
 	}
@@ -3795,6 +3886,8 @@ BOOL exmdb_server::write_message(const char *dir, const char *account,
 		*pvalue = nt_time;
 
 	{
+	if (!instance_materialize_embedded(pdb))
+		return FALSE;
 	auto sql_transact = gx_sql_begin_trans(pdb->psqlite);
 	if (!sql_transact)
 		return false;
@@ -3825,6 +3918,98 @@ BOOL exmdb_server::write_message(const char *dir, const char *account,
 	return TRUE;
 }
 
+/**
+ * Bulk variant of write_message for importers. All messages go into one
+ * transaction, and content tables/search folders are only brought up to date
+ * after the commit. Unlike write_message, PidTagMid/PidTagChangeNumber may be
+ * absent and are then allocated here. Any failure rolls back the entire batch
+ * and @pfailed names the offending index.
+ */
+BOOL exmdb_server::write_messages(const char *dir, const char *account,
+    cpid_t cpid, uint32_t count, const uint64_t *folder_ids,
+    const MESSAGE_CONTENT *pmsgctnts, ec_error_t *pe_result,
+    uint32_t *pfailed) try
+{
+	*pfailed = 0;
+	/* Done first, so that the database is not held up by compression */
+	cu_cid_prewrite(dir, cpid, count, pmsgctnts);
+	auto pdb = db_engine_get_db(dir);
+	if (pdb == nullptr || pdb->psqlite == nullptr)
+		return FALSE;
+	if (cu_check_msgsize_overflow(pdb->psqlite, PR_STORAGE_QUOTA_LIMIT) ||
+	    common_util_check_msgcnt_overflow(pdb->psqlite)) {
+		*pe_result = MAPI_E_STORE_FULL;
+		return TRUE;
+	}
+	struct written_msg {
+		uint64_t fid, mid;
+		bool b_exist;
+	};
+	std::vector<written_msg> written;
+	written.reserve(count);
+	auto nt_time = rop_util_current_nttime();
+	{
+	if (!instance_materialize_embedded(pdb))
+		return FALSE;
+	auto sql_transact = gx_sql_begin_trans(pdb->psqlite);
+	if (!sql_transact)
+		return false;
+	for (uint32_t i = 0; i < count; ++i) {
+		auto &msg = pmsgctnts[i];
+		auto fid_val = rop_util_get_gc_value(folder_ids[i]);
+		bool b_exist = false;
+		auto pmid = msg.proplist.get<uint64_t>(PidTagMid);
+		if (pmid != nullptr) {
+			uint64_t fid_val1 = 0;
+			if (!common_util_get_message_parent_folder(pdb->psqlite,
+			    rop_util_get_gc_value(*pmid), &fid_val1))
+				return FALSE;
+			if (fid_val1 != 0 && fid_val1 != fid_val) {
+				*pe_result = ecRpcFailed;
+				*pfailed = i;
+				return TRUE;
+			}
+			b_exist = fid_val1 != 0;
+		}
+		auto pvalue = msg.proplist.get<uint64_t>(PR_LAST_MODIFICATION_TIME);
+		if (pvalue != nullptr)
+			*pvalue = nt_time;
+		uint64_t mid_val = 0;
+		bool partial = false;
+		if (!message_write_message(FALSE, pdb->psqlite, account, cpid,
+		    false, fid_val, &msg, &mid_val, &partial))
+			return FALSE;
+		if (mid_val == 0) {
+			/* auto rollback at end of scope */
+			*pe_result = ecRpcFailed;
+			*pfailed = i;
+			return TRUE;
+		}
+		written.push_back({fid_val, mid_val, b_exist});
+	}
+	if (sql_transact.commit() != 0)
+		return false;
+	}
+	db_engine_begin_batch_mode(pdb);
+	for (const auto &w : written) {
+		if (w.b_exist) {
+			db_engine_proc_dynamic_event(pdb, cpid,
+				dynamic_event::modify_msg, w.fid, w.mid, 0);
+			db_engine_notify_message_modification(pdb, w.fid, w.mid);
+		} else {
+			db_engine_proc_dynamic_event(pdb, cpid,
+				dynamic_event::new_msg, w.fid, w.mid, 0);
+			db_engine_notify_message_creation(pdb, w.fid, w.mid);
+		}
+	}
+	db_engine_commit_batch_mode(std::move(pdb));
+	*pe_result = ecSuccess;
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2406: ENOMEM");
+	return false;
+}
+
 /**
  * @username:   Used for adjusting public store readstates
  */
@@ -3889,7 +4074,7 @@ BOOL exmdb_server::rule_new_message(const char *dir, const char *username,
 	seen_list seen{{fid_val}};
 	auto sql_transact = gx_sql_begin_trans(pdb->psqlite);
 	auto ec = message_rule_new_message({ENVELOPE_FROM_NULL, account, cpid, false,
-	          pdb->psqlite, fid_val, mid_val, std::move(digest)}, seen);
+	          pdb->psqlite, fid_val, mid_val, std::move(digest), pdb.get()}, seen);
 	if (ec != ecSuccess)
 		return FALSE;
 	if (sql_transact.commit() != 0)
@@ -1,12 +1,16 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
 #include <ctime>
 #include <memory>
 #include <mutex>
 #include <poll.h>
+#include <string>
+#include <thread>
 #include <unistd.h>
 #include <utility>
+#include <libHX/io.h>
 #include <gromox/exmdb_common_util.hpp>
 #include <gromox/exmdb_ext.hpp>
 #include <gromox/exmdb_rpc.hpp>
@@ -14,6 +18,124 @@
 #include "exmdb_parser.h"
 #include "notification_agent.h"
 
+using namespace std::string_literals;
+using namespace gromox;
+
+/*
+ * Notifications for a router are coalesced while they wait in its queue:
+ *
+ * - Once a table has more than DG_ROWS_MAX row notifications queued, they
+ *   are replaced by one *_table_changed, upon which the subscriber reloads
+ *   the table. Further row notifications for that table are dropped until
+ *   the reload notification has been sent.
+ * - folder_modified carries no payload beyond the IDs, so a datagram that
+ *   is byte-for-byte already queued is not queued again.
+ *
+ * The sender waits DG_WINDOW after being woken so that a burst collects in
+ * the queue, and then writes up to DG_BATCH datagrams per write() call.
+ */
+static constexpr unsigned int DG_ROWS_MAX = 32, DG_BATCH = 64;
+static constexpr auto DG_WINDOW = std::chrono::milliseconds(10);
+
+static dg_kind dg_classify(const DB_NOTIFY_DATAGRAM &n, db_notify_type *reload)
+{
+	switch (n.db_notify.type) {
+	case db_notify_type::content_table_row_added:
+	case db_notify_type::content_table_row_deleted:
+	case db_notify_type::content_table_row_modified:
+		*reload = db_notify_type::content_table_changed;
+		return n.b_table && n.id_array.count == 1 ? dg_kind::table_row : dg_kind::plain;
+	case db_notify_type::hierarchy_table_row_added:
+	case db_notify_type::hierarchy_table_row_deleted:
+	case db_notify_type::hierarchy_table_row_modified:
+		*reload = db_notify_type::hierarchy_table_changed;
+		return n.b_table && n.id_array.count == 1 ? dg_kind::table_row : dg_kind::plain;
+	case db_notify_type::content_table_changed:
+	case db_notify_type::hierarchy_table_changed:
+		*reload = n.db_notify.type;
+		return n.b_table && n.id_array.count == 1 ? dg_kind::table_reload : dg_kind::plain;
+	case db_notify_type::folder_modified:
+		return dg_kind::idempotent;
+	default:
+		return dg_kind::plain;
+	}
+}
+
+/* Caller holds prouter->lock. */
+static void dg_dequeued(ROUTER_CONNECTION &rt, const router_datagram &dg)
+{
+	if (dg.kind == dg_kind::plain)
+		return;
+	auto it = rt.pending.find(dg.key);
+	if (it == rt.pending.end())
+		return;
+	if (dg.kind == dg_kind::table_reload)
+		it->second.reload = false;
+	else if (it->second.count > 0)
+		--it->second.count;
+	if (it->second.count == 0 && !it->second.reload)
+		rt.pending.erase(it);
+}
+
+static bool dg_make_reload(const DB_NOTIFY_DATAGRAM &n, db_notify_type type,
+    BINARY *bin)
+{
+	DB_NOTIFY_DATAGRAM r;
+	r.dir = n.dir;
+	r.b_table = TRUE;
+	r.id_array = n.id_array;
+	r.db_notify.type = type;
+	r.db_notify.pdata = nullptr;
+	return exmdb_ext_push_db_notify(&r, bin) == EXT_ERR_SUCCESS;
+}
+
+/* Caller holds prouter->lock. Returns false if @dg was merged away. */
+static bool dg_coalesce(ROUTER_CONNECTION &rt, router_datagram &dg,
+    const DB_NOTIFY_DATAGRAM &n, db_notify_type reload_type)
+{
+	if (dg.kind == dg_kind::plain)
+		return true;
+	auto &pd = rt.pending[dg.key];
+	switch (dg.kind) {
+	case dg_kind::idempotent:
+		if (pd.count > 0)
+			return false;
+		pd.count = 1;
+		return true;
+	case dg_kind::table_reload:
+		if (pd.reload)
+			return false;
+		pd.reload = true;
+		return true;
+	case dg_kind::table_row:
+		break;
+	default:
+		return true;
+	}
+	if (pd.reload)
+		return false;
+	if (++pd.count <= DG_ROWS_MAX)
+		return true;
+	/* Flood: replace queued row notifications by one reload */
+	BINARY rb{};
+	if (!dg_make_reload(n, reload_type, &rb))
+		return true;
+	for (auto it = rt.datagram_list.begin(); it != rt.datagram_list.end(); ) {
+		if (it->kind != dg_kind::table_row || it->key != dg.key) {
+			++it;
+			continue;
+		}
+		free(it->bin.pb);
+		it = rt.datagram_list.erase(it);
+	}
+	pd.count = 0;
+	pd.reload = true;
+	free(dg.bin.pb);
+	dg.bin = rb;
+	dg.kind = dg_kind::table_reload;
+	return true;
+}
+
 void notification_agent_backward_notify(const char *remote_id,
     const DB_NOTIFY_DATAGRAM *pnotify)
 {
@@ -27,80 +149,110 @@ void notification_agent_backward_notify(const char *remote_id,
 	if (NULL == prouter) {
 		return;
 	}
-	BINARY bin{};
-	if (exmdb_ext_push_db_notify(pnotify, &bin) != EXT_ERR_SUCCESS) {
+	router_datagram dg;
+	if (exmdb_ext_push_db_notify(pnotify, &dg.bin) != EXT_ERR_SUCCESS) {
 		exmdb_parser_put_router(std::move(prouter));
 		return;	
 	}
 	try {
+		auto reload_type = pnotify->db_notify.type;
+		dg.kind = dg_classify(*pnotify, &reload_type);
+		if (dg.kind == dg_kind::idempotent)
+			dg.key.assign(dg.bin.pc, dg.bin.cb);
+		else if (dg.kind != dg_kind::plain)
+			dg.key = pnotify->dir + ":"s + std::to_string(pnotify->id_array.pl[0]);
 		std::unique_lock rt_hold(prouter->lock);
-		prouter->datagram_list.push_back(bin);
+		if (!dg_coalesce(*prouter, dg, *pnotify, reload_type)) {
+			rt_hold.unlock();
+			free(dg.bin.pb);
+			exmdb_parser_put_router(std::move(prouter));
+			return;
+		}
+		prouter->datagram_list.push_back(std::move(dg));
 	} catch (...) {
-		free(bin.pb);
+		free(dg.bin.pb);
+		exmdb_parser_put_router(std::move(prouter));
 		return;
 	}
 	prouter->waken_cond.notify_one();
 	exmdb_parser_put_router(std::move(prouter));
 }
 
-static BOOL notification_agent_read_response(std::shared_ptr<ROUTER_CONNECTION> prouter)
+static BOOL notification_agent_read_response(std::shared_ptr<ROUTER_CONNECTION> prouter,
+    size_t count = 1)
 {
 	int tv_msec;
-	exmdb_response resp_code;
+	exmdb_response resp_code[DG_BATCH];
 	struct pollfd pfd_read;
 	
 	tv_msec = SOCKET_TIMEOUT * 1000;
 	pfd_read.fd = prouter->sockd;
 	pfd_read.events = POLLIN|POLLPRI;
-	if (1 != poll(&pfd_read, 1, tv_msec) ||
-		1 != read(prouter->sockd, &resp_code, 1) ||
-	    resp_code != exmdb_response::success)
-		return FALSE;
+	while (count > 0) {
+		if (poll(&pfd_read, 1, tv_msec) != 1)
+			return FALSE;
+		auto ret = read(prouter->sockd, resp_code, std::min(count, std::size(resp_code)));
+		if (ret <= 0)
+			return FALSE;
+		for (ssize_t i = 0; i < ret; ++i)
+			if (resp_code[i] != exmdb_response::success)
+				return FALSE;
+		count -= ret;
+	}
 	return TRUE;
 }
 
+/* Take up to DG_BATCH datagrams off the queue and concatenate them. */
+static size_t dg_dequeue_batch(ROUTER_CONNECTION &rt, std::string &buf)
+{
+	std::lock_guard rt_lock(rt.lock);
+	size_t count = 0;
+	buf.clear();
+	while (count < DG_BATCH && rt.datagram_list.size() > 0) {
+		auto &dg = rt.datagram_list.front();
+		buf.append(dg.bin.pc, dg.bin.cb);
+		free(dg.bin.pb);
+		dg_dequeued(rt, dg);
+		rt.datagram_list.pop_front();
+		++count;
+	}
+	return count;
+}
+
 void notification_agent_thread_work(std::shared_ptr<ROUTER_CONNECTION> &&prouter)
 {
 	uint32_t ping_buff;
+	std::string buf;
 	
 	while (!prouter->b_stop) {
-		BINARY dg;
 		std::unique_lock cn_hold(prouter->cond_mutex);
 		static_assert(SOCKET_TIMEOUT >= 3, "integer underflow");
 		prouter->waken_cond.wait_for(cn_hold, std::chrono::seconds(SOCKET_TIMEOUT - 3));
 		cn_hold.unlock();
 
 		std::unique_lock rt_hold(prouter->lock);
-		if (prouter->datagram_list.size() > 0) {
-			dg = prouter->datagram_list.front();
-			prouter->datagram_list.pop_front();
-		} else {
-			dg.cb = 0;
-			dg.pb = nullptr;
-		}
+		bool empty = prouter->datagram_list.empty();
 		rt_hold.unlock();
-		if (dg.pb == nullptr) {
+		if (empty) {
 			ping_buff = 0;
 			if (write(prouter->sockd, &ping_buff, sizeof(uint32_t)) != sizeof(uint32_t) ||
 			    !notification_agent_read_response(prouter))
 				goto EXIT_THREAD;
 			continue;
 		}
-		while (dg.pb != nullptr) {
-			auto bytes_written = write(prouter->sockd, dg.pb, dg.cb);
-			free(dg.pb);
-			if (bytes_written < 0 ||
-			    static_cast<size_t>(bytes_written) != dg.cb ||
-			    !notification_agent_read_response(prouter))
-				goto EXIT_THREAD;
-			std::lock_guard rt_lock(prouter->lock);
-			if (prouter->datagram_list.size() > 0) {
-				dg = prouter->datagram_list.front();
-				prouter->datagram_list.pop_front();
-			} else {
-				dg.cb = 0;
-				dg.pb = nullptr;
+		std::this_thread::sleep_for(DG_WINDOW);
+		size_t count;
+		try {
+			while ((count = dg_dequeue_batch(*prouter, buf)) > 0) {
+				auto bytes_written = HXio_fullwrite(prouter->sockd, buf.data(), buf.size());
+				if (bytes_written < 0 ||
+				    static_cast<size_t>(bytes_written) != buf.size() ||
+				    !notification_agent_read_response(prouter, count))
+					goto EXIT_THREAD;
 			}
+		} catch (const std::bad_alloc &) {
+			mlog(LV_ERR, "E-2412: ENOMEM");
+			goto EXIT_THREAD;
 		}
 	}
  EXIT_THREAD:
@@ -108,9 +260,13 @@ void notification_agent_thread_work(std::shared_ptr<ROUTER_CONNECTION> &&prouter
 		sleep(1);
 	close(prouter->sockd);
 	prouter->sockd = -1;
-	for (auto &&bin : prouter->datagram_list)
-		free(bin.pb);
-	prouter->datagram_list.clear();
+	{
+		std::lock_guard rt_lock(prouter->lock);
+		for (auto &&dg : prouter->datagram_list)
+			free(dg.bin.pb);
+		prouter->datagram_list.clear();
+		prouter->pending.clear();
+	}
 	if (!prouter->b_stop) {
 		prouter->thr_id = {};
 		pthread_detach(pthread_self());
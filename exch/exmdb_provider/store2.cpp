@@ -10,6 +10,7 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <memory>
+#include <new>
 #include <sqlite3.h>
 #include <string>
 #include <unistd.h>
@@ -22,6 +23,7 @@
 #include <gromox/exmdb_common_util.hpp>
 #include <gromox/exmdb_server.hpp>
 #include <gromox/fileio.h>
+#include <gromox/freebusy.hpp>
 #include <gromox/mapi_types.hpp>
 #include <gromox/mapidefs.h>
 #include <gromox/rop_util.hpp>
@@ -267,6 +269,8 @@ BOOL exmdb_server::purge_softdelete(const char *dir, const char *username,
 	if (db == nullptr || db->psqlite == nullptr)
 		return false;
 	auto fid_val = rop_util_get_gc_value(folder_id);
+	if (!instance_materialize_embedded(db))
+		return false;
 	auto xact = gx_sql_begin_trans(db->psqlite);
 	if (!xact)
 		return false;
@@ -570,3 +574,186 @@ BOOL exmdb_server::recalc_store_size(const char *dir, uint32_t flags)
 	 */
 	return TRUE;
 }
+
+/*
+ * The busy-interval index covers a window around "now" and is re-expanded
+ * from scratch once it is older than FBIDX_REFRESH, so that the window rolls
+ * forward. Queries not inside the window that was actually expanded (see
+ * fb_index::covers) are expanded on the fly.
+ */
+static constexpr time_t FBIDX_PAST = 31 * 86400, FBIDX_FUTURE = 366 * 86400,
+	FBIDX_REFRESH = 86400;
+
+static uint16_t fbidx_intern(fb_appt &appt, const char *s)
+{
+	if (s == nullptr)
+		return fb_span::npos;
+	auto it = std::find(appt.strtab.cbegin(), appt.strtab.cend(), s);
+	if (it != appt.strtab.cend())
+		return it - appt.strtab.cbegin();
+	if (appt.strtab.size() >= fb_span::npos)
+		return fb_span::npos;
+	appt.strtab.emplace_back(s);
+	return appt.strtab.size() - 1;
+}
+
+static char *fbidx_str(const fb_appt &appt, uint16_t idx)
+{
+	return idx < appt.strtab.size() ?
+	       common_util_dup(appt.strtab[idx].c_str()) : nullptr;
+}
+
+/* Re-expand all queued messages of @fid into @idx. */
+static bool fbidx_refresh(sqlite3 *psqlite, uint64_t fid,
+    const freebusy_tags &ptag, fb_index &idx)
+{
+	if (idx.dirty.empty())
+		return true;
+	auto stm = gx_sql_prep(psqlite, "SELECT parent_fid, is_associated, "
+	           "is_deleted FROM messages WHERE message_id=?");
+	if (stm == nullptr)
+		return false;
+	auto tags = ptag.proptags();
+	const PROPTAG_ARRAY proptags = {tags.size(), tags.data()};
+	std::vector<freebusy_event> events;
+	for (auto mid : idx.dirty) {
+		idx.appts.erase(mid);
+		stm.reset();
+		stm.bind_int64(1, mid);
+		if (stm.step() != SQLITE_ROW || stm.col_uint64(0) != fid ||
+		    stm.col_uint64(1) != 0 || stm.col_uint64(2) != 0)
+			continue;
+		TPROPVAL_ARRAY vals;
+		if (!cu_get_properties(MAPI_MESSAGE, mid, CP_ACP, psqlite,
+		    &proptags, &vals))
+			return false;
+		events.clear();
+		if (!freebusy_expand(ptag, vals, idx.win_start, idx.win_end,
+		    true, events) || events.empty())
+			continue;
+		auto &appt = idx.appts[mid];
+		for (const auto &ev : events) {
+			fb_span span;
+			span.start_time     = ev.start_time;
+			span.end_time       = ev.end_time;
+			span.busy_status    = ev.busy_status;
+			auto &d             = *ev.details;
+			span.id             = fbidx_intern(appt, d.id);
+			span.subject        = fbidx_intern(appt, d.subject);
+			span.location       = fbidx_intern(appt, d.location);
+			span.is_meeting     = d.is_meeting;
+			span.is_recurring   = d.is_recurring;
+			span.is_exception   = d.is_exception;
+			span.is_reminderset = d.is_reminderset;
+			span.is_private     = d.is_private;
+			appt.spans.push_back(std::move(span));
+		}
+	}
+	idx.dirty.clear();
+	idx.b_sorted = false;
+	return true;
+}
+
+/* (Re)build @idx for [start,end] from all appointments in @fid. */
+static bool fbidx_load(sqlite3 *psqlite, uint64_t fid,
+    const freebusy_tags &ptag, time_t start, time_t end, fb_index &idx)
+{
+	idx = fb_index{};
+	idx.win_start = start;
+	idx.win_end   = end;
+	idx.built     = time(nullptr);
+	char qstr[128];
+	snprintf(qstr, std::size(qstr), "SELECT message_id FROM messages "
+	         "WHERE parent_fid=%llu AND is_associated=0 AND is_deleted=0",
+	         LLU{fid});
+	auto stm = gx_sql_prep(psqlite, qstr);
+	if (stm == nullptr)
+		return false;
+	while (stm.step() == SQLITE_ROW)
+		idx.dirty.insert(stm.col_uint64(0));
+	return fbidx_refresh(psqlite, fid, ptag, idx);
+}
+
+static void fbidx_sort(fb_index &idx)
+{
+	if (idx.b_sorted)
+		return;
+	idx.sorted.clear();
+	idx.max_span = 0;
+	for (const auto &[mid, appt] : idx.appts) {
+		for (const auto &span : appt.spans) {
+			idx.sorted.push_back(fb_ref{span.start_time, span.end_time, &appt, &span});
+			idx.max_span = std::max(idx.max_span, span.end_time - span.start_time);
+		}
+	}
+	std::sort(idx.sorted.begin(), idx.sorted.end(),
+		[](const fb_ref &a, const fb_ref &b) { return a.start_time < b.start_time; });
+	idx.b_sorted = true;
+}
+
+static bool fbidx_lookup(fb_index &idx, time_t start, time_t end,
+    bool b_detailed, FB_ARRAY *fb_events)
+{
+	fbidx_sort(idx);
+	/* Nothing that starts before start-max_span can still overlap. */
+	auto it = std::lower_bound(idx.sorted.cbegin(), idx.sorted.cend(),
+	          start - idx.max_span, [](const fb_ref &r, time_t t) { return r.start_time < t; });
+	std::vector<const fb_ref *> hits;
+	for (; it != idx.sorted.cend() && it->start_time <= end; ++it)
+		if (it->end_time >= start)
+			hits.push_back(&*it);
+	fb_events->count = hits.size();
+	fb_events->fb_events = cu_alloc<freebusy_event>(hits.size());
+	if (fb_events->fb_events == nullptr && hits.size() > 0)
+		return false;
+	for (size_t i = 0; i < hits.size(); ++i) {
+		auto &appt = *hits[i]->appt;
+		auto &span = *hits[i]->span;
+		new(&fb_events->fb_events[i]) freebusy_event(span.start_time,
+			span.end_time, span.busy_status, fbidx_str(appt, span.id),
+			fbidx_str(appt, span.subject), fbidx_str(appt, span.location),
+			span.is_meeting, span.is_recurring, span.is_exception,
+			span.is_reminderset, span.is_private, b_detailed);
+	}
+	return true;
+}
+
+BOOL exmdb_server::query_freebusy(const char *dir, uint64_t folder_id,
+    int64_t start_time, int64_t end_time, BOOL b_detailed,
+    FB_ARRAY *fb_events) try
+{
+	auto db = db_engine_get_db(dir);
+	if (db == nullptr || db->psqlite == nullptr)
+		return false;
+	PROPID_ARRAY ids;
+	if (!common_util_get_named_propids(db->psqlite, false,
+	    &freebusy_tags::propnames, &ids))
+		return false;
+	freebusy_tags ptag(ids);
+	auto fid_val = rop_util_get_gc_value(folder_id);
+	auto now = time(nullptr);
+	if (start_time >= now - FBIDX_PAST && end_time <= now + FBIDX_FUTURE) {
+		auto &idx = db->fb_indices[fid_val];
+		bool ok = idx.built == 0 || now - idx.built >= FBIDX_REFRESH ?
+		          fbidx_load(db->psqlite, fid_val, ptag, now - FBIDX_PAST,
+		          now + FBIDX_FUTURE, idx) :
+		          fbidx_refresh(db->psqlite, fid_val, ptag, idx);
+		if (!ok) {
+			db->fb_indices.erase(fid_val);
+			return false;
+		}
+		/*
+		 * The window of an index built earlier trails "now" by up to
+		 * FBIDX_REFRESH, so check against what was actually expanded.
+		 */
+		if (idx.covers(start_time, end_time))
+			return fbidx_lookup(idx, start_time, end_time,
+			       b_detailed, fb_events);
+	}
+	fb_index tmp;
+	return fbidx_load(db->psqlite, fid_val, ptag, start_time, end_time, tmp) &&
+	       fbidx_lookup(tmp, start_time, end_time, b_detailed, fb_events);
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2405: ENOMEM");
+	return false;
+}
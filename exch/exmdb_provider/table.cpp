@@ -10,11 +10,14 @@
 #include <fcntl.h>
 #include <iconv.h>
 #include <list>
+#include <string>
 #include <unistd.h>
 #include <utility>
 #include <vector>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <fmt/core.h>
+#include <libHX/string.h>
 #include <gromox/database.h>
 #include <gromox/exmdb_common_util.hpp>
 #include <gromox/exmdb_server.hpp>
@@ -145,7 +148,7 @@ static uint32_t table_sum_hierarchy(sqlite3 *psqlite,
  */
 static BOOL table_load_hierarchy(sqlite3 *psqlite,
 	uint64_t folder_id, const char *username, uint8_t table_flags,
-	const RESTRICTION *prestriction, sqlite3_stmt *pstmt, int depth,
+	const res_program *prog, sqlite3_stmt *pstmt, int depth,
 	uint32_t *prow_count)
 {
 	uint64_t folder_id1;
@@ -167,8 +170,8 @@ static BOOL table_load_hierarchy(sqlite3 *psqlite,
 			if (!(permission & (frightsReadAny | frightsVisible | frightsOwner)))
 				continue;
 		}
-		if (prestriction != nullptr &&
-		    !cu_eval_folder_restriction(psqlite, folder_id1, prestriction))
+		if (prog != nullptr &&
+		    !cu_eval_folder_restriction(psqlite, folder_id1, *prog))
 			goto LOAD_SUBFOLDER;
 		sqlite3_bind_int64(pstmt, 1, folder_id1);
 		sqlite3_bind_int64(pstmt, 2, depth);
@@ -179,7 +182,7 @@ static BOOL table_load_hierarchy(sqlite3 *psqlite,
  LOAD_SUBFOLDER:
 		if ((table_flags & TABLE_FLAG_DEPTH) &&
 		    !table_load_hierarchy(psqlite, folder_id1, username,
-		    table_flags, prestriction, pstmt, depth + 1, prow_count))
+		    table_flags, prog, pstmt, depth + 1, prow_count))
 			return FALSE;
 	}
 	return TRUE;
@@ -257,7 +260,8 @@ BOOL exmdb_server::load_hierarchy_table(const char *dir, uint64_t folder_id,
 	}
 	if (NULL != prestriction) {
 		ptnode->prestriction = restriction_dup(prestriction);
-		if (ptnode->prestriction == nullptr)
+		if (ptnode->prestriction == nullptr ||
+		    !ptnode->prog.compile(*ptnode->prestriction))
 			return FALSE;
 	}
 	snprintf(sql_string, std::size(sql_string), "INSERT INTO t%u (folder_id,"
@@ -267,7 +271,8 @@ BOOL exmdb_server::load_hierarchy_table(const char *dir, uint64_t folder_id,
 		return FALSE;
 	*prow_count = 0;
 	if (!table_load_hierarchy(pdb->psqlite, fid_val, username, table_flags,
-	    prestriction, pstmt, 1, prow_count))
+	    ptnode->prestriction != nullptr ? &ptnode->prog : nullptr,
+	    pstmt, 1, prow_count))
 		return FALSE;
 	pstmt.finalize();
 	if (table_transact.commit() != 0)
@@ -557,6 +562,50 @@ static inline const BINARY *get_conv_id(const RESTRICTION *x)
 	return b->cb == 16 ? b : nullptr;
 }
 
+/**
+ * Result column of the hot column query (see table_load_content_table) that
+ * holds the value of sort key @tag, or -1.
+ */
+static int table_hot_column(uint32_t tag, bool b_private)
+{
+	switch (tag) {
+	case PR_MESSAGE_DELIVERY_TIME: return 0;
+	case PR_LAST_MODIFICATION_TIME: return 1;
+	case PR_MESSAGE_CLASS: return 2;
+	case PR_SUBJECT: return 3;
+	case PR_READ: return b_private ? 4 : -1;
+	default: return -1;
+	}
+}
+
+/**
+ * Splits @res into a WHERE expression (@where, with parameters in @rs) and
+ * the conjuncts that have to be evaluated in-process (@residual). Returns
+ * false if nothing is left to evaluate in-process.
+ */
+static bool table_pushdown_restriction(const RESTRICTION &res, res_sql &rs,
+    std::string &where, std::vector<RESTRICTION> &residual_and)
+{
+	if (res.rt != RES_AND) {
+		if (rs.emit(res, where))
+			return false;
+		residual_and.push_back(res);
+		return true;
+	}
+	for (size_t i = 0; i < res.andor->count; ++i) {
+		auto &sub = res.andor->pres[i];
+		std::string expr;
+		if (rs.emit(sub, expr)) {
+			if (!where.empty())
+				where += " AND ";
+			where += std::move(expr);
+		} else {
+			residual_and.push_back(sub);
+		}
+	}
+	return !residual_and.empty();
+}
+
 /**
  * @username:   Used for retrieving public store readstates
  *
@@ -669,7 +718,8 @@ static BOOL table_load_content_table(db_item_ptr &pdb, cpid_t cpid,
 	}
 	if (NULL != prestriction) {
 		ptnode->prestriction = restriction_dup(prestriction);
-		if (ptnode->prestriction == nullptr)
+		if (ptnode->prestriction == nullptr ||
+		    !ptnode->prog.compile(*ptnode->prestriction))
 			return false;
 	}
 	xtransaction psort_transact;
@@ -859,9 +909,70 @@ static BOOL table_load_content_table(db_item_ptr &pdb, cpid_t cpid,
 		            " AND is_associated=0 AND is_deleted=%u",
 		            !!(table_flags & TABLE_FLAG_SOFTDELETES));
 	}
-	pstmt = gx_sql_prep(pdb->psqlite, sql_string);
+	/*
+	 * Let sqlite answer the parts of the restriction it can (unread,
+	 * flagged, date ranges, message class, ...); the rest is evaluated
+	 * per row below.
+	 */
+	const res_program *row_prog = prestriction != nullptr ? &ptnode->prog : nullptr;
+	res_program residual_prog;
+	res_sql rs;
+	std::string where;
+	std::vector<RESTRICTION> residual_and;
+	RESTRICTION_AND_OR residual_ao{};
+	RESTRICTION residual{RES_AND, {&residual_ao}};
+	if (prestriction != nullptr && conv_id == nullptr) {
+		rs.b_private = exmdb_server::is_private();
+		rs.b_hotcols = pdb->b_hotcols;
+		bool b_residual = table_pushdown_restriction(*ptnode->prestriction,
+		                  rs, where, residual_and);
+		residual_ao.count = residual_and.size();
+		residual_ao.pres = residual_and.data();
+		if (!b_residual)
+			row_prog = nullptr;
+		else if (where.empty())
+			/* nothing pushed down, keep using the full program */;
+		else if (!residual_prog.compile(residual))
+			return false;
+		else
+			row_prog = &residual_prog;
+		if (!where.empty() && mlog_enabled(LV_DEBUG))
+			mlog(LV_DEBUG, "exmdb: content table %u: pushed down to SQL: %s; "
+				"evaluated in-process: %s", table_id, where.c_str(),
+				b_residual ? residual.repr().c_str() : "none");
+	}
+	std::string full_query = sql_string;
+	if (!where.empty())
+		full_query += " AND (" + where + ")";
+	pstmt = gx_sql_prep(pdb->psqlite, full_query.c_str());
 	if (pstmt == nullptr)
 		return false;
+	for (size_t i = 0; i < rs.binds.size(); ++i) {
+		auto &b = rs.binds[i];
+		if (b.text)
+			sqlite3_bind_text(pstmt, i + 1, b.str.c_str(), -1, SQLITE_STATIC);
+		else
+			sqlite3_bind_int64(pstmt, i + 1, b.num);
+	}
+	/*
+	 * Sort keys that schema E-14 mirrors on the messages row are read from
+	 * there in one go. The string columns are NULL when the value needs
+	 * charset conversion; cu_get_property does that then.
+	 */
+	bool b_private = exmdb_server::is_private();
+	xstmt hot_stmt;
+	if (psorts != nullptr && pdb->b_hotcols &&
+	    (std::any_of(tmp_proptags, tmp_proptags + tag_count,
+	    [&](uint32_t t) { return table_hot_column(t, b_private) >= 0; }) ||
+	    (psorts->ccategories > 0 && b_private))) {
+		hot_stmt = gx_sql_prep(pdb->psqlite, b_private ?
+		           "SELECT delivery_time, lastmod_time, msg_class, subject,"
+		           " read_state FROM messages WHERE message_id=?" :
+		           "SELECT delivery_time, lastmod_time, msg_class, subject"
+		           " FROM messages WHERE message_id=?");
+		if (hot_stmt == nullptr)
+			return false;
+	}
 	uint64_t last_row_id = 0;
 	while (pstmt.step() == SQLITE_ROW) {
 		uint64_t mid_val = pstmt.col_uint64(0);
@@ -874,16 +985,36 @@ static BOOL table_load_content_table(db_item_ptr &pdb, cpid_t cpid,
 				return false;
 			if (parent_fid == 0)
 				continue;
-		} else if (prestriction != nullptr &&
-		    !cu_eval_msg_restriction(pdb->psqlite, cpid, mid_val, prestriction)) {
+		} else if (row_prog != nullptr &&
+		    !cu_eval_msg_restriction(pdb->psqlite, cpid, mid_val, *row_prog)) {
 			continue;
 		}
 		sqlite3_bind_int64(pstmt1, 1, mid_val);
 		if (NULL != psorts) {
+			bool hot_row = false;
+			if (hot_stmt != nullptr) {
+				hot_stmt.reset();
+				hot_stmt.bind_int64(1, mid_val);
+				hot_row = hot_stmt.step() == SQLITE_ROW;
+			}
 			for (size_t i = 0; i < tag_count; ++i) {
 				auto tmp_proptag = tmp_proptags[i];
 				if (tmp_proptag == ptnode->instance_tag)
 					continue;
+				auto hc = hot_row ? table_hot_column(tmp_proptag, b_private) : -1;
+				if (hc >= 0 && sqlite3_column_type(hot_stmt, hc) != SQLITE_NULL) {
+					if (tmp_proptag == PR_READ)
+						sqlite3_bind_int64(pstmt1, i + 2,
+							sqlite3_column_int64(hot_stmt, hc) != 0);
+					else
+						sqlite3_bind_value(pstmt1, i + 2,
+							sqlite3_column_value(hot_stmt, hc));
+					continue;
+				} else if (hc == 0 || hc == 1) {
+					/* the time columns are NULL exactly when absent */
+					sqlite3_bind_null(pstmt1, i + 2);
+					continue;
+				}
 				if (!cu_get_property(MAPI_MESSAGE, mid_val,
 				    cpid, pdb->psqlite, tmp_proptag, &pvalue))
 					return false;
@@ -893,7 +1024,10 @@ static BOOL table_load_content_table(db_item_ptr &pdb, cpid_t cpid,
 				    i + 2, PROP_TYPE(tmp_proptag), pvalue))
 					return false;
 			}
-			if (psorts->ccategories > 0) {
+			if (psorts->ccategories > 0 && hot_row && b_private) {
+				sqlite3_bind_int64(pstmt1, col_read,
+					sqlite3_column_int64(hot_stmt, 4) != 0);
+			} else if (psorts->ccategories > 0) {
 				if (!cu_get_property(MAPI_MESSAGE, mid_val,
 				    CP_ACP, pdb->psqlite, PR_READ, &pvalue))
 					return false;
@@ -2065,6 +2199,18 @@ static bool table_evaluate_row_restriction(const RESTRICTION *pres,
 	return FALSE;
 }
 
+static bool table_eval_hier_fallback(void *pparam, const RESTRICTION &res)
+{
+	return table_evaluate_row_restriction(&res, pparam,
+	       table_get_hierarchy_row_property);
+}
+
+static bool table_eval_ctnt_fallback(void *pparam, const RESTRICTION &res)
+{
+	return table_evaluate_row_restriction(&res, pparam,
+	       table_get_content_row_property);
+}
+
 static BOOL match_tbl_hier(cpid_t cpid, uint32_t table_id, BOOL b_forward,
     uint32_t start_pos, const RESTRICTION *pres, const PROPTAG_ARRAY *pproptags,
     int32_t *pposition, TPROPVAL_ARRAY *ppropvals, db_item_ptr &pdb)
@@ -2083,6 +2229,9 @@ static BOOL match_tbl_hier(cpid_t cpid, uint32_t table_id, BOOL b_forward,
 	auto pstmt = gx_sql_prep(pdb->tables.psqlite, sql_string);
 	if (pstmt == nullptr)
 		return FALSE;
+	res_program prog;
+	if (!prog.compile(*pres))
+		return FALSE;
 	auto sql_transact = gx_sql_begin_trans(pdb->psqlite);
 	if (!sql_transact)
 		return false;
@@ -2095,8 +2244,8 @@ static BOOL match_tbl_hier(cpid_t cpid, uint32_t table_id, BOOL b_forward,
 		hierarchy_param.psqlite = pdb->psqlite;
 		hierarchy_param.pstmt = pstmt;
 		hierarchy_param.folder_id = folder_id;
-		if (!table_evaluate_row_restriction(pres,
-		    &hierarchy_param, table_get_hierarchy_row_property))
+		if (!prog.eval(&hierarchy_param, table_get_hierarchy_row_property,
+		    table_eval_hier_fallback))
 			continue;
 		idx = sqlite3_column_int64(pstmt, 1);
 		ppropvals->ppropval = cu_alloc<TAGGED_PROPVAL>(pproptags->count);
@@ -2176,6 +2325,9 @@ static BOOL match_tbl_ctnt(cpid_t cpid, uint32_t table_id, BOOL b_forward,
 		pstmt1 = NULL;
 		pstmt2 = NULL;
 	}
+	res_program prog;
+	if (!prog.compile(*pres))
+		return FALSE;
 	auto sql_transact = gx_sql_begin_trans(pdb->psqlite);
 	if (!sql_transact)
 		return false;
@@ -2198,8 +2350,8 @@ static BOOL match_tbl_ctnt(cpid_t cpid, uint32_t table_id, BOOL b_forward,
 		content_param.psorts = ptnode->psorts;
 		content_param.instance_tag = ptnode->instance_tag;
 		content_param.extremum_tag = ptnode->extremum_tag;
-		if (!table_evaluate_row_restriction(pres,
-		    &content_param, table_get_content_row_property))
+		if (!prog.eval(&content_param, table_get_content_row_property,
+		    table_eval_ctnt_fallback))
 			continue;
 		idx = sqlite3_column_int64(pstmt, 1);
 		ppropvals->ppropval = cu_alloc<TAGGED_PROPVAL>(pproptags->count);
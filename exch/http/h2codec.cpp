@@ -0,0 +1,403 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * HPACK (RFC 7541) and the checks on HTTP/2 frames and fields (RFC 9113) that
+ * do not depend on connection state. Kept apart from http2.cpp, which needs
+ * the contexts pool and HPM plugins, so that tests can use it directly.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <gromox/endian.hpp>
+#include "h2codec.hpp"
+
+using hdr_list = hpack_decoder::hdr_list;
+
+namespace {
+
+/* Canonical decoding tables for the RFC 7541 Appendix B Huffman code */
+struct huff_canon {
+	huff_canon();
+	uint32_t first[31]{};
+	uint16_t count[31]{}, index[31]{}, sym[257]{};
+};
+
+}
+
+static constexpr std::pair<const char *, const char *> hpack_static[] = {
+	{":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+	{":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"},
+	{":status", "200"}, {":status", "204"}, {":status", "206"},
+	{":status", "304"}, {":status", "400"}, {":status", "404"},
+	{":status", "500"}, {"accept-charset", ""},
+	{"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+	{"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+	{"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+	{"content-disposition", ""}, {"content-encoding", ""},
+	{"content-language", ""}, {"content-length", ""}, {"content-location", ""},
+	{"content-range", ""}, {"content-type", ""}, {"cookie", ""}, {"date", ""},
+	{"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+	{"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""},
+	{"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+	{"link", ""}, {"location", ""}, {"max-forwards", ""},
+	{"proxy-authenticate", ""}, {"proxy-authorization", ""}, {"range", ""},
+	{"referer", ""}, {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+	{"set-cookie", ""}, {"strict-transport-security", ""},
+	{"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+	{"www-authenticate", ""},
+};
+
+/* Code lengths of symbols 0..255 and EOS; the codes themselves are canonical */
+static constexpr uint8_t hpack_huff_len[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30,
+};
+
+huff_canon::huff_canon()
+{
+	uint32_t code = 0;
+	unsigned int prev = 0, n = 0;
+	for (unsigned int len = 1; len <= 30; ++len) {
+		index[len] = n;
+		for (unsigned int s = 0; s < std::size(hpack_huff_len); ++s) {
+			if (hpack_huff_len[s] != len)
+				continue;
+			if (n > 0)
+				code = (code + 1) << (len - prev);
+			prev = len;
+			if (count[len]++ == 0)
+				first[len] = code;
+			sym[n++] = s;
+		}
+	}
+}
+
+bool hpack_huff_decode(const uint8_t *p, size_t z, std::string &out)
+{
+	static const huff_canon hc;
+	uint32_t code = 0;
+	unsigned int len = 0;
+	for (size_t i = 0; i < z; ++i) {
+		for (int b = 7; b >= 0; --b) {
+			code = (code << 1) | ((p[i] >> b) & 1);
+			if (++len > 30)
+				return false;
+			if (code - hc.first[len] >= hc.count[len])
+				continue;
+			auto s = hc.sym[hc.index[len] + code - hc.first[len]];
+			if (s == 256)
+				return false; /* EOS must not appear in a string */
+			out += static_cast<char>(s);
+			code = 0;
+			len = 0;
+		}
+	}
+	/* Padding is a prefix of EOS, i.e. up to 7 one-bits */
+	return len <= 7 && code == (1U << len) - 1;
+}
+
+bool hpack_get_int(const uint8_t *&p, const uint8_t *end,
+    unsigned int bits, uint64_t &v)
+{
+	if (p >= end)
+		return false;
+	uint64_t mask = (1U << bits) - 1;
+	v = *p++ & mask;
+	if (v < mask)
+		return true;
+	for (unsigned int shift = 0; p < end && shift < 56; shift += 7) {
+		auto c = *p++;
+		v += static_cast<uint64_t>(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+bool hpack_get_str(const uint8_t *&p, const uint8_t *end, std::string &s)
+{
+	if (p >= end)
+		return false;
+	bool huff = *p & 0x80;
+	uint64_t z;
+	if (!hpack_get_int(p, end, 7, z) || z > static_cast<uint64_t>(end - p))
+		return false;
+	s.clear();
+	if (huff) {
+		if (!hpack_huff_decode(p, z, s))
+			return false;
+	} else {
+		s.assign(reinterpret_cast<const char *>(p), z);
+	}
+	p += z;
+	return true;
+}
+
+void hpack_put_int(std::string &o, uint8_t first, unsigned int bits, uint64_t v)
+{
+	uint64_t mask = (1U << bits) - 1;
+	if (v < mask) {
+		o += static_cast<char>(first | v);
+		return;
+	}
+	o += static_cast<char>(first | mask);
+	for (v -= mask; v >= 0x80; v >>= 7)
+		o += static_cast<char>((v & 0x7f) | 0x80);
+	o += static_cast<char>(v);
+}
+
+void hpack_put_str(std::string &o, std::string_view s)
+{
+	hpack_put_int(o, 0x00, 7, s.size());
+	o += s;
+}
+
+bool hpack_decoder::lookup(uint64_t idx, std::string_view &name,
+    std::string_view &value) const
+{
+	if (idx == 0)
+		return false;
+	if (idx <= std::size(hpack_static)) {
+		name  = hpack_static[idx-1].first;
+		value = hpack_static[idx-1].second;
+		return true;
+	}
+	idx -= std::size(hpack_static) + 1;
+	if (idx >= m_dyn.size())
+		return false;
+	name  = m_dyn[idx].first;
+	value = m_dyn[idx].second;
+	return true;
+}
+
+void hpack_decoder::evict(size_t limit)
+{
+	while (m_size > limit && !m_dyn.empty()) {
+		m_size -= m_dyn.back().first.size() + m_dyn.back().second.size() + 32;
+		m_dyn.pop_back();
+	}
+}
+
+void hpack_decoder::insert(std::string &&name, std::string &&value)
+{
+	auto z = name.size() + value.size() + 32;
+	if (z > m_max) {
+		evict(0);
+		return;
+	}
+	evict(m_max - z);
+	m_size += z;
+	m_dyn.emplace_front(std::move(name), std::move(value));
+}
+
+/**
+ * Decode one header block into @out. Returns 1 on success; 0 if the header
+ * list exceeds the limit, in which case the block is still processed in
+ * full so that the dynamic table stays in sync, but @out is incomplete; and
+ * -1 on a compression error, after which the decoder is unusable.
+ *
+ * Fields beyond the limit are only measured, not copied, so that indexed
+ * references to a large table entry cannot blow up memory or CPU time.
+ */
+int hpack_decoder::decode(const uint8_t *p, size_t z, hdr_list &out) try
+{
+	auto end = p + z;
+	size_t list_size = 0;
+	bool fields = false;
+	auto emit = [&](std::string_view name, std::string_view value) {
+		fields = true;
+		list_size += name.size() + value.size() + 32;
+		if (list_size <= m_list_max)
+			out.emplace_back(name, value);
+	};
+	while (p < end) {
+		auto c = *p;
+		uint64_t idx;
+		std::string_view name, value;
+		if (c & 0x80) {
+			/* Indexed field */
+			if (!hpack_get_int(p, end, 7, idx) ||
+			    !lookup(idx, name, value))
+				return -1;
+			emit(name, value);
+			continue;
+		} else if ((c & 0xe0) == 0x20) {
+			/*
+			 * Table size update: only at the start of a block
+			 * (§4.2), and bounded by our (default) SETTINGS
+			 */
+			if (fields || !hpack_get_int(p, end, 5, idx) || idx > m_limit)
+				return -1;
+			m_max = idx;
+			evict(m_max);
+			continue;
+		}
+		bool incr = (c & 0xc0) == 0x40;
+		std::string nbuf, vbuf;
+		if (!hpack_get_int(p, end, incr ? 6 : 4, idx))
+			return -1;
+		if (idx == 0) {
+			if (!hpack_get_str(p, end, nbuf))
+				return -1;
+		} else {
+			if (!lookup(idx, name, value))
+				return -1;
+			nbuf = name;
+		}
+		if (!hpack_get_str(p, end, vbuf))
+			return -1;
+		emit(nbuf, vbuf);
+		if (incr)
+			insert(std::move(nbuf), std::move(vbuf));
+	}
+	return list_size <= m_list_max ? 1 : 0;
+} catch (const std::bad_alloc &) {
+	return -1;
+}
+
+bool h2_unpad(uint8_t flags, const uint8_t *&p, size_t &z)
+{
+	if (!(flags & H2F_PADDED))
+		return true;
+	if (z < 1 || p[0] >= z)
+		return false;
+	z -= 1 + p[0];
+	++p;
+	return true;
+}
+
+/**
+ * Check the rules of RFC 9113 §6 that do not depend on stream state.
+ * @cont_id is the stream whose header block awaits CONTINUATION frames, or
+ * 0. Returns a connection error code, or H2E_NO_ERROR.
+ */
+uint32_t h2_frame_check(uint32_t cont_id, uint8_t type, uint8_t flags,
+    uint32_t sid, const uint8_t *p, size_t z)
+{
+	if (cont_id != 0)
+		return type == H2_CONTINUATION && sid == cont_id ?
+		       H2E_NO_ERROR : H2E_PROTOCOL;
+	switch (type) {
+	case H2_DATA:
+		return sid != 0 && h2_unpad(flags, p, z) ? H2E_NO_ERROR : H2E_PROTOCOL;
+	case H2_HEADERS:
+		if (sid == 0 || !(sid & 1) || !h2_unpad(flags, p, z))
+			return H2E_PROTOCOL;
+		return !(flags & H2F_PRIORITY) || z >= 5 ? H2E_NO_ERROR : H2E_PROTOCOL;
+	case H2_PRIORITY:
+		if (sid == 0)
+			return H2E_PROTOCOL;
+		return z == 5 ? H2E_NO_ERROR : H2E_FRAME_SIZE;
+	case H2_RST_STREAM:
+		if (sid == 0)
+			return H2E_PROTOCOL;
+		return z == 4 ? H2E_NO_ERROR : H2E_FRAME_SIZE;
+	case H2_SETTINGS:
+		if (sid != 0)
+			return H2E_PROTOCOL;
+		if (flags & H2F_ACK)
+			return z == 0 ? H2E_NO_ERROR : H2E_FRAME_SIZE;
+		if (z % 6 != 0)
+			return H2E_FRAME_SIZE;
+		for (; z >= 6; p += 6, z -= 6) {
+			uint16_t id = (p[0] << 8) | p[1];
+			uint32_t v = be32p_to_cpu(&p[2]);
+			if (id == H2S_ENABLE_PUSH && v > 1)
+				return H2E_PROTOCOL;
+			else if (id == H2S_INITIAL_WINDOW_SIZE && v > H2_WINDOW_MAX)
+				return H2E_FLOW_CONTROL;
+			else if (id == H2S_MAX_FRAME_SIZE && (v < 16384 || v > 16777215))
+				return H2E_PROTOCOL;
+		}
+		return H2E_NO_ERROR;
+	case H2_PUSH_PROMISE:
+		/* Clients cannot push */
+		return H2E_PROTOCOL;
+	case H2_PING:
+		if (sid != 0)
+			return H2E_PROTOCOL;
+		return z == 8 ? H2E_NO_ERROR : H2E_FRAME_SIZE;
+	case H2_GOAWAY:
+		if (sid != 0)
+			return H2E_PROTOCOL;
+		return z >= 8 ? H2E_NO_ERROR : H2E_FRAME_SIZE;
+	case H2_WINDOW_UPDATE:
+		if (z != 4)
+			return H2E_FRAME_SIZE;
+		/* A zero increment on a stream is only a stream error */
+		return sid == 0 && (be32p_to_cpu(p) & 0x7fffffff) == 0 ?
+		       H2E_PROTOCOL : H2E_NO_ERROR;
+	case H2_CONTINUATION:
+		/* No header block is open */
+		return H2E_PROTOCOL;
+	default:
+		/* Unknown frame types are to be ignored */
+		return H2E_NO_ERROR;
+	}
+}
+
+/**
+ * RFC 9113 §8.2 and §8.3 checks on a decoded request (@trailer=false) or
+ * trailer field list. Requests which fail are malformed and get reset with
+ * PROTOCOL_ERROR; this is what keeps CR/LF and the like from reaching the
+ * HTTP/1-style header parser behind.
+ */
+bool h2_fields_valid(const hdr_list &hl, bool trailer)
+{
+	static constexpr std::string_view pseudo[] =
+		{":authority", ":method", ":path", ":scheme"};
+	unsigned int seen = 0;
+	bool regular = false;
+	for (const auto &[name, value] : hl) {
+		if (name.empty())
+			return false;
+		for (unsigned char c : value)
+			if (c == '\0' || c == '\r' || c == '\n')
+				return false;
+		if (!value.empty() && (value.front() == ' ' || value.front() == '\t' ||
+		    value.back() == ' ' || value.back() == '\t'))
+			return false;
+		if (name[0] == ':') {
+			/* Known ones only, each once, and before all others */
+			auto it = std::find(std::begin(pseudo), std::end(pseudo), name);
+			if (trailer || regular || it == std::end(pseudo))
+				return false;
+			auto bit = 1U << (it - std::begin(pseudo));
+			if (seen & bit)
+				return false;
+			seen |= bit;
+			continue;
+		}
+		regular = true;
+		for (unsigned char c : name)
+			if (c <= 0x20 || c >= 0x7f || (c >= 'A' && c <= 'Z') || c == ':')
+				return false;
+		/* Connection-specific fields */
+		if (name == "connection" || name == "keep-alive" ||
+		    name == "proxy-connection" || name == "transfer-encoding" ||
+		    name == "upgrade")
+			return false;
+		if (name == "te" && value != "trailers")
+			return false;
+	}
+	return true;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+enum : uint8_t {
+	H2_DATA = 0x0, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS,
+	H2_PUSH_PROMISE, H2_PING, H2_GOAWAY, H2_WINDOW_UPDATE, H2_CONTINUATION,
+};
+
+enum : uint8_t {
+	H2F_END_STREAM = 0x1, H2F_ACK = 0x1, H2F_END_HEADERS = 0x4,
+	H2F_PADDED = 0x8, H2F_PRIORITY = 0x20,
+};
+
+enum : uint32_t {
+	H2E_NO_ERROR = 0x0, H2E_PROTOCOL = 0x1, H2E_INTERNAL = 0x2,
+	H2E_FLOW_CONTROL = 0x3, H2E_STREAM_CLOSED = 0x5, H2E_FRAME_SIZE = 0x6,
+	H2E_REFUSED_STREAM = 0x7, H2E_CANCEL = 0x8, H2E_COMPRESSION = 0x9,
+	H2E_ENHANCE_YOUR_CALM = 0xb, H2E_HTTP_1_1_REQUIRED = 0xd,
+};
+
+enum : uint16_t {
+	H2S_HEADER_TABLE_SIZE = 0x1, H2S_ENABLE_PUSH, H2S_MAX_CONCURRENT_STREAMS,
+	H2S_INITIAL_WINDOW_SIZE, H2S_MAX_FRAME_SIZE, H2S_MAX_HEADER_LIST_SIZE,
+};
+
+static constexpr size_t H2_MAX_FRAME = 16384, H2_MAX_HDRBLOCK = 65536;
+/* Advertised as SETTINGS_MAX_HEADER_LIST_SIZE; counted as in RFC 9113 §6.5.2 */
+static constexpr size_t H2_MAX_HDRLIST = 65536;
+static constexpr int64_t H2_WINDOW_MAX = 0x7fffffff;
+
+class hpack_decoder {
+	public:
+	using hdr_list = std::vector<std::pair<std::string, std::string>>;
+	hpack_decoder(size_t table_max = 4096, size_t list_max = H2_MAX_HDRLIST) :
+		m_max(table_max), m_limit(table_max), m_list_max(list_max) {}
+	int decode(const uint8_t *, size_t, hdr_list &);
+	size_t table_size() const { return m_size; }
+
+	private:
+	bool lookup(uint64_t idx, std::string_view &name, std::string_view &value) const;
+	void insert(std::string &&name, std::string &&value);
+	void evict(size_t limit);
+
+	std::deque<std::pair<std::string, std::string>> m_dyn;
+	size_t m_size = 0, m_max = 4096, m_limit = 4096, m_list_max = H2_MAX_HDRLIST;
+};
+
+extern bool hpack_get_int(const uint8_t *&, const uint8_t *end, unsigned int bits, uint64_t &);
+extern bool hpack_get_str(const uint8_t *&, const uint8_t *end, std::string &);
+extern bool hpack_huff_decode(const uint8_t *, size_t, std::string &);
+extern void hpack_put_int(std::string &, uint8_t first, unsigned int bits, uint64_t);
+extern void hpack_put_str(std::string &, std::string_view);
+extern bool h2_unpad(uint8_t flags, const uint8_t *&, size_t &);
+extern uint32_t h2_frame_check(uint32_t cont_id, uint8_t type, uint8_t flags, uint32_t sid, const uint8_t *, size_t);
+extern bool h2_fields_valid(const hpack_decoder::hdr_list &, bool trailer);
@@ -20,6 +20,7 @@
 #include <gromox/svc_loader.hpp>
 #include <gromox/util.hpp>
 #include "hpm_processor.h"
+#include "http2.hpp"
 #include "http_parser.h"
 #include "pdu_processor.h"
 #include "resource.h"
@@ -64,6 +65,15 @@ static BOOL hpm_processor_register_interface(
 	HPM_INTERFACE *pinterface)
 {
 	auto fn = g_cur_plugin->file_name.c_str();
+	/*
+	 * Version 1 had no such field; its first member (a function
+	 * pointer) cannot be mistaken for the version number.
+	 */
+	if (pinterface->version != HPM_INTERFACE_VERSION) {
+		mlog(LV_ERR, "http_processor: %s was built for a different HPM_INTERFACE (version %zu, expected %u); rebuild it",
+		        fn, pinterface->version, HPM_INTERFACE_VERSION);
+		return FALSE;
+	}
 	if (NULL == pinterface->preproc) {
 		mlog(LV_ERR, "http_processor: preproc of interface in %s cannot be NULL", fn);
 		return FALSE;
@@ -82,7 +92,7 @@ static BOOL hpm_processor_register_interface(
 		mlog(LV_ERR, "http_processor: interface has already been registered in %s", fn);
 		return FALSE;
 	}
-	memcpy(&g_cur_plugin->interface, pinterface, sizeof(HPM_INTERFACE));
+	g_cur_plugin->interface = *pinterface;
 	return TRUE;
 }
 
@@ -119,7 +129,10 @@ static void hpm_processor_wakeup_context(unsigned int context_id)
 	if (phttp->sched_stat != hsched_stat::wait)
 		return;
 	phttp->sched_stat = hsched_stat::wrrep;
-	contexts_pool_signal(phttp);
+	if (phttp->h2_conn != nullptr)
+		http2_wakeup(phttp);
+	else
+		contexts_pool_signal(phttp);
 }
 
 static void *hpm_processor_queryservice(const char *service, const std::type_info &ti)
@@ -170,7 +183,11 @@ static void *hpm_processor_queryservice(const char *service, const std::type_inf
 		return reinterpret_cast<void *>(hpm_processor_wakeup_context);
 	if (strcmp(service, "activate_context") == 0)
 		return reinterpret_cast<void *>(+[](unsigned int id) {
-			context_pool_activate_context(http_parser_get_contexts_list()[id]);
+			auto h = static_cast<http_context *>(http_parser_get_contexts_list()[id]);
+			if (h->h2_conn != nullptr)
+				http2_wakeup(h);
+			else
+				context_pool_activate_context(h);
 		});
 	if (strcmp(service, "set_context") == 0)
 		return reinterpret_cast<void *>(http_parser_set_context);
@@ -289,7 +306,10 @@ http_status hpm_processor_take_request(http_context *phttp)
 				" is too long for hpm_processor");
 			return http_status::bad_request;
 		}
-		if (rq.b_chunked || rq.content_len > g_rqbody_flush_size) {
+		if (pplugin->interface.feed != nullptr) {
+			rq.body_fd.close();
+			rq.posted_size = 0;
+		} else if (rq.b_chunked || rq.content_len > g_rqbody_flush_size) {
 			auto path = LOCAL_DISK_TMPDIR;
 			if (mkdir(path, 0777) < 0 && errno != EEXIST) {
 				mlog(LV_ERR, "E-2079: mkdir %s: %s", path, strerror(errno));
@@ -325,7 +345,33 @@ bool hpm_processor_is_in_charge(HTTP_CONTEXT *phttp)
 }
 
 /**
- * Move the HTTP request body to cache_fd, depending on size.
+ * Returns the streaming body callback of the plugin in charge, if any.
+ */
+static auto hpm_feeder(const http_context *phttp)
+{
+	auto &h = g_context_list[phttp->context_id];
+	return h.b_preproc ? h.pinterface->feed : nullptr;
+}
+
+/**
+ * Pass a piece of request body to the plugin's feed function or the
+ * cache file.
+ */
+static http_status rqbody_put(http_context *phttp, const void *buf, int len)
+{
+	auto feed = hpm_feeder(phttp);
+	if (feed != nullptr)
+		return feed(phttp->context_id, buf, len);
+	auto &rq = phttp->request;
+	if (rq.body_fd >= 0 && write(rq.body_fd, buf, len) != len) {
+		phttp->log(LV_DEBUG, "failed to write cache file: %s", strerror(errno));
+		return http_status::service_unavailable;
+	}
+	return http_status::ok;
+}
+
+/**
+ * Move the HTTP request body to cache_fd (or the plugin), depending on size.
  */
 http_status http_write_request(HTTP_CONTEXT *phttp)
 {
@@ -338,13 +384,19 @@ http_status http_write_request(HTTP_CONTEXT *phttp)
 	
 	if (rq.b_end)
 		return http_status::ok;
-	if (!rq.b_chunked && rq.body_fd < 0) {
+	bool streaming = hpm_feeder(phttp) != nullptr;
+	if (!rq.b_chunked && rq.body_fd < 0 && !streaming) {
 		if (rq.content_len <= phttp->stream_in.get_total_length())
 			rq.b_end = true;
 		return http_status::ok;
 	}
 	if (!rq.b_chunked) {
-		if (rq.posted_size + phttp->stream_in.get_total_length() < rq.content_len &&
+		if (rq.posted_size == rq.content_len) {
+			rq.b_end = true;
+			return http_status::ok;
+		}
+		if (!streaming &&
+		    rq.posted_size + phttp->stream_in.get_total_length() < rq.content_len &&
 		    phttp->stream_in.get_total_length() < g_rqbody_flush_size)
 			return http_status::ok;
 		size = STREAM_BLOCK_SIZE;
@@ -357,12 +409,9 @@ http_status http_write_request(HTTP_CONTEXT *phttp)
 				rq.posted_size += size;
 				tmp_len = size;
 			}
-			if (rq.body_fd >= 0 &&
-			    write(rq.body_fd, pbuff, tmp_len) != tmp_len) {
-				phttp->log(LV_DEBUG, "failed to"
-					" write cache file: %s", strerror(errno));
-				return http_status::service_unavailable;
-			}
+			auto ret = rqbody_put(phttp, pbuff, tmp_len);
+			if (ret != http_status::ok)
+				return ret;
 			if (rq.posted_size == rq.content_len) {
 				rq.b_end = true;
 				return http_status::ok;
@@ -409,20 +458,16 @@ http_status http_write_request(HTTP_CONTEXT *phttp)
 	size = STREAM_BLOCK_SIZE;
 	while ((pbuff = phttp->stream_in.get_read_buf(reinterpret_cast<unsigned int *>(&size))) != nullptr) {
 		if (rq.chunk_size >= size + rq.chunk_offset) {
-			if (rq.body_fd >= 0 && write(rq.body_fd, pbuff, size) != size) {
-				phttp->log(LV_DEBUG, "failed to "
-					"write cache file: %s", strerror(errno));
-				return http_status::service_unavailable;
-			}
+			auto ret = rqbody_put(phttp, pbuff, size);
+			if (ret != http_status::ok)
+				return ret;
 			rq.chunk_offset += size;
 			rq.posted_size += size;
 		} else {
 			tmp_len = rq.chunk_size - rq.chunk_offset;
-			if (rq.body_fd >= 0 && write(rq.body_fd, pbuff, tmp_len) != tmp_len) {
-				phttp->log(LV_DEBUG, "failed to"
-					" write cache file: %s", strerror(errno));
-				return http_status::service_unavailable;
-			}
+			auto ret = rqbody_put(phttp, pbuff, tmp_len);
+			if (ret != http_status::ok)
+				return ret;
 			phttp->stream_in.rewind_read_ptr(size - tmp_len);
 			rq.posted_size += tmp_len;
 			rq.chunk_offset = rq.chunk_size;
@@ -450,7 +495,11 @@ BOOL hpm_processor_proc(HTTP_CONTEXT *phttp)
 	struct stat node_stat;
 	
 	auto phpm_ctx = &g_context_list[phttp->context_id];
-	if (rq.body_fd < 0) {
+	if (phpm_ctx->pinterface->feed != nullptr) {
+		/* body has already been handed over piecewise */
+		pcontent = nullptr;
+		rq.content_len = 0;
+	} else if (rq.body_fd < 0) {
 		if (rq.content_len == 0) {
 			pcontent = NULL;
 		} else {
@@ -0,0 +1,981 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * HTTP/2 (RFC 9113, RFC 7541) for TLS connections that negotiated "h2".
+ *
+ * The http_context of the connection owns the socket and runs the framing
+ * layer. Each request stream borrows a further context slot from the
+ * contexts pool, so HPM plugins, which address requests by context id, work
+ * unchanged: the slot carries the request and authentication state, and the
+ * HTTP/1.1 text that the plugin writes is translated into HEADERS and DATA
+ * frames. Slots are never scheduled on their own; a plugin wakeup activates
+ * the connection context instead.
+ *
+ * Requests not handled by an HPM plugin (RPC/HTTP, FastCGI, static files) and
+ * connection-bound NTLM authentication are refused with HTTP_1_1_REQUIRED,
+ * whereupon clients retry over HTTP/1.1.
+ */
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <libHX/socket.h>
+#include <libHX/string.h>
+#include <openssl/ssl.h>
+#include <gromox/clock.hpp>
+#include <gromox/contexts_pool.hpp>
+#include <gromox/endian.hpp>
+#include <gromox/hpm_common.h>
+#include <gromox/util.hpp>
+#include "hpm_processor.h"
+#include "http2.hpp"
+#include "http_parser.h"
+#include "mod_rewrite.h"
+
+using namespace gromox;
+using hdr_list = hpack_decoder::hdr_list;
+
+static constexpr char h2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+/* Bounds on output queued per connection and per stream before backing off */
+static constexpr size_t H2_WBUF_MAX = 256 * 1024, H2_BODY_MAX = 256 * 1024;
+
+/*
+ * Client RST_STREAMs tolerated per window before the connection is ended
+ * with ENHANCE_YOUR_CALM. Opening and cancelling streams in a loop costs the
+ * client next to nothing but keeps dispatching work here (CVE-2023-44487).
+ */
+static constexpr unsigned int H2_RST_MAX = 100;
+static constexpr auto H2_RST_WINDOW = std::chrono::seconds(10);
+static unsigned int g_max_streams = 100;
+
+static void h2_frame(h2_session &s, uint8_t type, uint8_t flags, uint32_t sid,
+    const void *data, size_t z)
+{
+	char hdr[9];
+	hdr[0] = z >> 16;
+	hdr[1] = z >> 8;
+	hdr[2] = z;
+	hdr[3] = type;
+	hdr[4] = flags;
+	cpu_to_be32p(&hdr[5], sid & 0x7fffffff);
+	s.wbuf.append(hdr, sizeof(hdr));
+	if (z > 0)
+		s.wbuf.append(static_cast<const char *>(data), z);
+}
+
+static void h2_frame_u32(h2_session &s, uint8_t type, uint32_t sid, uint32_t v)
+{
+	char buf[4];
+	cpu_to_be32p(buf, v);
+	h2_frame(s, type, 0, sid, buf, sizeof(buf));
+}
+
+static void h2_goaway(h2_session &s, uint32_t err)
+{
+	char buf[8];
+	cpu_to_be32p(&buf[0], s.last_id);
+	cpu_to_be32p(&buf[4], err);
+	h2_frame(s, H2_GOAWAY, 0, 0, buf, sizeof(buf));
+	s.goaway = true;
+}
+
+static void h2_release(h2_stream &st)
+{
+	auto ctx = st.ctx;
+	if (ctx == nullptr)
+		return;
+	if (hpm_processor_is_in_charge(ctx))
+		hpm_processor_put_context(ctx);
+	http_parser_context_clear(ctx);
+	ctx->h2_conn = nullptr;
+	contexts_pool_put_context(ctx, CONTEXT_FREE);
+	st.ctx = nullptr;
+}
+
+static void h2_reset(h2_session &s, uint32_t sid, uint32_t err)
+{
+	h2_frame_u32(s, H2_RST_STREAM, sid, err);
+	auto i = s.streams.find(sid);
+	if (i == s.streams.end())
+		return;
+	h2_release(i->second);
+	s.streams.erase(i);
+}
+
+/* Take whatever the plugin (or the HTTP/1 helpers) wrote to stream_out */
+static void h2_take_output(h2_stream &st)
+{
+	auto &so = st.ctx->stream_out;
+	unsigned int z = STREAM_BLOCK_SIZE;
+	void *p;
+	while ((p = so.get_read_buf(&z)) != nullptr) {
+		st.out.append(static_cast<const char *>(p), z);
+		z = STREAM_BLOCK_SIZE;
+	}
+	so.clear();
+}
+
+/* Complete the stream with the response the HTTP/1 code left in stream_out */
+static void h2_respond_output(h2_stream &st)
+{
+	if (hpm_processor_is_in_charge(st.ctx))
+		hpm_processor_put_context(st.ctx);
+	st.dispatched = false;
+	h2_take_output(st);
+	st.rsp_done = true;
+}
+
+static void h2_respond(h2_stream &st, http_status code)
+{
+	if (hpm_processor_is_in_charge(st.ctx))
+		hpm_processor_put_context(st.ctx);
+	st.dispatched = false;
+	st.ctx->stream_out.clear();
+	st.out = http_make_err_response(*st.ctx, code);
+	st.rsp_done = true;
+}
+
+/**
+ * Translate the status line and header block of the plugin's HTTP/1.1
+ * response. Returns 1 when done, 0 if more output is needed, -1 on garbage.
+ */
+static int h2_rsp_head(h2_session &s, uint32_t sid, h2_stream &st)
+{
+	auto eoh = st.out.find("\r\n\r\n");
+	if (eoh == st.out.npos)
+		return st.out.size() > H2_MAX_HDRBLOCK ? -1 : 0;
+	std::string_view head(st.out.data(), eoh + 2);
+	auto eol = head.find("\r\n");
+	auto sp = head.find(' ');
+	if (head.compare(0, 5, "HTTP/") != 0 || sp == head.npos ||
+	    sp + 4 > eol)
+		return -1;
+	std::string code(head.substr(sp + 1, 3)), blk;
+	hpack_put_int(blk, 0x00, 4, 8); /* literal, name is static :status */
+	hpack_put_str(blk, code);
+	bool chunked = false, has_length = false;
+	for (head.remove_prefix(eol + 2); !head.empty(); head.remove_prefix(eol + 2)) {
+		eol = head.find("\r\n");
+		auto line = head.substr(0, eol);
+		auto colon = line.find(':');
+		if (colon == line.npos || colon == 0)
+			continue;
+		std::string name(line.substr(0, colon));
+		HX_strlower(name.data());
+		auto value = line.substr(colon + 1);
+		while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+			value.remove_prefix(1);
+		while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+			value.remove_suffix(1);
+		/* Connection-specific fields are not allowed in HTTP/2 */
+		if (name == "transfer-encoding") {
+			chunked = strncasecmp(value.data(), "chunked", 7) == 0;
+			continue;
+		} else if (name == "connection" || name == "keep-alive" ||
+		    name == "proxy-connection" || name == "upgrade" || name == "te") {
+			continue;
+		} else if (name == "content-length") {
+			st.remain = strtoull(std::string(value).c_str(), nullptr, 10);
+			has_length = true;
+		}
+		blk += '\0'; /* literal without indexing, new name */
+		hpack_put_str(blk, name);
+		hpack_put_str(blk, value);
+	}
+	st.out.erase(0, eoh + 4);
+	if (st.ctx->request.imethod == http_method::head ||
+	    code == "204" || code == "304")
+		st.rstate = h2_rsp::done;
+	else if (chunked)
+		st.rstate = h2_rsp::chunk_size;
+	else if (!has_length)
+		st.rstate = h2_rsp::eof;
+	else
+		st.rstate = st.remain > 0 ? h2_rsp::length : h2_rsp::done;
+	uint8_t type = H2_HEADERS;
+	size_t off = 0;
+	do {
+		auto n = std::min(blk.size() - off, static_cast<size_t>(s.peer_frame));
+		h2_frame(s, type, off + n == blk.size() ? H2F_END_HEADERS : 0,
+			sid, &blk[off], n);
+		off += n;
+		type = H2_CONTINUATION;
+	} while (off < blk.size());
+	st.hdr_sent = true;
+	return 1;
+}
+
+/* Strip the HTTP/1.1 body framing; the payload goes into st.body */
+static bool h2_rsp_body(h2_stream &st)
+{
+	auto &o = st.out;
+	size_t off = 0;
+	while (off < o.size()) {
+		switch (st.rstate) {
+		case h2_rsp::head:
+		case h2_rsp::done:
+			off = o.size();
+			break;
+		case h2_rsp::eof:
+			st.body.append(o, off, o.npos);
+			off = o.size();
+			break;
+		case h2_rsp::length:
+		case h2_rsp::chunk_data: {
+			auto n = std::min(st.remain, static_cast<uint64_t>(o.size() - off));
+			st.body.append(o, off, n);
+			off += n;
+			st.remain -= n;
+			if (st.remain == 0)
+				st.rstate = st.rstate == h2_rsp::length ?
+				            h2_rsp::done : h2_rsp::chunk_crlf;
+			break;
+		}
+		case h2_rsp::chunk_crlf:
+			if (o.size() - off < 2)
+				goto out;
+			off += 2;
+			st.rstate = h2_rsp::chunk_size;
+			break;
+		case h2_rsp::chunk_size: {
+			auto eol = o.find("\r\n", off);
+			if (eol == o.npos) {
+				if (o.size() - off > 1024)
+					return false;
+				goto out;
+			}
+			char *end = nullptr;
+			auto z = strtoull(&o[off], &end, 16);
+			if (end == &o[off])
+				return false;
+			off = eol + 2;
+			st.remain = z;
+			st.rstate = z == 0 ? h2_rsp::trailer : h2_rsp::chunk_data;
+			break;
+		}
+		case h2_rsp::trailer: {
+			auto eol = o.find("\r\n", off);
+			if (eol == o.npos)
+				goto out;
+			if (eol == off)
+				st.rstate = h2_rsp::done;
+			off = eol + 2;
+			break;
+		}
+		}
+	}
+ out:
+	o.erase(0, off);
+	return true;
+}
+
+static void h2_send_body(h2_session &s, uint32_t sid, h2_stream &st)
+{
+	while (st.body_off < st.body.size() && s.send_window > 0 &&
+	    st.send_window > 0) {
+		if (s.wbuf.size() - s.woff >= H2_WBUF_MAX) {
+			s.busy = true;
+			break;
+		}
+		size_t n = std::min({st.body.size() - st.body_off,
+		           static_cast<size_t>(s.peer_frame),
+		           static_cast<size_t>(std::min(s.send_window, st.send_window))});
+		h2_frame(s, H2_DATA, 0, sid, &st.body[st.body_off], n);
+		st.body_off += n;
+		s.send_window -= n;
+		st.send_window -= n;
+	}
+	if (st.body_off == st.body.size()) {
+		st.body.clear();
+		st.body_off = 0;
+	} else if (st.body_off >= 65536) {
+		st.body.erase(0, st.body_off);
+		st.body_off = 0;
+	}
+}
+
+/**
+ * Move response data from the plugin to the wire, within flow control
+ * limits. Returns false when the stream is finished.
+ */
+static bool h2_pump(h2_session &s, uint32_t sid, h2_stream &st)
+{
+	auto ctx = st.ctx;
+	while (st.dispatched && !st.rsp_done &&
+	    ctx->sched_stat == hsched_stat::wrrep &&
+	    st.body.size() - st.body_off < H2_BODY_MAX) {
+		auto ret = hpm_processor_retrieve_response(ctx);
+		h2_take_output(st);
+		if (ret == HPM_RETRIEVE_WRITE)
+			continue;
+		if (ret == HPM_RETRIEVE_NONE) {
+			s.busy = true;
+		} else if (ret == HPM_RETRIEVE_WAIT) {
+			ctx->sched_stat = hsched_stat::wait;
+		} else if (ret == HPM_RETRIEVE_DONE) {
+			st.rsp_done = true;
+		} else if (!st.hdr_sent && st.out.empty()) {
+			h2_respond(st, http_status::bad_request);
+		} else {
+			h2_frame_u32(s, H2_RST_STREAM, sid, H2E_INTERNAL);
+			return false;
+		}
+		break;
+	}
+	if (!st.hdr_sent) {
+		auto ret = h2_rsp_head(s, sid, st);
+		if (ret < 0 || (ret == 0 && st.rsp_done)) {
+			ctx->log(LV_DEBUG, "h2: stream %u: unparsable response from handler", sid);
+			h2_frame_u32(s, H2_RST_STREAM, sid, H2E_INTERNAL);
+			return false;
+		} else if (ret == 0) {
+			return true;
+		}
+	}
+	if (!h2_rsp_body(st)) {
+		h2_frame_u32(s, H2_RST_STREAM, sid, H2E_INTERNAL);
+		return false;
+	}
+	h2_send_body(s, sid, st);
+	if (!st.rsp_done || !st.body.empty())
+		return true;
+	if (st.rstate != h2_rsp::done && st.rstate != h2_rsp::eof) {
+		/* Handler quit in the middle of the body */
+		h2_frame_u32(s, H2_RST_STREAM, sid, H2E_INTERNAL);
+		return false;
+	}
+	h2_frame(s, H2_DATA, H2F_END_STREAM, sid, nullptr, 0);
+	if (!st.in_closed)
+		/* Response is complete; the rest of the request is not needed */
+		h2_frame_u32(s, H2_RST_STREAM, sid, H2E_NO_ERROR);
+	return false;
+}
+
+/* Hand the request body to the plugin once it has been received */
+static void h2_feed(h2_stream &st)
+{
+	auto ctx = st.ctx;
+	auto ret = http_write_request(ctx);
+	if (ret != http_status::ok) {
+		h2_respond(st, ret);
+		return;
+	}
+	if (!ctx->request.b_end) {
+		if (st.in_closed)
+			/* END_STREAM came before Content-Length was reached */
+			h2_respond(st, http_status::bad_request);
+		return;
+	}
+	if (!hpm_processor_proc(ctx)) {
+		h2_respond(st, http_status::bad_request);
+		return;
+	}
+	ctx->sched_stat = hsched_stat::wrrep;
+}
+
+/* Returns false if the stream is to be refused with HTTP_1_1_REQUIRED */
+static bool h2_dispatch(h2_stream &st)
+{
+	auto status = hpm_processor_take_request(st.ctx);
+	if (status == http_status::none)
+		return false;
+	if (status != http_status::ok) {
+		h2_respond(st, status);
+		return true;
+	}
+	st.dispatched = true;
+	h2_feed(st);
+	return true;
+}
+
+/* Authenticate a stream; Basic results are remembered per connection */
+static void h2_auth(http_context *conn, h2_session &s, h2_stream &st)
+{
+	auto ctx = st.ctx;
+	auto i = ctx->request.f_others.find("Authorization");
+	if (i != ctx->request.f_others.end() &&
+	    conn->auth_status == http_status::ok && s.auth_line == i->second) {
+		gx_strlcpy(ctx->username, conn->username, std::size(ctx->username));
+		gx_strlcpy(ctx->password, conn->password, std::size(ctx->password));
+		gx_strlcpy(ctx->maildir, conn->maildir, std::size(ctx->maildir));
+		gx_strlcpy(ctx->lang, conn->lang, std::size(ctx->lang));
+		ctx->auth_status = http_status::ok;
+		return;
+	}
+	if (htp_auth_1(*ctx) != tproc_status::runoff) {
+		h2_respond_output(st);
+		return;
+	}
+	if (ctx->auth_status == http_status::unauthorized) {
+		h2_respond_output(st);
+		return;
+	}
+	if (ctx->auth_status != http_status::ok ||
+	    i == ctx->request.f_others.end())
+		return;
+	s.auth_line = i->second;
+	gx_strlcpy(conn->username, ctx->username, std::size(conn->username));
+	gx_strlcpy(conn->password, ctx->password, std::size(conn->password));
+	gx_strlcpy(conn->maildir, ctx->maildir, std::size(conn->maildir));
+	gx_strlcpy(conn->lang, ctx->lang, std::size(conn->lang));
+	conn->auth_status = http_status::ok;
+}
+
+/**
+ * Fill the request of the stream's context slot from the decoded header list
+ * and start processing. Returns false if the stream was reset.
+ */
+static bool h2_request(http_context *conn, h2_session &s, uint32_t sid,
+    h2_stream &st, hdr_list &hl) try
+{
+	auto ctx = st.ctx;
+	auto &rq = ctx->request;
+	std::string_view method, path, authority;
+	std::string cookie, line;
+	bool has_length = false;
+	for (auto &[name, value] : hl) {
+		if (name.size() > 0 && name[0] == ':') {
+			if (name == ":method") {
+				method = value;
+			} else if (name == ":path") {
+				path = value;
+			} else if (name == ":authority") {
+				authority = value;
+			}
+			continue;
+		} else if (name.empty() || name.size() >= 64) {
+			continue;
+		} else if (name == "cookie") {
+			/* RFC 9113 §8.2.3: crumbs are joined with "; " */
+			if (!cookie.empty())
+				cookie += "; ";
+			cookie += value;
+			continue;
+		} else if (name == "content-length") {
+			has_length = true;
+		}
+		line = name + ": " + value;
+		if (htparse_rdhead_mt(ctx, line.data(), line.size()) != tproc_status::runoff) {
+			h2_respond_output(st);
+			return true;
+		}
+	}
+	if (!cookie.empty())
+		rq.f_cookie = std::move(cookie);
+	if (method.empty() || path.empty() || method == "CONNECT") {
+		h2_reset(s, sid, H2E_PROTOCOL);
+		return false;
+	}
+	if (method.size() >= std::size(rq.method)) {
+		h2_respond(st, http_status::method_not_allowed);
+		return true;
+	}
+	memcpy(rq.method, method.data(), method.size());
+	rq.method[method.size()] = '\0';
+	rq.imethod = http_method_lookup(rq.method);
+	gx_strlcpy(rq.version, "2.0", std::size(rq.version));
+	ctx->b_close = false;
+	if (path.size() >= http_request::uri_limit) {
+		h2_respond(st, http_status::uri_too_long);
+		return true;
+	}
+	if (!mod_rewrite_process(path.data(), path.size(), rq.f_request_uri)) {
+		rq.f_request_uri = path;
+	} else if (rq.f_request_uri.empty()) {
+		h2_respond(st, http_status::bad_request);
+		return true;
+	}
+	if (rq.f_host.empty() && !authority.empty() && authority.size() < 264) {
+		char input[264]{}, domain[256];
+		memcpy(input, authority.data(), authority.size());
+		*domain = '\0';
+		if (HX_addrport_split(input, domain, std::size(domain), nullptr) > 0)
+			rq.f_host = domain;
+	}
+	if (rq.f_host.empty())
+		rq.f_host = ctx->connection.server_ip;
+
+	if (rq.imethod == http_method::rpcin || rq.imethod == http_method::rpcout) {
+		h2_reset(s, sid, H2E_HTTP_1_1_REQUIRED);
+		return false;
+	}
+	auto i = rq.f_others.find("Authorization");
+	if (i != rq.f_others.end() &&
+	    (strncasecmp(i->second.c_str(), "NTLM ", 5) == 0 ||
+	    strncasecmp(i->second.c_str(), "Negotiate TlRM", 14) == 0)) {
+		/* NTLM authenticates the connection, not the request */
+		h2_reset(s, sid, H2E_HTTP_1_1_REQUIRED);
+		return false;
+	}
+	h2_auth(conn, s, st);
+	if (st.rsp_done)
+		return true;
+	if (st.in_closed) {
+		rq.content_len = 0;
+	} else if (!has_length) {
+		/* Length only known at END_STREAM; buffer until then */
+		st.deferred = true;
+		return true;
+	}
+	if (!h2_dispatch(st)) {
+		h2_reset(s, sid, H2E_HTTP_1_1_REQUIRED);
+		return false;
+	}
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2415: ENOMEM");
+	h2_reset(s, sid, H2E_INTERNAL);
+	return false;
+}
+
+static uint32_t h2_block_done(http_context *conn, h2_session &s, uint32_t sid)
+{
+	auto &st = s.streams[sid];
+	hdr_list hl;
+	auto ret = s.dec.decode(reinterpret_cast<const uint8_t *>(st.hdrblock.data()),
+	           st.hdrblock.size(), hl);
+	if (ret < 0)
+		return H2E_COMPRESSION;
+	st.hdrblock.clear();
+	st.hdrblock.shrink_to_fit();
+	if (st.rst_err != 0) {
+		h2_reset(s, sid, st.rst_err);
+		return H2E_NO_ERROR;
+	}
+	if (ret == 0 && !st.headed) {
+		st.headed = true;
+		st.in_closed = st.hdr_es;
+		h2_respond(st, http_status::fields_too_large);
+		return H2E_NO_ERROR;
+	} else if (ret == 0 || !h2_fields_valid(hl, st.headed)) {
+		/* §8.1.1: malformed */
+		h2_reset(s, sid, H2E_PROTOCOL);
+		return H2E_NO_ERROR;
+	}
+	if (st.headed) {
+		/* Trailers; must end the stream and are otherwise ignored */
+		if (!st.hdr_es) {
+			h2_reset(s, sid, H2E_PROTOCOL);
+			return H2E_NO_ERROR;
+		}
+		st.in_closed = true;
+		if (st.deferred) {
+			st.deferred = false;
+			st.ctx->request.content_len = st.ctx->stream_in.get_total_length();
+			if (!h2_dispatch(st))
+				h2_reset(s, sid, H2E_HTTP_1_1_REQUIRED);
+		} else if (st.dispatched && !st.ctx->request.b_end) {
+			h2_feed(st);
+		}
+		return H2E_NO_ERROR;
+	}
+	st.headed = true;
+	st.in_closed = st.hdr_es;
+	h2_request(conn, s, sid, st, hl);
+	return H2E_NO_ERROR;
+}
+
+static uint32_t h2_headers_in(http_context *conn, h2_session &s, uint8_t flags,
+    uint32_t sid, const uint8_t *p, size_t z)
+{
+	h2_unpad(flags, p, z); /* lengths were checked by h2_frame_check */
+	if (flags & H2F_PRIORITY) {
+		p += 5;
+		z -= 5;
+	}
+	auto i = s.streams.find(sid);
+	if (i == s.streams.end() && sid <= s.last_id) {
+		/*
+		 * Closed, most likely by an RST_STREAM of ours that crossed
+		 * with late trailers (§5.1). Only the stream is affected, but
+		 * the header block still has to go through HPACK.
+		 */
+		i = s.streams.emplace(sid, h2_stream{}).first;
+		i->second.rst_err = H2E_STREAM_CLOSED;
+	} else if (i == s.streams.end()) {
+		s.last_id = sid;
+		auto slots = std::count_if(s.streams.cbegin(), s.streams.cend(),
+		             [](const auto &e) { return e.second.ctx != nullptr; });
+		i = s.streams.emplace(sid, h2_stream{}).first;
+		auto &st = i->second;
+		st.send_window = s.peer_window;
+		auto ctx = s.goaway || static_cast<size_t>(slots) >= g_max_streams ? nullptr :
+		           static_cast<http_context *>(contexts_pool_get_context(CONTEXT_FREE));
+		if (ctx == nullptr) {
+			st.rst_err = H2E_REFUSED_STREAM;
+		} else {
+			ctx->type = CONTEXT_CONSTRUCTING;
+			ctx->h2_conn = conn;
+			auto &cn = ctx->connection;
+			auto &pc = conn->connection;
+			gx_strlcpy(cn.client_ip, pc.client_ip, std::size(cn.client_ip));
+			gx_strlcpy(cn.server_ip, pc.server_ip, std::size(cn.server_ip));
+			cn.client_port = pc.client_port;
+			cn.server_port = pc.server_port;
+			cn.last_timestamp = pc.last_timestamp;
+			ctx->sched_stat = hsched_stat::rdbody;
+			st.ctx = ctx;
+		}
+	} else if (i->second.in_closed) {
+		/* Half-closed (remote): a stream error (§5.1) */
+		i->second.rst_err = H2E_STREAM_CLOSED;
+	}
+	auto &st = i->second;
+	st.hdr_es = flags & H2F_END_STREAM;
+	st.hdrblock.assign(reinterpret_cast<const char *>(p), z);
+	if (!(flags & H2F_END_HEADERS)) {
+		s.cont_id = sid;
+		return H2E_NO_ERROR;
+	}
+	return h2_block_done(conn, s, sid);
+}
+
+static uint32_t h2_data_in(h2_session &s, uint8_t flags, uint32_t sid,
+    const uint8_t *p, size_t z)
+{
+	auto flen = z;
+	h2_unpad(flags, p, z);
+	/* Data is consumed right away (into memory or the body cache file) */
+	if (flen > 0)
+		h2_frame_u32(s, H2_WINDOW_UPDATE, 0, flen);
+	auto i = s.streams.find(sid);
+	if (i == s.streams.end() || !i->second.headed || i->second.in_closed) {
+		if (sid > s.last_id)
+			return H2E_PROTOCOL;
+		h2_frame_u32(s, H2_RST_STREAM, sid, H2E_STREAM_CLOSED);
+		if (i != s.streams.end()) {
+			h2_release(i->second);
+			s.streams.erase(i);
+		}
+		return H2E_NO_ERROR;
+	}
+	auto &st = i->second;
+	auto ctx = st.ctx;
+	if (flags & H2F_END_STREAM)
+		st.in_closed = true;
+	else if (flen > 0)
+		h2_frame_u32(s, H2_WINDOW_UPDATE, sid, flen);
+	if (st.rsp_done || (!st.deferred &&
+	    (!st.dispatched || ctx->request.b_end)))
+		return H2E_NO_ERROR;
+	if (z > 0 && ctx->stream_in.write(p, z) != STREAM_WRITE_OK) {
+		h2_respond(st, http_status::enomem_CL);
+		return H2E_NO_ERROR;
+	}
+	if (st.deferred) {
+		if (ctx->stream_in.get_total_length() > g_rqbody_max_size) {
+			ctx->log(LV_DEBUG, "h2: request body too long");
+			h2_respond(st, http_status::bad_request);
+		} else if (st.in_closed) {
+			st.deferred = false;
+			ctx->request.content_len = ctx->stream_in.get_total_length();
+			if (!h2_dispatch(st))
+				h2_reset(s, sid, H2E_HTTP_1_1_REQUIRED);
+		}
+		return H2E_NO_ERROR;
+	}
+	if (!ctx->request.b_end)
+		h2_feed(st);
+	return H2E_NO_ERROR;
+}
+
+static uint32_t h2_settings_in(h2_session &s, uint8_t flags, uint32_t sid,
+    const uint8_t *p, size_t z)
+{
+	if (flags & H2F_ACK)
+		return H2E_NO_ERROR;
+	/* Values were range-checked by h2_frame_check */
+	for (; z >= 6; p += 6, z -= 6) {
+		uint16_t id = (p[0] << 8) | p[1];
+		uint32_t v = be32p_to_cpu(&p[2]);
+		switch (id) {
+		case H2S_INITIAL_WINDOW_SIZE:
+			for (auto &e : s.streams)
+				e.second.send_window += static_cast<int64_t>(v) - s.peer_window;
+			s.peer_window = v;
+			break;
+		case H2S_MAX_FRAME_SIZE:
+			s.peer_frame = v;
+			break;
+		}
+	}
+	h2_frame(s, H2_SETTINGS, H2F_ACK, 0, nullptr, 0);
+	return H2E_NO_ERROR;
+}
+
+/* Returns an HTTP/2 connection error code */
+static uint32_t h2_frame_in(http_context *conn, h2_session &s, uint8_t type,
+    uint8_t flags, uint32_t sid, const uint8_t *p, size_t z)
+{
+	auto err = h2_frame_check(s.cont_id, type, flags, sid, p, z);
+	if (err != H2E_NO_ERROR)
+		return err;
+	switch (type) {
+	case H2_DATA:
+		return h2_data_in(s, flags, sid, p, z);
+	case H2_HEADERS:
+		return h2_headers_in(conn, s, flags, sid, p, z);
+	case H2_CONTINUATION: {
+		auto i = s.streams.find(sid);
+		if (i == s.streams.end()) {
+			/* Stream went away while its header block was open */
+			i = s.streams.emplace(sid, h2_stream{}).first;
+			i->second.rst_err = H2E_STREAM_CLOSED;
+		}
+		auto &st = i->second;
+		if (st.hdrblock.size() + z > H2_MAX_HDRBLOCK)
+			return H2E_ENHANCE_YOUR_CALM;
+		st.hdrblock.append(reinterpret_cast<const char *>(p), z);
+		if (!(flags & H2F_END_HEADERS))
+			return H2E_NO_ERROR;
+		s.cont_id = 0;
+		return h2_block_done(conn, s, sid);
+	}
+	case H2_RST_STREAM: {
+		if (sid > s.last_id)
+			/* idle stream */
+			return H2E_PROTOCOL;
+		auto now = tp_now();
+		if (now - s.rst_since > H2_RST_WINDOW) {
+			s.rst_since = now;
+			s.rst_count = 0;
+		}
+		if (++s.rst_count > H2_RST_MAX) {
+			conn->log(LV_DEBUG, "h2: too many stream resets from client");
+			return H2E_ENHANCE_YOUR_CALM;
+		}
+		auto i = s.streams.find(sid);
+		if (i != s.streams.end()) {
+			h2_release(i->second);
+			s.streams.erase(i);
+		}
+		return H2E_NO_ERROR;
+	}
+	case H2_SETTINGS:
+		return h2_settings_in(s, flags, sid, p, z);
+	case H2_PING:
+		if (!(flags & H2F_ACK))
+			h2_frame(s, H2_PING, H2F_ACK, 0, p, z);
+		return H2E_NO_ERROR;
+	case H2_GOAWAY:
+		s.goaway = true;
+		return H2E_NO_ERROR;
+	case H2_WINDOW_UPDATE: {
+		uint32_t inc = be32p_to_cpu(p) & 0x7fffffff;
+		if (sid == 0) {
+			s.send_window += inc;
+			return s.send_window > H2_WINDOW_MAX ? H2E_FLOW_CONTROL : H2E_NO_ERROR;
+		}
+		auto i = s.streams.find(sid);
+		if (i == s.streams.end())
+			return H2E_NO_ERROR;
+		if (inc == 0) {
+			h2_reset(s, sid, H2E_PROTOCOL);
+			return H2E_NO_ERROR;
+		}
+		i->second.send_window += inc;
+		if (i->second.send_window > H2_WINDOW_MAX)
+			h2_reset(s, sid, H2E_FLOW_CONTROL);
+		return H2E_NO_ERROR;
+	}
+	default:
+		/* PRIORITY, and unknown frame types, which are to be ignored */
+		return H2E_NO_ERROR;
+	}
+}
+
+/* Returns -1 on connection loss, 0 if nothing was read, 1 otherwise */
+static int h2_read(http_context *conn, h2_session &s)
+{
+	int got = 0;
+	char buf[16384];
+	while (s.rbuf.size() - s.roff < 4 * H2_MAX_FRAME) {
+		auto ret = conn->connection.ssl != nullptr ?
+		           SSL_read(conn->connection.ssl, buf, sizeof(buf)) :
+		           read(conn->connection.sockd, buf, sizeof(buf));
+		if (ret == 0)
+			return -1;
+		if (ret < 0)
+			return errno == EAGAIN ? got : -1;
+		s.rbuf.append(buf, ret);
+		conn->connection.last_timestamp = tp_now();
+		got = 1;
+	}
+	/* Input left unread; come back once the frames at hand are handled */
+	s.busy = true;
+	return got;
+}
+
+/* Returns -1 on connection loss, 0 if the socket is full, 1 when flushed */
+static int h2_write(http_context *conn, h2_session &s)
+{
+	while (s.woff < s.wbuf.size()) {
+		auto ret = conn->connection.write(&s.wbuf[s.woff], s.wbuf.size() - s.woff);
+		if (ret == 0)
+			return -1;
+		if (ret < 0)
+			return errno == EAGAIN ? 0 : -1;
+		s.woff += ret;
+		conn->connection.last_timestamp = tp_now();
+	}
+	s.wbuf.clear();
+	s.woff = 0;
+	return 1;
+}
+
+void http2_init(SSL_CTX *ctx, unsigned int max_streams, size_t context_num)
+{
+	/*
+	 * Every open stream holds a context slot; do not let a single
+	 * connection take more than a sixteenth of them.
+	 */
+	g_max_streams = std::clamp(static_cast<size_t>(max_streams),
+	                static_cast<size_t>(1), std::max(context_num / 16, static_cast<size_t>(1)));
+	SSL_CTX_set_alpn_select_cb(ctx, [](SSL *, const unsigned char **out,
+	    unsigned char *outlen, const unsigned char *in, unsigned int inlen,
+	    void *) -> int {
+		static constexpr unsigned char protos[] = "\x02h2\x08http/1.1";
+		unsigned char *sel = nullptr;
+		if (SSL_select_next_proto(&sel, outlen, protos, sizeof(protos) - 1,
+		    in, inlen) != OPENSSL_NPN_NEGOTIATED)
+			return SSL_TLSEXT_ERR_NOACK;
+		*out = sel;
+		return SSL_TLSEXT_ERR_OK;
+	}, nullptr);
+}
+
+bool http2_negotiated(SSL *ssl)
+{
+	const unsigned char *p = nullptr;
+	unsigned int z = 0;
+	SSL_get0_alpn_selected(ssl, &p, &z);
+	return z == 2 && memcmp(p, "h2", 2) == 0;
+}
+
+tproc_status http2_accept(http_context *conn) try
+{
+	conn->h2 = std::make_unique<h2_session>();
+	auto &s = *conn->h2;
+	/* wbuf grows between retries of a blocked write */
+	SSL_set_mode(conn->connection.ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+		SSL_MODE_ENABLE_PARTIAL_WRITE);
+	char set[18];
+	cpu_to_be16p(&set[0], H2S_MAX_CONCURRENT_STREAMS);
+	cpu_to_be32p(&set[2], g_max_streams);
+	cpu_to_be16p(&set[6], H2S_ENABLE_PUSH);
+	cpu_to_be32p(&set[8], 0);
+	cpu_to_be16p(&set[12], H2S_MAX_HEADER_LIST_SIZE);
+	cpu_to_be32p(&set[14], H2_MAX_HDRLIST);
+	h2_frame(s, H2_SETTINGS, 0, 0, set, sizeof(set));
+	conn->b_close = false;
+	conn->sched_stat = hsched_stat::h2;
+	return tproc_status::cont;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2416: ENOMEM");
+	return tproc_status::runoff;
+}
+
+tproc_status http2_process(http_context *conn) try
+{
+	auto &s = *conn->h2;
+	s.busy = false;
+	auto got = h2_read(conn, s);
+	if (got < 0) {
+		conn->log(LV_DEBUG, "connection lost");
+		return tproc_status::runoff;
+	}
+	if (!s.preface && s.rbuf.size() >= strlen(h2_preface)) {
+		if (s.rbuf.compare(0, strlen(h2_preface), h2_preface) != 0) {
+			conn->log(LV_DEBUG, "h2: bad connection preface");
+			return tproc_status::runoff;
+		}
+		s.roff = strlen(h2_preface);
+		s.preface = true;
+	}
+	while (s.preface && s.rbuf.size() - s.roff >= 9) {
+		auto h = reinterpret_cast<const uint8_t *>(&s.rbuf[s.roff]);
+		size_t len = (h[0] << 16) | (h[1] << 8) | h[2];
+		uint32_t err = H2E_NO_ERROR;
+		if (len > H2_MAX_FRAME) {
+			err = H2E_FRAME_SIZE;
+		} else if (s.rbuf.size() - s.roff < 9 + len) {
+			break;
+		} else {
+			auto sid = be32p_to_cpu(&h[5]) & 0x7fffffff;
+			if (g_http_debug)
+				conn->log(LV_DEBUG, "h2 << type %u flags %#x stream %u len %zu",
+					h[3], h[4], sid, len);
+			err = h2_frame_in(conn, s, h[3], h[4], sid, &h[9], len);
+			s.roff += 9 + len;
+		}
+		if (err != H2E_NO_ERROR) {
+			conn->log(LV_DEBUG, "h2: connection error %u", err);
+			h2_goaway(s, err);
+			h2_write(conn, s);
+			return tproc_status::runoff;
+		}
+	}
+	if (s.roff == s.rbuf.size()) {
+		s.rbuf.clear();
+		s.roff = 0;
+	} else if (s.roff >= 65536) {
+		s.rbuf.erase(0, s.roff);
+		s.roff = 0;
+	}
+	for (auto i = s.streams.begin(); i != s.streams.end(); ) {
+		auto &st = i->second;
+		if (st.ctx == nullptr || (!st.dispatched && !st.rsp_done) ||
+		    h2_pump(s, i->first, st)) {
+			++i;
+			continue;
+		}
+		h2_release(st);
+		i = s.streams.erase(i);
+	}
+	auto wr = h2_write(conn, s);
+	if (wr < 0) {
+		conn->log(LV_DEBUG, "connection lost");
+		return tproc_status::runoff;
+	} else if (wr == 0) {
+		return tproc_status::polling_wronly;
+	}
+	if (s.goaway && s.streams.empty())
+		return tproc_status::runoff;
+	if (s.busy)
+		return tproc_status::cont;
+	if (s.streams.empty() && tp_now() - conn->connection.last_timestamp >=
+	    std::chrono::seconds(http_parser_get_param(HTTP_SESSION_TIMEOUT))) {
+		conn->log(LV_DEBUG, "I-1938: timeout");
+		h2_goaway(s, H2E_NO_ERROR);
+		h2_write(conn, s);
+		return tproc_status::runoff;
+	}
+	return tproc_status::polling_rdonly;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2417: ENOMEM");
+	return tproc_status::runoff;
+}
+
+void http2_end(http_context *conn)
+{
+	if (conn->h2 == nullptr)
+		return;
+	for (auto &e : conn->h2->streams)
+		h2_release(e.second);
+	conn->h2.reset();
+}
+
+void http2_wakeup(http_context *ctx)
+{
+	auto conn = ctx->h2_conn;
+	if (conn != nullptr)
+		context_pool_activate_context(conn);
+}
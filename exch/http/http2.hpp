@@ -0,0 +1,49 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <openssl/ssl.h>
+#include <gromox/clock.hpp>
+#include <gromox/threads_pool.hpp>
+#include "h2codec.hpp"
+
+struct http_context;
+
+/* Where we are in the HTTP/1.1 response text that the plugin produced */
+enum class h2_rsp {
+	head, chunk_size, chunk_data, chunk_crlf, trailer, length, eof, done,
+};
+
+struct h2_stream {
+	http_context *ctx = nullptr; /* borrowed context slot carrying the request */
+	int64_t send_window = 0;
+	std::string hdrblock, out, body;
+	size_t body_off = 0;
+	uint64_t remain = 0;
+	h2_rsp rstate = h2_rsp::head;
+	uint32_t rst_err = 0; /* reset with this once the header block is decoded */
+	bool headed = false, hdr_es = false, in_closed = false;
+	bool deferred = false, dispatched = false, rsp_done = false, hdr_sent = false;
+};
+
+struct h2_session {
+	hpack_decoder dec;
+	std::map<uint32_t, h2_stream> streams;
+	std::string rbuf, wbuf;
+	size_t roff = 0, woff = 0;
+	uint32_t last_id = 0, cont_id = 0, peer_frame = 16384;
+	int64_t send_window = 65535, peer_window = 65535;
+	bool preface = false, goaway = false, busy = false;
+	unsigned int rst_count = 0; /* client resets since @rst_since */
+	gromox::time_point rst_since;
+	std::string auth_line; /* Authorization value that auth_status of the connection is for */
+};
+
+extern void http2_init(SSL_CTX *, unsigned int max_streams, size_t context_num);
+extern bool http2_negotiated(SSL *);
+extern tproc_status http2_accept(http_context *);
+extern tproc_status http2_process(http_context *);
+extern void http2_end(http_context *);
+extern void http2_wakeup(http_context *);
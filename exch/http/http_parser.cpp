@@ -52,6 +52,7 @@
 #include <gromox/threads_pool.hpp>
 #include <gromox/util.hpp>
 #include "hpm_processor.h"
+#include "http2.hpp"
 #include "http_parser.h"
 #include "mod_cache.hpp"
 #include "mod_fastcgi.h"
@@ -131,7 +132,6 @@ static char g_certificate_passwd[1024];
 static std::unique_ptr<std::mutex[]> g_ssl_mutex_buf;
 static std::mutex g_vconnection_lock;
 
-static void http_parser_context_clear(HTTP_CONTEXT *pcontext);
 
 static void httpctx_report(const HTTP_CONTEXT &ctx, size_t i)
 {
@@ -160,6 +160,9 @@ void http_report()
 	mlog(LV_INFO, "-------------------------------------------------------------------------------");
 	for (size_t i = 0; i < g_context_num; ++i)
 		httpctx_report(g_context_list[i], i);
+	if (g_ssl_ctx != nullptr)
+		tls_resumption_report(g_ssl_ctx);
+	mod_cache_report();
 }
 
 void http_parser_init(size_t context_num, time_duration timeout,
@@ -247,6 +250,19 @@ int http_parser_run()
 			return -4;
 		}
 		tls_set_renego(g_ssl_ctx);
+		if (parse_bool(g_config_file->get_value("tls_ktls")) &&
+		    tls_set_ktls(g_ssl_ctx) != 0)
+			mlog(LV_NOTICE, "http_parser: tls_ktls: OpenSSL was built without kTLS support, continuing without");
+		if (tls_set_resumption(g_ssl_ctx, "gromox-http",
+		    g_config_file->get_ll("tls_session_cache_size"),
+		    g_config_file->get_ll("tls_session_timeout"),
+		    g_config_file->get_value("tls_ticket_key_file")) != 0) {
+			mlog(LV_ERR, "http_parser: failed to set up TLS session resumption");
+			return -4;
+		}
+		if (parse_bool(g_config_file->get_value("http_h2")))
+			http2_init(g_ssl_ctx, g_config_file->get_ll("http_h2_max_streams"),
+				g_context_num);
 		try {
 			g_ssl_mutex_buf = std::make_unique<std::mutex[]>(CRYPTO_num_locks());
 		} catch (const std::bad_alloc &) {
@@ -284,6 +300,7 @@ void http_parser_stop()
 	g_context_list.reset();
 	g_vconnection_hash.clear();
 	if (g_support_tls && g_ssl_ctx != nullptr) {
+		tls_resumption_report(g_ssl_ctx);
 		SSL_CTX_free(g_ssl_ctx);
 		g_ssl_ctx = NULL;
 	}
@@ -414,6 +431,7 @@ static const char *status_text(http_status s)
 	case http_status::uri_too_long: return "URI Too Long";
 	case http_status::range_insatisfiable: return "Range Not Satisfiable";
 	case http_status::too_many_ranges: return "Too Many Ranges";
+	case http_status::fields_too_large: return "Request Header Fields Too Large";
 	case http_status::not_impl: return "Not Implemented";
 	case http_status::bad_gateway: return "Bad FCGI Gateway";
 	case http_status::service_unavailable: return "Service Unavailable";
@@ -517,6 +535,7 @@ static tproc_status http_end(http_context *ctx)
 		ctx->pchannel = nullptr;
 	}
 
+	http2_end(ctx);
 	ctx->connection.reset();
 	http_parser_context_clear(ctx);
 	return tproc_status::close;
@@ -542,6 +561,8 @@ static tproc_status htparse_initssl(http_context *pcontext)
 		SSL_set_fd(pcontext->connection.ssl, pcontext->connection.sockd);
 	}
 	if (SSL_accept(pcontext->connection.ssl) >= 0) {
+		if (http2_negotiated(pcontext->connection.ssl))
+			return http2_accept(pcontext);
 		pcontext->sched_stat = hsched_stat::rdhead;
 		return tproc_status::cont;
 	}
@@ -562,7 +583,7 @@ static tproc_status htparse_initssl(http_context *pcontext)
 	return http_done(pcontext, http_status::timeout);
 }
 
-static enum http_method http_method_lookup(const char *s)
+enum http_method http_method_lookup(const char *s)
 {
 	/* Ordered by approximate use count */
 #define E(k, v) if (strcasecmp(s, #k) == 0) return http_method::v;
@@ -635,7 +656,7 @@ static tproc_status htparse_rdhead_no(http_context *pcontext, char *line,
 	return tproc_status::runoff;
 }
 
-static tproc_status htparse_rdhead_mt(http_context *pcontext, char *line,
+tproc_status htparse_rdhead_mt(http_context *pcontext, char *line,
     unsigned int line_length) try
 {
 	auto &ctx = *pcontext;
@@ -979,7 +1000,7 @@ static int auth_krb(http_context &ctx, const char *input, size_t isize,
 }
 #endif
 
-static tproc_status htp_auth_1(http_context &ctx)
+tproc_status htp_auth_1(http_context &ctx)
 {
 	if (ctx.auth_status != http_status::ok)
 		ctx.auth_status = http_status::none;
@@ -1414,12 +1435,45 @@ static tproc_status htparse_wrrep_nobuf(http_context *pcontext)
 	return tproc_status::runoff;
 }
 
+static tproc_status htparse_wrfile(http_context *pcontext)
+{
+	/* Bounded, so that one large download does not starve other contexts */
+	auto z = std::min(pcontext->sendfile_length, static_cast<uint64_t>(1U << 20));
+	auto written_len = pcontext->connection.sendfile(pcontext->sendfile_fd,
+	                   pcontext->sendfile_offset, z);
+	auto current_time = tp_now();
+	if (written_len == 0) {
+		pcontext->log(LV_DEBUG, "connection lost");
+		return tproc_status::runoff;
+	} else if (written_len < 0) {
+		if (errno != EAGAIN) {
+			pcontext->log(LV_DEBUG, "connection lost");
+			return tproc_status::runoff;
+		}
+		if (current_time - pcontext->connection.last_timestamp < g_timeout)
+			return tproc_status::polling_wronly;
+		pcontext->log(LV_DEBUG, "timeout");
+		return tproc_status::runoff;
+	}
+	pcontext->connection.last_timestamp = current_time;
+	pcontext->sendfile_offset += written_len;
+	pcontext->sendfile_length -= written_len;
+	pcontext->bytes_rw += written_len;
+	if (pcontext->sendfile_length == 0)
+		pcontext->sendfile_fd = -1;
+	return tproc_status::cont;
+}
+
 static tproc_status htparse_wrrep(http_context *pcontext)
 {
 	if (NULL == pcontext->write_buff) {
+		if (pcontext->sendfile_length > 0)
+			return htparse_wrfile(pcontext);
 		auto ret = htparse_wrrep_nobuf(pcontext);
 		if (ret != tproc_status::runoff)
 			return ret;
+		if (pcontext->write_buff == nullptr && pcontext->sendfile_length > 0)
+			return htparse_wrfile(pcontext);
 	}
 
 	ssize_t written_len = pcontext->write_length - pcontext->write_offset; /*int-int*/
@@ -2015,6 +2069,7 @@ tproc_status http_parser_process(schedule_context *vcontext)
 		case hsched_stat::rdbody:  ret = htparse_rdbody(pcontext);  break;
 		case hsched_stat::wrrep:   ret = htparse_wrrep(pcontext);   break;
 		case hsched_stat::wait:    ret = htparse_wait(pcontext);    break;
+		case hsched_stat::h2:      ret = http2_process(pcontext);   break;
 		default: continue;
 		}
 	} while (ret == tproc_status::loop);
@@ -2104,7 +2159,7 @@ http_context::http_context() :
 #endif
 }
 
-static void http_parser_context_clear(HTTP_CONTEXT *pcontext)
+void http_parser_context_clear(HTTP_CONTEXT *pcontext)
 {
     if (NULL == pcontext) {
         return;
@@ -2131,6 +2186,8 @@ static void http_parser_context_clear(HTTP_CONTEXT *pcontext)
 	pcontext->write_buff = NULL;
 	pcontext->write_offset = 0;
 	pcontext->write_length = 0;
+	pcontext->sendfile_fd = -1;
+	pcontext->sendfile_offset = pcontext->sendfile_length = 0;
 	pcontext->b_close = TRUE;
 	pcontext->auth_status = http_status::none;
 	pcontext->auth_times = 0;
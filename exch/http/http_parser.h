@@ -5,6 +5,7 @@
 #include <atomic>
 #include <cstdint>
 #include <ctime>
+#include <memory>
 #include <string>
 #include <vector>
 #ifdef HAVE_GSSAPI
@@ -31,7 +32,7 @@ enum {
 };
 
 enum class hsched_stat {
-	initssl = 0, rdhead, rdbody, wrrep, wait,
+	initssl = 0, rdhead, rdbody, wrrep, wait, h2,
 };
 
 enum class hchannel_stat {
@@ -43,6 +44,7 @@ enum class hchannel_type {
 };
 
 struct fastcgi_context;
+struct h2_session;
 
 struct http_context final : public schedule_context {
 	http_context();
@@ -64,6 +66,9 @@ struct http_context final : public schedule_context {
 	STREAM stream_in, stream_out;
 	void *write_buff = nullptr;
 	int write_offset = 0, write_length = 0;
+	/* file range queued by mod_cache, sent once stream_out has drained */
+	int sendfile_fd = -1;
+	uint64_t sendfile_offset = 0, sendfile_length = 0;
 	BOOL b_close = TRUE; /* Connection MIME Header for indicating closing */
 	/* @auth_status: 0=untried, 200=success, 401=rejected */
 	http_status auth_status = http_status::none;
@@ -81,6 +86,9 @@ struct http_context final : public schedule_context {
 #endif
 	std::string last_gss_output;
 	bool last_gss_b64 = false;
+	/* HTTP/2: state of the connection, or the connection owning this stream */
+	std::unique_ptr<h2_session> h2;
+	http_context *h2_conn = nullptr;
 };
 using HTTP_CONTEXT = http_context;
 
@@ -133,6 +141,10 @@ void http_parser_vconnection_async_reply(const char *host,
 	int port, const char *connection_cookie, DCERPC_CALL *pcall);
 extern void http_report();
 extern std::string http_make_err_response(const http_context &, http_status);
+extern enum http_method http_method_lookup(const char *);
+extern tproc_status htparse_rdhead_mt(http_context *, char *line, unsigned int len);
+extern tproc_status htp_auth_1(http_context &);
+extern void http_parser_context_clear(http_context *);
 
 extern alloc_limiter<stream_block> g_blocks_allocator;
 extern unsigned int g_http_debug, g_msrpc_debug;
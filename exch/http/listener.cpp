@@ -5,6 +5,7 @@
  *    connection is legal, construct a context to represent the connection and 
  *    throw it into contexts pool, or close the connection
  */
+#include <algorithm>
 #include <cerrno>
 #include <csignal>
 #include <cstdint>
@@ -16,6 +17,7 @@
 #include <pthread.h>
 #include <string>
 #include <unistd.h>
+#include <vector>
 #include <libHX/io.h>
 #include <libHX/socket.h>
 #include <libHX/string.h>
@@ -36,21 +38,28 @@ using namespace gromox;
 
 static void *htls_thrwork(void *);
 
-static unsigned int g_mss_size;
+namespace {
+struct acceptor {
+	int sockd = -1;
+	bool use_tls = false;
+	pthread_t thr_id{};
+};
+}
+
+static unsigned int g_mss_size, g_acceptor_num = 1;
 static gromox::atomic_bool g_stop_accept;
-static pthread_t g_thr_id;
-static int g_listener_sock = -1, g_listener_ssl_sock = -1;
+static std::vector<acceptor> g_acceptors;
 static std::string g_listener_addr;
 static uint16_t g_listener_port, g_listener_ssl_port;
-static pthread_t g_ssl_thr_id;
 
 void listener_init(const char *addr, uint16_t port, uint16_t ssl_port,
-    unsigned int mss_size)
+    unsigned int mss_size, unsigned int acceptors)
 {
 	g_listener_addr = addr;
 	g_listener_port = port;
 	g_listener_ssl_port = ssl_port;
 	g_mss_size = mss_size;
+	g_acceptor_num = std::max(acceptors, 1U);
 	g_stop_accept = false;
 }
 
@@ -64,52 +73,39 @@ void listener_init(const char *addr, uint16_t port, uint16_t ssl_port,
  */
 int listener_run()
 {
-	g_listener_sock = HX_inet_listen(g_listener_addr.c_str(), g_listener_port);
-	if (g_listener_sock < 0) {
-		mlog(LV_ERR, "listener: failed to create socket [*]:%hu: %s",
-		       g_listener_port, strerror(-g_listener_sock));
-		return -1;
-	}
-	gx_reexec_record(g_listener_sock);
-	if (g_mss_size > 0 &&
-	    setsockopt(g_listener_sock, IPPROTO_TCP, TCP_MAXSEG,
-	    &g_mss_size, sizeof(g_mss_size)) < 0)
-		return -2;
-	
-	if (g_listener_ssl_port > 0) {
-		g_listener_ssl_sock = HX_inet_listen(g_listener_addr.c_str(), g_listener_ssl_port);
-		if (g_listener_ssl_sock < 0) {
+	for (auto tls : {false, true}) {
+		auto port = tls ? g_listener_ssl_port : g_listener_port;
+		if (tls && port == 0)
+			continue;
+		std::vector<int> fds;
+		auto err = gx_inet_listen_multi(g_listener_addr.c_str(), port,
+		           g_acceptor_num, fds);
+		if (err != 0) {
 			mlog(LV_ERR, "listener: failed to create socket [*]:%hu: %s",
-			       g_listener_ssl_port, strerror(-g_listener_ssl_sock));
+			       port, strerror(err));
 			return -1;
 		}
-		gx_reexec_record(g_listener_ssl_sock);
-		if (g_mss_size > 0 &&
-		    setsockopt(g_listener_ssl_sock, IPPROTO_TCP, TCP_MAXSEG,
-		    &g_mss_size, sizeof(g_mss_size)) < 0)
-			return -2;
+		for (auto fd : fds)
+			g_acceptors.push_back(acceptor{fd, tls});
+		if (g_mss_size == 0)
+			continue;
+		for (auto fd : fds)
+			if (setsockopt(fd, IPPROTO_TCP, TCP_MAXSEG,
+			    &g_mss_size, sizeof(g_mss_size)) < 0)
+				return -2;
 	}
-
 	return 0;
 }
 
 int listener_trigger_accept()
 {
-	auto ret = pthread_create4(&g_thr_id, nullptr, htls_thrwork,
-	           reinterpret_cast<void *>(uintptr_t(false)));
-	if (ret != 0) {
-		mlog(LV_ERR, "listener: failed to create listener thread: %s", strerror(ret));
-		return -1;
-	}
-	pthread_setname_np(g_thr_id, "accept");
-	if (g_listener_ssl_port > 0) {
-		ret = pthread_create4(&g_ssl_thr_id, nullptr, htls_thrwork,
-		      reinterpret_cast<void *>(uintptr_t(true)));
+	for (auto &acc : g_acceptors) {
+		auto ret = pthread_create4(&acc.thr_id, nullptr, htls_thrwork, &acc);
 		if (ret != 0) {
 			mlog(LV_ERR, "listener: failed to create listener thread: %s", strerror(ret));
-			return -2;
+			return acc.use_tls ? -2 : -1;
 		}
-		pthread_setname_np(g_ssl_thr_id, "tls_accept");
+		pthread_setname_np(acc.thr_id, acc.use_tls ? "tls_accept" : "accept");
 	}
 	return 0;
 }
@@ -117,34 +113,32 @@ int listener_trigger_accept()
 void listener_stop_accept()
 {
 	g_stop_accept = true;
-	if (g_listener_sock >= 0)
-		shutdown(g_listener_sock, SHUT_RDWR); /* closed in listener_stop */
-	if (!pthread_equal(g_thr_id, {})) {
-		pthread_kill(g_thr_id, SIGALRM);
-		pthread_join(g_thr_id, NULL);
-	}
-	if (g_listener_ssl_sock >= 0)
-		shutdown(g_listener_ssl_sock, SHUT_RDWR);
-	if (!pthread_equal(g_ssl_thr_id, {})) {
-		pthread_kill(g_ssl_thr_id, SIGALRM);
-		pthread_join(g_ssl_thr_id, NULL);
+	for (auto &acc : g_acceptors) {
+		if (acc.sockd >= 0)
+			shutdown(acc.sockd, SHUT_RDWR); /* closed in listener_stop */
+		if (!pthread_equal(acc.thr_id, {})) {
+			pthread_kill(acc.thr_id, SIGALRM);
+			pthread_join(acc.thr_id, nullptr);
+			acc.thr_id = {};
+		}
 	}
 }
 
 static void *htls_thrwork(void *arg)
 {
-	bool use_tls = reinterpret_cast<uintptr_t>(arg);
+	const auto &acc = *static_cast<const acceptor *>(arg);
+	bool use_tls = acc.use_tls;
 	socklen_t addrlen;
 	int len, flag, sockd2;
 	struct sockaddr_storage fact_addr, client_peer;
-	char client_hostip[40], client_txtport[8], server_hostip[40];
+	char client_hostip[40], server_hostip[40];
 	char buff[1024];
 	
 	for (;;) {
 		addrlen = sizeof(client_peer);
 		/* wait for an incoming connection */
-		sockd2 = accept(use_tls ? g_listener_ssl_sock : g_listener_sock,
-		         reinterpret_cast<struct sockaddr *>(&client_peer), &addrlen);
+		sockd2 = accept4(acc.sockd, reinterpret_cast<struct sockaddr *>(&client_peer),
+		         &addrlen, SOCK_NONBLOCK);
 		if (g_stop_accept) {
 			if (sockd2 >= 0)
 				close(sockd2);
@@ -152,33 +146,28 @@ static void *htls_thrwork(void *arg)
 		}
 		if (sockd2 < 0)
 			continue;
-		int ret = getnameinfo(reinterpret_cast<struct sockaddr *>(&client_peer),
-		          addrlen, client_hostip, sizeof(client_hostip),
-		          client_txtport, sizeof(client_txtport),
-		          NI_NUMERICHOST | NI_NUMERICSERV);
-		if (ret != 0) {
-			mlog(LV_ERR, "E-1260: getnameinfo: %s", gai_strerror(ret));
+		uint16_t client_port = 0;
+		if (!gx_sockaddr_text(client_peer, client_hostip,
+		    std::size(client_hostip), &client_port)) {
+			mlog(LV_ERR, "E-1260: unsupported address family %u",
+			        static_cast<unsigned int>(client_peer.ss_family));
 			close(sockd2);
 			continue;
 		}
 		addrlen = sizeof(fact_addr); 
-		ret = getsockname(sockd2, reinterpret_cast<struct sockaddr *>(&fact_addr), &addrlen);
+		int ret = getsockname(sockd2, reinterpret_cast<struct sockaddr *>(&fact_addr), &addrlen);
 		if (ret != 0) {
 			mlog(LV_ERR, "E-1259: getsockname: %s", strerror(errno));
 			close(sockd2);
 			continue;
 		}
-		ret = getnameinfo(reinterpret_cast<struct sockaddr *>(&fact_addr),
-		      addrlen, server_hostip, sizeof(server_hostip),
-		      nullptr, 0, NI_NUMERICHOST | NI_NUMERICSERV);
-		if (ret != 0) {
-			mlog(LV_ERR, "E-1258: getsockname: %s", gai_strerror(ret));
+		if (!gx_sockaddr_text(fact_addr, server_hostip,
+		    std::size(server_hostip), nullptr)) {
+			mlog(LV_ERR, "E-1258: unsupported address family %u",
+			        static_cast<unsigned int>(fact_addr.ss_family));
 			close(sockd2);
 			continue;
 		}
-		uint16_t client_port = strtoul(client_txtport, nullptr, 0);
-		if (fcntl(sockd2, F_SETFL, O_NONBLOCK) < 0)
-			mlog(LV_WARN, "W-1408: fcntl: %s", strerror(errno));
 		flag = 1;
 		if (setsockopt(sockd2, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0)
 			mlog(LV_WARN, "W-1409: setsockopt: %s", strerror(errno));
@@ -234,12 +223,8 @@ static void *htls_thrwork(void *arg)
 
 void listener_stop()
 {
-	if (g_listener_sock >= 0) {
-		close(g_listener_sock);
-		g_listener_sock = -1;
-	}
-	if (g_listener_ssl_sock >= 0) {
-		close(g_listener_ssl_sock);
-		g_listener_ssl_sock = -1;
-	}
+	for (const auto &acc : g_acceptors)
+		if (acc.sockd >= 0)
+			close(acc.sockd);
+	g_acceptors.clear();
 }
@@ -83,15 +83,22 @@ static constexpr cfg_directive http_cfg_defaults[] = {
 	{"config_file_path", PKGSYSCONFDIR "/http:" PKGSYSCONFDIR},
 	{"context_average_mem", "256K", CFG_SIZE, "192K"},
 	{"context_num", "400", CFG_SIZE},
+	{"context_reactors", "1", CFG_SIZE},
 	{"data_file_path", PKGDATADIR "/http:" PKGDATADIR},
 	{"fastcgi_exec_timeout", "10min", CFG_TIME, "1min"},
 	{"http_auth_basic", "1", CFG_BOOL},
 	{"http_auth_spnego", "0", CFG_BOOL},
 	{"http_auth_spnego_ntlmssp", "1", CFG_BOOL},
 	{"http_auth_times", "10", CFG_SIZE, "1"},
+	{"http_cache_compress", "1", CFG_BOOL},
+	{"http_cache_max_size", "256M", CFG_SIZE, "0"},
+	{"http_cache_revalidate", "1s", CFG_TIME, "0"},
 	{"http_conn_timeout", "3min", CFG_TIME, "30s"},
 	{"http_debug", "0"},
+	{"http_h2", "0", CFG_BOOL},
+	{"http_h2_max_streams", "100", CFG_SIZE, "1"},
 	{"http_krb_service_principal", ""},
+	{"http_listen_acceptors", "1", CFG_SIZE, "1"},
 	{"http_listen_addr", "::"},
 	{"http_listen_port", "80"},
 	{"http_listen_tls_port", "0"},
@@ -115,7 +122,11 @@ static constexpr cfg_directive http_cfg_defaults[] = {
 	{"tcp_max_segment", "0", CFG_SIZE},
 	{"thread_charge_num", "http_thread_charge_num", CFG_ALIAS},
 	{"thread_init_num", "http_thread_init_num", CFG_ALIAS},
+	{"tls_ktls", "0", CFG_BOOL},
 	{"tls_min_proto", "tls1.2"},
+	{"tls_session_cache_size", "20480", CFG_SIZE},
+	{"tls_session_timeout", "1h", CFG_TIME, "1min"},
+	{"tls_ticket_key_file", ""},
 	{"user_default_lang", "en"},
 	CFG_TABLE_END,
 };
@@ -276,7 +287,8 @@ int main(int argc, const char **argv) try
 	uint16_t listen_port = g_config_file->get_ll("http_listen_port");
 	unsigned int mss_size = g_config_file->get_ll("tcp_max_segment");
 	listener_init(g_config_file->get_value("http_listen_addr"),
-		listen_port, listen_tls_port, mss_size);
+		listen_port, listen_tls_port, mss_size,
+		g_config_file->get_ll("http_listen_acceptors"));
 	auto cleanup_4 = make_scope_exit(listener_stop);
 	if (0 != listener_run()) {
 		mlog(LV_ERR, "system: failed to start listener");
@@ -379,7 +391,8 @@ int main(int argc, const char **argv) try
 		context_num,
 		http_parser_get_context_socket,
 		http_parser_get_context_timestamp,
-		thread_charge_num, http_conn_timeout); 
+		thread_charge_num, http_conn_timeout,
+		g_config_file->get_ll("context_reactors"));
 	auto cleanup_24 = make_scope_exit(contexts_pool_stop);
 	if (0 != contexts_pool_run()) { 
 		mlog(LV_ERR, "system: failed to start context_pool");
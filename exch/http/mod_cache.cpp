@@ -15,15 +15,21 @@
 #include <mutex>
 #include <pthread.h>
 #include <string>
+#include <string_view>
 #include <unistd.h>
 #include <unordered_map>
 #include <utility>
 #include <vector>
+#include <zlib.h>
+#include <zstd.h>
+#include <libHX/ctype_helper.h>
 #include <libHX/string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <gromox/atomic.hpp>
+#include <gromox/clock.hpp>
 #include <gromox/defs.h>
 #include <gromox/fileio.h>
 #include <gromox/http.hpp>
@@ -41,14 +47,29 @@
 using namespace gromox;
 
 namespace {
+
+enum {
+	ENC_IDENTITY, ENC_GZIP, ENC_ZSTD,
+};
+
+/**
+ * @gz, @zst:	precompressed variants (empty if not worthwhile)
+ * @checked:	last time @sb was compared against the file
+ * @lru_pos:	position in g_cache_lru
+ */
 struct cache_item {
 	cache_item() = default;
 	cache_item(cache_item &&) = delete;
 	~cache_item();
+	size_t footprint() const { return sb.st_size + gz.size() + zst.size(); }
 
 	const char *content_type = nullptr;
 	void *mblk = nullptr;
+	int fd = -1; /* for sendfile; -1 when over g_cache_max_fds */
 	struct stat sb{};
+	std::string gz, zst;
+	gromox::time_point checked;
+	std::list<std::string>::iterator lru_pos;
 };
 using CACHE_ITEM = cache_item;
 
@@ -59,6 +80,7 @@ struct RANGE {
 
 struct cache_context {
 	std::shared_ptr<cache_item> pitem;
+	uint8_t enc = ENC_IDENTITY;
 	BOOL b_header = false;
 	uint32_t offset = 0, until = 0;
 	ssize_t range_pos = -1;
@@ -78,18 +100,38 @@ static pthread_t g_scan_tid;
 static std::mutex g_hash_lock;
 static std::vector<DIRECTORY_NODE> g_directory_list;
 static std::unordered_map<std::string, std::shared_ptr<cache_item>> g_cache_hash;
+static std::list<std::string> g_cache_lru; /* front = least recently used */
+static size_t g_cache_bytes, g_cache_max_size, g_cache_max_fds;
+static std::atomic<size_t> g_cache_fds;
+static bool g_cache_compress;
+static gromox::time_duration g_cache_revalidate;
+static std::atomic<uint64_t> g_cache_hits, g_cache_misses, g_bytes_out, g_bytes_out_cmp;
 static std::unique_ptr<CACHE_CONTEXT[]> g_context_list;
 
 cache_item::~cache_item()
 {
 	if (mblk != nullptr)
 		munmap(mblk, static_cast<size_t>(sb.st_size));
+	if (fd >= 0) {
+		close(fd);
+		--g_cache_fds;
+	}
 }
 
 static bool stat4_eq(const struct stat &a, const struct stat &b)
 {
 	return a.st_dev == b.st_dev && a.st_ino == b.st_ino &&
-	       a.st_mtime == b.st_mtime && a.st_size == b.st_size;
+	       a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+	       a.st_mtim.tv_nsec == b.st_mtim.tv_nsec && a.st_size == b.st_size;
+}
+
+/* g_hash_lock must be held */
+static void mod_cache_erase(decltype(g_cache_hash)::iterator iter)
+{
+	auto &pitem = iter->second;
+	g_cache_bytes -= pitem->footprint();
+	g_cache_lru.erase(pitem->lru_pos);
+	g_cache_hash.erase(iter);
 }
 
 static void *mod_cache_scanwork(void *pparam)
@@ -112,7 +154,9 @@ static void *mod_cache_scanwork(void *pparam)
 				++iter;
 				continue;
 			}
-			iter = g_cache_hash.erase(iter);
+			auto next = std::next(iter);
+			mod_cache_erase(iter);
+			iter = next;
 		}
 		count = 0;
 	}
@@ -172,6 +216,18 @@ int mod_cache_run() try
 	auto ret = mod_cache_read_txt();
 	if (ret < 0)
 		return ret;
+	g_cache_max_size = g_config_file->get_ll("http_cache_max_size");
+	g_cache_compress = parse_bool(g_config_file->get_value("http_cache_compress"));
+	g_cache_revalidate = std::chrono::seconds(g_config_file->get_ll("http_cache_revalidate"));
+	/*
+	 * main() reserves 5 fds per context; let cached files take up to one
+	 * of them, and no more than a quarter of whatever the limit ended up
+	 * as.
+	 */
+	struct rlimit rl;
+	g_cache_max_fds = g_context_num;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+		g_cache_max_fds = std::min(g_cache_max_fds, static_cast<size_t>(rl.rlim_cur / 4));
 	g_context_list = std::make_unique<cache_context[]>(g_context_num);
 	g_notify_stop = false;
 	ret = pthread_create4(&g_scan_tid, nullptr, mod_cache_scanwork, nullptr);
@@ -199,6 +255,23 @@ void mod_cache_stop()
 	g_directory_list.clear();
 	g_context_list.reset();
 	g_cache_hash.clear();
+	g_cache_lru.clear();
+	g_cache_bytes = 0;
+}
+
+void mod_cache_report()
+{
+	using LLU = unsigned long long;
+	LLU hits = g_cache_hits, misses = g_cache_misses;
+	std::unique_lock hhold(g_hash_lock);
+	size_t items = g_cache_hash.size(), bytes = g_cache_bytes;
+	hhold.unlock();
+	size_t fds = g_cache_fds;
+	mlog(LV_INFO, "mod_cache: %zu files (%zu/%zu open), %zu of %zu bytes used; %llu hits, %llu misses (%.1f%% hit ratio)",
+	        items, fds, g_cache_max_fds, bytes, g_cache_max_size, hits, misses,
+	        hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0);
+	mlog(LV_INFO, "mod_cache: %llu bytes served, %llu of them compressed",
+	        LLU{g_bytes_out}, LLU{g_bytes_out_cmp});
 }
 
 static CACHE_CONTEXT* mod_cache_get_cache_context(HTTP_CONTEXT *phttp)
@@ -214,26 +287,148 @@ bool mod_cache_is_in_charge(HTTP_CONTEXT *phttp)
 	return pcontext->pitem != nullptr;
 }
 
-static bool mod_cache_retrieve_etag(const char *etag, struct stat &sb)
+/**
+ * The ETag covers the inode identity, size and mtime down to the nanosecond,
+ * plus the content coding, so every variant of every file revision has its
+ * own tag.
+ */
+static void mod_cache_serialize_etag(const struct stat &sb, uint8_t enc,
+    char *etag, size_t len)
+{
+	snprintf(etag, len, "%x-%llx-%llx-%llx.%lx%s",
+	         static_cast<unsigned int>(sb.st_dev),
+	         static_cast<unsigned long long>(sb.st_ino),
+	         static_cast<unsigned long long>(sb.st_size),
+	         static_cast<unsigned long long>(sb.st_mtim.tv_sec),
+	         static_cast<unsigned long>(sb.st_mtim.tv_nsec),
+	         enc == ENC_GZIP ? "-gz" : enc == ENC_ZSTD ? "-zst" : "");
+}
+
+/**
+ * Evaluate an If-None-Match list (RFC 9110 §13.1.2, weak comparison).
+ */
+static bool mod_cache_etag_match(const char *list, const char *etag)
+{
+	auto elen = strlen(etag);
+	while (*list != '\0') {
+		while (HX_isspace(*list) || *list == ',')
+			++list;
+		if (*list == '*')
+			return true;
+		if (strncmp(list, "W/", 2) == 0)
+			list += 2;
+		if (*list != '"')
+			return false;
+		auto end = strchr(list + 1, '"');
+		if (end == nullptr)
+			return false;
+		if (static_cast<size_t>(end - list - 1) == elen &&
+		    strncmp(list + 1, etag, elen) == 0)
+			return true;
+		list = end + 1;
+	}
+	return false;
+}
+
+/**
+ * Returns true if the Accept-Encoding header value lists @coding with a
+ * non-zero qvalue.
+ */
+static bool mod_cache_accepts(std::string_view hdr, std::string_view coding)
 {
-	unsigned int dev, ino;
-	unsigned long long size, mtim;
-	if (sscanf(etag, "%x-%x-%llx-%llx", &dev, &ino, &size, &mtim) != 4)
+	while (!hdr.empty()) {
+		auto comma = hdr.find(',');
+		auto elem = hdr.substr(0, comma);
+		hdr = comma == hdr.npos ? std::string_view() : hdr.substr(comma + 1);
+		while (!elem.empty() && HX_isspace(elem.front()))
+			elem.remove_prefix(1);
+		auto semi = elem.find(';');
+		auto name = elem.substr(0, semi);
+		while (!name.empty() && HX_isspace(name.back()))
+			name.remove_suffix(1);
+		if (name.size() != coding.size() ||
+		    strncasecmp(name.data(), coding.data(), coding.size()) != 0)
+			continue;
+		if (semi == elem.npos)
+			return true;
+		auto q = elem.find("q=", semi);
+		return q == elem.npos ||
+		       strtod(std::string(elem.substr(q + 2)).c_str(), nullptr) > 0;
+	}
+	return false;
+}
+
+static bool mod_cache_compressible(const char *ctype)
+{
+	if (ctype == nullptr)
 		return false;
-	sb.st_dev = dev;
-	sb.st_ino = ino;
-	sb.st_size = size;
-	sb.st_mtime = mtim;
-	return true;
+	return strncmp(ctype, "text/", 5) == 0 || strstr(ctype, "javascript") != nullptr ||
+	       strstr(ctype, "json") != nullptr || strstr(ctype, "xml") != nullptr ||
+	       strcmp(ctype, "application/wasm") == 0 ||
+	       strcmp(ctype, "application/x-font-ttf") == 0 ||
+	       strcmp(ctype, "font/ttf") == 0;
 }
 
-static void mod_cache_serialize_etag(const struct stat &sb, char *etag, size_t len)
+static std::string mod_cache_gzip(const void *src, size_t srclen)
 {
-	snprintf(etag, len, "%x-%llx-%llx-%llx",
-	         static_cast<unsigned int>(sb.st_dev),
-	         static_cast<unsigned long long>(sb.st_ino),
-	         static_cast<unsigned long long>(sb.st_size),
-	         static_cast<unsigned long long>(sb.st_mtime));
+	z_stream zs{};
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK)
+		return {};
+	std::string out;
+	out.resize(deflateBound(&zs, srclen));
+	zs.next_in   = static_cast<Bytef *>(const_cast<void *>(src));
+	zs.avail_in  = srclen;
+	zs.next_out  = reinterpret_cast<Bytef *>(out.data());
+	zs.avail_out = out.size();
+	auto ret = deflate(&zs, Z_FINISH);
+	deflateEnd(&zs);
+	if (ret != Z_STREAM_END)
+		return {};
+	out.resize(zs.total_out);
+	return out;
+}
+
+static std::string mod_cache_zstd(const void *src, size_t srclen)
+{
+	std::string out;
+	out.resize(ZSTD_compressBound(srclen));
+	auto ret = ZSTD_compress(out.data(), out.size(), src, srclen, ZSTD_CLEVEL_DEFAULT);
+	if (ZSTD_isError(ret))
+		return {};
+	out.resize(ret);
+	return out;
+}
+
+/**
+ * Precompute compressed variants, keeping only those that save at least
+ * an eighth. This runs in the request worker on a cache miss, so it is
+ * limited to files of modest size and to the default (fast) levels;
+ * anything larger is just served as-is.
+ */
+static void mod_cache_precompress(cache_item &item) try
+{
+	static constexpr size_t COMPRESS_MAX = 1U << 20;
+	size_t size = item.sb.st_size;
+	if (!g_cache_compress || size < 256 || size > COMPRESS_MAX ||
+	    !mod_cache_compressible(item.content_type))
+		return;
+	item.gz = mod_cache_gzip(item.mblk, size);
+	if (item.gz.size() > size - size / 8)
+		item.gz = std::string();
+	item.zst = mod_cache_zstd(item.mblk, size);
+	if (item.zst.size() > size - size / 8)
+		item.zst = std::string();
+} catch (const std::bad_alloc &) {
+	item.gz = item.zst = std::string();
+}
+
+static std::string_view mod_cache_body(const cache_context &c)
+{
+	auto &i = *c.pitem;
+	return c.enc == ENC_GZIP ? std::string_view(i.gz) :
+	       c.enc == ENC_ZSTD ? std::string_view(i.zst) :
+	       std::string_view(static_cast<const char *>(i.mblk), i.sb.st_size);
 }
 
 static const char *
@@ -269,10 +464,10 @@ static BOOL mod_cache_response_single_header(HTTP_CONTEXT *phttp)
 	rfc1123_dstring(date_string, std::size(date_string));
 	gmtime_r(&pcontext->pitem->sb.st_mtime, &tmp_tm);
 	rfc1123_dstring(modified_string, std::size(modified_string), tmp_tm);
-	mod_cache_serialize_etag(pcontext->pitem->sb, etag, std::size(etag));
+	mod_cache_serialize_etag(pcontext->pitem->sb, pcontext->enc, etag, std::size(etag));
 	auto pcontent_type = pcontext->pitem->content_type;
 	bool emit_206 = pcontext->offset != 0 ||
-	                pcontext->until != static_cast<uint64_t>(pcontext->pitem->sb.st_size);
+	                pcontext->until != mod_cache_body(*pcontext).size();
 	strcpy(response_buff, emit_206 ?
 	       "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n");
 	response_len = strlen(response_buff);
@@ -290,6 +485,15 @@ static BOOL mod_cache_response_single_header(HTTP_CONTEXT *phttp)
 		response_len += gx_snprintf(&response_buff[response_len],
 				std::size(response_buff) - response_len,
 				"Content-Type: %s\r\n", pcontent_type);
+	if (!pcontext->pitem->gz.empty() || !pcontext->pitem->zst.empty())
+		response_len += gx_snprintf(&response_buff[response_len],
+				std::size(response_buff) - response_len,
+				"Vary: Accept-Encoding\r\n");
+	if (pcontext->enc != ENC_IDENTITY)
+		response_len += gx_snprintf(&response_buff[response_len],
+				std::size(response_buff) - response_len,
+				"Content-Encoding: %s\r\n",
+				pcontext->enc == ENC_GZIP ? "gzip" : "zstd");
 	if (emit_206) {
 		response_len += gx_snprintf(response_buff + response_len,
 		                std::size(response_buff) - response_len,
@@ -348,7 +552,7 @@ static BOOL mod_cache_response_multiple_header(HTTP_CONTEXT *phttp)
 	rfc1123_dstring(date_string, std::size(date_string));
 	gmtime_r(&pcontext->pitem->sb.st_mtime, &tmp_tm);
 	rfc1123_dstring(modified_string, std::size(modified_string), tmp_tm);
-	mod_cache_serialize_etag(pcontext->pitem->sb, etag, std::size(etag));
+	mod_cache_serialize_etag(pcontext->pitem->sb, pcontext->enc, etag, std::size(etag));
 	content_length =  mod_cache_calculate_content_length(pcontext);	
 	response_len = gx_snprintf(response_buff, std::size(response_buff),
 					"HTTP/1.1 206 Partial Content\r\n"
@@ -441,13 +645,126 @@ static http_status mod_cache_parse_range_value(char *value,
 	return http_status::service_unavailable;
 }
 
+static http_status mod_cache_errno_status(int err)
+{
+	return err == ENOENT || err == ENOTDIR ? http_status::not_found :
+	       err == EACCES || err == EISDIR ? http_status::forbidden :
+	       http_status::service_unavailable;
+}
+
+/**
+ * Insert @pitem at the most-recently-used end, evicting from the other end
+ * to stay within http_cache_max_size. Files that do not fit at all are not
+ * cached. g_hash_lock must be held.
+ */
+static void mod_cache_insert(const char *path, std::shared_ptr<cache_item> &pitem)
+{
+	auto need = pitem->footprint();
+	if (need > g_cache_max_size)
+		return;
+	while (g_cache_bytes + need > g_cache_max_size && !g_cache_lru.empty())
+		mod_cache_erase(g_cache_hash.find(g_cache_lru.front()));
+	auto [iter, added] = g_cache_hash.emplace(path, pitem);
+	if (!added)
+		return;
+	pitem->lru_pos = g_cache_lru.emplace(g_cache_lru.end(), path);
+	g_cache_bytes += need;
+}
+
+/**
+ * Look up @path in the cache. Entries whose last stat is younger than
+ * http_cache_revalidate are used without touching the filesystem; older ones
+ * are revalidated, and outdated or missing ones are (re)loaded.
+ */
+static std::shared_ptr<cache_item> mod_cache_get_item(const char *path,
+    const char *suffix, http_status &err) try
+{
+	auto now = tp_now();
+	std::unique_lock hhold(g_hash_lock);
+	auto iter = g_cache_hash.find(path);
+	if (iter != g_cache_hash.end() && now - iter->second->checked < g_cache_revalidate) {
+		auto pitem = iter->second;
+		g_cache_lru.splice(g_cache_lru.end(), g_cache_lru, pitem->lru_pos);
+		++g_cache_hits;
+		return pitem;
+	}
+	hhold.unlock();
+
+	struct stat node_stat;
+	wrapfd fd = open(path, O_RDONLY);
+	if (fd.get() < 0) {
+		err = mod_cache_errno_status(errno);
+		return nullptr;
+	}
+	if (fstat(fd.get(), &node_stat) != 0) {
+		err = http_status::server_error;
+		return nullptr;
+	}
+	if (static_cast<unsigned long long>(node_stat.st_size) >= UINT32_MAX) {
+		err = http_status::server_error;
+		return nullptr;
+	} else if (!S_ISREG(node_stat.st_mode)) {
+		err = http_status::forbidden;
+		return nullptr;
+	}
+	static_assert(UINT32_MAX <= SIZE_MAX);
+	hhold.lock();
+	iter = g_cache_hash.find(path);
+	if (iter != g_cache_hash.end()) {
+		auto pitem = iter->second;
+		if (stat4_eq(pitem->sb, node_stat)) {
+			pitem->checked = now;
+			g_cache_lru.splice(g_cache_lru.end(), g_cache_lru, pitem->lru_pos);
+			++g_cache_hits;
+			return pitem;
+		}
+		mod_cache_erase(iter);
+	}
+	hhold.unlock();
+
+	++g_cache_misses;
+	auto pitem = std::make_shared<cache_item>();
+	pitem->content_type = extension_to_mime(suffix);
+	pitem->sb = node_stat;
+	pitem->checked = now;
+	pitem->mblk = mmap(nullptr, node_stat.st_size, PROT_READ, MAP_SHARED, fd.get(), 0);
+	if (pitem->mblk == MAP_FAILED) {
+		pitem->mblk = nullptr;
+		err = http_status::service_unavailable;
+		return nullptr;
+	}
+	posix_madvise(pitem->mblk, static_cast<size_t>(node_stat.st_size), POSIX_MADV_SEQUENTIAL);
+	/*
+	 * Items without an fd are served from the mapping. Retained fds
+	 * are bounded, since RLIMIT_NOFILE is sized by context count,
+	 * not by how many files are in the cache.
+	 */
+	if (++g_cache_fds <= g_cache_max_fds)
+		pitem->fd = fd.release();
+	else
+		--g_cache_fds;
+	/* compress outside the lock; a concurrent loader of the same file just loses */
+	mod_cache_precompress(*pitem);
+	hhold.lock();
+	iter = g_cache_hash.find(path);
+	if (iter != g_cache_hash.end()) {
+		if (stat4_eq(iter->second->sb, node_stat))
+			return iter->second;
+		mod_cache_erase(iter);
+	}
+	mod_cache_insert(path, pitem);
+	return pitem;
+} catch (const std::bad_alloc &) {
+	err = http_status::service_unavailable;
+	return nullptr;
+}
+
 http_status mod_cache_take_request(http_context *phttp)
 {
 	char *ptoken;
 	char suffix[16];
 	char tmp_path[512];
 	char tmp_buff[8192];
-	struct stat node_stat;
 	char request_uri[http_request::uri_limit];
 	CACHE_CONTEXT *pcontext;
 	
@@ -479,11 +796,10 @@ http_status mod_cache_take_request(http_context *phttp)
 		return http_status::none;
 	snprintf(tmp_path, std::size(tmp_path), "%s%s", it->dir.c_str(),
 	         request_uri + it->path.size());
-	wrapfd fd = open(tmp_path, O_RDONLY);
-	if (fd.get() < 0)
-		return errno == ENOENT || errno == ENOTDIR ? http_status::not_found :
-		       errno == EACCES || errno == EISDIR ? http_status::forbidden :
-		       http_status::service_unavailable;
+	auto status = http_status::none;
+	auto pitem = mod_cache_get_item(tmp_path, suffix, status);
+	if (pitem == nullptr)
+		return status;
 	if (phttp->request.imethod == http_method::head ||
 	    phttp->request.imethod == http_method::get ||
 	    phttp->request.imethod == http_method::post)
@@ -494,78 +810,44 @@ http_status mod_cache_take_request(http_context *phttp)
 		return http_status::forbidden;
 	else
 		return http_status::not_impl;
-	if (fstat(fd.get(), &node_stat) != 0)
-		return http_status::server_error;
-	if (static_cast<unsigned long long>(node_stat.st_size) >= UINT32_MAX)
-		return http_status::server_error;
-	else if (!S_ISREG(node_stat.st_mode))
-		return http_status::forbidden;
-	static_assert(UINT32_MAX <= SIZE_MAX);
+
+	auto range = mod_cache_get_others_field(phttp->request.f_others, "Range");
+	uint8_t enc = ENC_IDENTITY;
+	if (range == nullptr) {
+		auto &ae = phttp->request.f_accept_encoding;
+		if (!pitem->zst.empty() && mod_cache_accepts(ae, "zstd"))
+			enc = ENC_ZSTD;
+		else if (!pitem->gz.empty() && mod_cache_accepts(ae, "gzip"))
+			enc = ENC_GZIP;
+	}
+	char etag[128];
+	mod_cache_serialize_etag(pitem->sb, enc, etag, std::size(etag));
 	struct stat sb;
 	auto val = mod_cache_get_others_field(phttp->request.f_others, "If-None-Match");
-	if (val != nullptr && mod_cache_retrieve_etag(val, sb)) {
-		if (stat4_eq(sb, node_stat))
+	if (val != nullptr) {
+		if (mod_cache_etag_match(val, etag))
 			return http_status::not_modified;
 	} else if ((val = mod_cache_get_others_field(phttp->request.f_others, "If-Modified-Since")) != nullptr &&
 	    mod_cache_parse_rfc1123_dstring(val, &sb.st_mtime)) {
-		if (sb.st_mtime == node_stat.st_mtime)
+		if (sb.st_mtime == pitem->sb.st_mtime)
 			return http_status::not_modified;
 	}
 	pcontext = mod_cache_get_cache_context(phttp);
 	*pcontext = {};
 	phttp->request.posted_size = 0;
-	val = mod_cache_get_others_field(phttp->request.f_others, "Range");
-	if (val != nullptr) {
-		gx_strlcpy(tmp_buff, val, std::size(tmp_buff));
-		auto status = mod_cache_parse_range_value(tmp_buff,
-		              node_stat.st_size, pcontext);
-		if (status != http_status::none)
+	pcontext->pitem = std::move(pitem);
+	pcontext->enc = enc;
+	if (range != nullptr) {
+		gx_strlcpy(tmp_buff, range, std::size(tmp_buff));
+		status = mod_cache_parse_range_value(tmp_buff,
+		         pcontext->pitem->sb.st_size, pcontext);
+		if (status != http_status::none) {
+			pcontext->pitem.reset();
 			return status;
+		}
 	} else {
 		pcontext->offset = 0;
-		pcontext->until = node_stat.st_size;
-	}
-	std::unique_lock hhold(g_hash_lock);
-	auto iter = g_cache_hash.find(tmp_path);
-	if (iter != g_cache_hash.end()) {
-		auto pitem = iter->second;
-		if (!stat4_eq(pitem->sb, node_stat)) {
-			g_cache_hash.erase(iter);
-		} else {
-			pitem->mblk = mmap(nullptr, node_stat.st_size,
-			              PROT_READ, MAP_SHARED, fd.get(), 0);
-			if (pitem->mblk == MAP_FAILED) {
-				pcontext->range.clear();
-				return http_status::service_unavailable;
-			}
-			posix_madvise(pitem->mblk, static_cast<size_t>(node_stat.st_size), POSIX_MADV_SEQUENTIAL);
-			pcontext->pitem = std::move(pitem);
-			return http_status::ok;
-		}
-	}
-	hhold.unlock();
-
-	try {
-	auto pitem = std::make_shared<cache_item>();
-	pitem->content_type = extension_to_mime(suffix);
-	pitem->sb = node_stat;
-	hhold.lock();
-	iter = g_cache_hash.find(tmp_path);
-	if (iter == g_cache_hash.end()) {
-		pitem->mblk = mmap(nullptr, node_stat.st_size,
-		              PROT_READ, MAP_SHARED, fd.get(), 0);
-		if (pitem->mblk == MAP_FAILED) {
-			pcontext->range.clear();
-			return http_status::service_unavailable;
-		}
-		posix_madvise(pitem->mblk, static_cast<size_t>(node_stat.st_size), POSIX_MADV_SEQUENTIAL);
-		g_cache_hash.emplace(tmp_path, pitem);
-		pcontext->pitem = std::move(pitem);
-		return http_status::ok;
-	}
-	} catch (const std::bad_alloc &) {
-		pcontext->range.clear();
-		return http_status::service_unavailable;
+		pcontext->until = mod_cache_body(*pcontext).size();
 	}
 	return http_status::ok;
 }
@@ -618,20 +900,39 @@ BOOL mod_cache_read_response(HTTP_CONTEXT *phttp)
 		}
 	}
 	auto &item = *pcontext->pitem;
+	if (pcontext->enc == ENC_IDENTITY && item.fd >= 0 &&
+	    pcontext->offset < pcontext->until &&
+	    phttp->connection.can_sendfile()) {
+		/*
+		 * Hand the whole range to http_parser, which sends it straight
+		 * from the page cache after the headers have gone out. Part
+		 * boundaries (if any) are emitted on the next call.
+		 */
+		phttp->sendfile_fd     = item.fd;
+		phttp->sendfile_offset = pcontext->offset;
+		phttp->sendfile_length = pcontext->until - pcontext->offset;
+		g_bytes_out += phttp->sendfile_length;
+		pcontext->offset = pcontext->until;
+		return TRUE;
+	}
+	auto body = mod_cache_body(*pcontext);
 	uint32_t writeout_size = std::min(pcontext->until - pcontext->offset, static_cast<uint32_t>(STREAM_BLOCK_SIZE) - 1);
-	auto rem_to_eof = pcontext->offset < static_cast<uint64_t>(item.sb.st_size) ?
-	                  static_cast<uint64_t>(item.sb.st_size) - pcontext->offset : 0;
-	writeout_size = std::min(static_cast<uint64_t>(writeout_size), rem_to_eof);
+	auto rem_to_eof = pcontext->offset < body.size() ?
+	                  body.size() - pcontext->offset : 0;
+	writeout_size = std::min(static_cast<size_t>(writeout_size), rem_to_eof);
 	if (item.mblk == nullptr) {
 		mlog(LV_DEBUG, "%s called without active memory mapping", __func__);
 		mod_cache_put_context(phttp);
 		return FALSE;
 	}
-	if (phttp->stream_out.write(static_cast<const char *>(item.mblk) +
-	    pcontext->offset, writeout_size) != STREAM_WRITE_OK) {
+	if (phttp->stream_out.write(body.data() + pcontext->offset,
+	    writeout_size) != STREAM_WRITE_OK) {
 		mod_cache_put_context(phttp);
 		return false;
 	}
+	g_bytes_out += writeout_size;
+	if (pcontext->enc != ENC_IDENTITY)
+		g_bytes_out_cmp += writeout_size;
 	pcontext->offset += writeout_size;
 	if (pcontext->offset == pcontext->until) {
 		if (pcontext->range.size() >= 2) {
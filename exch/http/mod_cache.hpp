@@ -13,3 +13,4 @@ void mod_cache_put_context(HTTP_CONTEXT *phttp);
 BOOL mod_cache_check_responded(HTTP_CONTEXT *phttp);
 BOOL mod_cache_read_response(HTTP_CONTEXT *phttp);
 extern bool mod_cache_discard_content(http_context *);
+extern void mod_cache_report();
@@ -367,7 +367,7 @@ static std::unique_ptr<MhEmsmdbPlugin> plugin;
  */
 static BOOL hpm_mh_emsmdb(int reason, void **ppdata)
 {
-	HPM_INTERFACE interface;
+	HPM_INTERFACE interface{};
 
 	switch (reason) {
 	case PLUGIN_INIT: {
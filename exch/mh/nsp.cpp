@@ -317,7 +317,7 @@ static http_status nsp_proc(int, const void*, uint64_t);
  */
 static BOOL hpm_mh_nsp(int reason, void **plugdata)
 {
-	HPM_INTERFACE interface;
+	HPM_INTERFACE interface{};
 
 	switch (reason) {
 	case PLUGIN_INIT: {
@@ -131,6 +131,8 @@ struct IDB_ITEM {
 	uint32_t sub_id = 0;
 	std::atomic<int> reference{0};
 	std::timed_mutex lock;
+	/* folders.sync_cn is available (schema EM-2) */
+	bool b_sync_cn = false;
 };
 
 struct idb_item_del {
@@ -1546,16 +1548,191 @@ static void mail_engine_sync_message(IDB_ITEM *pidb,
 			NULL, message_flags, received_time, mod_time);
 }
 
-static BOOL mail_engine_sync_contents(IDB_ITEM *pidb, uint64_t folder_id) try
+/*
+ * Bring the messages of one folder up to date by asking exmdb only for
+ * what changed after change number @sync_cn (the same query ICS uses). Read
+ * states are allocated from the same CN counter, so one watermark covers
+ * both. Returns false if the caller should do the full comparison instead.
+ */
+static bool mail_engine_sync_delta(IDB_ITEM *pidb, uint64_t folder_id,
+    uint64_t sync_cn, uint32_t *puidnext, uint64_t *pnew_cn) try
+{
+	auto dir = common_util_get_maildir();
+	auto given = idset::create(true, REPL_TYPE_ID);
+	auto seen  = idset::create(true, REPL_TYPE_ID);
+	if (given == nullptr || seen == nullptr ||
+	    !seen->append_range(1, 1, sync_cn))
+		return false;
+	char sql_string[256];
+	snprintf(sql_string, std::size(sql_string), "SELECT message_id FROM "
+	         "messages WHERE folder_id=%llu ORDER BY message_id", LLU{folder_id});
+	auto pstmt = gx_sql_prep(pidb->psqlite, sql_string);
+	if (pstmt == nullptr)
+		return false;
+	size_t given_count = 0;
+	uint64_t lo = 0, hi = 0;
+	while (pstmt.step() == SQLITE_ROW) {
+		uint64_t mid = sqlite3_column_int64(pstmt, 0);
+		++given_count;
+		if (lo != 0 && mid == hi + 1) {
+			hi = mid;
+			continue;
+		}
+		if (lo != 0 && !given->append_range(1, lo, hi))
+			return false;
+		lo = hi = mid;
+	}
+	pstmt.finalize();
+	if (lo != 0 && !given->append_range(1, lo, hi))
+		return false;
+
+	uint32_t fai_count = 0, normal_count = 0;
+	uint64_t fai_total = 0, normal_total = 0, last_cn = 0, last_readcn = 0;
+	EID_ARRAY updated{}, chg{}, given_mids{}, deleted{}, nolonger{}, reads{}, unreads{};
+	if (!exmdb_client::get_content_sync(dir, rop_util_make_eid_ex(1, folder_id),
+	    pidb->username.c_str(), given.get(), seen.get(), nullptr, seen.get(),
+	    CP_ACP, nullptr, false, &fai_count, &fai_total, &normal_count,
+	    &normal_total, &updated, &chg, &last_cn, &given_mids, &deleted,
+	    &nolonger, &reads, &unreads, &last_readcn))
+		return false;
+	/*
+	 * Past this many messages, fetching them one by one costs more than
+	 * the single content table query of the full comparison.
+	 */
+	if (chg.count > 1024 && chg.count > given_count / 8)
+		return false;
+	mlog(LV_DEBUG, "sync_contents %s fld %llu: since cn %llu: %u changed, "
+	        "%u deleted, %u read states", dir, LLU{folder_id}, LLU{sync_cn},
+	        chg.count, deleted.count + nolonger.count, reads.count + unreads.count);
+
+	auto stm_del = gx_sql_prep(pidb->psqlite, "DELETE FROM messages WHERE message_id=?");
+	if (stm_del == nullptr)
+		return false;
+	for (const auto *set : {&deleted, &nolonger}) {
+		for (size_t i = 0; i < set->count; ++i) {
+			sqlite3_reset(stm_del);
+			stm_del.bind_int64(1, rop_util_get_gc_value(set->pids[i]));
+			if (stm_del.step() != SQLITE_DONE)
+				return false;
+		}
+	}
+	stm_del.finalize();
+
+	auto stm_read = gx_sql_prep(pidb->psqlite, "UPDATE messages SET read=? WHERE message_id=?");
+	if (stm_read == nullptr)
+		return false;
+	for (auto read : {true, false}) {
+		const auto &set = read ? reads : unreads;
+		for (size_t i = 0; i < set.count; ++i) {
+			sqlite3_reset(stm_read);
+			stm_read.bind_int64(1, read);
+			stm_read.bind_int64(2, rop_util_get_gc_value(set.pids[i]));
+			if (stm_read.step() != SQLITE_DONE)
+				return false;
+		}
+	}
+	stm_read.finalize();
+
+	auto pstmt1 = gx_sql_prep(pidb->psqlite, "SELECT message_id, mid_string,"
+	              " mod_time, unsent, read FROM messages WHERE message_id=?");
+	if (pstmt1 == nullptr)
+		return false;
+	snprintf(sql_string, std::size(sql_string), "INSERT INTO messages (message_id, "
+		"folder_id, mid_string, mod_time, uid, unsent, read, subject,"
+		" sender, rcpt, size, received) VALUES (?, %llu, ?, ?, ?, ?, "
+		"?, ?, ?, ?, ?, ?)", LLU{folder_id});
+	auto pstmt2 = gx_sql_prep(pidb->psqlite, sql_string);
+	if (pstmt2 == nullptr)
+		return false;
+	auto stm_upd_msg = gx_sql_prep(pidb->psqlite, "UPDATE messages"
+	              " SET unsent=?, read=? WHERE message_id=?");
+	if (stm_upd_msg == nullptr)
+		return false;
+	static constexpr uint32_t tags_0[] = {
+		PR_MESSAGE_FLAGS, PR_LAST_MODIFICATION_TIME,
+		PR_MESSAGE_DELIVERY_TIME, PidTagMidString,
+	};
+	static constexpr PROPTAG_ARRAY tags_1 = {std::size(tags_0), deconst(tags_0)};
+	for (size_t i = 0; i < chg.count; ++i) {
+		TPROPVAL_ARRAY props{};
+		if (!exmdb_client::get_message_properties(dir, nullptr, CP_ACP,
+		    chg.pids[i], &tags_1, &props))
+			return false;
+		auto flags = props.get<uint32_t>(PR_MESSAGE_FLAGS);
+		if (flags == nullptr)
+			continue;
+		*flags &= ~(MSGFLAG_HASATTACH | MSGFLAG_FROMME | MSGFLAG_ASSOCIATED |
+		          MSGFLAG_RN_PENDING | MSGFLAG_NRN_PENDING);
+		auto mod_time  = props.get<const uint64_t>(PR_LAST_MODIFICATION_TIME);
+		auto recv_time = props.get<const uint64_t>(PR_MESSAGE_DELIVERY_TIME);
+		auto midstr    = props.get<const char>(PidTagMidString);
+		auto message_id = rop_util_get_gc_value(chg.pids[i]);
+		sqlite3_reset(pstmt1);
+		sqlite3_bind_int64(pstmt1, 1, message_id);
+		if (pstmt1.step() != SQLITE_ROW)
+			mail_engine_insert_message(pstmt2, puidnext, message_id,
+				midstr, *flags, recv_time != nullptr ? *recv_time : 0,
+				mod_time != nullptr ? *mod_time : 0);
+		else
+			mail_engine_sync_message(pidb, pstmt2, stm_upd_msg,
+				puidnext, message_id,
+				recv_time != nullptr ? *recv_time : 0, midstr,
+				pstmt1.col_text(1),
+				mod_time != nullptr ? *mod_time : 0,
+				sqlite3_column_int64(pstmt1, 2), *flags,
+				sqlite3_column_int64(pstmt1, 3),
+				sqlite3_column_int64(pstmt1, 4));
+	}
+	*pnew_cn = std::max({sync_cn, rop_util_get_gc_value(last_cn),
+	           rop_util_get_gc_value(last_readcn)});
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2411: ENOMEM");
+	return false;
+}
+
+static BOOL mail_engine_sync_contents(IDB_ITEM *pidb, uint64_t folder_id,
+    bool force_full = false) try
 {
 	const char *dir;
 	TARRAY_SET rows;
 	sqlite3 *psqlite;
 	uint32_t uidnext;
 	uint32_t uidnext1;
+	uint64_t sync_cn = 0, new_cn = 0;
 	char sql_string[1024];
 	
 	dir = common_util_get_maildir();
+	snprintf(sql_string, std::size(sql_string), "SELECT uidnext%s FROM"
+	          " folders WHERE folder_id=%llu",
+	          pidb->b_sync_cn ? ", sync_cn" : "", LLU{folder_id});
+	auto pstmt = gx_sql_prep(pidb->psqlite, sql_string);
+	if (pstmt == nullptr)
+		return FALSE;
+	if (pstmt.step() != SQLITE_ROW)
+		return TRUE;
+	uidnext = sqlite3_column_int64(pstmt, 0);
+	if (pidb->b_sync_cn)
+		sync_cn = sqlite3_column_int64(pstmt, 1);
+	pstmt.finalize();
+	uidnext1 = uidnext;
+	if (!force_full && sync_cn != 0) {
+		if (mail_engine_sync_delta(pidb, folder_id, sync_cn, &uidnext, &new_cn)) {
+			snprintf(sql_string, std::size(sql_string), "UPDATE folders SET "
+			         "uidnext=%u, sync_cn=%llu WHERE folder_id=%llu",
+			         uidnext, LLU{new_cn}, LLU{folder_id});
+			if (gx_sql_exec(pidb->psqlite, sql_string) != SQLITE_OK)
+				return false;
+			if (uidnext != uidnext1 || new_cn != sync_cn) {
+				snprintf(sql_string, std::size(sql_string), "UPDATE folders SET sort_field=%d "
+				        "WHERE folder_id=%llu", FIELD_NONE, LLU{folder_id});
+				gx_sql_exec(pidb->psqlite, sql_string);
+			}
+			return TRUE;
+		}
+		/* Incremental pass may have inserted some messages already */
+		uidnext1 = 0;
+	}
 	mlog(LV_NOTICE, "Running sync_contents for %s, folder %llu",
 	        dir, LLU{folder_id});
 
@@ -1568,7 +1745,7 @@ static BOOL mail_engine_sync_contents(IDB_ITEM *pidb, uint64_t folder_id) try
 		auto cl_0 = make_scope_exit([&]() { exmdb_client::unload_table(dir, table_id); });
 		static constexpr uint32_t proptags_0[] = {
 			PidTagMid, PR_MESSAGE_FLAGS, PR_LAST_MODIFICATION_TIME,
-			PR_MESSAGE_DELIVERY_TIME, PidTagMidString,
+			PR_MESSAGE_DELIVERY_TIME, PidTagMidString, PidTagChangeNumber,
 		};
 		static constexpr PROPTAG_ARRAY proptags_1 = {std::size(proptags_0), deconst(proptags_0)};
 		if (!exmdb_client::query_table(dir, nullptr, CP_ACP, table_id,
@@ -1576,16 +1753,6 @@ static BOOL mail_engine_sync_contents(IDB_ITEM *pidb, uint64_t folder_id) try
 			return false;
 	}
 
-	snprintf(sql_string, std::size(sql_string), "SELECT uidnext FROM"
-	          " folders WHERE folder_id=%llu", LLU{folder_id});
-	auto pstmt = gx_sql_prep(pidb->psqlite, sql_string);
-	if (pstmt == nullptr)
-		return FALSE;
-	if (pstmt.step() != SQLITE_ROW)
-		return TRUE;
-	uidnext = sqlite3_column_int64(pstmt, 0);
-	pstmt.finalize();
-	uidnext1 = uidnext;
 	if (sqlite3_open_v2(":memory:", &psqlite, SQLITE_OPEN_READWRITE |
 	    SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK)
 		return FALSE;
@@ -1620,6 +1787,9 @@ static BOOL mail_engine_sync_contents(IDB_ITEM *pidb, uint64_t folder_id) try
 		auto mod_time = rows.pparray[i]->get<uint64_t>(PR_LAST_MODIFICATION_TIME);
 		auto recv_time = rows.pparray[i]->get<uint64_t>(PR_MESSAGE_DELIVERY_TIME);
 		auto midstr = rows.pparray[i]->get<const char>(PidTagMidString);
+		auto cn = rows.pparray[i]->get<const uint64_t>(PidTagChangeNumber);
+		if (cn != nullptr)
+			new_cn = std::max(new_cn, rop_util_get_gc_value(*cn));
 		sqlite3_reset(pstmt);
 		sqlite3_bind_int64(pstmt, 1, message_id);
 		if (midstr == nullptr)
@@ -1735,6 +1905,12 @@ static BOOL mail_engine_sync_contents(IDB_ITEM *pidb, uint64_t folder_id) try
 		if (gx_sql_exec(pidb->psqlite, sql_string) != SQLITE_OK)
 			return FALSE;
 	}
+	if (pidb->b_sync_cn) {
+		snprintf(sql_string, std::size(sql_string), "UPDATE folders SET sync_cn=%llu "
+		        "WHERE folder_id=%llu", LLU{new_cn}, LLU{folder_id});
+		if (gx_sql_exec(pidb->psqlite, sql_string) != SQLITE_OK)
+			return FALSE;
+	}
 	}
 	snprintf(sql_string, std::size(sql_string), "UPDATE folders SET sort_field=%d "
 	        "WHERE folder_id=%llu", FIELD_NONE, LLU{folder_id});
@@ -1993,7 +2169,12 @@ static BOOL mail_engine_sync_mailbox(IDB_ITEM *pidb,
 				continue;	
 			b_new = FALSE;
 		}
-		if (!mail_engine_sync_contents(pidb, folder_id))
+		/*
+		 * A commit time going backwards means the store was restored, and
+		 * change numbers from before may no longer mean the same.
+		 */
+		if (!mail_engine_sync_contents(pidb, folder_id, force_resync ||
+		    (!b_new && gx_sql_col_uint64(pstmt1, 2) > commit_max)))
 			return false;
 		if (!b_new) {
 			snprintf(sql_string, std::size(sql_string), "UPDATE folders SET commit_max=%llu"
@@ -2132,6 +2313,7 @@ static IDB_REF mail_engine_get_idb(const char *path, bool force_resync = false)
 			pidb->psqlite = nullptr;
 			return {};
 		}
+		pidb->b_sync_cn = dbop_sqlite_schemaversion(pidb->psqlite, sqlite_kind::midb) >= 2;
 		gx_sql_exec(pidb->psqlite, "PRAGMA foreign_keys=ON");
 		gx_sql_exec(pidb->psqlite, "DELETE FROM mapping");
 		/* Delete obsolete field (old midb versions cannot use the db then however) */
@@ -3905,7 +4087,7 @@ static int mail_engine_xrsyf(int argc, char **argv, int sockd)
 	auto idb = mail_engine_get_idb(argv[1]);
 	if (idb == nullptr)
 		return MIDB_E_HASHTABLE_FULL;
-	if (!mail_engine_sync_contents(idb.get(), strtoul(argv[2], nullptr, 0)))
+	if (!mail_engine_sync_contents(idb.get(), strtoul(argv[2], nullptr, 0), true))
 		return cmd_write(sockd, "FALSE 1\r\n");
 	else
 		return cmd_write(sockd, "TRUE 1\r\n");
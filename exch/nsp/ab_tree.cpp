@@ -1154,6 +1154,18 @@ ec_error_t ab_tree_fetchprop(const SIMPLE_TREE_NODE *node, cpid_t codepage,
 	return ecNotFound;
 }
 
+/* Raw (UTF-8 / decimal) form of a user-defined property, or nullptr */
+const std::string *ab_tree_get_propval(const tree_node *node, uint32_t proptag)
+{
+	auto node_type = ab_tree_get_node_type(node);
+	if (node_type != abnode_type::user && node_type != abnode_type::mlist)
+		return nullptr;
+	auto xab = containerof(node, AB_NODE, stree);
+	const auto &obj = *static_cast<const sql_user *>(xab->d_info);
+	auto it = obj.propvals.find(proptag);
+	return it != obj.propvals.cend() ? &it->second : nullptr;
+}
+
 void ab_tree_invalidate_cache()
 {
 	mlog(LV_NOTICE, "nsp: Invalidating AB caches");
@@ -125,6 +125,7 @@ extern void ab_tree_get_server_dn(const SIMPLE_TREE_NODE *, char *dn, int len);
 int ab_tree_get_guid_base_id(GUID guid);
 extern ec_error_t ab_tree_proplist(const tree_node *, std::vector<uint32_t> &);
 extern ec_error_t ab_tree_fetchprop(const SIMPLE_TREE_NODE *, cpid_t, unsigned int proptag, PROPERTY_VALUE *);
+extern const std::string *ab_tree_get_propval(const tree_node *, uint32_t proptag);
 extern void ab_tree_invalidate_cache();
 extern uint32_t ab_tree_get_dtyp(const tree_node *);
 extern std::optional<uint32_t> ab_tree_get_dtypx(const tree_node *);
@@ -105,6 +105,7 @@ static BOOL proc_exchange_nsp(int reason, void **ppdata) try
 		    !regsvr(nsp_interface_get_templateinfo) ||
 		    !regsvr(nsp_interface_mod_linkatt) ||
 		    !regsvr(nsp_interface_mod_props) ||
+		    !regsvr(nsp_interface_oab_records) ||
 		    !regsvr(nsp_interface_query_columns) ||
 		    !regsvr(nsp_interface_query_rows) ||
 		    !regsvr(nsp_interface_resolve_namesw) ||
@@ -24,6 +24,7 @@
 #include <gromox/list_file.hpp>
 #include <gromox/mapidefs.h>
 #include <gromox/mysql_adaptor.hpp>
+#include <gromox/oxoab.hpp>
 #include <gromox/oxoabkt.hpp>
 #include <gromox/paths.h>
 #include <gromox/proc_common.h>
@@ -2488,3 +2489,94 @@ int nsp_interface_get_templateinfo(NSPI_HANDLE handle, uint32_t flags,
 	*ppdata = row;
 	return 0;
 }
+
+/**
+ * Produce the offline address book records (MS-OXOAB) for the GAL that
+ * @username sees. Records are ordered by DN so that consecutive revisions
+ * line up well for differential files.
+ */
+BOOL nsp_interface_oab_records(const char *username, int *pbase_id,
+    std::vector<oab_record> *precs) try
+{
+	auto pdomain = strchr(username, '@');
+	if (pdomain == nullptr)
+		return false;
+	unsigned int domain_id = 0, org_id = 0;
+	if (!get_domain_ids(pdomain + 1, &domain_id, &org_id))
+		return false;
+	*pbase_id = org_id == 0 ? -domain_id : org_id;
+	auto pbase = ab_tree_get_base(*pbase_id);
+	if (pbase == nullptr)
+		return false;
+	precs->clear();
+	char buf[1280];
+	auto add_str = [](oab_record &r, uint32_t tag, const char *v) {
+		if (v != nullptr && *v != '\0')
+			r.push_back(oab_propval{tag, 0, {v}});
+	};
+	auto add_num = [](oab_record &r, uint32_t tag, uint32_t v) {
+		r.push_back(oab_propval{tag, v, {}});
+	};
+	static constexpr uint32_t copy_tags[] = {
+		PR_GIVEN_NAME, PR_SURNAME, PR_TITLE, PR_ASSISTANT,
+		PR_BUSINESS_TELEPHONE_NUMBER, PR_MOBILE_TELEPHONE_NUMBER,
+		PR_HOME_TELEPHONE_NUMBER,
+	};
+	for (auto pnode : pbase->gal_list) {
+		auto node_type = ab_tree_get_node_type(pnode);
+		if (node_type != abnode_type::user && node_type != abnode_type::mlist)
+			continue;
+		if (ab_tree_hidden(pnode) & AB_HIDE_FROM_AL)
+			continue;
+		oab_record r;
+		if (!ab_tree_node_to_dn(pnode, buf, std::size(buf)))
+			continue;
+		add_str(r, PR_EMAIL_ADDRESS, buf);
+		ab_tree_get_display_name(pnode, CP_ACP, buf, std::size(buf));
+		add_str(r, PR_DISPLAY_NAME, buf);
+		if (node_type == abnode_type::mlist)
+			ab_tree_get_mlist_info(pnode, buf, nullptr, nullptr);
+		else
+			gx_strlcpy(buf, znul(ab_tree_get_user_info(pnode, USER_MAIL_ADDRESS)), std::size(buf));
+		add_str(r, PR_SMTP_ADDRESS, buf);
+		add_str(r, PR_ACCOUNT, buf);
+		if (*buf != '\0') {
+			oab_propval pv{PR_EMS_AB_PROXY_ADDRESSES, 0, {"SMTP:"s + buf}};
+			for (const auto &a : ab_tree_get_object_aliases(pnode))
+				pv.str.push_back("smtp:" + a);
+			r.push_back(std::move(pv));
+		}
+		add_num(r, PR_OBJECT_TYPE, static_cast<uint32_t>(node_type == abnode_type::mlist ?
+			MAPI_DISTLIST : MAPI_MAILUSER));
+		add_num(r, PR_DISPLAY_TYPE, ab_tree_get_dtyp(pnode));
+		auto dtypx = ab_tree_get_dtypx(pnode);
+		add_num(r, PR_DISPLAY_TYPE_EX, dtypx.has_value() ? *dtypx : DT_MAILUSER);
+		ab_tree_get_company_info(pnode, buf, nullptr);
+		add_str(r, PR_COMPANY_NAME, buf);
+		ab_tree_get_company_info(pnode, nullptr, buf);
+		add_str(r, PR_OFFICE_LOCATION, buf);
+		ab_tree_get_department_name(pnode, buf);
+		add_str(r, PR_DEPARTMENT_NAME, buf);
+		for (auto tag : copy_tags) {
+			auto v = ab_tree_get_propval(pnode, tag);
+			if (v != nullptr)
+				add_str(r, tag, v->c_str());
+		}
+		precs->push_back(std::move(r));
+	}
+	/*
+	 * DNs compare case-insensitively, so break ties bytewise; anything
+	 * still equal keeps its gal_list order. Either way, the same GAL
+	 * always yields the same record order.
+	 */
+	std::stable_sort(precs->begin(), precs->end(),
+		[](const oab_record &a, const oab_record &b) {
+			auto &x = a[0].str[0], &y = b[0].str[0];
+			auto c = strcasecmp(x.c_str(), y.c_str());
+			return c != 0 ? c < 0 : x < y;
+		});
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2418: ENOMEM");
+	return false;
+}
@@ -1,4 +1,6 @@
 #pragma once
+#include <vector>
+#include <gromox/oxoab.hpp>
 #include <gromox/simple_tree.hpp>
 #include "nsp_types.h"
 
@@ -24,6 +26,7 @@ int nsp_interface_query_columns(NSPI_HANDLE handle, uint32_t reserved,
 	uint32_t flags, LPROPTAG_ARRAY **ppcolumns);
 extern int nsp_interface_resolve_names(NSPI_HANDLE, uint32_t reserved, const STAT *, LPROPTAG_ARRAY *&, const STRINGS_ARRAY *, MID_ARRAY **, NSP_ROWSET **);
 extern int nsp_interface_resolve_namesw(NSPI_HANDLE, uint32_t reserved, const STAT *, LPROPTAG_ARRAY *&, const STRINGS_ARRAY *, MID_ARRAY **, NSP_ROWSET **);
+extern BOOL nsp_interface_oab_records(const char *username, int *base_id, std::vector<gromox::oab_record> *);
 /* clean NSPI_HANDLE by system, not operation of interface */
 void nsp_interface_unbind_rpc_handle(uint64_t hrpc);
 
@@ -1,35 +1,157 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
-// SPDX-FileCopyrightText: 2022 grommunio GmbH
+// SPDX-FileCopyrightText: 2022-2024 grommunio GmbH
 // This file is part of Gromox.
+/*
+ * Offline address book distribution (MS-OXWOAB). For every address book base
+ * (organization or lone domain), a version 4 full details file is generated
+ * from exchange_nsp's view of the GAL and kept under the state directory,
+ * together with binary patches leading up to it from earlier revisions.
+ * Revisions are only produced when the content actually changed.
+ *
+ * Generation runs on a worker thread; requests are answered from the last
+ * completed revision in the meantime.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
 #include <cstring>
+#include <ctime>
+#include <deque>
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <fmt/core.h>
+#include <libHX/io.h>
+#include <libHX/string.h>
+#include <openssl/evp.h>
+#include <sys/stat.h>
+#include <gromox/config_file.hpp>
 #include <gromox/defs.h>
+#include <gromox/fileio.h>
 #include <gromox/hpm_common.h>
+#include <gromox/mapidefs.h>
+#include <gromox/mapitags.hpp>
+#include <gromox/oxoab.hpp>
 
 using namespace std::string_literals;
 using namespace gromox;
 
 namespace {
 
+/**
+ * Per-base generation state, protected by OabPlugin::m_lock.
+ *
+ * @username:	a user who sees this base (for exchange_nsp)
+ * @manifest:	oab.xml for the last completed revision; empty if none yet
+ * @next_check:	when to queue the next refresh; sooner after a failed one
+ * @seq:	last completed revision
+ * @queued:	queued for, or undergoing, a refresh
+ */
+struct oab_base {
+	std::string username, manifest;
+	time_t next_check = 0;
+	uint32_t seq = 0;
+	bool loaded = false, queued = false;
+};
+
 class OabPlugin {
 	public:
 	OabPlugin();
+	~OabPlugin();
 	http_status proc(int, const void*, uint64_t);
+	int retr(int);
+	void term(int);
 	static BOOL preproc(int);
+
+	private:
+	http_status send_manifest(int ctx_id, const std::string &body);
+	http_status send_file(int ctx_id, const std::string &guid, const char *name);
+	bool refresh(const std::string &username, int base_id, const std::string &guid, uint32_t &seq);
+	void worker();
+
+	std::mutex m_lock;
+	std::condition_variable m_cond;
+	std::map<int, oab_base> m_bases;
+	std::deque<int> m_queue;
+	bool m_stop = false;
+	std::vector<int> m_files; /* per context: file being sent, or -1 */
+	std::thread m_thread;
 };
 
 }
 
 DECLARE_HPM_API();
 
-static constexpr char
-	response[] = "<?xml version=\"1.0\" encoding=\"utf-8\"?><OAB></OAB>",
-	header[] =
-		"HTTP/1.1 200 OK\r\n"
-		"Content-Type: text/xml\r\n"
-		"Content-Length: 49\r\n\r\n";
+/* MS-OXOAB §2.9.1.2: header record properties, not in mapitags.hpp due to collisions */
+enum : uint32_t {
+	PR_OAB_NAME = PROP_TAG(PT_UNICODE, 0x6800),
+	PR_OAB_SEQUENCE = PROP_TAG(PT_LONG, 0x6801),
+	PR_OAB_CONTAINER_GUID = PROP_TAG(PT_STRING8, 0x6802),
+	PR_OAB_DN = PROP_TAG(PT_STRING8, 0x6804),
+};
 
-OabPlugin::OabPlugin(){}
+static const std::vector<oab_attr> oab_hdr_atts = {
+	{PR_OAB_NAME, 0}, {PR_OAB_DN, 0}, {PR_OAB_SEQUENCE, 0},
+	{PR_OAB_CONTAINER_GUID, 0},
+};
+
+static const std::vector<oab_attr> oab_rec_atts = {
+	{PR_EMAIL_ADDRESS, 0},
+	{PR_DISPLAY_NAME, OAB_ANR | OAB_INDEX},
+	{PR_SMTP_ADDRESS, OAB_ANR | OAB_INDEX},
+	{PR_ACCOUNT, OAB_ANR | OAB_INDEX},
+	{PR_EMS_AB_PROXY_ADDRESSES, OAB_ANR},
+	{PR_OBJECT_TYPE, 0},
+	{PR_DISPLAY_TYPE, 0},
+	{PR_DISPLAY_TYPE_EX, 0},
+	{PR_COMPANY_NAME, 0},
+	{PR_OFFICE_LOCATION, OAB_ANR},
+	{PR_DEPARTMENT_NAME, 0},
+	{PR_GIVEN_NAME, OAB_ANR},
+	{PR_SURNAME, OAB_ANR},
+	{PR_TITLE, 0},
+	{PR_ASSISTANT, 0},
+	{PR_BUSINESS_TELEPHONE_NUMBER, 0},
+	{PR_MOBILE_TELEPHONE_NUMBER, 0},
+	{PR_HOME_TELEPHONE_NUMBER, 0},
+};
+
+static constexpr cfg_directive oab_cfg_defaults[] = {
+	{"oab_cache_interval", "1h", CFG_TIME, "1min", "1year"},
+	{"oab_diff_versions", "7", 0, "0", "100"},
+	CFG_TABLE_END,
+};
+
+static BOOL (*get_domain_ids)(const char *, unsigned int *, unsigned int *);
+static BOOL (*nsp_interface_oab_records)(const char *, int *, std::vector<oab_record> *);
+static time_t g_oab_interval;
+static unsigned int g_oab_diff_versions;
+static std::string g_oab_dir;
+
+OabPlugin::OabPlugin() : m_files(get_context_num(), -1)
+{
+	m_thread = std::thread([this]() { worker(); });
+}
+
+OabPlugin::~OabPlugin()
+{
+	std::unique_lock hold(m_lock);
+	m_stop = true;
+	hold.unlock();
+	m_cond.notify_one();
+	if (m_thread.joinable())
+		m_thread.join();
+	for (auto &fd : m_files)
+		if (fd >= 0)
+			close(fd);
+}
 
 /**
  * @brief      Preprocess request
@@ -44,11 +166,307 @@ BOOL OabPlugin::preproc(int ctx_id)
 	return strncasecmp(req->f_request_uri.c_str(), "/OAB", 4) == 0 ? TRUE : false;
 }
 
+static std::string oab_slurp(const std::string &path)
+{
+	std::string data;
+	wrapfd fd = open(path.c_str(), O_RDONLY);
+	if (fd.get() < 0)
+		return data;
+	char buf[65536];
+	ssize_t have_read;
+	while ((have_read = read(fd.get(), buf, sizeof(buf))) > 0)
+		data.append(buf, have_read);
+	return data;
+}
+
+static bool oab_store(const std::string &dir, const std::string &name,
+    std::string_view data)
+{
+	gromox::tmpfile tf;
+	auto fd = tf.open_linkable(dir.c_str(), O_WRONLY, FMODE_PUBLIC);
+	if (fd < 0) {
+		mlog(LV_ERR, "E-2419: oab: cannot create file in %s: %s",
+			dir.c_str(), strerror(-fd));
+		return false;
+	}
+	auto wr = HXio_fullwrite(fd, data.data(), data.size());
+	if (wr < 0 || static_cast<size_t>(wr) != data.size()) {
+		mlog(LV_ERR, "E-2420: oab: write %s/%s: %s",
+			dir.c_str(), name.c_str(), strerror(errno));
+		return false;
+	}
+	auto path = dir + "/" + name;
+	auto err = tf.link_to(path.c_str());
+	if (err != 0) {
+		mlog(LV_ERR, "E-2380: oab: link %s: %s", path.c_str(), strerror(err));
+		return false;
+	}
+	return true;
+}
+
+static std::string oab_sha1(std::string_view data)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen = 0;
+	if (EVP_Digest(data.data(), data.size(), md, &mdlen, EVP_sha1(), nullptr) <= 0)
+		return {};
+	std::string out;
+	for (unsigned int i = 0; i < mdlen; ++i)
+		out += fmt::format("{:02x}", md[i]);
+	return out;
+}
+
+static std::string oab_full_name(const std::string &guid, uint32_t seq)
+{
+	return guid + "-data-" + std::to_string(seq) + ".lzx";
+}
+
+static std::string oab_diff_name(const std::string &guid, uint32_t seq)
+{
+	return guid + "-binpatch-" + std::to_string(seq) + ".lzx";
+}
+
+static std::string oab_guid(int base_id)
+{
+	return fmt::format("{:08x}-6f61-6200-0000-000000000000",
+	       static_cast<uint32_t>(base_id));
+}
+
+/* Pick up the newest revision left by a previous run */
+static uint32_t oab_load(const std::string &guid)
+{
+	auto dir = g_oab_dir + "/" + guid;
+	if (mkdir(dir.c_str(), FMODE_PUBLIC | S_IXUSR | S_IXGRP | S_IXOTH) != 0 &&
+	    errno != EEXIST) {
+		mlog(LV_ERR, "E-2381: oab: mkdir %s: %s", dir.c_str(), strerror(errno));
+		return 0;
+	}
+	return strtoul(oab_slurp(dir + "/seq").c_str(), nullptr, 0);
+}
+
+/**
+ * Compose oab.xml for revision @seq. This reads (and hashes) every file it
+ * lists, so it is only done once per refresh.
+ */
+static std::string oab_manifest(const std::string &guid, uint32_t seq)
+{
+	auto dir = g_oab_dir + "/" + guid;
+	auto entry = [&](const char *elem, uint32_t s, const std::string &name,
+	             uint64_t usize) {
+		auto data = oab_slurp(dir + "/" + name);
+		if (data.size() < 20)
+			return std::string();
+		if (usize == 0) {
+			/* patches: ulTargetSize of PATCH_HDR */
+			auto p = reinterpret_cast<const uint8_t *>(data.data());
+			usize = p[16] | (p[17] << 8) | (p[18] << 16) | (static_cast<uint32_t>(p[19]) << 24);
+		}
+		return fmt::format("<{} seq=\"{}\" ver=\"32\" size=\"{}\" uncompressedsize=\"{}\" SHA=\"{}\">{}</{}>\r\n",
+		       elem, s, data.size(), usize, oab_sha1(data), name, elem);
+	};
+	std::string body = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n<OAB>\r\n"
+		"<OAL id=\"" + guid + "\" dn=\"/\" name=\"\\Global Address List\">\r\n";
+	struct stat sb;
+	if (stat((dir + "/" + std::to_string(seq) + ".oab").c_str(), &sb) != 0)
+		return {};
+	auto full = entry("Full", seq, oab_full_name(guid, seq), sb.st_size);
+	if (full.empty())
+		return {};
+	body += std::move(full);
+	/* Older patches are useless once one in the chain is missing */
+	for (uint32_t s = seq; s > 1 && seq - s < g_oab_diff_versions; --s) {
+		auto e = entry("Diff", s, oab_diff_name(guid, s), 0);
+		if (e.empty())
+			break;
+		body += std::move(e);
+	}
+	body += "</OAL>\r\n</OAB>\r\n";
+	return body;
+}
+
+/**
+ * Regenerate the full details file of a base, and emit a new revision
+ * (plus patch) when the GAL changed. Runs on the worker thread without
+ * m_lock held; @seq is the last completed revision, and is advanced when
+ * a new one was made.
+ *
+ * Returns false if the address book could not be examined or the files
+ * not be written.
+ */
+bool OabPlugin::refresh(const std::string &username, int base_id,
+    const std::string &guid, uint32_t &seq) try
+{
+	auto dir = g_oab_dir + "/" + guid;
+	std::vector<oab_record> recs;
+	int rbase = 0;
+	if (!nsp_interface_oab_records(username.c_str(), &rbase, &recs)) {
+		mlog(LV_ERR, "E-2384: oab: could not obtain the GAL of base %d (as %s)",
+			base_id, username.c_str());
+		return false;
+	} else if (rbase != base_id) {
+		mlog(LV_ERR, "E-2385: oab: GAL for %s belongs to base %d, not %d",
+			username.c_str(), rbase, base_id);
+		return false;
+	}
+	auto make_hdr = [&](uint32_t s) {
+		return oab_record{
+			{PR_OAB_NAME, 0, {"\\Global Address List"}},
+			{PR_OAB_DN, 0, {"/"}},
+			{PR_OAB_SEQUENCE, s, {}},
+			{PR_OAB_CONTAINER_GUID, 0, {guid}},
+		};
+	};
+	std::string prev;
+	if (seq != 0) {
+		prev = oab_slurp(dir + "/" + std::to_string(seq) + ".oab");
+		if (!prev.empty() &&
+		    oab_write_v4(oab_hdr_atts, make_hdr(seq), oab_rec_atts, recs) == prev)
+			return true;
+	}
+	auto nseq = seq + 1;
+	auto cur = oab_write_v4(oab_hdr_atts, make_hdr(nseq), oab_rec_atts, recs);
+	auto full = oab_compress(cur);
+	if (!oab_store(dir, std::to_string(nseq) + ".oab", cur) ||
+	    !oab_store(dir, oab_full_name(guid, nseq), full))
+		return false;
+	if (!prev.empty() && g_oab_diff_versions > 0) {
+		/*
+		 * A patch that saves less than half of the full download is
+		 * not worth the client's trouble; without it, the manifest
+		 * chain ends and clients fetch the full file instead.
+		 */
+		auto patch = oab_make_patch(prev, cur);
+		if (patch.size() < full.size() / 2 &&
+		    !oab_store(dir, oab_diff_name(guid, nseq), patch))
+			return false;
+	}
+	if (!oab_store(dir, "seq", std::to_string(nseq)))
+		return false;
+	mlog(LV_INFO, "oab: generated revision %u for base %d (%zu records)",
+		nseq, base_id, recs.size());
+	/*
+	 * Drop what the manifest no longer references. The previous full
+	 * file stays for one more round, since clients may just be
+	 * downloading it according to a manifest they got a moment ago.
+	 */
+	if (seq != 0)
+		unlink((dir + "/" + std::to_string(seq) + ".oab").c_str());
+	if (seq > 1)
+		unlink((dir + "/" + oab_full_name(guid, seq - 1)).c_str());
+	if (nseq > g_oab_diff_versions)
+		unlink((dir + "/" + oab_diff_name(guid, nseq - g_oab_diff_versions)).c_str());
+	seq = nseq;
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2382: ENOMEM");
+	return false;
+}
+
+void OabPlugin::worker()
+{
+	std::unique_lock hold(m_lock);
+	while (!m_stop) {
+		if (m_queue.empty()) {
+			m_cond.wait(hold);
+			continue;
+		}
+		auto base_id = m_queue.front();
+		m_queue.pop_front();
+		auto &ob = m_bases[base_id];
+		auto username = ob.username;
+		auto seq = ob.seq;
+		auto loaded = ob.loaded;
+		hold.unlock();
+		auto guid = oab_guid(base_id);
+		if (!loaded)
+			seq = oab_load(guid);
+		auto ok = refresh(username, base_id, guid, seq);
+		std::string manifest;
+		try {
+			if (seq != 0)
+				manifest = oab_manifest(guid, seq);
+		} catch (const std::bad_alloc &) {
+			mlog(LV_ERR, "E-2383: ENOMEM");
+		}
+		hold.lock();
+		/* Retry a failed refresh after a minute rather than a full interval */
+		ob.next_check = time(nullptr) + (ok ? g_oab_interval :
+		                std::min(g_oab_interval, static_cast<time_t>(60)));
+		ob.seq = seq;
+		ob.loaded = true;
+		if (!manifest.empty())
+			ob.manifest = std::move(manifest);
+		ob.queued = false;
+	}
+}
+
+http_status OabPlugin::send_manifest(int ctx_id, const std::string &body)
+{
+	auto head = fmt::format("HTTP/1.1 200 OK\r\n"
+	            "Content-Type: text/xml\r\n"
+	            "Content-Length: {}\r\n\r\n", body.size());
+	auto wr = write_response(ctx_id, head.c_str(), head.size());
+	if (wr != http_status::ok)
+		return wr;
+	return write_response(ctx_id, body.c_str(), body.size());
+}
+
+http_status OabPlugin::send_file(int ctx_id, const std::string &guid,
+    const char *name)
+{
+	if (strncasecmp(name, guid.c_str(), guid.size()) != 0 ||
+	    name[guid.size()] != '-' || strchr(name, '/') != nullptr)
+		return http_status::not_found;
+	auto path = g_oab_dir + "/" + guid + "/" + name;
+	wrapfd fd = open(path.c_str(), O_RDONLY);
+	struct stat sb;
+	if (fd.get() < 0 || fstat(fd.get(), &sb) != 0 || !S_ISREG(sb.st_mode))
+		return http_status::not_found;
+	auto head = fmt::format("HTTP/1.1 200 OK\r\n"
+	            "Content-Type: application/octet-stream\r\n"
+	            "Content-Length: {}\r\n\r\n", sb.st_size);
+	auto wr = write_response(ctx_id, head.c_str(), head.size());
+	if (wr != http_status::ok)
+		return wr;
+	/* The body follows piecewise from retr */
+	m_files[ctx_id] = fd.release();
+	return http_status::ok;
+}
+
+/**
+ * Hand out the next piece of a download started by send_file, once the
+ * previous one has been written to the client.
+ */
+int OabPlugin::retr(int ctx_id)
+{
+	auto fd = m_files[ctx_id];
+	if (fd < 0)
+		return HPM_RETRIEVE_DONE;
+	char buf[65536];
+	auto have_read = read(fd, buf, sizeof(buf));
+	if (have_read <= 0) {
+		close(fd);
+		m_files[ctx_id] = -1;
+		return have_read == 0 ? HPM_RETRIEVE_DONE : HPM_RETRIEVE_ERROR;
+	}
+	if (write_response(ctx_id, buf, have_read) != http_status::ok)
+		return HPM_RETRIEVE_ERROR;
+	return HPM_RETRIEVE_WRITE;
+}
+
+void OabPlugin::term(int ctx_id)
+{
+	if (m_files[ctx_id] < 0)
+		return;
+	close(m_files[ctx_id]);
+	m_files[ctx_id] = -1;
+}
+
 /**
  * @brief      Proccess request
  *
- * Checks checks the request data, processes the request and
- * writes the response.
+ * Serves oab.xml (the OAL manifest) and the full/differential files it
+ * references, restricted to the address book the user is a member of.
  *
  * @param      ctx_id   Request context identifier
  * @param      content  Request data
@@ -58,14 +476,43 @@ BOOL OabPlugin::preproc(int ctx_id)
  */
 http_status OabPlugin::proc(int ctx_id, const void *content, uint64_t len) try
 {
-	// TODO: check if unauthed requests are required
 	HTTP_AUTH_INFO auth_info = get_auth_info(ctx_id);
 	if (auth_info.auth_status != http_status::ok)
 		return http_status::unauthorized;
-	auto wr = write_response(ctx_id, header, strlen(header));
-	if (wr != http_status::ok)
-		return wr;
-	return write_response(ctx_id, response, strlen(response));
+	auto req = get_request(ctx_id);
+	auto domain = strchr(auth_info.username, '@');
+	unsigned int domain_id = 0, org_id = 0;
+	if (domain == nullptr || !get_domain_ids(domain + 1, &domain_id, &org_id))
+		return http_status::forbidden;
+	int base_id = org_id == 0 ? -static_cast<int>(domain_id) : org_id;
+	auto guid = oab_guid(base_id);
+
+	std::unique_lock hold(m_lock);
+	auto &ob = m_bases[base_id];
+	auto now = time(nullptr);
+	if (!ob.queued && now >= ob.next_check) {
+		ob.username = auth_info.username;
+		ob.queued = true;
+		m_queue.push_back(base_id);
+		m_cond.notify_one();
+	}
+	/* Until the first revision is complete, there is nothing to offer */
+	auto manifest = ob.manifest;
+	hold.unlock();
+	if (manifest.empty())
+		return http_status::service_unavailable;
+
+	std::string_view uri = req->f_request_uri;
+	auto q = uri.find('?');
+	if (q != uri.npos)
+		uri = uri.substr(0, q);
+	uri.remove_prefix(std::min(uri.size(), static_cast<size_t>(4)));
+	while (!uri.empty() && uri[0] == '/')
+		uri.remove_prefix(1);
+	std::string name(uri);
+	if (name.empty() || strcasecmp(name.c_str(), "oab.xml") == 0)
+		return send_manifest(ctx_id, manifest);
+	return send_file(ctx_id, guid, name.c_str());
 } catch (const std::bad_alloc &) {
 	fprintf(stderr, "E-1700: ENOMEM\n");
 	return http_status::none;
@@ -86,11 +533,30 @@ static std::unique_ptr<OabPlugin> g_oab_plugin;
 static BOOL oab_init(void **apidata)
 {
 	LINK_HPM_API(apidata)
+	auto cfg = config_file_initd("oab.cfg", get_config_path(), oab_cfg_defaults);
+	if (cfg == nullptr) {
+		mlog(LV_ERR, "oab: config_file_initd oab.cfg: %s", strerror(errno));
+		return false;
+	}
+	g_oab_interval = cfg->get_ll("oab_cache_interval");
+	g_oab_diff_versions = cfg->get_ll("oab_diff_versions");
+	query_service2("get_domain_ids", get_domain_ids);
+	query_service1(nsp_interface_oab_records);
+	if (get_domain_ids == nullptr || nsp_interface_oab_records == nullptr) {
+		mlog(LV_ERR, "oab: address book services (exchange_nsp) not available");
+		return false;
+	}
+	g_oab_dir = get_state_path() + "/oab"s;
+	if (mkdir(g_oab_dir.c_str(), FMODE_PUBLIC | S_IXUSR | S_IXGRP | S_IXOTH) != 0 &&
+	    errno != EEXIST) {
+		mlog(LV_ERR, "oab: mkdir %s: %s", g_oab_dir.c_str(), strerror(errno));
+		return false;
+	}
 	HPM_INTERFACE ifc{};
 	ifc.preproc = &OabPlugin::preproc;
 	ifc.proc    = [](int ctx, const void *cont, uint64_t len) { return g_oab_plugin->proc(ctx, cont, len); };
-	ifc.retr    = [](int ctx) { return HPM_RETRIEVE_DONE; };
-	ifc.term    = [](int ctx) {};
+	ifc.retr    = [](int ctx) { return g_oab_plugin->retr(ctx); };
+	ifc.term    = [](int ctx) { g_oab_plugin->term(ctx); };
 	if (!register_interface(&ifc))
 		return false;
 	try {
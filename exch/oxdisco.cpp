@@ -11,6 +11,7 @@
 #include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 #include <tinyxml2.h>
 #include <fmt/core.h>
 #include <fmt/printf.h>
@@ -40,7 +41,9 @@ class OxdiscoPlugin {
 	public:
 	OxdiscoPlugin();
 
+	http_status feed(int, const void *, uint64_t);
 	http_status proc(int, const void *, uint64_t);
+	void term(int);
 	std::pair<unsigned int, std::string> access_ok(int, const char *, const char *);
 	static BOOL preproc(int);
 
@@ -75,6 +78,8 @@ class OxdiscoPlugin {
 	int pretty_response = 0; // 0 = compact output, 1 = pretty printed response
 	adv_setting m_advertise_rpch = adv_setting::yes, m_advertise_mh = adv_setting::yes;
 	bool m_validate_scndrequest = true;
+	/* Request bodies, collected by feed(); indexed by context */
+	std::vector<std::string> m_body;
 
 	void loadConfig();
 	static void writeheader(int, int, size_t);
@@ -183,6 +188,7 @@ OxdiscoPlugin::OxdiscoPlugin()
 	host_id = get_host_ID();
 	loadConfig();
 	server_id = std::hash<std::string>{}(host_id);
+	m_body.resize(get_context_num());
 
 	mlog(LV_DEBUG, "[oxdisco] org %s RedirectAddr %s RedirectUrl %s request_logging %d response_logging %d pretty_response %d",
 		x500_org_name.empty() ? "empty" : x500_org_name.c_str(),
@@ -293,20 +299,41 @@ std::pair<unsigned int, std::string> OxdiscoPlugin::access_ok(int ctx_id,
 	return {bad_address_code, bad_address_msg + " (403 Permission Denied)"s};
 }
 
+/**
+ * @brief      Collect a piece of the request body
+ *
+ * Autodiscover requests are a few hundred bytes; anything beyond
+ * MAX_REQUEST_BODY is refused before it gets buffered.
+ */
+http_status OxdiscoPlugin::feed(int ctx_id, const void *data, uint64_t len) try
+{
+	static constexpr size_t MAX_REQUEST_BODY = 64 * 1024;
+	auto &body = m_body[ctx_id];
+	if (len > MAX_REQUEST_BODY - body.size())
+		return http_status::bad_request;
+	body.append(static_cast<const char *>(data), len);
+	return http_status::ok;
+} catch (const std::bad_alloc &) {
+	return http_status::enomem_CL;
+}
+
+void OxdiscoPlugin::term(int ctx_id)
+{
+	std::string().swap(m_body[ctx_id]);
+}
+
 /**
  * @brief      Proccess request
  *
- * Checks checks the request data, processes the request and
- * writes the response.
+ * Checks checks the request data (as collected by feed), processes the
+ * request and writes the response.
  *
  * @param      ctx_id   Request context identifier
- * @param      content  Request data
- * @param      len      Length of request data
  *
  * @return http_status::none if left unhandled, http_status::ok if any response sent, or
  * >=http_status::bad_request to let httpd generate a response
  */
-http_status OxdiscoPlugin::proc(int ctx_id, const void *content, uint64_t len) try
+http_status OxdiscoPlugin::proc(int ctx_id, const void *, uint64_t) try
 {
 	HTTP_AUTH_INFO auth_info = get_auth_info(ctx_id);
 	auto req = get_request(ctx_id);
@@ -327,7 +354,8 @@ http_status OxdiscoPlugin::proc(int ctx_id, const void *content, uint64_t len) t
 	if (auth_info.auth_status != http_status::ok)
 		return http_status::unauthorized;
 	XMLDocument doc;
-	if (doc.Parse(static_cast<const char *>(content), len) != XML_SUCCESS)
+	auto &body = m_body[ctx_id];
+	if (doc.Parse(body.c_str(), body.size()) != XML_SUCCESS)
 		return die(ctx_id, invalid_request_code, invalid_request_msg);
 
 	auto root = doc.RootElement();
@@ -337,8 +365,7 @@ http_status OxdiscoPlugin::proc(int ctx_id, const void *content, uint64_t len) t
 	}
 
 	if (request_logging > 0)
-		mlog(LV_DEBUG, "[oxdisco] incoming: %.*s",
-			static_cast<int>(len), static_cast<const char *>(content));
+		mlog(LV_DEBUG, "[oxdisco] incoming: %s", body.c_str());
 
 	auto req_node = root->FirstChildElement("Request");
 	if (req_node == nullptr)
@@ -1120,7 +1147,8 @@ static BOOL oxdisco_init(void **apidata)
 	ifc.preproc = &OxdiscoPlugin::preproc;
 	ifc.proc    = [](int ctx, const void *cont, uint64_t len) { return g_oxdisco_plugin->proc(ctx, cont, len); };
 	ifc.retr    = [](int ctx) { return HPM_RETRIEVE_DONE; };
-	ifc.term    = [](int ctx) {};
+	ifc.term    = [](int ctx) { g_oxdisco_plugin->term(ctx); };
+	ifc.feed    = [](int ctx, const void *data, uint64_t len) { return g_oxdisco_plugin->feed(ctx, data, len); };
 	if (!register_interface(&ifc))
 		return false;
 	try {
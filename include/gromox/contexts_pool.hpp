@@ -34,12 +34,14 @@ struct schedule_context {
 	DOUBLE_LIST_NODE node{};
 	int type = CONTEXT_FREE;
 	BOOL b_waiting = false; /* is still in epoll queue */
+	bool b_activate = false; /* activation arrived while not polling */
 	int polling_mask = 0;
 	unsigned int context_id = 0;
+	unsigned int reactor = 0; /* event loop owning this context */
 };
 using SCHEDULE_CONTEXT = schedule_context;
 
-extern GX_EXPORT void contexts_pool_init(schedule_context **, unsigned int context_num, int (*get_socket)(const schedule_context *), gromox::time_point (*get_ts)(const schedule_context *), unsigned int contexts_per_thr, gromox::time_duration timeout);
+extern GX_EXPORT void contexts_pool_init(schedule_context **, unsigned int context_num, int (*get_socket)(const schedule_context *), gromox::time_point (*get_ts)(const schedule_context *), unsigned int contexts_per_thr, gromox::time_duration timeout, unsigned int reactors = 1);
 extern int contexts_pool_run();
 extern void contexts_pool_stop();
 SCHEDULE_CONTEXT* contexts_pool_get_context(int type);
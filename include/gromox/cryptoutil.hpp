@@ -27,6 +27,9 @@ struct GX_EXPORT HMACMD5_CTX {
 
 extern GX_EXPORT int tls_set_min_proto(SSL_CTX *, const char *);
 extern GX_EXPORT void tls_set_renego(SSL_CTX *);
+extern GX_EXPORT int tls_set_ktls(SSL_CTX *);
+extern GX_EXPORT int tls_set_resumption(SSL_CTX *, const char *id_ctx, size_t cache_size, unsigned int lifetime, const char *ticket_key_file);
+extern GX_EXPORT void tls_resumption_report(SSL_CTX *);
 extern GX_EXPORT std::string sss_obf_reverse(const std::string_view &);
 
 }
@@ -10,6 +10,7 @@
 #include <gromox/element_data.hpp>
 #include <gromox/exmdb_rpc.hpp>
 #include <gromox/mysql_adaptor.hpp>
+#include <gromox/restriction.hpp>
 #define MAXIMUM_PROPNAME_NUMBER								0x7000
 #define MAX_DIGLEN											256*1024
 #define MAX_RULE_RECIPIENTS									256
@@ -29,6 +30,8 @@ enum {
 	ID_TAG_TRANSPORTMESSAGEHEADERS_STRING8 = PROP_TAG(PT_GXI_STRING, 0x0007),
 	ID_TAG_ATTACHDATABINARY = PROP_TAG(PT_GXI_STRING, 0x000b),
 	ID_TAG_ATTACHDATAOBJECT = PROP_TAG(PT_GXI_STRING, 0x000f),
+	/* "<message_id>:<message_size>:<change_number>" of a not-yet-loaded embedded message */
+	ID_TAG_EMBEDDED = PROP_TAG(PT_GXI_STRING, 0x0010),
 };
 
 enum {
@@ -118,6 +121,7 @@ BOOL common_util_get_message_flags(sqlite3 *psqlite,
 	uint64_t message_id, BOOL b_native,
 	uint32_t **ppmessage_flags);
 extern std::string cu_cid_path(const char *dir, const char *cid, unsigned int type);
+extern void cu_cid_prewrite(const char *dir, cpid_t, size_t count, const MESSAGE_CONTENT *);
 void common_util_set_message_read(sqlite3 *psqlite,
 	uint64_t message_id, uint8_t is_read);
 extern BOOL common_util_addressbook_entryid_to_username(const BINARY *eid, char *username, size_t);
@@ -140,6 +144,8 @@ BOOL common_util_load_search_scopes(sqlite3 *psqlite,
 	uint64_t folder_id, LONGLONG_ARRAY *pfolder_ids);
 extern bool cu_eval_folder_restriction(sqlite3 *, uint64_t folder_id, const RESTRICTION *);
 extern bool cu_eval_msg_restriction(sqlite3 *, cpid_t, uint64_t msgid, const RESTRICTION *);
+extern bool cu_eval_folder_restriction(sqlite3 *, uint64_t folder_id, const gromox::res_program &);
+extern bool cu_eval_msg_restriction(sqlite3 *, cpid_t, uint64_t msgid, const gromox::res_program &);
 BOOL common_util_check_search_result(sqlite3 *psqlite,
 	uint64_t folder_id, uint64_t message_id, BOOL *pb_exist);
 BOOL common_util_get_mid_string(sqlite3 *psqlite,
@@ -181,5 +187,6 @@ extern int need_msg_perm_check(sqlite3 *, const char *user, uint64_t fid);
 extern int have_delete_perm(sqlite3 *, const char *user, uint64_t fid, uint64_t mid = 0);
 
 extern unsigned int g_max_rule_num, g_max_extrule_num, g_cid_compression;
+extern bool g_cid_usedict;
 extern thread_local unsigned int g_inside_flush_instance;
 extern thread_local sqlite3 *g_sqlite_for_oxcmail;
@@ -78,6 +78,7 @@ EXMIDL(flush_instance, (const char *dir, uint32_t instance_id, const char *accou
 EXMIDL(unload_instance, (const char *dir, uint32_t instance_id))
 EXMIDL(get_instance_all_proptags, (const char *dir, uint32_t instance_id, IDLOUT PROPTAG_ARRAY *proptags))
 EXMIDL(get_instance_properties, (const char *dir, uint32_t size_limit, uint32_t instance_id, const PROPTAG_ARRAY *pproptags, IDLOUT TPROPVAL_ARRAY *propvals))
+EXMIDL(read_instance_range, (const char *dir, uint32_t instance_id, uint32_t proptag, uint32_t offset, uint32_t length, IDLOUT uint32_t *total_size, BINARY *data))
 EXMIDL(set_instance_properties, (const char *dir, uint32_t instance_id, const TPROPVAL_ARRAY *pproperties, IDLOUT PROBLEM_ARRAY *problems))
 EXMIDL(remove_instance_properties, (const char *dir, uint32_t instance_id, const PROPTAG_ARRAY *pproptags, IDLOUT PROBLEM_ARRAY *problems))
 EXMIDL(check_instance_cycle, (const char *dir, uint32_t src_instance_id, uint32_t dst_instance_id, IDLOUT BOOL *b_cycle))
@@ -118,6 +119,7 @@ EXMIDL(empty_folder_rule, (const char *dir, uint64_t folder_id))
 EXMIDL(update_folder_rule, (const char *dir, uint64_t folder_id, uint16_t count, const RULE_DATA *prow, IDLOUT BOOL *b_exceed))
 EXMIDL(deliver_message, (const char *dir, const char *from_address, const char *account, cpid_t cpid, uint32_t dlflags, const MESSAGE_CONTENT *pmsg, const char *pdigest, IDLOUT uint64_t *folder_id, uint64_t *message_id, uint32_t *result))
 EXMIDL(write_message, (const char *dir, const char *account, cpid_t cpid, uint64_t folder_id, const MESSAGE_CONTENT *pmsgctnt, IDLOUT ec_error_t *e_result))
+EXMIDL(write_messages, (const char *dir, const char *account, cpid_t cpid, uint32_t count, const uint64_t *folder_ids, const MESSAGE_CONTENT *pmsgctnts, IDLOUT ec_error_t *e_result, uint32_t *failed_index))
 EXMIDL(read_message, (const char *dir, const char *username, cpid_t cpid, uint64_t message_id, IDLOUT MESSAGE_CONTENT **pmsgctnt))
 EXMIDL(get_content_sync, (const char *dir, uint64_t folder_id, const char *username, const IDSET *pgiven, const IDSET *pseen, const IDSET *pseen_fai, const IDSET *pread, cpid_t cpid, const RESTRICTION *prestriction, BOOL b_ordered, IDLOUT uint32_t *fai_count, uint64_t *fai_total, uint32_t *normal_count, uint64_t *normal_total, EID_ARRAY *updated_mids, EID_ARRAY *chg_mids, uint64_t *last_cn, EID_ARRAY *given_mids, EID_ARRAY *deleted_mids, EID_ARRAY *nolonger_mids, EID_ARRAY *read_mids, EID_ARRAY *unread_mids, uint64_t *last_readcn))
 EXMIDL(get_hierarchy_sync, (const char *dir, uint64_t folder_id, const char *username, const IDSET *pgiven, const IDSET *pseen, IDLOUT FOLDER_CHANGES *fldchgs, uint64_t *last_cn, EID_ARRAY *given_fids, EID_ARRAY *deleted_fids))
@@ -136,3 +138,4 @@ EXMIDL(purge_datafiles, (const char *dir))
 EXMIDL(autoreply_tsquery, (const char *dir, const char *peer, uint64_t window, IDLOUT uint64_t *tdiff))
 EXMIDL(autoreply_tsupdate, (const char *dir, const char *peer))
 EXMIDL(recalc_store_size, (const char *dir, uint32_t flags))
+EXMIDL(query_freebusy, (const char *dir, uint64_t folder_id, int64_t start_time, int64_t end_time, BOOL b_detailed, IDLOUT FB_ARRAY *fb_events))
@@ -164,6 +164,9 @@ enum class exmdb_callid : uint8_t {
 	recalc_store_size = 0x8a,
 	movecopy_folder = 0x8b,
 	create_folder = 0x8c,
+	query_freebusy = 0x8d,
+	write_messages = 0x8e,
+	read_instance_range = 0x8f,
 	/* update exch/exmdb_provider/names.cpp:exmdb_rpc_idtoname! */
 };
 
@@ -774,6 +777,18 @@ struct exreq_write_message : public exreq {
 	MESSAGE_CONTENT *pmsgctnt;
 };
 
+struct exreq_write_messages : public exreq {
+	char *account = nullptr;
+	cpid_t cpid{};
+	uint32_t count = 0;
+	uint64_t *folder_ids = nullptr;
+	MESSAGE_CONTENT *pmsgctnts = nullptr;
+};
+
+struct exreq_read_instance_range : public exreq {
+	uint32_t instance_id = 0, proptag = 0, offset = 0, length = 0;
+};
+
 struct exreq_read_message : public exreq {
 	char *username;
 	cpid_t cpid;
@@ -858,6 +873,12 @@ struct exreq_recalc_store_size : public exreq {
 	uint32_t flags = 0;
 };
 
+struct exreq_query_freebusy : public exreq {
+	uint64_t folder_id = 0;
+	int64_t start_time = 0, end_time = 0;
+	BOOL b_detailed = false;
+};
+
 struct exresp {
 	exresp() = default; /* Prevent use of direct-init-list */
 	exmdb_callid call_id{};
@@ -1295,6 +1316,20 @@ struct exresp_autoreply_tsquery : public exresp {
 	uint64_t tdiff = 0;
 };
 
+struct exresp_query_freebusy : public exresp {
+	FB_ARRAY fb_events{};
+};
+
+struct exresp_write_messages : public exresp {
+	ec_error_t e_result{};
+	uint32_t failed_index = 0;
+};
+
+struct exresp_read_instance_range : public exresp {
+	uint32_t total_size = 0;
+	BINARY data{};
+};
+
 using exreq_ping_store = exreq;
 using exreq_get_all_named_propids = exreq;
 using exreq_get_store_all_proptags = exreq;
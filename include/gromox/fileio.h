@@ -9,6 +9,7 @@
 #include <string_view>
 #include <unistd.h>
 #include <vector>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <gromox/defs.h>
 
@@ -88,12 +89,17 @@ extern GX_EXPORT std::string resource_parse_stcode_line(const char *);
 extern GX_EXPORT void startup_banner(const char *);
 extern GX_EXPORT void gx_reexec_record(int);
 extern GX_EXPORT void gx_reexec_finish();
+extern GX_EXPORT errno_t gx_inet_listen_multi(const char *host, uint16_t port, unsigned int count, std::vector<int> &fds);
+extern GX_EXPORT bool gx_sockaddr_text(const struct sockaddr_storage &, char *host, size_t hsize, uint16_t *port);
 extern GX_EXPORT errno_t gx_reexec(const char *const *);
 extern GX_EXPORT unsigned long gx_gettid();
 extern GX_EXPORT std::string zstd_decompress(std::string_view);
 extern GX_EXPORT size_t gx_decompressed_size(const char *);
 extern GX_EXPORT errno_t gx_decompress_file(const char *, BINARY &, void *(*)(size_t), void *(*)(void *, size_t));
-extern GX_EXPORT errno_t gx_compress_tofd(std::string_view, int fd, uint8_t complvl = 0);
+extern GX_EXPORT errno_t gx_decompress_range(const char *, uint64_t offset, uint32_t length, BINARY &, void *(*)(size_t), uint64_t *total = nullptr);
+extern GX_EXPORT errno_t gx_compress_tofd(std::string_view, int fd, uint8_t complvl = 0, uint32_t dict_id = 0);
+extern GX_EXPORT void gx_zdict_setdir(const char *);
+extern GX_EXPORT uint32_t gx_zdict_lookup(const char *name);
 extern GX_EXPORT errno_t gx_compress_tofile(std::string_view, const char *outfile, uint8_t complvl = 0, unsigned int mode = FMODE_PRIVATE);
 extern GX_EXPORT std::string base64_encode(const std::string_view &);
 extern GX_EXPORT std::string base64_decode(const std::string_view &);
@@ -54,5 +54,6 @@ struct FLUSH_ENTITY final {
 	BOOL is_spam = false; /* whether the mail is spam */
 	int context_ID = 0;
 	unsigned int command_protocol = 0;
+	bool is_raw = false; /* BDAT octets, to be spooled without dot-unstuffing */
 	SMTP_CONTEXT *pcontext = nullptr;
 };
@@ -1,4 +1,6 @@
 #pragma once
+#include <array>
+#include <cstdint>
 #include <ctime>
 #include <vector>
 #include <fmt/core.h>
@@ -27,9 +29,14 @@ struct event
 	EXTENDEDEXCEPTION *xe = nullptr;
 };
 
-struct freebusy_tags
+struct GX_EXPORT freebusy_tags
 {
 	freebusy_tags(const char *);
+	freebusy_tags(const PROPID_ARRAY &);
+	/* Columns that freebusy_expand looks at */
+	std::array<uint32_t, 13> proptags() const;
+
+	static const PROPNAME_ARRAY propnames;
 
 	uint32_t apptstartwhole = 0, apptendwhole = 0, busystatus = 0, recurring = 0,
 		apptrecur = 0, apptsubtype = 0, private_flag = 0, apptstateflags = 0,
@@ -37,4 +44,10 @@ struct freebusy_tags
 		timezonestruct = 0;
 };
 
+/*
+ * Turn one calendar item (a row with freebusy_tags::proptags) into busy
+ * intervals within [start,end]. String pointers in the emitted events refer
+ * to the row and to exmdb_rpc_alloc memory.
+ */
+extern GX_EXPORT bool freebusy_expand(const freebusy_tags &, const TPROPVAL_ARRAY &, time_t, time_t, bool detailed, std::vector<freebusy_event> &);
 extern GX_EXPORT bool get_freebusy(const char *, const char *, time_t, time_t, std::vector<freebusy_event> &);
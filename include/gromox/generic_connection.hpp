@@ -1,6 +1,11 @@
 #pragma once
+#include <cerrno>
 #include <unistd.h>
+#include <openssl/bio.h>
 #include <openssl/ssl.h>
+#ifdef __linux__
+#	include <sys/sendfile.h>
+#endif
 #include <gromox/clock.hpp>
 #include <gromox/defs.h>
 
@@ -30,6 +35,41 @@ struct GX_EXPORT GENERIC_CONNECTION {
 		       ::write(sockd, buf, z);
 	}
 
+	/*
+	 * File data can be handed to the kernel directly if the connection is
+	 * plaintext, or if the TLS record layer for sending was offloaded to
+	 * the kernel (kTLS).
+	 */
+	bool can_sendfile() const
+	{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+		if (ssl != nullptr)
+			return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+		if (ssl != nullptr)
+			return false;
+#endif
+#ifdef __linux__
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	ssize_t sendfile(int fd, off_t offset, size_t z)
+	{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+		if (ssl != nullptr)
+			return SSL_sendfile(ssl, fd, offset, z, 0);
+#endif
+#ifdef __linux__
+		if (ssl == nullptr)
+			return ::sendfile(sockd, fd, &offset, z);
+#endif
+		errno = ENOSYS;
+		return -1;
+	}
+
 	char client_ip[40]{}; /* client ip address string */
 	char server_ip[40]{}; /* server ip address */
 	uint16_t client_port = 0, server_port = 0;
@@ -22,13 +22,28 @@
 
 struct LIB_BUFFER;
 
+/* Bumped whenever the layout of HPM_INTERFACE changes */
+#define HPM_INTERFACE_VERSION 2
+
+/**
+ * @version:	filled in by the default member initializer; lets
+ * 		register_interface reject plugins that were built against a
+ * 		different HPM_INTERFACE
+ * @feed:	optional; if set, the request body is handed to the plugin
+ * 		piecewise as it arrives (already de-chunked) instead of being
+ * 		buffered, and @proc is subsequently called with (nullptr, 0).
+ * 		Returning anything but http_status::ok aborts the request
+ * 		with that status.
+ */
 struct HPM_INTERFACE {
+	size_t version = HPM_INTERFACE_VERSION;
 	BOOL (*preproc)(int);
 	http_status (*proc)(int, const void*, uint64_t);
 	int (*retr)(int);
 	BOOL (*send)(int, const void*, int);
 	int (*receive)(int, void*, int length);
 	void (*term)(int);
+	http_status (*feed)(int, const void *, uint64_t);
 };
 
 enum class http_method {
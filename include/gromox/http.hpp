@@ -14,6 +14,7 @@ enum class http_status {
 	uri_too_long = 414,
 	uri_too_long_CL = -414,
 	range_insatisfiable = 416,
+	fields_too_large = 431,
 	too_many_ranges = 4162,
 	server_error = 500,
 	not_impl = 501,
@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <gromox/defs.h>
+
+namespace gromox {
+
+/**
+ * One property of an offline address book record. @num carries PT_LONG and
+ * PT_BOOLEAN values; @str carries string and binary values (one element
+ * for single-valued types, any number for PT_MV_*).
+ */
+struct oab_propval {
+	uint32_t tag = 0, num = 0;
+	std::vector<std::string> str;
+};
+using oab_record = std::vector<oab_propval>;
+
+/* MS-OXOAB §2.9.2 OAB_PROP_REC::ulFlags */
+enum {
+	OAB_ANR = 0x1U,
+	OAB_RDN = 0x2U,
+	OAB_INDEX = 0x4U,
+};
+
+struct oab_attr {
+	uint32_t tag, flags;
+};
+
+extern GX_EXPORT uint32_t oab_crc(std::string_view, uint32_t crc = 0xffffffffU);
+extern GX_EXPORT std::string oab_write_v4(const std::vector<oab_attr> &hdr_atts, const oab_record &hdr, const std::vector<oab_attr> &atts, const std::vector<oab_record> &recs);
+extern GX_EXPORT std::string oab_compress(std::string_view);
+extern GX_EXPORT std::string oab_make_patch(std::string_view src, std::string_view dst);
+
+}
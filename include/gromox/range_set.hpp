@@ -5,6 +5,7 @@
 #else
 #	define GX_RANGE_NODE_ASSERT
 #endif
+#include <algorithm>
 #include <cstdint>
 #include <utility>
 #include <vector>
@@ -52,6 +53,38 @@ template<typename T> class GX_EXPORT range_set : private std::vector<gromox::ran
 	 */
 	base &vec() { return *this; }
 
+	/* O(log n) membership test; relies on the ordering invariant */
+	bool contains(const T &v) const
+	{
+		auto i = std::lower_bound(begin(), end(), v,
+		         [](const range_node<T> &n, const T &x) { return n.hi < x; });
+		return i != end() && i->lo <= v;
+	}
+
+	/* Restore the ordering invariant after filling vec() directly */
+	void normalize()
+	{
+		auto &v = vec();
+		std::sort(v.begin(), v.end(), [](const range_node<T> &a, const range_node<T> &b) {
+			return a.lo < b.lo;
+		});
+		auto out = v.begin();
+		for (auto i = v.begin(); i != v.end(); ++i) {
+			if (i == v.begin()) {
+				++out;
+				continue;
+			}
+			auto &prev = *std::prev(out);
+			if (i->lo <= prev.hi || i->lo == prev.hi + 1) {
+				if (i->hi > prev.hi)
+					prev.hi = i->hi;
+				continue;
+			}
+			*out++ = std::move(*i);
+		}
+		v.erase(out, v.end());
+	}
+
 	void insert(T lo) { insert(lo, lo); }
 	void insert(T lo, T hi) {
 		if (lo > hi)
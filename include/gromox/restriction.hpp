@@ -1,7 +1,113 @@
 #pragma once
 #include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+#include <gromox/common_types.hpp>
+#include <gromox/defs.h>
 #include <gromox/mapi_types.hpp>
 
 void restriction_free(RESTRICTION *prestriction);
 RESTRICTION* restriction_dup(const RESTRICTION *prestriction);
 uint32_t restriction_size(const RESTRICTION *r);
+
+namespace gromox {
+
+/**
+ * A RESTRICTION lowered into a flat list of property tests, for evaluating
+ * the same restriction against many rows. Each instruction carries the index
+ * of the instruction to continue with on match and on mismatch, so
+ * AND/OR/NOT only exist as jump targets and cost nothing per row. Property
+ * tags are mapped to fetch slots, so a property is read at most once per
+ * row; the RHS is pre-decoded per property type; content needles are
+ * pre-folded; and AND/OR operands are tried cheapest-first where that cannot
+ * change the outcome.
+ *
+ * Node types whose semantics differ between the callers (RES_PROPCOMPARE,
+ * RES_SUBRESTRICTION, RES_COUNT, RES_NULL, and RES_PROPERTY on PR_ANR,
+ * PR_PARENT_ENTRYID or PR_PARENT_SVREID) are handed back to the caller's own
+ * interpreter through the fallback function.
+ *
+ * The program refers to the RESTRICTION it was compiled from, which must
+ * outlive it.
+ */
+class GX_EXPORT res_program {
+	public:
+	/* Same shape as the table row getters: FALSE means "cannot tell" */
+	using get_fn = BOOL (*)(void *param, uint32_t proptag, void **value);
+	using fallback_fn = bool (*)(void *param, const RESTRICTION &);
+
+	bool compile(const RESTRICTION &);
+	bool eval(void *param, get_fn, fallback_fn) const;
+	bool compiled() const { return m_entry != PC_NONE; }
+
+	private:
+	enum class op : uint8_t {
+		exist, bitmask, size, cmp_u16, cmp_u32, cmp_u64, cmp_bool,
+		cmp_flt, cmp_dbl, cmp_str, cmp_any, cont_bin, cont_str,
+		fallback,
+	};
+	static constexpr int32_t PC_ACCEPT = -1, PC_REJECT = -2, PC_NONE = -3;
+	static constexpr uint8_t NO_SLOT = 0xff, MAX_SLOTS = 32;
+	struct insn {
+		op opc = op::fallback;
+		uint8_t relop = 0, slot = NO_SLOT;
+		bool nullres = false, icase = false;
+		uint16_t fuzzy = 0;
+		uint32_t proptag = 0;
+		int32_t jt = PC_REJECT, jf = PC_REJECT;
+		union {
+			uint32_t u32;
+			uint64_t u64;
+			float flt;
+			double dbl;
+		} imm{};
+		const void *rhs = nullptr;
+		size_t rlen = 0;
+		std::string folded;
+		const RESTRICTION *node = nullptr;
+	};
+
+	int32_t emit(const RESTRICTION &, int32_t jt, int32_t jf);
+	int32_t emit_leaf(insn &&, int32_t jt, int32_t jf);
+	static bool test(const insn &, const void *);
+
+	std::vector<insn> m_insn;
+	std::vector<uint32_t> m_slot_tags;
+	int32_t m_entry = PC_NONE;
+};
+
+/**
+ * Translation of (part of) a content table restriction into an SQL
+ * expression over the exmdb `messages` table. Every emitted expression
+ * evaluates to 0 or 1 (never NULL), so that NOT and OR behave like their
+ * RESTRICTION counterparts, including the EXC2019 semantics for absent
+ * properties. Placeholders are to be bound in order from @binds.
+ *
+ * @b_private:  PR_READ may be taken from messages.read_state
+ * @b_hotcols:  the messages table has the schema-14 hot columns
+ */
+struct GX_EXPORT res_sql {
+	struct bindval {
+		bool text = false;
+		int64_t num = 0;
+		std::string str;
+	};
+	bool b_private = false, b_hotcols = false;
+	std::vector<bindval> binds;
+
+	bool emit(const RESTRICTION &, std::string &);
+
+	private:
+	bool emit_prop(const RESTRICTION_PROPERTY &, std::string &);
+	bool emit_content(const RESTRICTION_CONTENT &, std::string &);
+	bool emit_bitmask(const RESTRICTION_BITMASK &, std::string &);
+	bool emit_exist(const RESTRICTION_EXIST &, std::string &);
+	void bind(int64_t v) { binds.emplace_back(bindval{false, v, {}}); }
+	void bind(std::string &&v) { binds.emplace_back(bindval{true, 0, std::move(v)}); }
+};
+
+/* Message properties that exmdb computes rather than reads from message_properties */
+extern GX_EXPORT bool msgprop_computed(uint32_t proptag);
+
+}
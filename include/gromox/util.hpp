@@ -156,6 +156,7 @@ extern GX_EXPORT bool get_digest(const char *src, const char *tag, char *out, si
 extern GX_EXPORT bool set_digest(char *src, size_t length, const char *tag, const char *v);
 extern GX_EXPORT bool set_digest(char *src, size_t length, const char *tag, uint64_t v);
 extern GX_EXPORT void mlog_init(const char *file, unsigned int level);
+extern GX_EXPORT bool mlog_enabled(unsigned int level);
 extern GX_EXPORT void mlog(unsigned int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
 extern GX_EXPORT int pthread_create4(pthread_t *, std::nullptr_t, void *(*)(void *), void * = nullptr) noexcept;
 extern GX_EXPORT int strtailcase(const char *h, const char *n);
@@ -2,11 +2,15 @@
 #ifdef HAVE_CONFIG_H
 #	include "config.h"
 #endif
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
+#include <climits>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
 #include <mutex>
 #include <pthread.h>
 #include <unistd.h>
@@ -45,15 +49,33 @@ struct evqueue {
 	errno_t del(SCHEDULE_CONTEXT *);
 	void reset();
 };
+
+/*
+ * An event loop with its own share of the contexts: those contexts are
+ * polled on its evqueue, and once ready, are queued on its turning list.
+ * Pool threads serve the turning list of their home reactor first and
+ * steal from the others when it is empty.
+ */
+struct reactor {
+	evqueue poll_ctx;
+	pthread_t thread_id{};
+	DOUBLE_LIST polling{}, turning{};
+	std::mutex poll_lock, turn_lock;
+	/* length of @turning, for peeking at it without @turn_lock */
+	std::atomic<size_t> nturning{0};
+};
 }
 
 static time_duration g_time_out;
 static unsigned int g_context_num, g_contexts_per_thr;
-static evqueue g_poll_ctx;
+static unsigned int g_reactor_num = 1;
+static std::unique_ptr<reactor[]> g_reactors;
+static std::atomic<unsigned int> g_next_home;
+static thread_local unsigned int g_home_reactor = UINT_MAX;
 static pthread_t g_scan_id;
 static SCHEDULE_CONTEXT **g_context_ptr;
-static pthread_t g_thread_id;
 static gromox::atomic_bool g_notify_stop{true};
+/* POLLING and TURNING contexts live in the reactors instead */
 static DOUBLE_LIST g_context_lists[CONTEXT_TYPES];
 static std::mutex g_context_locks[CONTEXT_TYPES];
 
@@ -184,24 +206,43 @@ int contexts_pool_get_param(int type)
 	case CUR_SLEEPING_CONTEXTS:
 		return double_list_get_nodes_num(
 			&g_context_lists[CONTEXT_SLEEPING]);
-	case CUR_SCHEDULING_CONTEXTS:
-		return double_list_get_nodes_num(
-			&g_context_lists[CONTEXT_TURNING]);
+	case CUR_SCHEDULING_CONTEXTS: {
+		size_t num = 0;
+		for (unsigned int i = 0; i < g_reactor_num; ++i)
+			num += g_reactors[i].nturning.load(std::memory_order_relaxed);
+		return num;
+	}
 	default:
 		return -1;
 	}
 }
 
+static inline reactor &ctx_reactor(const SCHEDULE_CONTEXT *pcontext)
+{
+	return g_reactors[pcontext->reactor];
+}
+
+/* Append to the turning list of the context's reactor */
+static void ctx_make_turning(SCHEDULE_CONTEXT *pcontext)
+{
+	auto &r = ctx_reactor(pcontext);
+	std::lock_guard turn_hold(r.turn_lock);
+	pcontext->type = CONTEXT_TURNING;
+	double_list_append_as_tail(&r.turning, &pcontext->node);
+	++r.nturning;
+}
+
 static void *ctxp_thrwork(void *pparam)
 {
+	auto &r = *static_cast<reactor *>(pparam);
 	while (!g_notify_stop) {
-		auto num = g_poll_ctx.wait();
+		auto num = r.poll_ctx.wait();
 		if (num <= 0) {
 			continue;
 		}
 		for (unsigned int i = 0; i < static_cast<unsigned int>(num); ++i) {
-			auto pcontext = g_poll_ctx.get_data(i);
-			std::unique_lock poll_hold(g_context_locks[CONTEXT_POLLING]);
+			auto pcontext = r.poll_ctx.get_data(i);
+			std::unique_lock poll_hold(r.poll_lock);
 			if (CONTEXT_POLLING != pcontext->type) {
 				/* context may be waked up and modified by
 				scan_work_func or context_pool_activate_context */
@@ -213,8 +254,7 @@ static void *ctxp_thrwork(void *pparam)
 					" context: %p", pcontext);
 				continue;
 			}
-			double_list_remove(&g_context_lists[CONTEXT_POLLING],
-				&pcontext->node);
+			double_list_remove(&r.polling, &pcontext->node);
 			pcontext->type = CONTEXT_SWITCHING;
 			poll_hold.unlock();
 			contexts_pool_put_context(pcontext, CONTEXT_TURNING);
@@ -228,45 +268,54 @@ static void *ctxp_thrwork(void *pparam)
 	return nullptr;
 }
 
+/*
+ * Move the polling contexts of @r which have timed out (or are no longer
+ * registered with the evqueue) to @temp_list.
+ */
+static void ctxp_scan_polling(reactor &r, DOUBLE_LIST *temp_list)
+{
+	DOUBLE_LIST_NODE *pnode;
+	SCHEDULE_CONTEXT *pcontext;
+
+	std::lock_guard poll_hold(r.poll_lock);
+	auto current_time = tp_now();
+	auto ptail = double_list_get_tail(&r.polling);
+	while ((pnode = double_list_pop_front(&r.polling)) != nullptr) {
+		pcontext = (SCHEDULE_CONTEXT*)pnode->pdata;
+		if (!pcontext->b_waiting) {
+			pcontext->type = CONTEXT_SWITCHING;
+			double_list_append_as_tail(temp_list, pnode);
+			goto CHECK_TAIL;
+		}
+		if (current_time - contexts_pool_get_context_timestamp(pcontext) >= g_time_out) {
+			if (r.poll_ctx.del(pcontext) != 0) {
+				mlog(LV_DEBUG, "contexts_pool: failed to remove event from epoll");
+			} else {
+				pcontext->b_waiting = FALSE;
+				pcontext->type = CONTEXT_SWITCHING;
+				double_list_append_as_tail(temp_list, pnode);
+				goto CHECK_TAIL;
+			}
+		}
+		double_list_append_as_tail(&r.polling, pnode);
+ CHECK_TAIL:
+		if (pnode == ptail) {
+			break;
+		}
+	}
+}
+
 static void *ctxp_scanwork(void *pparam)
 {
 	int num;
 	DOUBLE_LIST temp_list;
 	DOUBLE_LIST_NODE *pnode;
-	DOUBLE_LIST_NODE *ptail;
 	SCHEDULE_CONTEXT *pcontext;
 	
 	double_list_init(&temp_list);
 	while (!g_notify_stop) {
-		std::unique_lock poll_hold(g_context_locks[CONTEXT_POLLING]);
-		auto current_time = tp_now();
-		ptail = double_list_get_tail(
-			&g_context_lists[CONTEXT_POLLING]);
-		while ((pnode = double_list_pop_front(&g_context_lists[CONTEXT_POLLING])) != nullptr) {
-			pcontext = (SCHEDULE_CONTEXT*)pnode->pdata;
-			if (!pcontext->b_waiting) {
-				pcontext->type = CONTEXT_SWITCHING;
-				double_list_append_as_tail(&temp_list, pnode);
-				goto CHECK_TAIL;
-			}
-			if (current_time - contexts_pool_get_context_timestamp(pcontext) >= g_time_out) {
-				if (g_poll_ctx.del(pcontext) != 0) {
-					mlog(LV_DEBUG, "contexts_pool: failed to remove event from epoll");
-				} else {
-					pcontext->b_waiting = FALSE;
-					pcontext->type = CONTEXT_SWITCHING;
-					double_list_append_as_tail(&temp_list, pnode);
-					goto CHECK_TAIL;
-				}
-			}
-			double_list_append_as_tail(
-				&g_context_lists[CONTEXT_POLLING], pnode);
- CHECK_TAIL:
-			if (pnode == ptail) {
-				break;
-			}
-		}
-		poll_hold.unlock();
+		for (unsigned int i = 0; i < g_reactor_num; ++i)
+			ctxp_scan_polling(g_reactors[i], &temp_list);
 		std::unique_lock idle_hold(g_context_locks[CONTEXT_IDLING]);
 		while ((pnode = double_list_pop_front(&g_context_lists[CONTEXT_IDLING])) != nullptr) {
 			pcontext = (SCHEDULE_CONTEXT*)pnode->pdata;
@@ -275,14 +324,10 @@ static void *ctxp_scanwork(void *pparam)
 		}
 		idle_hold.unlock();
 		num = 0;
-		std::unique_lock turn_hold(g_context_locks[CONTEXT_TURNING]);
 		while ((pnode = double_list_pop_front(&temp_list)) != nullptr) {
-			((SCHEDULE_CONTEXT*)pnode->pdata)->type = CONTEXT_TURNING;
-			double_list_append_as_tail(
-				&g_context_lists[CONTEXT_TURNING], pnode);
+			ctx_make_turning(static_cast<SCHEDULE_CONTEXT *>(pnode->pdata));
 			num ++;
 		}
-		turn_hold.unlock();
 		if (1 == num) {
 			threads_pool_wakeup_thread();
 		} else if (num > 1) {
@@ -297,9 +342,20 @@ static void *ctxp_scanwork(void *pparam)
 void contexts_pool_init(SCHEDULE_CONTEXT **pcontexts, unsigned int context_num,
     int (*get_socket)(const schedule_context *),
     time_point (*get_timestamp)(const schedule_context *),
-    unsigned int contexts_per_thr, time_duration timeout)
+    unsigned int contexts_per_thr, time_duration timeout,
+    unsigned int reactors)
 {
 	setup_sigalrm();
+	if (reactors == 0) {
+		auto ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		reactors = ncpu > 0 ? ncpu : 1;
+	}
+	g_reactor_num = std::max(1U, std::min(reactors, context_num));
+	g_reactors = std::make_unique<reactor[]>(g_reactor_num);
+	for (unsigned int i = 0; i < g_reactor_num; ++i) {
+		double_list_init(&g_reactors[i].polling);
+		double_list_init(&g_reactors[i].turning);
+	}
 	g_context_ptr = pcontexts;
 	g_context_num = context_num;
 	contexts_pool_get_context_socket = get_socket;
@@ -311,34 +367,59 @@ void contexts_pool_init(SCHEDULE_CONTEXT **pcontexts, unsigned int context_num,
 	for (size_t i = 0; i < g_context_num; ++i) {
 		auto pcontext = g_context_ptr[i];
 		context_init(pcontext);
+		pcontext->reactor = i % g_reactor_num;
 		double_list_append_as_tail(
 			&g_context_lists[CONTEXT_FREE], &pcontext->node);
 	}
 }
 
+static void ctxp_stop_reactors()
+{
+	for (unsigned int i = 0; i < g_reactor_num; ++i)
+		if (!pthread_equal(g_reactors[i].thread_id, {}))
+			pthread_kill(g_reactors[i].thread_id, SIGALRM);
+	for (unsigned int i = 0; i < g_reactor_num; ++i) {
+		auto &r = g_reactors[i];
+		if (!pthread_equal(r.thread_id, {}))
+			pthread_join(r.thread_id, NULL);
+		r.thread_id = {};
+	}
+}
+
 int contexts_pool_run()
 {    
-	auto ret = g_poll_ctx.init(g_context_num);
-	if (ret != 0) {
-		mlog(LV_ERR, "contexts_pool: evqueue: %s", strerror(ret));
-		return -1;
+	auto evnum = (g_context_num + g_reactor_num - 1) / g_reactor_num;
+	for (unsigned int i = 0; i < g_reactor_num; ++i) {
+		auto ret = g_reactors[i].poll_ctx.init(evnum);
+		if (ret != 0) {
+			mlog(LV_ERR, "contexts_pool: evqueue: %s", strerror(ret));
+			return -1;
+		}
 	}
 	g_notify_stop = false;
-	ret = pthread_create4(&g_thread_id, nullptr, ctxp_thrwork, nullptr);
-	if (ret != 0) {
-		mlog(LV_ERR, "contexts_pool: failed to create epoll thread: %s", strerror(ret));
-		g_notify_stop = true;
-		return -3;
+	for (unsigned int i = 0; i < g_reactor_num; ++i) {
+		auto &r = g_reactors[i];
+		auto ret = pthread_create4(&r.thread_id, nullptr, ctxp_thrwork, &r);
+		if (ret != 0) {
+			mlog(LV_ERR, "contexts_pool: failed to create epoll thread: %s", strerror(ret));
+			r.thread_id = {};
+			g_notify_stop = true;
+			ctxp_stop_reactors();
+			return -3;
+		}
+		if (g_reactor_num == 1) {
+			pthread_setname_np(r.thread_id, "epollctx/work");
+		} else {
+			char buf[32];
+			snprintf(buf, sizeof(buf), "epollctx/%u", i);
+			pthread_setname_np(r.thread_id, buf);
+		}
 	}
-	pthread_setname_np(g_thread_id, "epollctx/work");
-	ret = pthread_create4(&g_scan_id, nullptr, ctxp_scanwork, nullptr);
+	auto ret = pthread_create4(&g_scan_id, nullptr, ctxp_scanwork, nullptr);
 	if (ret != 0) {
 		mlog(LV_ERR, "contexts_pool: failed to create scan thread: %s", strerror(ret));
 		g_notify_stop = true;
-		if (!pthread_equal(g_thread_id, {})) {
-			pthread_kill(g_thread_id, SIGALRM);
-			pthread_join(g_thread_id, NULL);
-		}
+		ctxp_stop_reactors();
 		return -4;
 	}
 	pthread_setname_np(g_scan_id, "epollctx/scan");
@@ -348,24 +429,50 @@ int contexts_pool_run()
 void contexts_pool_stop()
 {
 	g_notify_stop = true;
-	if (!pthread_equal(g_thread_id, {}))
-		pthread_kill(g_thread_id, SIGALRM);
 	if (!pthread_equal(g_scan_id, {}))
 		pthread_kill(g_scan_id, SIGALRM);
-	if (!pthread_equal(g_thread_id, {}))
-		pthread_join(g_thread_id, NULL);
+	if (g_reactors != nullptr)
+		ctxp_stop_reactors();
 	if (!pthread_equal(g_scan_id, {}))
 		pthread_join(g_scan_id, NULL);
-	g_poll_ctx.reset();
 	for (size_t i = 0; i < g_context_num; ++i)
 		context_free(g_context_ptr[i]);
 	for (size_t i = CONTEXT_BEGIN; i < CONTEXT_TYPES; ++i)
 		double_list_free(&g_context_lists[i]);
+	for (unsigned int i = 0; g_reactors != nullptr && i < g_reactor_num; ++i) {
+		auto &r = g_reactors[i];
+		r.poll_ctx.reset();
+		double_list_free(&r.polling);
+		double_list_free(&r.turning);
+	}
+	g_reactors.reset();
+	g_reactor_num = 1;
 	g_context_ptr = nullptr;
 	g_context_num = 0;
 	g_contexts_per_thr = 0;
 }
 
+/* Pop the next ready context, from the home reactor or else by stealing. */
+static SCHEDULE_CONTEXT *ctxp_get_turning()
+{
+	if (g_home_reactor == UINT_MAX)
+		g_home_reactor = g_next_home++;
+	auto home = g_home_reactor % g_reactor_num;
+	for (unsigned int i = 0; i < g_reactor_num; ++i) {
+		auto &r = g_reactors[(home + i) % g_reactor_num];
+		if (i > 0 && r.nturning.load(std::memory_order_relaxed) == 0)
+			/* missing a just-queued context is harmless */
+			continue;
+		std::lock_guard turn_hold(r.turn_lock);
+		auto pnode = double_list_pop_front(&r.turning);
+		if (pnode != nullptr) {
+			--r.nturning;
+			return static_cast<SCHEDULE_CONTEXT *>(pnode->pdata);
+		}
+	}
+	return nullptr;
+}
+
 /*
  *	@param    
  *		type	type can only be one of CONTEXT_FREE OR CONTEXT_TURNING
@@ -378,6 +485,8 @@ SCHEDULE_CONTEXT* contexts_pool_get_context(int type)
 	if (CONTEXT_FREE != type && CONTEXT_TURNING != type) {
 		return NULL;
 	}
+	if (type == CONTEXT_TURNING)
+		return ctxp_get_turning();
 	std::lock_guard xhold(g_context_locks[type]);
 	pnode = double_list_pop_front(&g_context_lists[type]);
 	/* do not change context type under this circumstance */
@@ -410,20 +519,25 @@ void contexts_pool_put_context(SCHEDULE_CONTEXT *pcontext, int type)
 	}
 	
 	/* append the context at the tail of the corresponding list */
-	std::lock_guard xhold(g_context_locks[type]);
+	auto &r = ctx_reactor(pcontext);
+	auto &lock = type == CONTEXT_POLLING ? r.poll_lock :
+	             type == CONTEXT_TURNING ? r.turn_lock : g_context_locks[type];
+	auto &list = type == CONTEXT_POLLING ? r.polling :
+	             type == CONTEXT_TURNING ? r.turning : g_context_lists[type];
+	std::unique_lock xhold(lock);
 	auto original_type = pcontext->type;
 	pcontext->type = type;
 	if (CONTEXT_POLLING == type) {
 		if (original_type == CONTEXT_CONSTRUCTING) {
-			if (g_poll_ctx.mod(pcontext, true) != 0) {
+			if (r.poll_ctx.mod(pcontext, true) != 0) {
 				pcontext->b_waiting = FALSE;
 				mlog(LV_DEBUG, "contexts_pool: failed to add event to epoll");
 			} else {
 				pcontext->b_waiting = TRUE;
 			}
-		} else if (g_poll_ctx.mod(pcontext, false) != 0) {
+		} else if (r.poll_ctx.mod(pcontext, false) != 0) {
 			int se = errno;
-			if (errno == ENOENT && g_poll_ctx.mod(pcontext, true) != 0) {
+			if (errno == ENOENT && r.poll_ctx.mod(pcontext, true) != 0) {
 				/* sometimes, fd will be removed by scanning
 				thread because of timeout, add it back
 				into epoll queue again */
@@ -435,13 +549,33 @@ void contexts_pool_put_context(SCHEDULE_CONTEXT *pcontext, int type)
 				         pcontext), SHUT_RDWR);
 			}
 		}
+		if (pcontext->b_activate) {
+			/* missed an activation while it was being processed */
+			pcontext->b_activate = false;
+			pcontext->type = CONTEXT_SWITCHING;
+			xhold.unlock();
+			ctx_make_turning(pcontext);
+			threads_pool_wakeup_thread();
+			return;
+		}
 	} else if (type == CONTEXT_FREE && original_type == CONTEXT_TURNING) {
 		if (pcontext->b_waiting)
 			/* socket was removed by "close()" function automatically,
 				no need to call epoll_ctl with EPOLL_CTL_DEL */
 			pcontext->b_waiting = FALSE;
 	}
-	double_list_append_as_tail(&g_context_lists[type], &pcontext->node);
+	if (type == CONTEXT_FREE) {
+		/*
+		 * b_activate belongs to poll_lock (cf.
+		 * context_pool_activate_context). Nesting it inside the free
+		 * list lock is fine; nobody takes them the other way round.
+		 */
+		std::lock_guard poll_hold(r.poll_lock);
+		pcontext->b_activate = false;
+	}
+	double_list_append_as_tail(&list, &pcontext->node);
+	if (type == CONTEXT_TURNING)
+		++r.nturning;
 }
 
 void contexts_pool_signal(SCHEDULE_CONTEXT *pcontext)
@@ -493,25 +627,24 @@ BOOL contexts_pool_wakeup_context(SCHEDULE_CONTEXT *pcontext, int type)
 }
 
 /*
- *	try to activate a context from polling queue
+ *	try to activate a context from polling queue; if the context is not
+ *	polling at the moment, the activation is remembered and takes effect
+ *	when it is next put into the polling queue
  *	@param
  *		pcontext [in]	indicate the context object
- *		type			can only be CONTEXT_POLLING,
  */
 void context_pool_activate_context(SCHEDULE_CONTEXT *pcontext)
 {
-	std::unique_lock poll_hold(g_context_locks[CONTEXT_POLLING]);
+	auto &r = ctx_reactor(pcontext);
+	std::unique_lock poll_hold(r.poll_lock);
 	if (CONTEXT_POLLING != pcontext->type) {
+		if (pcontext->type != CONTEXT_FREE)
+			pcontext->b_activate = true;
 		return;
 	}
-	double_list_remove(&g_context_lists[CONTEXT_POLLING], &pcontext->node);
+	double_list_remove(&r.polling, &pcontext->node);
 	pcontext->type = CONTEXT_SWITCHING;
 	poll_hold.unlock();
-	std::unique_lock turn_hold(g_context_locks[CONTEXT_TURNING]);
-	pcontext->type = CONTEXT_TURNING;
-	double_list_append_as_tail(
-		&g_context_lists[CONTEXT_TURNING],
-		&pcontext->node);
-	turn_hold.unlock();
+	ctx_make_turning(pcontext);
 	threads_pool_wakeup_thread();
 }
@@ -1,14 +1,31 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later, OR GPL-2.0-or-later WITH linking exception
 // SPDX-FileCopyrightText: 2021-2022 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <cstdint>
 #include <cstring>
+#include <ctime>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <string_view>
+#include <vector>
+#include <libHX/io.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 #include <openssl/ssl.h>
+#if defined(OPENSSL_VERSION_NUMBER) && OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(LIBRESSL_VERSION_NUMBER)
+#	include <openssl/core_names.h>
+#	define GX_TICKET_EVP_CB 1
+#endif
+#include <sys/stat.h>
 #include <gromox/cryptoutil.hpp>
+#include <gromox/defs.h>
 #include <gromox/endian.hpp>
+#include <gromox/util.hpp>
 
 namespace gromox {
 
@@ -96,6 +113,22 @@ void tls_set_renego(SSL_CTX *ctx)
 #endif
 }
 
+/**
+ * Ask OpenSSL to move the TLS record layer into the kernel after the
+ * handshake. Whether that actually happens is decided per connection (the
+ * kernel needs the tls module and the cipher must be supported); if it does
+ * not, the connection silently stays on the userspace path.
+ */
+int tls_set_ktls(SSL_CTX *ctx)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
 std::string sss_obf_reverse(const std::string_view &x)
 {
 	std::string out;
@@ -126,4 +159,206 @@ std::string sss_obf_reverse(const std::string_view &x)
 #undef CU
 }
 
+namespace {
+
+/* Layout of a key in tls_ticket_key_file, same as nginx's 80-byte keys */
+struct ticket_key {
+	uint8_t name[16], hmac[32], aes[32];
+	time_t created = 0;
+};
+
+/*
+ * There is just one server SSL_CTX per process, so the ticket key ring is
+ * process-wide. keys[0] encrypts new tickets; all of them are accepted for
+ * decryption.
+ */
+struct ticket_ring {
+	std::mutex lock;
+	std::vector<ticket_key> keys;
+	std::string file;
+	time_t lifetime = 0, file_mtime = 0, last_check = 0;
+};
+
+}
+
+static ticket_ring g_tkr;
+static std::atomic<unsigned long> g_tk_issued, g_tk_resumed, g_tk_unknown;
+
+static bool tkr_load_file(const char *file, std::vector<ticket_key> &out)
+{
+	size_t slurp_size = 0;
+	std::unique_ptr<char[], stdlib_delete> data(HX_slurp_file(file, &slurp_size));
+	if (data == nullptr) {
+		mlog(LV_ERR, "tls: cannot read %s: %s", file, strerror(errno));
+		return false;
+	}
+	static constexpr size_t ksize = 80;
+	if (slurp_size == 0 || slurp_size % ksize != 0) {
+		mlog(LV_ERR, "tls: %s: size must be a non-zero multiple of %zu bytes",
+		        file, ksize);
+		return false;
+	}
+	out.clear();
+	for (size_t ofs = 0; ofs < slurp_size; ofs += ksize) {
+		ticket_key k;
+		memcpy(k.name, &data[ofs], 16);
+		memcpy(k.hmac, &data[ofs+16], 32);
+		memcpy(k.aes, &data[ofs+48], 32);
+		out.push_back(k);
+	}
+	return true;
+}
+
+/* Bring the key ring up to date. Must be called with g_tkr.lock held. */
+static void tkr_refresh(time_t now)
+{
+	if (!g_tkr.file.empty()) {
+		/* Shared keys are rotated externally; look for a new file once a minute. */
+		if (!g_tkr.keys.empty() && now - g_tkr.last_check < 60)
+			return;
+		g_tkr.last_check = now;
+		struct stat sb;
+		if (stat(g_tkr.file.c_str(), &sb) != 0) {
+			mlog(LV_ERR, "tls: stat %s: %s", g_tkr.file.c_str(), strerror(errno));
+			return;
+		}
+		if (!g_tkr.keys.empty() && sb.st_mtime == g_tkr.file_mtime)
+			return;
+		std::vector<ticket_key> nk;
+		if (!tkr_load_file(g_tkr.file.c_str(), nk))
+			return;
+		g_tkr.keys = std::move(nk);
+		g_tkr.file_mtime = sb.st_mtime;
+		mlog(LV_INFO, "tls: loaded %zu session ticket key(s) from %s",
+		        g_tkr.keys.size(), g_tkr.file.c_str());
+		return;
+	}
+	if (!g_tkr.keys.empty() && now - g_tkr.keys[0].created < g_tkr.lifetime)
+		return;
+	ticket_key k;
+	if (RAND_bytes(k.name, sizeof(k.name)) != 1 ||
+	    RAND_bytes(k.hmac, sizeof(k.hmac)) != 1 ||
+	    RAND_bytes(k.aes, sizeof(k.aes)) != 1)
+		return;
+	k.created = now;
+	g_tkr.keys.insert(g_tkr.keys.begin(), k);
+	/*
+	 * A ticket made just before rotation must remain usable for its full
+	 * lifetime, so the previous key is kept around for decryption.
+	 */
+	if (g_tkr.keys.size() > 2)
+		g_tkr.keys.resize(2);
+}
+
+#ifdef GX_TICKET_EVP_CB
+using ticket_mac_ctx = EVP_MAC_CTX;
+static bool tk_mac_init(EVP_MAC_CTX *hctx, const ticket_key &k)
+{
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+			const_cast<uint8_t *>(k.hmac), sizeof(k.hmac)),
+		OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+			const_cast<char *>("sha256"), 0),
+		OSSL_PARAM_construct_end(),
+	};
+	return EVP_MAC_CTX_set_params(hctx, params) == 1;
+}
+#else
+using ticket_mac_ctx = HMAC_CTX;
+static bool tk_mac_init(HMAC_CTX *hctx, const ticket_key &k)
+{
+	return HMAC_Init_ex(hctx, k.hmac, sizeof(k.hmac), EVP_sha256(), nullptr) == 1;
+}
+#endif
+
+/*
+ * Return values as per SSL_CTX_set_tlsext_ticket_key_cb: 1 = ok, 2 = ok but
+ * please issue a fresh ticket (old key), 0 = unknown key (full handshake),
+ * -1 = error.
+ */
+static int tk_callback(SSL *, unsigned char *key_name, unsigned char *iv,
+    EVP_CIPHER_CTX *cctx, ticket_mac_ctx *hctx, int enc)
+{
+	std::lock_guard hold(g_tkr.lock);
+	tkr_refresh(time(nullptr));
+	if (g_tkr.keys.empty())
+		return enc ? -1 : 0;
+	if (enc) {
+		const auto &k = g_tkr.keys[0];
+		if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1 ||
+		    EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, k.aes, iv) != 1 ||
+		    !tk_mac_init(hctx, k))
+			return -1;
+		memcpy(key_name, k.name, sizeof(k.name));
+		++g_tk_issued;
+		return 1;
+	}
+	for (size_t i = 0; i < g_tkr.keys.size(); ++i) {
+		const auto &k = g_tkr.keys[i];
+		if (memcmp(key_name, k.name, sizeof(k.name)) != 0)
+			continue;
+		if (!tk_mac_init(hctx, k) ||
+		    EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, k.aes, iv) != 1)
+			return -1;
+		++g_tk_resumed;
+		return i == 0 ? 1 : 2;
+	}
+	++g_tk_unknown;
+	return 0;
+}
+
+/**
+ * @id_ctx:	session id context; must differ between services that should
+ * 		not resume each other's sessions
+ * @cache_size:	number of sessions held in the server-side cache (0 = no cache)
+ * @lifetime:	session/ticket validity in seconds; also the rotation interval
+ * 		of self-generated ticket keys
+ * @key_file:	optional file with shared ticket keys (empty/nullptr = generate
+ * 		keys in-process)
+ */
+int tls_set_resumption(SSL_CTX *ctx, const char *id_ctx, size_t cache_size,
+    unsigned int lifetime, const char *key_file)
+{
+	if (SSL_CTX_set_session_id_context(ctx, reinterpret_cast<const unsigned char *>(id_ctx),
+	    std::min(strlen(id_ctx), static_cast<size_t>(SSL_MAX_SID_CTX_LENGTH))) != 1)
+		return -1;
+	if (cache_size > 0) {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(ctx, cache_size);
+	} else {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	}
+	if (lifetime > 0)
+		SSL_CTX_set_timeout(ctx, lifetime);
+	std::lock_guard hold(g_tkr.lock);
+	g_tkr.lifetime = lifetime > 0 ? lifetime : 3600;
+	g_tkr.file = znul(key_file);
+	g_tkr.keys.clear();
+	g_tkr.last_check = 0;
+	tkr_refresh(time(nullptr));
+	if (g_tkr.keys.empty())
+		return -1;
+#ifdef GX_TICKET_EVP_CB
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, tk_callback);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(ctx, tk_callback);
+#endif
+	return 0;
+}
+
+void tls_resumption_report(SSL_CTX *ctx)
+{
+	using LLU = unsigned long long;
+	auto full = SSL_CTX_sess_accept_good(ctx);
+	auto hits = SSL_CTX_sess_hits(ctx);
+	mlog(LV_INFO, "tls: %lld handshakes, %lld resumed (%.1f%%), %lld cache misses, %lld cache timeouts, %ld cached",
+	        static_cast<long long>(full), static_cast<long long>(hits),
+	        full > 0 ? 100.0 * hits / full : 0.0,
+	        static_cast<long long>(SSL_CTX_sess_misses(ctx)),
+	        static_cast<long long>(SSL_CTX_sess_timeouts(ctx)),
+	        SSL_CTX_sess_number(ctx));
+	mlog(LV_INFO, "tls: tickets: %llu issued, %llu accepted, %llu with unknown key",
+	        LLU{g_tk_issued}, LLU{g_tk_resumed}, LLU{g_tk_unknown});
+}
+
 }
@@ -3,11 +3,15 @@
 // This file is part of Gromox.
 #include <cerrno>
 #include <climits>
+#include <cstdint>
 #include <cstdio>
+#include <initializer_list>
 #include <memory>
+#include <string>
 #include <fmt/core.h>
 #include <gromox/database.h>
 #include <gromox/dbop.h>
+#include <gromox/mapidefs.h>
 #include <gromox/scope.hpp>
 #include <gromox/util.hpp>
 
@@ -383,6 +387,75 @@ static constexpr char tbl_pub_replmap_0[] =
 "  replid INTEGER PRIMARY KEY AUTOINCREMENT,"
 "  replguid TEXT COLLATE NOCASE UNIQUE NOT NULL)";
 
+/*
+ * Copies of frequently sorted/filtered message properties on the messages
+ * row, so that content tables need not look them up in message_properties
+ * one row at a time. The triggers keep them in sync with every writer of
+ * message_properties.
+ *
+ * delivery_time/lastmod_time: PR_MESSAGE_DELIVERY_TIME, PR_LAST_MODIFICATION_TIME
+ * (NULL if absent).
+ * msg_class: PR_MESSAGE_CLASS (absent: "IPM.Note"), subject: PR_SUBJECT
+ * (prefix + normalized subject). Both NULL whenever an 8-bit variant is
+ * stored, as those need charset conversion when read.
+ */
+static std::string msghot_tags(std::initializer_list<uint32_t> tags)
+{
+	std::string s;
+	for (auto t : tags)
+		s += (s.empty() ? "" : ",") + std::to_string(t);
+	return s;
+}
+
+/* Assignments recomputing all hot columns of message @m */
+static std::string msghot_set(const char *m)
+{
+	auto prop = [&](uint32_t t) {
+		return fmt::format("(SELECT propval FROM message_properties"
+		       " WHERE message_id={} AND proptag={})", m, t);
+	};
+	auto has = [&](std::initializer_list<uint32_t> t) {
+		return fmt::format("EXISTS(SELECT 1 FROM message_properties"
+		       " WHERE message_id={} AND proptag IN ({}))", m, msghot_tags(t));
+	};
+	return "delivery_time=" + prop(PR_MESSAGE_DELIVERY_TIME) +
+	       ",lastmod_time=" + prop(PR_LAST_MODIFICATION_TIME) +
+	       ",msg_class=CASE WHEN " + has({PR_MESSAGE_CLASS_A}) +
+	       " THEN NULL ELSE IFNULL(" + prop(PR_MESSAGE_CLASS) + ",'IPM.Note') END" +
+	       ",subject=CASE WHEN " + has({PR_SUBJECT_PREFIX_A, PR_NORMALIZED_SUBJECT_A}) +
+	       " THEN NULL ELSE IFNULL(" + prop(PR_SUBJECT_PREFIX) + ",'')||IFNULL(" +
+	       prop(PR_NORMALIZED_SUBJECT) + ",'') END";
+}
+
+static std::string msghot_sql()
+{
+	auto tags = msghot_tags({PR_MESSAGE_DELIVERY_TIME,
+	            PR_LAST_MODIFICATION_TIME, PR_MESSAGE_CLASS_A,
+	            PR_MESSAGE_CLASS, PR_SUBJECT_PREFIX_A, PR_SUBJECT_PREFIX,
+	            PR_NORMALIZED_SUBJECT_A, PR_NORMALIZED_SUBJECT});
+	return "ALTER TABLE messages ADD COLUMN delivery_time INTEGER DEFAULT NULL;"
+	       "ALTER TABLE messages ADD COLUMN lastmod_time INTEGER DEFAULT NULL;"
+	       "ALTER TABLE messages ADD COLUMN msg_class TEXT DEFAULT NULL;"
+	       "ALTER TABLE messages ADD COLUMN subject TEXT DEFAULT NULL;"
+	       "UPDATE messages SET " + msghot_set("messages.message_id") + ";"
+	       "CREATE INDEX parent_delivery_index14 ON messages(parent_fid, is_associated, delivery_time);"
+	       "CREATE INDEX parent_lastmod_index14 ON messages(parent_fid, is_associated, lastmod_time);"
+	       "CREATE TRIGGER msghot_insert14 AFTER INSERT ON message_properties"
+	       " WHEN NEW.proptag IN (" + tags + ") BEGIN"
+	       " UPDATE messages SET " + msghot_set("NEW.message_id") +
+	       " WHERE message_id=NEW.message_id; END;"
+	       "CREATE TRIGGER msghot_update14 AFTER UPDATE ON message_properties"
+	       " WHEN NEW.proptag IN (" + tags + ") OR OLD.proptag IN (" + tags + ") BEGIN"
+	       " UPDATE messages SET " + msghot_set("NEW.message_id") +
+	       " WHERE message_id=NEW.message_id; END;"
+	       "CREATE TRIGGER msghot_delete14 AFTER DELETE ON message_properties"
+	       " WHEN OLD.proptag IN (" + tags + ") BEGIN"
+	       " UPDATE messages SET " + msghot_set("OLD.message_id") +
+	       " WHERE message_id=OLD.message_id; END;";
+}
+
+static const std::string tbl_msghot_14 = msghot_sql();
+
 static constexpr tbl_init tbl_pvt_init_0[] = {
 	{"configurations", tbl_config_0},
 	{"allocated_eids", tbl_alloc_eids_0},
@@ -405,7 +478,7 @@ static constexpr tbl_init tbl_pvt_init_0[] = {
 	TABLE_END,
 };
 
-static constexpr tbl_init tbl_pvt_init_top[] = {
+static const tbl_init tbl_pvt_init_top[] = {
 	{"configurations", tbl_config_1},
 	{"allocated_eids", tbl_alloc_eids_0},
 	{"named_properties", tbl_namedprops_12},
@@ -422,6 +495,7 @@ static constexpr tbl_init tbl_pvt_init_top[] = {
 	{"attachment_properties", tbl_atxprops_6},
 	{"folders", tbl_pvt_folders_10},
 	{"messages", tbl_pvt_msgs_8},
+	{"messages (hot columns)", tbl_msghot_14.c_str()},
 	{"receive_table", tbl_pvt_recvfld_0},
 	{"search_scopes", tbl_pvt_searchscopes_0},
 	{"search_result", tbl_pvt_searchresult_0},
@@ -451,7 +525,7 @@ static constexpr tbl_init tbl_pub_init_0[] = {
 	TABLE_END,
 };
 
-static constexpr tbl_init tbl_pub_init_top[] = {
+static const tbl_init tbl_pub_init_top[] = {
 	{"configurations", tbl_config_1},
 	{"allocated_eids", tbl_alloc_eids_0},
 	{"named_properties", tbl_namedprops_0},
@@ -467,6 +541,7 @@ static constexpr tbl_init tbl_pub_init_top[] = {
 	{"attachment_properties", tbl_atxprops_6},
 	{"folders", tbl_pub_folders_0},
 	{"messages", tbl_pub_msgs_0},
+	{"messages (hot columns)", tbl_msghot_14.c_str()},
 	{"read_states", tbl_pub_readst_0},
 	{"read_cns", tbl_pub_readcn_0},
 	{"replca_mapping", tbl_pub_replmap_0},
@@ -484,6 +559,18 @@ static constexpr char tbl_midb_folders_0[] =
 "  sort_field INTEGER DEFAULT 0);"
 "CREATE INDEX parent_fid_index ON folders(parent_fid);";
 
+static constexpr char tbl_midb_folders_2[] =
+"CREATE TABLE folders ("
+"  folder_id INTEGER PRIMARY KEY,"
+"  parent_fid INTEGER NOT NULL,"
+"  commit_max INTEGER NOT NULL,"
+"  name TEXT NOT NULL UNIQUE,"
+"  uidnext INTEGER DEFAULT 0,"
+"  unsub INTEGER DEFAULT 0,"
+"  sort_field INTEGER DEFAULT 0,"
+"  sync_cn INTEGER DEFAULT 0);"
+"CREATE INDEX parent_fid_index ON folders(parent_fid);";
+
 static constexpr char tbl_midb_msgs_0[] =
 "CREATE TABLE messages ("
 "  message_id INTEGER PRIMARY KEY,"
@@ -537,7 +624,7 @@ static constexpr tbl_init tbl_midb_init_0[] = {
 
 static constexpr tbl_init tbl_midb_init_top[] = {
 	{"configurations", tbl_config_1},
-	{"folders", tbl_midb_folders_0},
+	{"folders", tbl_midb_folders_2},
 	{"messages", tbl_midb_msgs_0},
 	{"mapping", tbl_midb_mapping_0},
 	TABLE_END,
@@ -547,7 +634,7 @@ static constexpr tbl_init tbl_midb_init_top[] = {
  * Because sqlite does not support ALTER TABLE CHANGE COLUMN statements, we are
  * but left with recreating the entire table and issuing a move(copy) command.
  */
-static constexpr tblite_upgradefn tbl_pvt_upgrade_list[] = {
+static const tblite_upgradefn tbl_pvt_upgrade_list[] = {
 	{1, nullptr, "configurations", tbl_config_1, tbl_config_move1},
 	{2, nullptr, "store_properties", tbl_storeprops_2, tbl_storeprops_move2},
 	{3, nullptr, "folder_properties", tbl_fldprops_3, tbl_fldprops_move3},
@@ -565,11 +652,12 @@ static constexpr tblite_upgradefn tbl_pvt_upgrade_list[] = {
 	{11, tbl_pvt_autoreply_ts_11},
 	{12, "CREATE UNIQUE INDEX namedprop_unique ON named_properties(name_string)"},
 	{13, tbl_replguidmap_13},
+	{14, tbl_msghot_14.c_str()},
 	/* advance schema numbers in lockstep with public stores */
 	TABLE_END,
 };
 
-static constexpr tblite_upgradefn tbl_pub_upgrade_list[] = {
+static const tblite_upgradefn tbl_pub_upgrade_list[] = {
 	{1, nullptr, "configurations", tbl_config_1, tbl_config_move1},
 	{2, nullptr, "store_properties", tbl_storeprops_2, tbl_storeprops_move2},
 	{3, nullptr, "folder_properties", tbl_fldprops_3, tbl_fldprops_move3},
@@ -577,12 +665,14 @@ static constexpr tblite_upgradefn tbl_pub_upgrade_list[] = {
 	{5, nullptr, "recipients_properties", tbl_rcptprops_5, tbl_rcptprops_move5},
 	{6, nullptr, "attachment_properties", tbl_atxprops_6, tbl_atxprops_move6},
 	{13, tbl_replguidmap_13},
+	{14, tbl_msghot_14.c_str()},
 	/* advance schema numbers in lockstep with private stores */
 	TABLE_END,
 };
 
 static constexpr tblite_upgradefn tbl_midb_upgrade_list[] = {
 	{1, nullptr, "configurations", tbl_config_1, tbl_config_move1},
+	{2, "ALTER TABLE folders ADD COLUMN sync_cn INTEGER DEFAULT 0"},
 	TABLE_END,
 };
 
@@ -1851,7 +1851,53 @@ static pack_result exmdb_push(EXT_PUSH &x, const exreq_write_message &d)
 	TRY(x.p_uint64(d.folder_id));
 	return x.p_msgctnt(*d.pmsgctnt);
 }
+
+static pack_result exmdb_pull(EXT_PULL &x, exreq_write_messages &d)
+{
+	TRY(x.g_str(&d.account));
+	TRY(x.g_nlscp(&d.cpid));
+	TRY(x.g_uint32(&d.count));
+	if (d.count == 0)
+		return EXT_ERR_SUCCESS;
+	d.folder_ids = cu_alloc<uint64_t>(d.count);
+	d.pmsgctnts = cu_alloc<MESSAGE_CONTENT>(d.count);
+	if (d.folder_ids == nullptr || d.pmsgctnts == nullptr)
+		return EXT_ERR_ALLOC;
+	for (size_t i = 0; i < d.count; ++i) {
+		TRY(x.g_uint64(&d.folder_ids[i]));
+		TRY(x.g_msgctnt(&d.pmsgctnts[i]));
+	}
+	return EXT_ERR_SUCCESS;
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exreq_write_messages &d)
+{
+	TRY(x.p_str(d.account));
+	TRY(x.p_uint32(d.cpid));
+	TRY(x.p_uint32(d.count));
+	for (size_t i = 0; i < d.count; ++i) {
+		TRY(x.p_uint64(d.folder_ids[i]));
+		TRY(x.p_msgctnt(d.pmsgctnts[i]));
+	}
+	return EXT_ERR_SUCCESS;
+}
 	
+static pack_result exmdb_pull(EXT_PULL &x, exreq_read_instance_range &d)
+{
+	TRY(x.g_uint32(&d.instance_id));
+	TRY(x.g_uint32(&d.proptag));
+	TRY(x.g_uint32(&d.offset));
+	return x.g_uint32(&d.length);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exreq_read_instance_range &d)
+{
+	TRY(x.p_uint32(d.instance_id));
+	TRY(x.p_uint32(d.proptag));
+	TRY(x.p_uint32(d.offset));
+	return x.p_uint32(d.length);
+}
+
 static pack_result exmdb_pull(EXT_PULL &x, exreq_read_message &d)
 {
 	uint8_t tmp_byte;
@@ -2242,6 +2288,22 @@ static pack_result exmdb_push(EXT_PUSH &x, const exreq_recalc_store_size &d)
 	return x.p_uint32(d.flags);
 }
 
+static pack_result exmdb_pull(EXT_PULL &x, exreq_query_freebusy &d)
+{
+	TRY(x.g_uint64(&d.folder_id));
+	TRY(x.g_int64(&d.start_time));
+	TRY(x.g_int64(&d.end_time));
+	return x.g_bool(&d.b_detailed);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exreq_query_freebusy &d)
+{
+	TRY(x.p_uint64(d.folder_id));
+	TRY(x.p_int64(d.start_time));
+	TRY(x.p_int64(d.end_time));
+	return x.p_bool(d.b_detailed);
+}
+
 #define RQ_WITH_ARGS \
 	E(get_named_propids) \
 	E(get_named_propnames) \
@@ -2364,7 +2426,10 @@ static pack_result exmdb_push(EXT_PUSH &x, const exreq_recalc_store_size &d)
 	E(purge_softdelete) \
 	E(autoreply_tsquery) \
 	E(autoreply_tsupdate) \
-	E(recalc_store_size)
+	E(recalc_store_size) \
+	E(query_freebusy) \
+	E(write_messages) \
+	E(read_instance_range)
 
 /**
  * This uses *& because we do not know which request type we are going to get
@@ -3637,6 +3702,43 @@ static pack_result exmdb_push(EXT_PUSH &x, const exresp_autoreply_tsquery &d)
 	return x.p_uint64(d.tdiff);
 }
 
+static pack_result exmdb_pull(EXT_PULL &x, exresp_query_freebusy &d)
+{
+	return x.g_fb_a(&d.fb_events);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exresp_query_freebusy &d)
+{
+	TRY(x.p_uint32(d.fb_events.count));
+	for (size_t i = 0; i < d.fb_events.count; ++i)
+		TRY(x.p_fbevent(d.fb_events.fb_events[i]));
+	return EXT_ERR_SUCCESS;
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exresp_write_messages &d)
+{
+	TRY(x.g_uint32(reinterpret_cast<uint32_t *>(&d.e_result)));
+	return x.g_uint32(&d.failed_index);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exresp_write_messages &d)
+{
+	TRY(x.p_uint32(d.e_result));
+	return x.p_uint32(d.failed_index);
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exresp_read_instance_range &d)
+{
+	TRY(x.g_uint32(&d.total_size));
+	return x.g_bin_ex(&d.data);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exresp_read_instance_range &d)
+{
+	TRY(x.p_uint32(d.total_size));
+	return x.p_bin_ex(d.data);
+}
+
 #define RSP_WITHOUT_ARGS \
 	E(ping_store) \
 	E(remove_store_properties) \
@@ -3768,7 +3870,10 @@ static pack_result exmdb_push(EXT_PUSH &x, const exresp_autoreply_tsquery &d)
 	E(check_contact_address) \
 	E(get_public_folder_unread_count) \
 	E(store_eid_to_user) \
-	E(autoreply_tsquery)
+	E(autoreply_tsquery) \
+	E(query_freebusy) \
+	E(write_messages) \
+	E(read_instance_range)
 
 /* exmdb_callid::connect, exmdb_callid::listen_notification not included */
 /*
@@ -1,6 +1,9 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 // SPDX-FileCopyrightText: 2023 grommunio GmbH
 // This file is part of Gromox.
+#include <array>
+#include <cstring>
+#include <string>
 #include <vector>
 #include <fmt/core.h>
 #include <fmt/format.h>
@@ -19,43 +22,56 @@
 using namespace gromox;
 namespace exmdb_client = exmdb_client_remote;
 
+static const PROPERTY_NAME fb_propname_buff[] = {
+	{MNID_ID, PSETID_APPOINTMENT, PidLidAppointmentStartWhole},
+	{MNID_ID, PSETID_APPOINTMENT, PidLidAppointmentEndWhole},
+	{MNID_ID, PSETID_APPOINTMENT, PidLidBusyStatus},
+	{MNID_ID, PSETID_APPOINTMENT, PidLidRecurring},
+	{MNID_ID, PSETID_APPOINTMENT, PidLidAppointmentRecur},
+	{MNID_ID, PSETID_APPOINTMENT, PidLidAppointmentSubType},
+	{MNID_ID, PSETID_COMMON,      PidLidPrivate},
+	{MNID_ID, PSETID_APPOINTMENT, PidLidAppointmentStateFlags},
+	{MNID_ID, PSETID_APPOINTMENT, PidLidClipEnd},
+	{MNID_ID, PSETID_APPOINTMENT, PidLidLocation},
+	{MNID_ID, PSETID_COMMON,      PidLidReminderSet},
+	{MNID_ID, PSETID_MEETING,     PidLidGlobalObjectId},
+	{MNID_ID, PSETID_APPOINTMENT, PidLidTimeZoneStruct},
+};
+
+const PROPNAME_ARRAY freebusy_tags::propnames =
+	{std::size(fb_propname_buff), deconst(fb_propname_buff)};
+
 freebusy_tags::freebusy_tags(const char *dir)
 {
-	static const PROPERTY_NAME propname_buff[] = {
-		{MNID_ID, PSETID_APPOINTMENT, PidLidAppointmentStartWhole},
-		{MNID_ID, PSETID_APPOINTMENT, PidLidAppointmentEndWhole},
-		{MNID_ID, PSETID_APPOINTMENT, PidLidBusyStatus},
-		{MNID_ID, PSETID_APPOINTMENT, PidLidRecurring},
-		{MNID_ID, PSETID_APPOINTMENT, PidLidAppointmentRecur},
-		{MNID_ID, PSETID_APPOINTMENT, PidLidAppointmentSubType},
-		{MNID_ID, PSETID_COMMON,      PidLidPrivate},
-		{MNID_ID, PSETID_APPOINTMENT, PidLidAppointmentStateFlags},
-		{MNID_ID, PSETID_APPOINTMENT, PidLidClipEnd},
-		{MNID_ID, PSETID_APPOINTMENT, PidLidLocation},
-		{MNID_ID, PSETID_COMMON,      PidLidReminderSet},
-		{MNID_ID, PSETID_MEETING,     PidLidGlobalObjectId},
-		{MNID_ID, PSETID_APPOINTMENT, PidLidTimeZoneStruct},
-	};
-
-	const PROPNAME_ARRAY propnames = {std::size(propname_buff), deconst(propname_buff)};
 	PROPID_ARRAY ids;
-	if (exmdb_client::get_named_propids(dir, false, &propnames, &ids) &&
-	    ids.count == propnames.count) {
-
-		apptstartwhole = PROP_TAG(PT_SYSTIME, ids.ppropid[0]);
-		apptendwhole   = PROP_TAG(PT_SYSTIME, ids.ppropid[1]);
-		busystatus     = PROP_TAG(PT_LONG,    ids.ppropid[2]);
-		recurring      = PROP_TAG(PT_BOOLEAN, ids.ppropid[3]);
-		apptrecur      = PROP_TAG(PT_BINARY,  ids.ppropid[4]);
-		apptsubtype    = PROP_TAG(PT_BOOLEAN, ids.ppropid[5]);
-		private_flag   = PROP_TAG(PT_BOOLEAN, ids.ppropid[6]);
-		apptstateflags = PROP_TAG(PT_LONG,    ids.ppropid[7]);
-		clipend        = PROP_TAG(PT_SYSTIME, ids.ppropid[8]);
-		location       = PROP_TAG(PT_UNICODE, ids.ppropid[9]);
-		reminderset    = PROP_TAG(PT_BOOLEAN, ids.ppropid[10]);
-		globalobjectid = PROP_TAG(PT_BINARY,  ids.ppropid[11]);
-		timezonestruct = PROP_TAG(PT_BINARY,  ids.ppropid[12]);
-	}
+	if (exmdb_client::get_named_propids(dir, false, &propnames, &ids))
+		*this = freebusy_tags(ids);
+}
+
+freebusy_tags::freebusy_tags(const PROPID_ARRAY &ids)
+{
+	if (ids.count != propnames.count)
+		return;
+	apptstartwhole = PROP_TAG(PT_SYSTIME, ids.ppropid[0]);
+	apptendwhole   = PROP_TAG(PT_SYSTIME, ids.ppropid[1]);
+	busystatus     = PROP_TAG(PT_LONG,    ids.ppropid[2]);
+	recurring      = PROP_TAG(PT_BOOLEAN, ids.ppropid[3]);
+	apptrecur      = PROP_TAG(PT_BINARY,  ids.ppropid[4]);
+	apptsubtype    = PROP_TAG(PT_BOOLEAN, ids.ppropid[5]);
+	private_flag   = PROP_TAG(PT_BOOLEAN, ids.ppropid[6]);
+	apptstateflags = PROP_TAG(PT_LONG,    ids.ppropid[7]);
+	clipend        = PROP_TAG(PT_SYSTIME, ids.ppropid[8]);
+	location       = PROP_TAG(PT_UNICODE, ids.ppropid[9]);
+	reminderset    = PROP_TAG(PT_BOOLEAN, ids.ppropid[10]);
+	globalobjectid = PROP_TAG(PT_BINARY,  ids.ppropid[11]);
+	timezonestruct = PROP_TAG(PT_BINARY,  ids.ppropid[12]);
+}
+
+std::array<uint32_t, 13> freebusy_tags::proptags() const
+{
+	return {apptstartwhole, apptendwhole, busystatus, recurring, apptrecur,
+	        apptsubtype, private_flag, apptstateflags, location,
+	        reminderset, globalobjectid, timezonestruct, PR_SUBJECT};
 }
 
 freebusy_event_details::freebusy_event_details(char *ev_id, char *ev_subject,
@@ -324,6 +340,92 @@ static bool goid_to_icaluid(BINARY *gobj, std::string &uid_buf)
 	return true;
 }
 
+bool freebusy_expand(const freebusy_tags &ptag, const TPROPVAL_ARRAY &row,
+    time_t start_time, time_t end_time, bool detailed,
+    std::vector<freebusy_event> &fb_data)
+{
+	std::string uid_buf;
+	if (!goid_to_icaluid(row.get<BINARY>(ptag.globalobjectid), uid_buf))
+		return false;
+	/* the events only carry pointers, so the uid must outlive this frame */
+	auto uid = static_cast<char *>(exmdb_rpc_alloc(uid_buf.size() + 1));
+	if (uid == nullptr)
+		return false;
+	memcpy(uid, uid_buf.c_str(), uid_buf.size() + 1);
+	auto ts = row.get<const uint64_t>(ptag.apptstartwhole);
+	if (ts == nullptr)
+		return false;
+	auto start_whole = rop_util_nttime_to_unix(*ts);
+	ts = row.get<uint64_t>(ptag.apptendwhole);
+	if (ts == nullptr)
+		return false;
+	auto end_whole   = rop_util_nttime_to_unix(*ts);
+	auto subject     = row.get<char>(PR_SUBJECT);
+	auto location    = row.get<char>(ptag.location);
+	auto flag        = row.get<const uint8_t>(ptag.reminderset);
+	bool is_reminder = flag != nullptr && *flag != 0;
+	flag = row.get<uint8_t>(ptag.private_flag);
+	bool is_private  = flag != nullptr && *flag != 0;
+	auto num = row.get<const uint32_t>(ptag.busystatus);
+	uint32_t busy_type = num == nullptr || *num > olWorkingElsewhere ? 0 : *num;
+	num = row.get<uint32_t>(ptag.apptstateflags);
+	bool is_meeting = num != nullptr && *num & asfMeeting;
+	flag = row.get<uint8_t>(ptag.recurring);
+
+	// non-recurring appointments
+	if (flag == nullptr || *flag == 0) {
+		fb_data.emplace_back(start_whole, end_whole, busy_type, uid,
+			subject, location, is_meeting, false, false, is_reminder, is_private, detailed);
+		return true;
+	}
+	// recurring appointments
+	EXT_PULL ext_pull;
+	std::optional<ical_component> tzcom;
+	auto bin = row.get<BINARY>(ptag.timezonestruct);
+	if (bin != nullptr) {
+		TIMEZONESTRUCT tz;
+		ext_pull.init(bin->pb, bin->cb, exmdb_rpc_alloc, EXT_FLAG_UTF16);
+		if (ext_pull.g_tzstruct(&tz) != EXT_ERR_SUCCESS)
+			return false;
+		tzcom = tz_to_vtimezone(1600, "timezone", tz);
+		if (!tzcom.has_value())
+			return false;
+	}
+
+	bin = row.get<BINARY>(ptag.apptrecur);
+	if (bin == nullptr)
+		return false;
+	APPOINTMENT_RECUR_PAT apprecurr;
+	ext_pull.init(bin->pb, bin->cb, exmdb_rpc_alloc, EXT_FLAG_UTF16);
+	if (ext_pull.g_apptrecpat(&apprecurr) != EXT_ERR_SUCCESS)
+		return false;
+
+	std::vector<event> event_list;
+	if (!find_recur_times(tzcom.has_value() ? &*tzcom : nullptr,
+	    start_whole, apprecurr, start_time, end_time, event_list))
+		return false;
+
+	for (const auto &event : event_list) {
+		if (event.ei == nullptr || event.xe == nullptr) {
+			fb_data.emplace_back(event.start_time, event.end_time, busy_type,
+				uid, subject, location, is_meeting, TRUE, false,
+				is_reminder, is_private, detailed);
+			continue;
+		}
+
+		bool ov_meeting  = (event.ei->overrideflags & ARO_MEETINGTYPE) ? event.ei->meetingtype & 1 : is_meeting;
+		bool ov_reminder = (event.ei->overrideflags & ARO_REMINDER)    ? event.ei->reminderset == 0 : is_reminder;
+		uint32_t ov_busy = (event.ei->overrideflags & ARO_BUSYSTATUS)  ? event.ei->busystatus : busy_type;
+		auto ov_subj     = (event.ei->overrideflags & ARO_SUBJECT)     ? event.xe->subject : subject;
+		auto ov_location = (event.ei->overrideflags & ARO_LOCATION)    ? event.xe->location : location;
+
+		fb_data.emplace_back(event.start_time, event.end_time, ov_busy,
+			uid, ov_subj, ov_location, ov_meeting, TRUE, TRUE,
+			ov_reminder, is_private, detailed);
+	}
+	return true;
+}
+
 bool get_freebusy(const char *username, const char *dir, time_t start_time,
     time_t end_time, std::vector<freebusy_event> &fb_data)
 {
@@ -339,10 +441,20 @@ bool get_freebusy(const char *username, const char *dir, time_t start_time,
 		permission = frightsFreeBusyDetailed | frightsReadAny;
 	}
 
+	bool detailed = permission & (frightsFreeBusyDetailed | frightsReadAny);
+	FB_ARRAY idx_events{};
+	if (exmdb_client::query_freebusy(dir, cal_eid, start_time, end_time,
+	    detailed, &idx_events)) {
+		if (idx_events.count > 0)
+			fb_data.insert(fb_data.end(), idx_events.fb_events,
+				idx_events.fb_events + idx_events.count);
+		return true;
+	}
+
+	/* Server without the busy-interval index; expand on this side. */
 	freebusy_tags ptag(dir);
 	auto start_nttime = rop_util_unix_to_nttime(start_time);
 	auto end_nttime   = rop_util_unix_to_nttime(end_time);
-	bool detailed     = permission & (frightsFreeBusyDetailed | frightsReadAny);
 	static constexpr uint8_t fixed_true = 1;
 
 	/* C1: apptstartwhole >= start && apptstartwhole <= end */
@@ -390,94 +502,15 @@ bool get_freebusy(const char *username, const char *dir, time_t start_time,
 
 	auto cl_0 = make_scope_exit([&]() { exmdb_client::unload_table(dir, table_id);});
 
-	uint32_t proptag_buff[] = {
-		ptag.apptstartwhole, ptag.apptendwhole, ptag.busystatus,
-		ptag.recurring, ptag.apptrecur, ptag.apptsubtype, ptag.private_flag,
-		ptag.apptstateflags, ptag.location, ptag.reminderset,
-		ptag.globalobjectid, ptag.timezonestruct, PR_SUBJECT,
-	};
-	const PROPTAG_ARRAY proptags = {std::size(proptag_buff), deconst(proptag_buff)};
+	auto proptag_buff = ptag.proptags();
+	const PROPTAG_ARRAY proptags = {proptag_buff.size(), proptag_buff.data()};
 	TARRAY_SET rows;
 	if (!exmdb_client::query_table(dir, nullptr, CP_ACP, table_id,
 	    &proptags, 0, row_count, &rows))
 		return false;
-
-	for (size_t i = 0; i < rows.count; ++i) {
-		std::string uid_buf;
-		if (!goid_to_icaluid(rows.pparray[i]->get<BINARY>(ptag.globalobjectid), uid_buf))
-			continue;
-		auto ts = rows.pparray[i]->get<const uint64_t>(ptag.apptstartwhole);
-		if (ts == nullptr)
-			continue;
-		auto start_whole = rop_util_nttime_to_unix(*ts);
-		ts = rows.pparray[i]->get<uint64_t>(ptag.apptendwhole);
-		if (ts == nullptr)
-			continue;
-		auto end_whole   = rop_util_nttime_to_unix(*ts);
-		auto subject     = rows.pparray[i]->get<char>(PR_SUBJECT);
-		auto location    = rows.pparray[i]->get<char>(ptag.location);
-		auto flag        = rows.pparray[i]->get<const uint8_t>(ptag.reminderset);
-		bool is_reminder = flag != nullptr && *flag != 0;
-		flag = rows.pparray[i]->get<uint8_t>(ptag.private_flag);
-		bool is_private  = flag != nullptr && *flag != 0;
-		auto num = rows.pparray[i]->get<const uint32_t>(ptag.busystatus);
-		uint32_t busy_type = num == nullptr || *num > olWorkingElsewhere ? 0 : *num;
-		num = rows.pparray[i]->get<uint32_t>(ptag.apptstateflags);
-		bool is_meeting = num != nullptr && *num & asfMeeting;
-		flag = rows.pparray[i]->get<uint8_t>(ptag.recurring);
-
-		// non-recurring appointments
-		if (flag == nullptr || *flag == 0) {
-			fb_data.emplace_back(start_whole, end_whole, busy_type, uid_buf.data(),
-				subject, location, is_meeting, false, false, is_reminder, is_private, detailed);
-			continue;
-		}
-		// recurring appointments
-		EXT_PULL ext_pull;
-		std::optional<ical_component> tzcom;
-		auto bin = rows.pparray[i]->get<BINARY>(ptag.timezonestruct);
-		if (bin != nullptr) {
-			TIMEZONESTRUCT tz;
-			ext_pull.init(bin->pb, bin->cb, exmdb_rpc_alloc, EXT_FLAG_UTF16);
-			if (ext_pull.g_tzstruct(&tz) != EXT_ERR_SUCCESS)
-				continue;
-			tzcom = tz_to_vtimezone(1600, "timezone", tz);
-			if (!tzcom.has_value())
-				continue;
-		}
-
-		bin = rows.pparray[i]->get<BINARY>(ptag.apptrecur);
-		if (bin == nullptr)
-			continue;
-		APPOINTMENT_RECUR_PAT apprecurr;
-		ext_pull.init(bin->pb, bin->cb, exmdb_rpc_alloc, EXT_FLAG_UTF16);
-		if (ext_pull.g_apptrecpat(&apprecurr) != EXT_ERR_SUCCESS)
-			continue;
-
-		std::vector<event> event_list;
-		if (!find_recur_times(tzcom.has_value() ? &*tzcom : nullptr,
-		    start_whole, apprecurr, start_time, end_time, event_list))
-			continue;
-
-		for (const auto &event : event_list) {
-			if (event.ei == nullptr || event.xe == nullptr) {
-				fb_data.emplace_back(event.start_time, event.end_time, busy_type,
-					uid_buf.data(), subject, location, is_meeting, TRUE, false,
-					is_reminder, is_private, detailed);
-				continue;
-			}
-
-			bool ov_meeting  = (event.ei->overrideflags & ARO_MEETINGTYPE) ? event.ei->meetingtype & 1 : is_meeting;
-			bool ov_reminder = (event.ei->overrideflags & ARO_REMINDER)    ? event.ei->reminderset == 0 : is_reminder;
-			uint32_t ov_busy = (event.ei->overrideflags & ARO_BUSYSTATUS)  ? event.ei->busystatus : busy_type;
-			auto ov_subj     = (event.ei->overrideflags & ARO_SUBJECT)     ? event.xe->subject : subject;
-			auto ov_location = (event.ei->overrideflags & ARO_LOCATION)    ? event.xe->location : location;
-
-			fb_data.emplace_back(event.start_time, event.end_time, ov_busy,
-				uid_buf.data(), ov_subj, ov_location, ov_meeting, TRUE, TRUE,
-				ov_reminder, is_private, detailed);
-		}
-	}
+	for (size_t i = 0; i < rows.count; ++i)
+		freebusy_expand(ptag, *rows.pparray[i], start_time, end_time,
+			detailed, fb_data);
 
 	cl_0.release();
 	if (!exmdb_client::unload_table(dir, table_id))
@@ -5,6 +5,7 @@
 #include <cstring>
 #include <limits>
 #include <memory>
+#include <new>
 #include <string>
 #include <libHX/string.h>
 #include <gromox/defs.h>
@@ -2077,7 +2078,11 @@ pack_result EXT_PULL::g_fb(freebusy_event *fb_event)
 	BOOL b;
 	TRY(g_bool(&b));
 
-	if (b) {
+	if (!b) {
+		fb_event->details.reset();
+	} else {
+		fb_event->details.emplace(nullptr, nullptr, nullptr,
+			false, false, false, false, false);
 		TRY(g_str(&fb_event->details->id));
 		TRY(g_str(&fb_event->details->subject));
 		TRY(g_bool(&b));
@@ -2106,8 +2111,11 @@ pack_result EXT_PULL::g_fb_a(FB_ARRAY *r)
 		return EXT_ERR_ALLOC;
 	}
 
-	for (size_t i = 0; i < r->count; ++i)
+	for (size_t i = 0; i < r->count; ++i) {
+		new(&r->fb_events[i]) freebusy_event(0, 0, 0, nullptr, nullptr,
+			nullptr, false, false, false, false, false, false);
 		TRY(g_fb(&r->fb_events[i]));
+	}
 	return EXT_ERR_SUCCESS;
 }
 
@@ -120,10 +120,7 @@ BOOL idset::hint(uint64_t eid)
 	                  [&](const repl_node &n) { return n.replid == replid; });
 	if (prepl_node == repl_list.end())
 		return FALSE;
-	for (const auto &range_node : prepl_node->range_list)
-		if (range_node.contains(value))
-			return TRUE;
-	return FALSE;
+	return prepl_node->range_list.contains(value);
 }
 
 static std::unique_ptr<BINARY, mdel> idset_init_binary()
@@ -479,6 +476,8 @@ BOOL idset::deserialize(const BINARY &bin) try
 		if (length == 0)
 			return FALSE;
 		offset += length;
+		/* The wire data is not trusted to be ordered; hint() depends on it */
+		repl_node.range_list.normalize();
 		repl_list.push_back(std::move(repl_node));
 	}
 	return TRUE;
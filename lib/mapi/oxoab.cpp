@@ -0,0 +1,605 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later WITH linking exception
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Offline address book files (MS-OXOAB): the version 4 full details file,
+ * its compressed container and binary patches between two revisions.
+ *
+ * The container uses stored blocks only. Patches are LZX DELTA streams
+ * (MS-PATCH) in verbatim blocks, with the corresponding part of the old file
+ * as reference data, so unchanged records become long back-references.
+ */
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <gromox/mapidefs.h>
+#include <gromox/oxoab.hpp>
+
+namespace gromox {
+
+namespace {
+
+struct crc_table {
+	uint32_t v[256];
+	constexpr crc_table() : v()
+	{
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (unsigned int k = 0; k < 8; ++k)
+				c = c & 1 ? 0xedb88320U ^ (c >> 1) : c >> 1;
+			v[i] = c;
+		}
+	}
+};
+
+static constexpr crc_table oab_crc_tbl;
+static constexpr uint32_t OAB_BLOCK_MAX = 0x40000;
+
+}
+
+/**
+ * CRC-32 as used by MS-OXOAB: reflected 0xEDB88320 polynomial, seeded with
+ * all ones, no final inversion.
+ */
+uint32_t oab_crc(std::string_view s, uint32_t crc)
+{
+	for (auto c : s)
+		crc = oab_crc_tbl.v[(crc ^ static_cast<uint8_t>(c)) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+static void put_le32(std::string &o, uint32_t v)
+{
+	char b[4] = {static_cast<char>(v), static_cast<char>(v >> 8),
+	             static_cast<char>(v >> 16), static_cast<char>(v >> 24)};
+	o.append(b, 4);
+}
+
+static void set_le32(std::string &o, size_t pos, uint32_t v)
+{
+	o[pos]   = static_cast<char>(v);
+	o[pos+1] = static_cast<char>(v >> 8);
+	o[pos+2] = static_cast<char>(v >> 16);
+	o[pos+3] = static_cast<char>(v >> 24);
+}
+
+/* MS-OXOAB §2.10.1: integers below 0x80 are one byte, others 0x80|count + LE bytes */
+static void put_cint(std::string &o, uint32_t v)
+{
+	if (v < 0x80) {
+		o += static_cast<char>(v);
+		return;
+	}
+	unsigned int n = v <= 0xff ? 1 : v <= 0xffff ? 2 : v <= 0xffffff ? 3 : 4;
+	o += static_cast<char>(0x80 | n);
+	for (unsigned int i = 0; i < n; ++i)
+		o += static_cast<char>(v >> (8 * i));
+}
+
+static void put_value(std::string &o, uint16_t type, const oab_propval &pv)
+{
+	switch (type) {
+	case PT_LONG:
+		put_cint(o, pv.num);
+		break;
+	case PT_BOOLEAN:
+		o += static_cast<char>(pv.num != 0);
+		break;
+	case PT_STRING8:
+	case PT_UNICODE:
+		if (!pv.str.empty())
+			o += pv.str[0];
+		o += '\0';
+		break;
+	case PT_BINARY:
+		if (pv.str.empty()) {
+			put_cint(o, 0);
+			break;
+		}
+		put_cint(o, pv.str[0].size());
+		o += pv.str[0];
+		break;
+	case PT_MV_STRING8:
+	case PT_MV_UNICODE:
+		put_cint(o, pv.str.size());
+		for (const auto &s : pv.str) {
+			o += s;
+			o += '\0';
+		}
+		break;
+	case PT_MV_BINARY:
+		put_cint(o, pv.str.size());
+		for (const auto &s : pv.str) {
+			put_cint(o, s.size());
+			o += s;
+		}
+		break;
+	}
+}
+
+/* OAB_V4_REC: size, presence bit array, values in attribute order */
+static void put_record(std::string &o, const std::vector<oab_attr> &atts,
+    const oab_record &rec)
+{
+	auto start = o.size();
+	put_le32(o, 0);
+	auto bits = o.size();
+	o.append((atts.size() + 7) / 8, '\0');
+	for (size_t i = 0; i < atts.size(); ++i) {
+		auto it = std::find_if(rec.cbegin(), rec.cend(),
+		          [&](const oab_propval &v) { return v.tag == atts[i].tag; });
+		if (it == rec.cend())
+			continue;
+		o[bits + i / 8] |= 0x80 >> (i % 8);
+		put_value(o, PROP_TYPE(atts[i].tag), *it);
+	}
+	set_le32(o, start, o.size() - start);
+}
+
+static void put_proptable(std::string &o, const std::vector<oab_attr> &atts)
+{
+	put_le32(o, atts.size());
+	for (const auto &a : atts) {
+		put_le32(o, a.tag);
+		put_le32(o, a.flags);
+	}
+}
+
+/**
+ * Produce an uncompressed version 4 full details file (MS-OXOAB §2.9).
+ */
+std::string oab_write_v4(const std::vector<oab_attr> &hdr_atts,
+    const oab_record &hdr, const std::vector<oab_attr> &atts,
+    const std::vector<oab_record> &recs)
+{
+	std::string o;
+	put_le32(o, 0x20); /* ulVersion */
+	put_le32(o, 0); /* ulSerial */
+	put_le32(o, recs.size());
+	auto meta = o.size();
+	put_le32(o, 0);
+	put_proptable(o, hdr_atts);
+	put_proptable(o, atts);
+	set_le32(o, meta, o.size() - meta);
+	put_record(o, hdr_atts, hdr);
+	for (const auto &r : recs)
+		put_record(o, atts, r);
+	set_le32(o, 4, oab_crc(std::string_view(o).substr(12)));
+	return o;
+}
+
+/**
+ * Wrap @data into the LZX container (MS-OXOAB §2.11) using uncompressed
+ * blocks.
+ */
+std::string oab_compress(std::string_view data)
+{
+	std::string o;
+	o.reserve(16 + data.size() + (data.size() / OAB_BLOCK_MAX + 1) * 16);
+	put_le32(o, 3);
+	put_le32(o, 1);
+	put_le32(o, OAB_BLOCK_MAX);
+	put_le32(o, data.size());
+	for (size_t pos = 0; pos < data.size(); pos += OAB_BLOCK_MAX) {
+		auto blk = data.substr(pos, OAB_BLOCK_MAX);
+		put_le32(o, 0); /* ulFlags: stored */
+		put_le32(o, blk.size());
+		put_le32(o, blk.size());
+		put_le32(o, oab_crc(blk));
+		o += blk;
+	}
+	return o;
+}
+
+namespace {
+
+static constexpr unsigned int LZX_FRAME = 32768, LZX_MIN_MATCH = 3,
+	LZX_MAX_MATCH = 257, LZX_NUM_CHARS = 256, LZX_LENGTH_SYMS = 249,
+	LZX_PRETREE_SYMS = 20, LZX_MAX_SLOTS = 290;
+
+/* LZX bit writer: 16-bit little-endian words, most significant bit first */
+struct lzx_bitwriter {
+	void put(uint32_t v, unsigned int bits);
+	void align() { if (m_nbits > 0) put(0, 16 - m_nbits); }
+
+	std::string out;
+	private:
+	uint32_t m_acc = 0;
+	unsigned int m_nbits = 0;
+};
+
+struct lzx_token {
+	uint32_t len = 0, dist = 0; /* len == 0: literal */
+	uint8_t lit = 0;
+};
+
+struct lzx_slots {
+	lzx_slots();
+	unsigned int slot_of(uint32_t formatted) const;
+	static unsigned int extra(unsigned int s) { return s < 4 ? 0 : std::min((s - 2) / 2, 17U); }
+
+	uint32_t base[LZX_MAX_SLOTS + 1];
+};
+
+}
+
+void lzx_bitwriter::put(uint32_t v, unsigned int bits)
+{
+	while (bits > 0) {
+		unsigned int take = std::min(bits, 16 - m_nbits);
+		m_acc = (m_acc << take) | ((v >> (bits - take)) & ((1U << take) - 1));
+		m_nbits += take;
+		bits -= take;
+		if (m_nbits == 16) {
+			out += static_cast<char>(m_acc);
+			out += static_cast<char>(m_acc >> 8);
+			m_acc = m_nbits = 0;
+		}
+	}
+}
+
+lzx_slots::lzx_slots()
+{
+	base[0] = 0;
+	for (unsigned int s = 0; s < LZX_MAX_SLOTS; ++s)
+		base[s+1] = base[s] + (1U << extra(s));
+}
+
+unsigned int lzx_slots::slot_of(uint32_t formatted) const
+{
+	return std::upper_bound(base, base + LZX_MAX_SLOTS, formatted) - base - 1;
+}
+
+static const lzx_slots lzx_slot_tbl;
+
+/**
+ * Compute Huffman code lengths no longer than @maxlen. Trees must be
+ * complete for the decoder, so a lone symbol gets a partner.
+ */
+static void huff_lengths(std::vector<uint32_t> freq, unsigned int maxlen,
+    std::vector<uint8_t> &len)
+{
+	auto num = freq.size();
+	len.assign(num, 0);
+	size_t used = std::count_if(freq.cbegin(), freq.cend(), [](uint32_t f) { return f > 0; });
+	if (used == 0)
+		return;
+	if (used == 1)
+		freq[freq[0] == 0 ? 0 : 1] = 1;
+	while (true) {
+		using node = std::pair<uint64_t, uint32_t>; /* weight, index */
+		std::priority_queue<node, std::vector<node>, std::greater<node>> pq;
+		std::vector<uint32_t> parent(2 * num, 0);
+		for (uint32_t i = 0; i < num; ++i)
+			if (freq[i] > 0)
+				pq.emplace(freq[i], i);
+		uint32_t next = num;
+		while (pq.size() > 1) {
+			auto a = pq.top();
+			pq.pop();
+			auto b = pq.top();
+			pq.pop();
+			parent[a.second] = parent[b.second] = next;
+			pq.emplace(a.first + b.first, next++);
+		}
+		auto root = pq.top().second;
+		unsigned int maxseen = 0;
+		for (uint32_t i = 0; i < num; ++i) {
+			if (freq[i] == 0)
+				continue;
+			unsigned int d = 0;
+			for (auto n = i; n != root; n = parent[n])
+				++d;
+			len[i] = d;
+			maxseen = std::max(maxseen, d);
+		}
+		if (maxseen <= maxlen)
+			return;
+		for (auto &f : freq)
+			if (f > 0)
+				f = (f >> 1) | 1;
+	}
+}
+
+/* Canonical codes: by increasing length, then by symbol */
+static std::vector<uint16_t> huff_codes(const std::vector<uint8_t> &len)
+{
+	unsigned int count[17]{}, next[18]{};
+	for (auto l : len)
+		if (l > 0)
+			++count[l];
+	for (unsigned int b = 1; b <= 16; ++b)
+		next[b+1] = (next[b] + count[b]) << 1;
+	std::vector<uint16_t> code(len.size());
+	for (size_t i = 0; i < len.size(); ++i)
+		if (len[i] > 0)
+			code[i] = next[len[i]]++;
+	return code;
+}
+
+/*
+ * Transmit code lengths @cur[first..last) as deltas against the lengths of
+ * the previous block, through a pretree (with zero-run codes 17 and 18).
+ */
+static void lzx_write_lens(lzx_bitwriter &bw, const std::vector<uint8_t> &prev,
+    const std::vector<uint8_t> &cur, size_t first, size_t last)
+{
+	std::vector<std::pair<uint8_t, uint8_t>> toks; /* symbol, extra bits value */
+	for (size_t i = first; i < last; ) {
+		if (cur[i] == 0) {
+			size_t run = 1;
+			while (i + run < last && cur[i+run] == 0 && run < 51)
+				++run;
+			if (run >= 20) {
+				toks.emplace_back(18, run - 20);
+				i += run;
+				continue;
+			} else if (run >= 4) {
+				toks.emplace_back(17, run - 4);
+				i += run;
+				continue;
+			}
+		}
+		toks.emplace_back((prev[i] + 17 - cur[i]) % 17, 0);
+		++i;
+	}
+	std::vector<uint32_t> freq(LZX_PRETREE_SYMS);
+	for (const auto &t : toks)
+		++freq[t.first];
+	std::vector<uint8_t> plen;
+	huff_lengths(std::move(freq), 15, plen);
+	auto pcode = huff_codes(plen);
+	for (auto l : plen)
+		bw.put(l, 4);
+	for (const auto &[sym, ext] : toks) {
+		bw.put(pcode[sym], plen[sym]);
+		if (sym == 17)
+			bw.put(ext, 4);
+		else if (sym == 18)
+			bw.put(ext, 5);
+	}
+}
+
+namespace {
+
+/* Hash chain match finder over reference + target */
+struct lzx_matcher {
+	lzx_matcher(std::string_view w) : m_win(w), m_prev(w.size(), UINT32_MAX) {}
+	void insert(uint32_t pos);
+	lzx_token find(uint32_t pos, uint32_t maxlen, uint32_t maxdist) const;
+
+	private:
+	static constexpr unsigned int HBITS = 16, CHAIN = 48;
+	uint32_t hash(uint32_t pos) const {
+		auto p = reinterpret_cast<const uint8_t *>(m_win.data()) + pos;
+		return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & ((1U << HBITS) - 1);
+	}
+
+	std::string_view m_win;
+	std::vector<uint32_t> m_prev;
+	std::vector<uint32_t> m_head = std::vector<uint32_t>(1U << HBITS, UINT32_MAX);
+};
+
+}
+
+void lzx_matcher::insert(uint32_t pos)
+{
+	if (pos + LZX_MIN_MATCH > m_win.size())
+		return;
+	auto h = hash(pos);
+	m_prev[pos] = m_head[h];
+	m_head[h] = pos;
+}
+
+lzx_token lzx_matcher::find(uint32_t pos, uint32_t maxlen, uint32_t maxdist) const
+{
+	lzx_token best;
+	if (maxlen < LZX_MIN_MATCH || pos + LZX_MIN_MATCH > m_win.size())
+		return best;
+	auto w = m_win.data();
+	unsigned int steps = 0;
+	for (auto cand = m_head[hash(pos)]; cand != UINT32_MAX && steps < CHAIN;
+	     cand = m_prev[cand], ++steps) {
+		if (cand >= pos || pos - cand > maxdist)
+			continue;
+		if (w[cand+best.len] != w[pos+best.len])
+			continue;
+		uint32_t l = 0;
+		while (l < maxlen && w[cand+l] == w[pos+l])
+			++l;
+		if (l >= LZX_MIN_MATCH && l > best.len) {
+			best.len = l;
+			best.dist = pos - cand;
+			if (l == maxlen)
+				break;
+		}
+	}
+	return best;
+}
+
+/* MS-PATCH: the decoder sizes the window from reference and target */
+static unsigned int lzx_window_bits(size_t ref, size_t tgt)
+{
+	size_t wsize = ((ref + 32767) & ~static_cast<size_t>(32767)) + tgt;
+	unsigned int bits = 17;
+	while (bits < 25 && (static_cast<size_t>(1) << bits) < wsize)
+		++bits;
+	return bits;
+}
+
+/**
+ * Encode @tgt as an LZX DELTA stream with @ref as reference data.
+ */
+static std::string lzxd_encode(std::string_view ref, std::string_view tgt)
+{
+	auto wbits = lzx_window_bits(ref.size(), tgt.size());
+	unsigned int nslots = lzx_slot_tbl.slot_of((1U << wbits) - 1) + 1;
+	uint32_t maxdist = lzx_slot_tbl.base[nslots] - 3;
+	size_t nmain = LZX_NUM_CHARS + 8 * nslots;
+
+	std::string win;
+	win.reserve(ref.size() + tgt.size());
+	win += ref;
+	win += tgt;
+	lzx_matcher mf(win);
+	for (uint32_t i = 0; i < ref.size(); ++i)
+		mf.insert(i);
+
+	lzx_bitwriter bw;
+	std::vector<uint8_t> prev_main(nmain), prev_len(LZX_LENGTH_SYMS);
+	std::vector<lzx_token> toks;
+	for (size_t fpos = 0; fpos < tgt.size(); fpos += LZX_FRAME) {
+		uint32_t fend = std::min(tgt.size(), fpos + LZX_FRAME);
+		/* Tokenize the frame; matches must not run past its end. */
+		toks.clear();
+		for (uint32_t p = fpos; p < fend; ) {
+			uint32_t q = ref.size() + p;
+			auto t = mf.find(q, std::min(LZX_MAX_MATCH, fend - p), maxdist);
+			if (t.len == 0) {
+				t.lit = tgt[p];
+				mf.insert(q);
+				++p;
+			} else {
+				for (uint32_t k = 0; k < t.len; ++k)
+					mf.insert(q + k);
+				p += t.len;
+			}
+			toks.push_back(t);
+		}
+		std::vector<uint32_t> fmain(nmain), flen(LZX_LENGTH_SYMS);
+		for (const auto &t : toks) {
+			if (t.len == 0) {
+				++fmain[t.lit];
+				continue;
+			}
+			auto slot = lzx_slot_tbl.slot_of(t.dist + 2);
+			auto lh = std::min(t.len - 2, 7U);
+			++fmain[LZX_NUM_CHARS + slot * 8 + lh];
+			if (lh == 7)
+				++flen[t.len - 9];
+		}
+		std::vector<uint8_t> lmain, llen;
+		huff_lengths(std::move(fmain), 16, lmain);
+		huff_lengths(std::move(flen), 16, llen);
+		auto cmain = huff_codes(lmain), clen = huff_codes(llen);
+
+		/* chunk size (patched below), then the E8 header on the first frame */
+		auto chunk = bw.out.size();
+		bw.put(0, 16);
+		if (fpos == 0)
+			bw.put(0, 1);
+		bw.put(1, 3); /* verbatim block */
+		bw.put((fend - fpos) >> 8, 16);
+		bw.put((fend - fpos) & 0xff, 8);
+		lzx_write_lens(bw, prev_main, lmain, 0, LZX_NUM_CHARS);
+		lzx_write_lens(bw, prev_main, lmain, LZX_NUM_CHARS, nmain);
+		lzx_write_lens(bw, prev_len, llen, 0, LZX_LENGTH_SYMS);
+		for (const auto &t : toks) {
+			if (t.len == 0) {
+				bw.put(cmain[t.lit], lmain[t.lit]);
+				continue;
+			}
+			auto fmt = t.dist + 2;
+			auto slot = lzx_slot_tbl.slot_of(fmt);
+			auto lh = std::min(t.len - 2, 7U);
+			auto sym = LZX_NUM_CHARS + slot * 8 + lh;
+			bw.put(cmain[sym], lmain[sym]);
+			if (lh == 7)
+				bw.put(clen[t.len-9], llen[t.len-9]);
+			auto nx = lzx_slots::extra(slot);
+			if (nx > 0)
+				bw.put(fmt - lzx_slot_tbl.base[slot], nx);
+		}
+		bw.align();
+		auto csize = bw.out.size() - chunk - 2;
+		bw.out[chunk]   = static_cast<char>(csize);
+		bw.out[chunk+1] = static_cast<char>(csize >> 8);
+		prev_main = std::move(lmain);
+		prev_len  = std::move(llen);
+	}
+	return std::move(bw.out);
+}
+
+/**
+ * Pick where the source block for the target block starting at @dpos
+ * ends, i.e. where the next source block begins: preferably at the spot
+ * in @src where the data following @dpos in @dst occurs, as close to the
+ * proportional position @want as possible, within [@lo,@hi].
+ */
+static size_t oab_patch_cut(std::string_view src, std::string_view dst,
+    size_t dpos, size_t want, size_t lo, size_t hi)
+{
+	static constexpr size_t ANCHOR = 64;
+	want = std::clamp(want, lo, hi);
+	if (dst.size() - dpos < ANCHOR)
+		return want;
+	auto anchor = dst.substr(dpos, ANCHOR);
+	/* Only look inside the window, lest every block scan all of @src */
+	auto win = src.substr(lo, hi - lo + ANCHOR);
+	auto best = want;
+	size_t bestdist = SIZE_MAX;
+	for (auto wpos = win.find(anchor); wpos != win.npos;
+	     wpos = win.find(anchor, wpos + 1)) {
+		auto pos = lo + wpos;
+		size_t d = pos > want ? pos - want : want - pos;
+		if (d >= bestdist)
+			break;
+		best = pos;
+		bestdist = d;
+	}
+	return best;
+}
+
+/**
+ * Produce a binary patch (MS-OXOAB §2.12) which turns @src into @dst. The
+ * target is cut into equally-sized blocks; each is encoded against the
+ * next slice of @src, whose end is placed where the following target
+ * block's data starts in @src, so that insertions and deletions do not
+ * leave the blocks misaligned for the rest of the file.
+ */
+std::string oab_make_patch(std::string_view src, std::string_view dst)
+{
+	size_t nblk = std::max({(src.size() + OAB_BLOCK_MAX - 1) / OAB_BLOCK_MAX,
+	              (dst.size() + OAB_BLOCK_MAX - 1) / OAB_BLOCK_MAX, static_cast<size_t>(1)});
+	std::string o;
+	put_le32(o, 3);
+	put_le32(o, 2);
+	put_le32(o, OAB_BLOCK_MAX);
+	put_le32(o, src.size());
+	put_le32(o, dst.size());
+	put_le32(o, oab_crc(src));
+	put_le32(o, oab_crc(dst));
+	size_t spos = 0;
+	for (size_t i = 0; i < nblk; ++i) {
+		auto dpos = dst.size() * i / nblk, dend = dst.size() * (i + 1) / nblk;
+		/*
+		 * Source blocks are consumed in order and, like target
+		 * blocks, are at most OAB_BLOCK_MAX long; what remains must
+		 * still fit into the remaining blocks.
+		 */
+		auto left = nblk - i - 1;
+		auto send = left == 0 ? src.size() :
+		            oab_patch_cut(src, dst, dend, src.size() * (i + 1) / nblk,
+		            std::max(spos, src.size() > left * OAB_BLOCK_MAX ?
+		            src.size() - left * OAB_BLOCK_MAX : 0),
+		            std::min(spos + OAB_BLOCK_MAX, src.size()));
+		auto s = src.substr(spos, send - spos);
+		auto d = dst.substr(dpos, dend - dpos);
+		spos = send;
+		auto data = lzxd_encode(s, d);
+		put_le32(o, data.size());
+		put_le32(o, d.size());
+		put_le32(o, s.size());
+		put_le32(o, oab_crc(d));
+		o += data;
+	}
+	return o;
+}
+
+}
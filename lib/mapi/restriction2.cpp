@@ -1,6 +1,9 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later WITH linking exception
 // SPDX-FileCopyrightText: 2022-2023 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
+#include <cstring>
+#include <new>
 #include <sstream>
 #include <string>
 #include <string_view>
@@ -10,6 +13,7 @@
 #include <gromox/mapidefs.h>
 #include <gromox/mapi_types.hpp>
 #include <gromox/propval.hpp>
+#include <gromox/restriction.hpp>
 #include <gromox/rop_util.hpp>
 #include <gromox/util.hpp>
 
@@ -612,3 +616,388 @@ std::string PROPTAG_ARRAY::repr() const
 	s += "}";
 	return s;
 }
+
+static bool res_pure(const RESTRICTION &r)
+{
+	switch (r.rt) {
+	case RES_AND:
+	case RES_OR:
+		for (size_t i = 0; i < r.andor->count; ++i)
+			if (!res_pure(r.andor->pres[i]))
+				return false;
+		return true;
+	case RES_NOT:
+		return res_pure(r.xnot->res);
+	case RES_COMMENT:
+	case RES_ANNOTATION:
+		return r.comment->pres == nullptr || res_pure(*r.comment->pres);
+	case RES_SUBRESTRICTION:
+	case RES_COUNT:
+		/* RES_COUNT decrements its counter as it goes */
+		return false;
+	default:
+		return true;
+	}
+}
+
+/* Rough per-row cost of a subtree, for ordering AND/OR operands */
+static unsigned int res_cost(const RESTRICTION &r)
+{
+	unsigned int c = 0;
+	switch (r.rt) {
+	case RES_AND:
+	case RES_OR:
+		for (size_t i = 0; i < r.andor->count && c < 1000; ++i)
+			c += res_cost(r.andor->pres[i]);
+		return c;
+	case RES_NOT:
+		return res_cost(r.xnot->res);
+	case RES_COMMENT:
+	case RES_ANNOTATION:
+		return r.comment->pres != nullptr ? res_cost(*r.comment->pres) : 0;
+	case RES_EXIST:
+	case RES_BITMASK:
+		return 1;
+	case RES_PROPERTY:
+		if (r.prop->proptag == PR_ANR ||
+		    r.prop->proptag == PR_PARENT_ENTRYID ||
+		    r.prop->proptag == PR_PARENT_SVREID)
+			return 16;
+		switch (PROP_TYPE(r.prop->proptag)) {
+		case PT_SHORT: case PT_LONG: case PT_ERROR: case PT_BOOLEAN:
+		case PT_CURRENCY: case PT_I8: case PT_SYSTIME:
+		case PT_FLOAT: case PT_DOUBLE: case PT_APPTIME:
+			return 2;
+		default:
+			return 3;
+		}
+	case RES_SIZE:
+		return 3;
+	case RES_CONTENT:
+		return 4;
+	default:
+		return 16;
+	}
+}
+
+static inline uint8_t res_fold(char c)
+{
+	/* same folding as strcasecmp in the C/UTF-8 locales */
+	return c >= 'A' && c <= 'Z' ? c + 0x20 : static_cast<uint8_t>(c);
+}
+
+namespace gromox {
+
+int32_t res_program::emit_leaf(insn &&x, int32_t jt, int32_t jf)
+{
+	x.jt = jt;
+	x.jf = jf;
+	if (x.opc != op::fallback) {
+		auto it = std::find(m_slot_tags.cbegin(), m_slot_tags.cend(), x.proptag);
+		if (it != m_slot_tags.cend()) {
+			x.slot = it - m_slot_tags.cbegin();
+		} else if (m_slot_tags.size() < MAX_SLOTS) {
+			x.slot = m_slot_tags.size();
+			m_slot_tags.push_back(x.proptag);
+		}
+	}
+	m_insn.push_back(std::move(x));
+	return m_insn.size() - 1;
+}
+
+/**
+ * Instructions are emitted back to front, so that the targets of every
+ * operand are known by the time it is emitted. Constant outcomes collapse
+ * into the jump target directly.
+ */
+int32_t res_program::emit(const RESTRICTION &r, int32_t jt, int32_t jf)
+{
+	insn x;
+	switch (r.rt) {
+	case RES_AND:
+	case RES_OR: {
+		auto &ao = *r.andor;
+		std::vector<const RESTRICTION *> kids(ao.count);
+		for (size_t i = 0; i < ao.count; ++i)
+			kids[i] = &ao.pres[i];
+		if (res_pure(r))
+			std::stable_sort(kids.begin(), kids.end(),
+				[](const RESTRICTION *a, const RESTRICTION *b) {
+					return res_cost(*a) < res_cost(*b);
+				});
+		auto next = r.rt == RES_AND ? jt : jf;
+		for (size_t i = kids.size(); i-- > 0; )
+			next = r.rt == RES_AND ? emit(*kids[i], next, jf) :
+			       emit(*kids[i], jt, next);
+		return next;
+	}
+	case RES_NOT:
+		return emit(r.xnot->res, jf, jt);
+	case RES_COMMENT:
+	case RES_ANNOTATION:
+		return r.comment->pres != nullptr ? emit(*r.comment->pres, jt, jf) : jt;
+	case RES_EXIST:
+		x.opc = op::exist;
+		x.proptag = r.exist->proptag;
+		return emit_leaf(std::move(x), jt, jf);
+	case RES_BITMASK: {
+		auto &rbm = *r.bm;
+		if (!rbm.comparable())
+			return jf;
+		x.opc = op::bitmask;
+		x.proptag = rbm.proptag;
+		x.relop = static_cast<uint8_t>(rbm.bitmask_relop);
+		x.imm.u32 = rbm.mask;
+		x.nullres = x.relop == 0;
+		if (x.relop > 1)
+			return jf;
+		return emit_leaf(std::move(x), jt, jf);
+	}
+	case RES_SIZE: {
+		auto &rsize = *r.size;
+		x.opc = op::size;
+		x.proptag = rsize.proptag;
+		x.relop = static_cast<uint8_t>(rsize.relop);
+		x.imm.u32 = rsize.size;
+		x.nullres = three_way_eval(rsize.relop, three_way_compare(0U, rsize.size));
+		return emit_leaf(std::move(x), jt, jf);
+	}
+	case RES_CONTENT: {
+		auto &rcon = *r.cont;
+		if (!rcon.comparable() || rcon.propval.pvalue == nullptr)
+			return jf;
+		x.proptag = rcon.proptag;
+		x.fuzzy = rcon.fuzzy_level & 0xFFFF;
+		if (x.fuzzy != FL_FULLSTRING && x.fuzzy != FL_SUBSTRING &&
+		    x.fuzzy != FL_PREFIX)
+			return jf;
+		if (PROP_TYPE(rcon.proptag) == PT_BINARY) {
+			auto &bin = *static_cast<const BINARY *>(rcon.propval.pvalue);
+			x.opc = op::cont_bin;
+			x.rhs = bin.pv;
+			x.rlen = bin.cb;
+			return emit_leaf(std::move(x), jt, jf);
+		}
+		x.opc = op::cont_str;
+		x.rhs = rcon.propval.pvalue;
+		x.rlen = strlen(static_cast<const char *>(x.rhs));
+		x.icase = rcon.fuzzy_level & (FL_IGNORECASE | FL_LOOSE);
+		if (x.icase) {
+			x.folded.resize(x.rlen);
+			for (size_t i = 0; i < x.rlen; ++i)
+				x.folded[i] = res_fold(static_cast<const char *>(x.rhs)[i]);
+		}
+		return emit_leaf(std::move(x), jt, jf);
+	}
+	case RES_PROPERTY: {
+		auto &rprop = *r.prop;
+		if (!rprop.comparable())
+			return jf;
+		/*
+		 * ANR and the parent folder comparisons (exmdb substitutes
+		 * an SVREID) are up to each caller.
+		 */
+		if (rprop.proptag == PR_ANR || rprop.proptag == PR_PARENT_ENTRYID ||
+		    rprop.proptag == PR_PARENT_SVREID)
+			break;
+		switch (rprop.relop) {
+		case RELOP_LT: case RELOP_LE: case RELOP_GT:
+		case RELOP_GE: case RELOP_EQ: case RELOP_NE:
+			break;
+		default:
+			return jf;
+		}
+		x.proptag = rprop.proptag;
+		x.relop = static_cast<uint8_t>(rprop.relop);
+		x.rhs = rprop.propval.pvalue;
+		x.imm.u32 = PROP_TYPE(rprop.proptag);
+		x.opc = op::cmp_any;
+		if (x.rhs == nullptr) {
+			x.nullres = three_way_eval(rprop.relop, 0);
+			return emit_leaf(std::move(x), jt, jf);
+		}
+		x.nullres = three_way_eval(rprop.relop, -1);
+		switch (PROP_TYPE(rprop.proptag)) {
+		case PT_SHORT:
+			x.opc = op::cmp_u16;
+			x.imm.u32 = *static_cast<const uint16_t *>(x.rhs);
+			break;
+		case PT_LONG:
+		case PT_ERROR:
+			x.opc = op::cmp_u32;
+			x.imm.u32 = *static_cast<const uint32_t *>(x.rhs);
+			break;
+		case PT_BOOLEAN:
+			x.opc = op::cmp_bool;
+			x.imm.u32 = !!*static_cast<const uint8_t *>(x.rhs);
+			break;
+		case PT_CURRENCY:
+		case PT_I8:
+		case PT_SYSTIME:
+			x.opc = op::cmp_u64;
+			x.imm.u64 = *static_cast<const uint64_t *>(x.rhs);
+			break;
+		case PT_FLOAT:
+			x.opc = op::cmp_flt;
+			x.imm.flt = *static_cast<const float *>(x.rhs);
+			break;
+		case PT_DOUBLE:
+		case PT_APPTIME:
+			x.opc = op::cmp_dbl;
+			x.imm.dbl = *static_cast<const double *>(x.rhs);
+			break;
+		case PT_STRING8:
+		case PT_UNICODE:
+			x.opc = op::cmp_str;
+			break;
+		}
+		return emit_leaf(std::move(x), jt, jf);
+	}
+	case RES_PROPCOMPARE:
+	case RES_SUBRESTRICTION:
+	case RES_COUNT:
+	case RES_NULL:
+		break;
+	default:
+		return jf;
+	}
+	x.opc = op::fallback;
+	x.node = &r;
+	return emit_leaf(std::move(x), jt, jf);
+}
+
+bool res_program::compile(const RESTRICTION &r) try
+{
+	m_insn.clear();
+	m_slot_tags.clear();
+	m_entry = emit(r, PC_ACCEPT, PC_REJECT);
+	return true;
+} catch (const std::bad_alloc &) {
+	m_insn.clear();
+	m_slot_tags.clear();
+	m_entry = PC_NONE;
+	return false;
+}
+
+bool res_program::test(const insn &i, const void *v)
+{
+	auto rel = static_cast<enum relop>(i.relop);
+	switch (i.opc) {
+	case op::exist:
+		return true;
+	case op::bitmask:
+		return !!(*static_cast<const uint32_t *>(v) & i.imm.u32) == i.relop;
+	case op::size:
+		return three_way_eval(rel, three_way_compare(propval_size(i.proptag, v), i.imm.u32));
+	case op::cmp_u16:
+		return three_way_eval(rel, three_way_compare(*static_cast<const uint16_t *>(v), i.imm.u32));
+	case op::cmp_u32:
+		return three_way_eval(rel, three_way_compare(*static_cast<const uint32_t *>(v), i.imm.u32));
+	case op::cmp_u64:
+		return three_way_eval(rel, three_way_compare(*static_cast<const uint64_t *>(v), i.imm.u64));
+	case op::cmp_bool:
+		return three_way_eval(rel, three_way_compare(!!*static_cast<const uint8_t *>(v), !!i.imm.u32));
+	case op::cmp_flt:
+		return three_way_eval(rel, three_way_compare(*static_cast<const float *>(v), i.imm.flt));
+	case op::cmp_dbl:
+		return three_way_eval(rel, three_way_compare(*static_cast<const double *>(v), i.imm.dbl));
+	case op::cmp_str:
+		return three_way_eval(rel, strcasecmp(static_cast<const char *>(v),
+		       static_cast<const char *>(i.rhs)));
+	case op::cmp_any:
+		return propval_compare_relop_nullok(rel, i.imm.u32, v, i.rhs);
+	case op::cont_bin: {
+		auto &lhs = *static_cast<const BINARY *>(v);
+		switch (i.fuzzy) {
+		case FL_FULLSTRING:
+			return lhs.cb == i.rlen && memcmp(lhs.pv, i.rhs, i.rlen) == 0;
+		case FL_SUBSTRING:
+			return HX_memmem(lhs.pv, lhs.cb, i.rhs, i.rlen) != nullptr;
+		case FL_PREFIX:
+			return lhs.cb >= i.rlen && memcmp(lhs.pv, i.rhs, i.rlen) == 0;
+		}
+		return false;
+	}
+	case op::cont_str: {
+		auto h = static_cast<const char *>(v);
+		auto n = static_cast<const char *>(i.rhs);
+		if (!i.icase) {
+			switch (i.fuzzy) {
+			case FL_FULLSTRING: return strcmp(h, n) == 0;
+			case FL_SUBSTRING: return strstr(h, n) != nullptr;
+			case FL_PREFIX: return strncmp(h, n, i.rlen) == 0;
+			}
+			return false;
+		}
+		auto &f = i.folded;
+		switch (i.fuzzy) {
+		case FL_FULLSTRING: {
+			size_t j = 0;
+			for (; h[j] != '\0'; ++j)
+				if (j >= f.size() || res_fold(h[j]) != static_cast<uint8_t>(f[j]))
+					return false;
+			return j == f.size();
+		}
+		case FL_PREFIX:
+			/* h's terminator cannot match, since f contains no NULs */
+			for (size_t j = 0; j < f.size(); ++j)
+				if (res_fold(h[j]) != static_cast<uint8_t>(f[j]))
+					return false;
+			return true;
+		case FL_SUBSTRING: {
+			if (f.empty())
+				return true;
+			auto f0 = static_cast<uint8_t>(f[0]);
+			for (; *h != '\0'; ++h) {
+				if (res_fold(*h) != f0)
+					continue;
+				size_t j = 1;
+				while (j < f.size() && res_fold(h[j]) == static_cast<uint8_t>(f[j]))
+					++j;
+				if (j == f.size())
+					return true;
+			}
+			return false;
+		}
+		}
+		return false;
+	}
+	default:
+		return false;
+	}
+}
+
+/**
+ * @get:	property getter, called at most once per distinct proptag
+ * @fb:		interpreter for the node types that were not compiled
+ */
+bool res_program::eval(void *param, get_fn get, fallback_fn fb) const
+{
+	void *val[MAX_SLOTS];
+	uint8_t state[MAX_SLOTS]; /* 0: not fetched, 1: fetched, 2: getter failed */
+	memset(state, 0, m_slot_tags.size());
+	auto pc = m_entry;
+	while (pc >= 0) {
+		auto &i = m_insn[pc];
+		bool ok;
+		if (i.opc == op::fallback) {
+			ok = fb(param, *i.node);
+		} else if (i.slot == NO_SLOT) {
+			void *v = nullptr;
+			ok = get(param, i.proptag, &v) &&
+			     (v == nullptr ? i.nullres : test(i, v));
+		} else {
+			auto s = i.slot;
+			if (state[s] == 0) {
+				val[s] = nullptr;
+				state[s] = get(param, i.proptag, &val[s]) ? 1 : 2;
+			}
+			ok = state[s] == 1 &&
+			     (val[s] == nullptr ? i.nullres : test(i, val[s]));
+		}
+		pc = ok ? i.jt : i.jf;
+	}
+	return pc == PC_ACCEPT;
+}
+
+}
@@ -0,0 +1,321 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later WITH linking exception
+// SPDX-FileCopyrightText: 2026 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Translation of content table restrictions into SQL over the exmdb
+ * message tables, see res_sql.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <fmt/core.h>
+#include <libHX/string.h>
+#include <gromox/mapidefs.h>
+#include <gromox/mapitags.hpp>
+#include <gromox/mapi_types.hpp>
+#include <gromox/propval.hpp>
+#include <gromox/restriction.hpp>
+
+namespace gromox {
+
+/* Message properties that exmdb's gp_msgprop computes instead of reading them */
+static constexpr uint32_t msgprop_computed_tags[] = {
+	PR_ENTRYID, PR_PARENT_ENTRYID, PidTagFolderId, PidTagParentFolderId,
+	PR_INSTANCE_SVREID, PR_PARENT_DISPLAY, PR_PARENT_DISPLAY_A,
+	PR_MESSAGE_SIZE, PR_ASSOCIATED, PidTagChangeNumber, PR_READ,
+	PR_HAS_NAMED_PROPERTIES, PR_HASATTACH, PidTagMid, PR_MESSAGE_FLAGS,
+	PR_SUBJECT, PR_SUBJECT_A, PR_DISPLAY_TO, PR_DISPLAY_CC,
+	PR_DISPLAY_BCC, PR_DISPLAY_TO_A, PR_DISPLAY_CC_A, PR_DISPLAY_BCC_A,
+	PR_BODY, PR_BODY_A, PR_TRANSPORT_MESSAGE_HEADERS,
+	PR_TRANSPORT_MESSAGE_HEADERS_A, PR_HTML, PR_RTF_COMPRESSED,
+	PidTagMidString,
+};
+
+bool msgprop_computed(uint32_t tag)
+{
+	return std::find(std::begin(msgprop_computed_tags),
+	       std::end(msgprop_computed_tags), tag) != std::end(msgprop_computed_tags);
+}
+
+/**
+ * Whether cu_get_property reads @tag verbatim from message_properties (and
+ * the same row means the same thing in SQL).
+ */
+static bool res_sql_stored_tag(uint32_t tag)
+{
+	if (msgprop_computed(tag))
+		return false;
+	switch (PROP_TYPE(tag)) {
+	case PT_SHORT: case PT_LONG: case PT_SYSTIME: case PT_BOOLEAN:
+	case PT_UNICODE: case PT_STRING8:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* String values are pushed down only when the needle is plain ASCII. */
+static bool res_sql_ascii(const char *s)
+{
+	for (; *s != '\0'; ++s)
+		if (static_cast<unsigned char>(*s) >= 0x80)
+			return false;
+	return true;
+}
+
+/* Column of messages holding a copy of @tag (schema E-14), or nullptr */
+static const char *res_sql_hotcol(uint32_t tag)
+{
+	switch (tag) {
+	case PR_MESSAGE_DELIVERY_TIME: return "messages.delivery_time";
+	case PR_LAST_MODIFICATION_TIME: return "messages.lastmod_time";
+	default: return nullptr;
+	}
+}
+
+/* Subquery yielding the stored value of @tag, or NULL */
+static std::string res_sql_value(uint32_t tag, bool hot)
+{
+	auto col = hot ? res_sql_hotcol(tag) : nullptr;
+	if (col != nullptr)
+		return col;
+	auto type = PROP_TYPE(tag);
+	if (type == PT_UNICODE || type == PT_STRING8) {
+		auto s = fmt::format("(SELECT propval FROM message_properties"
+		         " WHERE message_id=messages.message_id AND proptag IN"
+		         " ({},{}) LIMIT 1)", CHANGE_PROP_TYPE(tag, PT_UNICODE),
+		         CHANGE_PROP_TYPE(tag, PT_STRING8));
+		/* gp_msgprop_synth; there is no default for the STRING8 tag */
+		if (tag != PR_MESSAGE_CLASS)
+			return s;
+		s = "IFNULL(" + std::move(s) + ",'IPM.Note')";
+		return hot ? "IFNULL(messages.msg_class," + std::move(s) + ")" : s;
+	}
+	return fmt::format("(SELECT propval FROM message_properties WHERE"
+	       " message_id=messages.message_id AND proptag={})", tag);
+}
+
+static const char *res_sql_relop(enum relop r)
+{
+	switch (r) {
+	case RELOP_LT: return "<";
+	case RELOP_LE: return "<=";
+	case RELOP_GT: return ">";
+	case RELOP_GE: return ">=";
+	case RELOP_EQ: return "=";
+	case RELOP_NE: return "<>";
+	default: return nullptr;
+	}
+}
+
+bool res_sql::emit_prop(const RESTRICTION_PROPERTY &rprop, std::string &out)
+{
+	if (!rprop.comparable() || rprop.propval.pvalue == nullptr)
+		return false;
+	auto op = res_sql_relop(rprop.relop);
+	if (op == nullptr)
+		return false;
+	/* propval_compare_relop_nullok: absent sorts before anything */
+	int absent = three_way_eval(rprop.relop, -1);
+	auto rhs = rprop.propval.pvalue;
+	if (rprop.proptag == PR_READ) {
+		if (!b_private)
+			return false;
+		out += fmt::format("((messages.read_state<>0){}?)", op);
+		bind(!!*static_cast<const uint8_t *>(rhs));
+		return true;
+	}
+	if (!res_sql_stored_tag(rprop.proptag))
+		return false;
+	auto val = res_sql_value(rprop.proptag, b_hotcols);
+	switch (PROP_TYPE(rprop.proptag)) {
+	case PT_SHORT:
+		bind(*static_cast<const uint16_t *>(rhs));
+		break;
+	case PT_LONG:
+		bind(*static_cast<const uint32_t *>(rhs));
+		break;
+	case PT_SYSTIME: {
+		/* stored signed, compared unsigned */
+		auto v = *static_cast<const uint64_t *>(rhs);
+		if (v > INT64_MAX)
+			return false;
+		bind(v);
+		break;
+	}
+	case PT_BOOLEAN:
+		val = "(" + val + "<>0)";
+		bind(!!*static_cast<const uint8_t *>(rhs));
+		break;
+	case PT_UNICODE:
+	case PT_STRING8:
+		/* Only equality; ordering of converted STRING8 values may differ */
+		if ((rprop.relop != RELOP_EQ && rprop.relop != RELOP_NE) ||
+		    !res_sql_ascii(static_cast<const char *>(rhs)))
+			return false;
+		out += fmt::format("IFNULL({}{}? COLLATE NOCASE,{})", val, op, absent);
+		bind(std::string(static_cast<const char *>(rhs)));
+		return true;
+	default:
+		return false;
+	}
+	/* Same truth table as IFNULL, but lets sqlite use the column index */
+	if (b_hotcols && res_sql_hotcol(rprop.proptag) != nullptr && absent)
+		out += fmt::format("({0} IS NULL OR {0}{1}?)", val, op);
+	else if (b_hotcols && res_sql_hotcol(rprop.proptag) != nullptr)
+		out += fmt::format("({0} IS NOT NULL AND {0}{1}?)", val, op);
+	else
+		out += fmt::format("IFNULL({}{}?,{})", val, op, absent);
+	return true;
+}
+
+bool res_sql::emit_content(const RESTRICTION_CONTENT &rcon, std::string &out)
+{
+	if (!rcon.comparable() || rcon.propval.pvalue == nullptr ||
+	    PROP_TYPE(rcon.proptag) == PT_BINARY ||
+	    !res_sql_stored_tag(rcon.proptag))
+		return false;
+	auto needle = static_cast<const char *>(rcon.propval.pvalue);
+	if (!res_sql_ascii(needle))
+		return false;
+	auto val = res_sql_value(rcon.proptag, b_hotcols);
+	bool icase = rcon.fuzzy_level & (FL_IGNORECASE | FL_LOOSE);
+	auto coll = icase ? " COLLATE NOCASE" : "";
+	switch (rcon.fuzzy_level & 0xFFFF) {
+	case FL_FULLSTRING:
+		out += fmt::format("IFNULL({}=?{},0)", val, coll);
+		bind(needle);
+		return true;
+	case FL_PREFIX:
+		out += fmt::format("IFNULL(substr({},1,{})=?{},0)", val,
+		       strlen(needle), coll);
+		bind(needle);
+		return true;
+	case FL_SUBSTRING: {
+		std::string n = needle;
+		if (!icase) {
+			out += fmt::format("IFNULL(instr({},?)>0,0)", val);
+		} else {
+			/* lower() without ICU folds ASCII only, like res_program */
+			out += fmt::format("IFNULL(instr(lower({}),?)>0,0)", val);
+			HX_strlower(n.data());
+		}
+		bind(std::move(n));
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+bool res_sql::emit_bitmask(const RESTRICTION_BITMASK &rbm, std::string &out)
+{
+	auto want = static_cast<uint8_t>(rbm.bitmask_relop);
+	if (!rbm.comparable() || want > 1)
+		return false;
+	if (rbm.proptag == PR_MESSAGE_FLAGS) {
+		/* Bits that common_util_get_message_flags computes on the fly */
+		static constexpr uint32_t dyn = MSGFLAG_READ | MSGFLAG_HASATTACH |
+			MSGFLAG_FROMME | MSGFLAG_ASSOCIATED | MSGFLAG_RN_PENDING |
+			MSGFLAG_NRN_PENDING;
+		if (rbm.mask == MSGFLAG_READ && b_private) {
+			out += fmt::format("((messages.read_state<>0)={})", want);
+			return true;
+		}
+		if (rbm.mask & dyn)
+			return false;
+		out += fmt::format("(((IFNULL({},0)&{})<>0)={})",
+		       res_sql_value(rbm.proptag, b_hotcols), rbm.mask, want);
+		return true;
+	}
+	if (!res_sql_stored_tag(rbm.proptag))
+		return false;
+	out += fmt::format("(((IFNULL({},0)&{})<>0)={})",
+	       res_sql_value(rbm.proptag, b_hotcols), rbm.mask, want);
+	return true;
+}
+
+bool res_sql::emit_exist(const RESTRICTION_EXIST &rex, std::string &out)
+{
+	auto tag = rex.proptag;
+	/* The Unicode tag always exists (gp_msgprop_synth) */
+	if (!res_sql_stored_tag(tag) || tag == PR_MESSAGE_CLASS)
+		return false;
+	auto col = b_hotcols ? res_sql_hotcol(tag) : nullptr;
+	auto type = PROP_TYPE(tag);
+	if (col != nullptr)
+		out += fmt::format("({} IS NOT NULL)", col);
+	else if (type == PT_UNICODE || type == PT_STRING8)
+		out += fmt::format("EXISTS(SELECT 1 FROM message_properties WHERE"
+		       " message_id=messages.message_id AND proptag IN ({},{}))",
+		       CHANGE_PROP_TYPE(tag, PT_UNICODE), CHANGE_PROP_TYPE(tag, PT_STRING8));
+	else
+		out += fmt::format("EXISTS(SELECT 1 FROM message_properties WHERE"
+		       " message_id=messages.message_id AND proptag={})", tag);
+	return true;
+}
+
+/**
+ * Appends the SQL form of @res to @out. Returns false (with @out and the
+ * bind list left unchanged) if any part of @res cannot be translated.
+ */
+bool res_sql::emit(const RESTRICTION &res, std::string &out)
+{
+	auto out_len = out.size();
+	auto bind_count = binds.size();
+	bool ok = false;
+	switch (res.rt) {
+	case RES_AND:
+	case RES_OR: {
+		if (res.andor->count == 0) {
+			out += res.rt == RES_AND ? "1" : "0";
+			return true;
+		}
+		out += "(";
+		ok = true;
+		for (size_t i = 0; i < res.andor->count && ok; ++i) {
+			if (i > 0)
+				out += res.rt == RES_AND ? " AND " : " OR ";
+			ok = emit(res.andor->pres[i], out);
+		}
+		out += ")";
+		break;
+	}
+	case RES_NOT:
+		out += "NOT ";
+		ok = emit(res.xnot->res, out);
+		break;
+	case RES_COMMENT:
+	case RES_ANNOTATION:
+		if (res.comment->pres == nullptr) {
+			out += "1";
+			return true;
+		}
+		ok = emit(*res.comment->pres, out);
+		break;
+	case RES_PROPERTY:
+		ok = emit_prop(*res.prop, out);
+		break;
+	case RES_CONTENT:
+		ok = emit_content(*res.cont, out);
+		break;
+	case RES_BITMASK:
+		ok = emit_bitmask(*res.bm, out);
+		break;
+	case RES_EXIST:
+		ok = emit_exist(*res.exist, out);
+		break;
+	default:
+		break;
+	}
+	if (!ok) {
+		out.resize(out_len);
+		binds.resize(bind_count);
+	}
+	return ok;
+}
+
+}
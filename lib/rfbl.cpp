@@ -4,6 +4,7 @@
 #ifdef HAVE_CONFIG_H
 #	include "config.h"
 #endif
+#include <algorithm>
 #include <cerrno>
 #include <climits>
 #include <clocale>
@@ -19,7 +20,10 @@
 #include <iconv.h>
 #include <istream>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <netdb.h>
 #include <shared_mutex>
 #include <spawn.h>
 #include <sstream>
@@ -27,12 +31,15 @@
 #include <string>
 #include <string_view>
 #include <unistd.h>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 #include <zstd.h>
 #ifdef HAVE_SYSLOG_H
 #	include <syslog.h>
 #endif
+#include <arpa/inet.h>
+#include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #if defined(HAVE_SYS_XATTR_H)
@@ -43,6 +50,7 @@
 #include <libHX/ctype_helper.h>
 #include <libHX/io.h>
 #include <libHX/proc.h>
+#include <libHX/socket.h>
 #include <libHX/string.h>
 #include <sys/wait.h>
 #ifdef __FreeBSD__
@@ -50,6 +58,7 @@
 #	include <sys/sysctl.h>
 #endif
 #include <gromox/config_file.hpp>
+#include <gromox/endian.hpp>
 #include <gromox/fileio.h>
 #include <gromox/json.hpp>
 #include <gromox/mapidefs.h>
@@ -786,6 +795,137 @@ void gx_reexec_record(int new_fd)
 		gx_reexec_top_fd = new_fd;
 }
 
+/**
+ * Open @count listening sockets on the same address, with SO_REUSEPORT, so
+ * that the kernel distributes incoming connections over that many acceptor
+ * threads. With @count<=1, this is just HX_inet_listen.
+ *
+ * After gx_reexec, the sockets made by the privileged instance are picked up
+ * again. (HX_inet_listen cannot be used for that, as it would return the same
+ * inherited fd every time; and the unprivileged process could not join the
+ * reuseport group of root's sockets with a fresh socket either.)
+ */
+errno_t gx_inet_listen_multi(const char *host, uint16_t port,
+    unsigned int count, std::vector<int> &fds) try
+{
+	fds.clear();
+	if (count <= 1) {
+		auto fd = HX_inet_listen(host, port);
+		if (fd < 0)
+			return -fd;
+		gx_reexec_record(fd);
+		fds.push_back(fd);
+		return 0;
+	}
+#if defined(SO_REUSEPORT_LB)
+	static constexpr int opt_reuseport = SO_REUSEPORT_LB;
+#elif defined(SO_REUSEPORT)
+	static constexpr int opt_reuseport = SO_REUSEPORT;
+#else
+	static constexpr int opt_reuseport = -1;
+#endif
+	if (opt_reuseport < 0)
+		return EOPNOTSUPP;
+	struct addrinfo hints{}, *aires = nullptr;
+	hints.ai_flags    = AI_PASSIVE | AI_NUMERICSERV;
+	hints.ai_socktype = SOCK_STREAM;
+	auto portstr = std::to_string(port);
+	if (host != nullptr && *host == '\0')
+		host = nullptr;
+	auto err = getaddrinfo(host, portstr.c_str(), &hints, &aires);
+	if (err != 0) {
+		mlog(LV_ERR, "E-2414: getaddrinfo [%s]:%hu: %s",
+		        host != nullptr ? host : "*", port, gai_strerror(err));
+		return EINVAL;
+	}
+	auto cl_0 = make_scope_exit([&]() { freeaddrinfo(aires); });
+	auto cl_1 = make_scope_exit([&]() {
+		for (auto fd : fds)
+			close(fd);
+		fds.clear();
+	});
+
+	/*
+	 * Like HX_inet_listen, use the first address (in getaddrinfo's
+	 * preference order) that we can actually bind to.
+	 */
+	auto s = getenv("HX_LISTEN_TOP_FD");
+	int top_fd = s != nullptr ? strtol(s, nullptr, 0) : 0;
+	int ret = EADDRNOTAVAIL;
+	for (auto ai = aires; ai != nullptr; ai = ai->ai_next) {
+		for (int fd = 3; fd < top_fd && fds.size() < count; ++fd) {
+			int acc = 0;
+			socklen_t az = sizeof(acc);
+			struct sockaddr_storage ss{};
+			socklen_t sl = sizeof(ss);
+			if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &acc, &az) != 0 ||
+			    acc == 0 ||
+			    getsockname(fd, reinterpret_cast<sockaddr *>(&ss), &sl) != 0 ||
+			    sl != ai->ai_addrlen || memcmp(&ss, ai->ai_addr, sl) != 0)
+				continue;
+			fds.push_back(fd);
+		}
+		while (fds.size() < count) {
+			int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+			         ai->ai_protocol);
+			if (fd < 0) {
+				ret = errno;
+				break;
+			}
+			static constexpr int y = 1;
+			if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &y, sizeof(y)) != 0 ||
+			    setsockopt(fd, SOL_SOCKET, opt_reuseport, &y, sizeof(y)) != 0 ||
+			    bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 ||
+			    listen(fd, SOMAXCONN) != 0) {
+				ret = errno;
+				close(fd);
+				break;
+			}
+			fds.push_back(fd);
+		}
+		if (fds.size() == count)
+			break;
+		/* Partial group on this address: discard, try the next one */
+		for (auto fd : fds)
+			close(fd);
+		fds.clear();
+	}
+	if (fds.size() < count)
+		return ret;
+	for (auto fd : fds)
+		gx_reexec_record(fd);
+	cl_1.release();
+	return 0;
+} catch (const std::bad_alloc &) {
+	return ENOMEM;
+}
+
+/**
+ * Produce the numeric host and port of a socket address, like getnameinfo
+ * with NI_NUMERICHOST|NI_NUMERICSERV would, but without going through the
+ * resolver library for every accepted connection.
+ */
+bool gx_sockaddr_text(const struct sockaddr_storage &ss, char *host,
+    size_t hsize, uint16_t *port)
+{
+	if (ss.ss_family == AF_INET6) {
+		auto sa = reinterpret_cast<const struct sockaddr_in6 *>(&ss);
+		if (inet_ntop(AF_INET6, &sa->sin6_addr, host, hsize) == nullptr)
+			return false;
+		if (port != nullptr)
+			*port = ntohs(sa->sin6_port);
+		return true;
+	} else if (ss.ss_family == AF_INET) {
+		auto sa = reinterpret_cast<const struct sockaddr_in *>(&ss);
+		if (inet_ntop(AF_INET, &sa->sin_addr, host, hsize) == nullptr)
+			return false;
+		if (port != nullptr)
+			*port = ntohs(sa->sin_port);
+		return true;
+	}
+	return false;
+}
+
 /**
  * Upon setuid, tasks are restricted in their dumping (cf. linux/kernel/cred.c
  * in commit_creds, calling set_dumpable). To restore the dump flag, one could
@@ -1181,6 +1321,12 @@ void mlog_init(const char *filename, unsigned int max_level)
 	}
 }
 
+/* For callers that have to do work just to build the message */
+bool mlog_enabled(unsigned int level)
+{
+	return level <= g_max_loglevel;
+}
+
 void mlog(unsigned int level, const char *fmt, ...)
 {
 	if (level > g_max_loglevel)
@@ -1271,7 +1417,188 @@ std::string zstd_decompress(std::string_view x)
 	return out;
 }
 
-size_t gx_decompressed_size(const char *infile)
+/*
+ * Objects larger than one frame are written in the zstd seekable format
+ * (contrib/seekable_format in the zstd source tree): independent frames of
+ * GX_SEEKABLE_FRAME uncompressed bytes each, followed by a skippable frame
+ * holding the frame sizes. Plain zstd decoders skip the table and just
+ * concatenate the frames, so such files remain ordinary .zst files.
+ */
+static constexpr size_t GX_SEEKABLE_FRAME = 256U << 10;
+static constexpr uint32_t ZSTD_SKIPPABLE_SEEKTABLE = 0x184D2A5E,
+	ZSTD_SEEKABLE_MAGIC = 0x8F92EAB1;
+static constexpr unsigned int SEEKTABLE_FOOTER = 9;
+
+namespace {
+struct seek_entry {
+	uint64_t c_off, d_off;
+	uint32_t c_size, d_size;
+};
+}
+
+/**
+ * Read the seek table of @fd. Returns false if there is none (single-frame
+ * or non-zstd file); @tbl is then empty.
+ */
+static bool gx_read_seektable(int fd, uint64_t fsize, std::vector<seek_entry> &tbl)
+{
+	tbl.clear();
+	if (fsize < SEEKTABLE_FOOTER + 8)
+		return false;
+	uint8_t foot[SEEKTABLE_FOOTER];
+	if (pread(fd, foot, sizeof(foot), fsize - sizeof(foot)) != sizeof(foot) ||
+	    le32p_to_cpu(&foot[5]) != ZSTD_SEEKABLE_MAGIC)
+		return false;
+	uint32_t nframes = le32p_to_cpu(&foot[0]);
+	unsigned int esize = foot[4] & 0x80 ? 12 : 8;
+	uint64_t tsize = static_cast<uint64_t>(nframes) * esize + SEEKTABLE_FOOTER;
+	if (tsize + 8 > fsize)
+		return false;
+	std::unique_ptr<uint8_t[]> raw(new(std::nothrow) uint8_t[tsize+8]);
+	if (raw == nullptr ||
+	    pread(fd, raw.get(), tsize + 8, fsize - tsize - 8) != static_cast<ssize_t>(tsize + 8) ||
+	    le32p_to_cpu(&raw[0]) != ZSTD_SKIPPABLE_SEEKTABLE ||
+	    le32p_to_cpu(&raw[4]) != tsize)
+		return false;
+	tbl.resize(nframes);
+	uint64_t c_off = 0, d_off = 0;
+	for (uint32_t i = 0; i < nframes; ++i) {
+		auto e = &raw[8+i*esize];
+		auto &t = tbl[i];
+		t.c_off  = c_off;
+		t.d_off  = d_off;
+		t.c_size = le32p_to_cpu(&e[0]);
+		t.d_size = le32p_to_cpu(&e[4]);
+		c_off += t.c_size;
+		d_off += t.d_size;
+	}
+	if (c_off + tsize + 8 != fsize) {
+		tbl.clear();
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Trained dictionaries (see gromox-compress(8)). @g_zdict_dir holds
+ * "<id>.zdict" files, which decompression finds by the dictionary ID that
+ * zstd records in the frame header, plus names like "default.zdict" (usually
+ * symlinks) by which writers select a dictionary for new objects.
+ */
+namespace {
+struct zdict_name {
+	uint32_t id;
+	time_t expire;
+};
+}
+
+static std::mutex g_zdict_lock;
+static std::string g_zdict_dir = PKGSTATEDIR "/zdict";
+static std::unordered_map<uint32_t, std::string> g_zdict_blobs;
+static std::unordered_map<uint32_t, ZSTD_DDict *> g_zdict_ddicts;
+static std::map<std::pair<uint32_t, int>, ZSTD_CDict *> g_zdict_cdicts;
+static std::unordered_map<std::string, zdict_name> g_zdict_names;
+
+/**
+ * Directory to look for dictionaries in; NULL or "" selects the default.
+ * There is always one, since objects written with a dictionary must remain
+ * readable no matter whether new writes use one.
+ */
+void gx_zdict_setdir(const char *dir)
+{
+	std::lock_guard lk(g_zdict_lock);
+	g_zdict_dir = dir != nullptr && *dir != '\0' ? dir : PKGSTATEDIR "/zdict";
+	g_zdict_names.clear();
+}
+
+static std::string zdict_slurp(const std::string &path)
+{
+	std::string blob;
+	wrapfd fd(open(path.c_str(), O_RDONLY));
+	struct stat sb;
+	if (fd.get() < 0 || fstat(fd.get(), &sb) != 0 || !S_ISREG(sb.st_mode))
+		return blob;
+	blob.resize(sb.st_size);
+	if (read(fd.get(), blob.data(), blob.size()) != sb.st_size)
+		blob.clear();
+	return blob;
+}
+
+/* Caller holds g_zdict_lock */
+static const std::string *zdict_blob(uint32_t id)
+{
+	auto it = g_zdict_blobs.find(id);
+	if (it != g_zdict_blobs.end())
+		return &it->second;
+	auto blob = zdict_slurp(g_zdict_dir + "/" + std::to_string(id) + ".zdict");
+	if (blob.empty() || ZSTD_getDictID_fromDict(blob.data(), blob.size()) != id)
+		return nullptr;
+	return &g_zdict_blobs.emplace(id, std::move(blob)).first->second;
+}
+
+/**
+ * Resolve a dictionary name to its ID (0 if there is none). Results are
+ * cached for a minute so that newly trained dictionaries get picked up.
+ */
+uint32_t gx_zdict_lookup(const char *name) try
+{
+	std::lock_guard lk(g_zdict_lock);
+	auto now = time(nullptr);
+	auto it = g_zdict_names.find(name);
+	if (it != g_zdict_names.end() && it->second.expire > now)
+		return it->second.id;
+	auto blob = zdict_slurp(g_zdict_dir + "/" + name + ".zdict");
+	uint32_t id = blob.empty() ? 0 : ZSTD_getDictID_fromDict(blob.data(), blob.size());
+	if (id != 0 && g_zdict_blobs.find(id) == g_zdict_blobs.end())
+		g_zdict_blobs.emplace(id, std::move(blob));
+	g_zdict_names[name] = {id, now + 60};
+	return id;
+} catch (const std::bad_alloc &) {
+	return 0;
+}
+
+static const ZSTD_CDict *zdict_cdict(uint32_t id, int level)
+{
+	std::lock_guard lk(g_zdict_lock);
+	auto it = g_zdict_cdicts.find({id, level});
+	if (it != g_zdict_cdicts.end())
+		return it->second;
+	auto blob = zdict_blob(id);
+	if (blob == nullptr)
+		return nullptr;
+	auto cd = ZSTD_createCDict(blob->data(), blob->size(), level);
+	if (cd != nullptr)
+		g_zdict_cdicts.emplace(std::make_pair(id, level), cd);
+	return cd;
+}
+
+/**
+ * If the frame at @src was made with a dictionary, make it available to
+ * @dctx.
+ */
+static errno_t zdict_attach(ZSTD_DCtx *dctx, const void *src, size_t srcsize,
+    const char *infile)
+{
+	auto id = ZSTD_getDictID_fromFrame(src, srcsize);
+	if (id == 0)
+		return 0;
+	std::lock_guard lk(g_zdict_lock);
+	auto it = g_zdict_ddicts.find(id);
+	if (it == g_zdict_ddicts.end()) {
+		auto blob = zdict_blob(id);
+		auto dd = blob != nullptr ? ZSTD_createDDict(blob->data(), blob->size()) : nullptr;
+		if (dd == nullptr) {
+			mlog(LV_ERR, "%s: zstd dictionary %u unavailable in %s",
+				infile, id, g_zdict_dir.c_str());
+			return ENOENT;
+		}
+		it = g_zdict_ddicts.emplace(id, dd).first;
+	}
+	ZSTD_DCtx_refDDict(dctx, it->second);
+	return 0;
+}
+
+size_t gx_decompressed_size(const char *infile) try
 {
 	wrapfd fd(open(infile, O_RDONLY));
 	if (fd.get() < 0)
@@ -1279,6 +1606,9 @@ size_t gx_decompressed_size(const char *infile)
 	struct stat sb;
 	if (fstat(fd.get(), &sb) < 0 || !S_ISREG(sb.st_mode))
 		return 0;
+	std::vector<seek_entry> tbl;
+	if (gx_read_seektable(fd.get(), sb.st_size, tbl))
+		return tbl.size() > 0 ? tbl.back().d_off + tbl.back().d_size : 0;
 	size_t inbufsize = ZSTD_DStreamInSize();
 	if (static_cast<unsigned long long>(sb.st_size) < inbufsize)
 		inbufsize = sb.st_size;
@@ -1292,6 +1622,85 @@ size_t gx_decompressed_size(const char *infile)
 	else if (outsize == ZSTD_CONTENTSIZE_UNKNOWN)
 		return sb.st_size;
 	return outsize;
+} catch (const std::bad_alloc &) {
+	return 0;
+}
+
+/**
+ * Decompress the uncompressed byte range [@offset, @offset+@length) of
+ * @infile into a new buffer obtained from @alloc (with a trailing NUL). The
+ * result is truncated at EOF. Only the frames overlapping the range are
+ * read, which requires a seek table; files without one (single-frame or
+ * uncompressed) yield ESPIPE, and the caller should decode them in one go
+ * (gx_decompress_file) rather than repeatedly from the start for every
+ * range. On success, the uncompressed size of the whole file is stored in
+ * @ptotal if given.
+ */
+errno_t gx_decompress_range(const char *infile, uint64_t offset,
+    uint32_t length, BINARY &outbin, void *(*alloc)(size_t),
+    uint64_t *ptotal) try
+{
+	outbin = {};
+	wrapfd fd(open(infile, O_RDONLY));
+	if (fd.get() < 0)
+		return errno;
+	struct stat sb;
+	if (fstat(fd.get(), &sb) < 0)
+		return errno;
+	if (!S_ISREG(sb.st_mode))
+		return 0;
+	std::vector<seek_entry> tbl;
+	if (!gx_read_seektable(fd.get(), sb.st_size, tbl))
+		return ESPIPE;
+	uint64_t total = tbl.size() > 0 ? tbl.back().d_off + tbl.back().d_size : 0;
+	if (ptotal != nullptr)
+		*ptotal = total;
+	auto end = std::min(offset + length, total);
+	outbin.pv = alloc(offset < end ? end - offset + 1 : 1);
+	if (outbin.pv == nullptr)
+		return ENOMEM;
+	outbin.pb[0] = '\0';
+	if (offset >= end)
+		return 0;
+	auto dctx = ZSTD_createDCtx();
+	if (dctx == nullptr)
+		throw std::bad_alloc();
+	auto cl_0 = make_scope_exit([&]() { ZSTD_freeDCtx(dctx); });
+	auto it = std::upper_bound(tbl.cbegin(), tbl.cend(), offset,
+	          [](uint64_t v, const seek_entry &e) { return v < e.d_off + e.d_size; });
+	std::unique_ptr<char[]> cbuf, dbuf;
+	size_t cbuf_size = 0, dbuf_size = 0;
+	for (; it != tbl.cend() && it->d_off < end; ++it) {
+		if (it->c_size > cbuf_size) {
+			cbuf = std::make_unique<char[]>(it->c_size);
+			cbuf_size = it->c_size;
+		}
+		if (it->d_size > dbuf_size) {
+			dbuf = std::make_unique<char[]>(it->d_size);
+			dbuf_size = it->d_size;
+		}
+		if (pread(fd.get(), cbuf.get(), it->c_size, it->c_off) !=
+		    static_cast<ssize_t>(it->c_size))
+			return EIO;
+		auto ret = zdict_attach(dctx, cbuf.get(), it->c_size, infile);
+		if (ret != 0)
+			return ret;
+		auto zr = ZSTD_decompressDCtx(dctx, dbuf.get(), it->d_size,
+		          cbuf.get(), it->c_size);
+		if (ZSTD_isError(zr) || zr != it->d_size) {
+			mlog(LV_ERR, "ZSTD_decompressDCtx %s: %s", infile,
+			        ZSTD_isError(zr) ? ZSTD_getErrorName(zr) : "short frame");
+			return EIO;
+		}
+		auto lo = std::max(offset, it->d_off);
+		auto hi = std::min(end, it->d_off + it->d_size);
+		memcpy(&outbin.pb[lo-offset], &dbuf[lo-it->d_off], hi - lo);
+		outbin.cb = hi - offset;
+	}
+	outbin.pb[outbin.cb] = '\0';
+	return 0;
+} catch (const std::bad_alloc &) {
+	return ENOMEM;
 }
 
 /**
@@ -1328,9 +1737,20 @@ errno_t gx_decompress_file(const char *infile, BINARY &outbin,
 		/* ignore */;
 #endif
 
+	std::vector<seek_entry> tbl;
 	auto outsize = ZSTD_getFrameContentSize(inbuf.get(), rdret);
 	if (outsize == ZSTD_CONTENTSIZE_ERROR)
 		return EIO;
+	auto ret = zdict_attach(strm, inbuf.get(), rdret, infile);
+	if (ret != 0)
+		return ret;
+	else if (gx_read_seektable(fd.get(), sb.st_size, tbl) && tbl.size() > 0)
+		/*
+		 * Size the buffer for all frames, not just the first. One
+		 * spare byte so that a full buffer does not trigger a resize
+		 * while the trailing seek table is skipped.
+		 */
+		outsize = tbl.back().d_off + tbl.back().d_size + 1;
 	else if (outsize == ZSTD_CONTENTSIZE_UNKNOWN)
 		outsize = 1023;
 	else if (outsize == 0)
@@ -1389,16 +1809,62 @@ errno_t gx_decompress_file(const char *infile, BINARY &outbin,
 	return ENOMEM;
 }
 
-errno_t gx_compress_tofd(std::string_view inbuf, int fd, uint8_t complvl)
+static errno_t gx_compress_seekable(std::string_view inbuf, int fd, int level)
+{
+	auto cctx = ZSTD_createCCtx();
+	if (cctx == nullptr)
+		return ENOMEM;
+	auto cl_0 = make_scope_exit([&]() { ZSTD_freeCCtx(cctx); });
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+	auto nframes = (inbuf.size() + GX_SEEKABLE_FRAME - 1) / GX_SEEKABLE_FRAME;
+	if (nframes > UINT32_MAX)
+		return EFBIG;
+	size_t tsize = nframes * 8 + SEEKTABLE_FOOTER;
+	std::string tbl(8 + tsize, '\0');
+	cpu_to_le32p(&tbl[0], ZSTD_SKIPPABLE_SEEKTABLE);
+	cpu_to_le32p(&tbl[4], tsize);
+	auto outbuf = std::make_unique<char[]>(ZSTD_compressBound(GX_SEEKABLE_FRAME));
+	for (size_t i = 0; i < nframes; ++i) {
+		auto chunk = inbuf.substr(i * GX_SEEKABLE_FRAME, GX_SEEKABLE_FRAME);
+		auto zr = ZSTD_compress2(cctx, outbuf.get(),
+		          ZSTD_compressBound(GX_SEEKABLE_FRAME), chunk.data(), chunk.size());
+		if (ZSTD_isError(zr))
+			return EIO;
+		if (HXio_fullwrite(fd, outbuf.get(), zr) < 0)
+			return EIO;
+		cpu_to_le32p(&tbl[8+8*i], zr);
+		cpu_to_le32p(&tbl[8+8*i+4], chunk.size());
+	}
+	auto foot = &tbl[8+8*nframes];
+	cpu_to_le32p(&foot[0], nframes);
+	foot[4] = 0; /* no per-frame checksums in the table; frames have their own */
+	cpu_to_le32p(&foot[5], ZSTD_SEEKABLE_MAGIC);
+	if (HXio_fullwrite(fd, tbl.data(), tbl.size()) < 0)
+		return EIO;
+	return 0;
+}
+
+errno_t gx_compress_tofd(std::string_view inbuf, int fd, uint8_t complvl,
+    uint32_t dict_id) try
 {
 #ifdef HAVE_FSETXATTR
 	if (fsetxattr(fd, "btrfs.compression", "none", 4, XATTR_CREATE) != 0)
 		/* ignore */;
 #endif
+	int level = complvl == 0 ? ZSTD_minCLevel() : complvl;
+	if (inbuf.size() > GX_SEEKABLE_FRAME)
+		return gx_compress_seekable(inbuf, fd, level);
 
 	auto strm = ZSTD_createCStream();
 	auto cl_0 = make_scope_exit([&]() { ZSTD_freeCStream(strm); });
-	ZSTD_initCStream(strm, complvl == 0 ? ZSTD_minCLevel() : complvl);
+	ZSTD_initCStream(strm, level);
+	if (dict_id != 0) {
+		/* Only pays off for small inputs, hence not for seekable ones */
+		auto cd = zdict_cdict(dict_id, level);
+		if (cd != nullptr)
+			ZSTD_CCtx_refCDict(strm, cd);
+	}
 	ZSTD_CCtx_setParameter(strm, ZSTD_c_checksumFlag, 1);
 	ZSTD_CCtx_setPledgedSrcSize(strm, inbuf.size());
 	ZSTD_inBuffer inds = {inbuf.data(), inbuf.size()};
@@ -1426,6 +1892,8 @@ errno_t gx_compress_tofd(std::string_view inbuf, int fd, uint8_t complvl)
 			break;
 	}
 	return 0;
+} catch (const std::bad_alloc &) {
+	return ENOMEM;
 }
 
 errno_t gx_compress_tofile(std::string_view inbuf, const char *outfile,
@@ -16,6 +16,7 @@
 #include <gromox/mapitags.hpp>
 #include <gromox/pcl.hpp>
 #include <gromox/propval.hpp>
+#include <gromox/restriction.hpp>
 #include <gromox/rop_util.hpp>
 #include <gromox/scope.hpp>
 #include <gromox/util.hpp>
@@ -50,6 +51,11 @@ struct rule_node {
 	RESTRICTION *cond = nullptr;
 	RULE_ACTIONS *act = nullptr;
 	/* XXX: Who frees this? */
+	/*
+	 * Compiled from @cond once the rule list is final (it refers to
+	 * @xcond's address); not carried over by moves.
+	 */
+	res_program prog;
 
 	bool operator<(const struct rule_node &o) const { return seq < o.seq; }
 };
@@ -117,6 +123,7 @@ rule_node &rule_node::operator=(rule_node &&o)
 	o.cond = nullptr;
 	act = o.act;
 	o.act = nullptr;
+	prog = res_program{};
 	return *this;
 }
 
@@ -382,33 +389,65 @@ static ec_error_t rx_load_ext_rules(const char *dir, eid_t fid, bool oof,
 
 static bool rx_eval_props(const MESSAGE_CONTENT *ct, const TPROPVAL_ARRAY &props, const RESTRICTION &res);
 
+namespace {
+struct rx_evalctx {
+	const MESSAGE_CONTENT *ct;
+	const TPROPVAL_ARRAY &props;
+};
+}
+
+static BOOL rx_eval_getprop(void *pp, uint32_t proptag, void **pvalue)
+{
+	*pvalue = static_cast<const rx_evalctx *>(pp)->props.getval(proptag);
+	return TRUE;
+}
+
+static bool rx_eval_fallback(void *pp, const RESTRICTION &res)
+{
+	auto c = static_cast<const rx_evalctx *>(pp);
+	return rx_eval_props(c->ct, c->props, res);
+}
+
+static bool rx_eval_prog(const res_program &prog, const MESSAGE_CONTENT *ct,
+    const TPROPVAL_ARRAY &props)
+{
+	rx_evalctx c{ct, props};
+	return prog.eval(&c, rx_eval_getprop, rx_eval_fallback);
+}
+
+static bool rx_eval_cond(const MESSAGE_CONTENT *ct, const rule_node &rule)
+{
+	if (!rule.prog.compiled())
+		return rx_eval_props(ct, ct->proplist, *rule.cond);
+	return rx_eval_prog(rule.prog, ct, ct->proplist);
+}
+
 static bool rx_eval_msgsub(const MESSAGE_CHILDREN &ch, uint32_t tag,
     const RESTRICTION &res)
 {
+	/* The same subrestriction is tested against every recipient/attachment */
+	auto &sub = res.rt == RES_COUNT ? res.count->sub_res : res;
+	res_program prog;
+	if (!prog.compile(sub))
+		return false;
 	uint32_t count = 0;
 	if (tag == PR_MESSAGE_RECIPIENTS && ch.prcpts != nullptr) {
 		for (size_t i = 0; i < ch.prcpts->count; ++i) {
 			auto rcpt = ch.prcpts->pparray[i];
-			if (res.rt == RES_COUNT) {
-				if (rx_eval_props(nullptr, *rcpt,
-				    static_cast<RESTRICTION_COUNT *>(res.pres)->sub_res))
-					++count;
-			} else {
-				if (rx_eval_props(nullptr, *rcpt, res))
-					return true;
-			}
+			if (!rx_eval_prog(prog, nullptr, *rcpt))
+				continue;
+			if (res.rt != RES_COUNT)
+				return true;
+			++count;
 		}
 	} else if (tag == PR_MESSAGE_ATTACHMENTS && ch.pattachments != nullptr) {
 		for (size_t i = 0; i < ch.pattachments->count; ++i) {
 			auto atx = ch.pattachments->pplist[i];
-			if (res.rt == RES_COUNT) {
-				if (rx_eval_props(nullptr, atx[i].proplist,
-				    static_cast<RESTRICTION_COUNT *>(res.pres)->sub_res))
-					++count;
-			} else {
-				if (rx_eval_props(nullptr, atx[i].proplist, res))
-					return true;
-			}
+			if (!rx_eval_prog(prog, nullptr, atx->proplist))
+				continue;
+			if (res.rt != RES_COUNT)
+				return true;
+			++count;
 		}
 	}
 	return res.rt == RES_COUNT && res.count->count == count;
@@ -752,7 +791,7 @@ static ec_error_t op_process(rxparam &par, const rule_node &rule)
 	if (rule.cond != nullptr) {
 		if (g_ruleproc_debug)
 			mlog(LV_DEBUG, "Rule_Condition %s", rule.cond->repr().c_str());
-		if (!rx_eval_props(par.ctnt, par.ctnt->proplist, *rule.cond))
+		if (!rx_eval_cond(par.ctnt, rule))
 			return ecSuccess;
 	}
 	if (rule.state & ST_EXIT_LEVEL)
@@ -787,8 +826,7 @@ static ec_error_t opx_process(rxparam &par, const rule_node &rule)
 {
 	if (par.exit && !(rule.state & ST_ONLY_WHEN_OOF))
 		return ecSuccess;
-	if (rule.cond != nullptr &&
-	    !rx_eval_props(par.ctnt, par.ctnt->proplist, *rule.cond))
+	if (rule.cond != nullptr && !rx_eval_cond(par.ctnt, rule))
 		return ecSuccess;
 	if (rule.state & ST_EXIT_LEVEL)
 		par.exit = true;
@@ -815,6 +853,9 @@ ec_error_t exmdb_local_rules_execute(const char *dir, const char *ev_from,
 	if (err != ecSuccess)
 		return err;
 	std::sort(rule_list.begin(), rule_list.end());
+	for (auto &rule : rule_list)
+		if (rule.cond != nullptr)
+			rule.prog.compile(*rule.cond); /* else: interpreted */
 
 	rxparam par = {ev_from, ev_to, {{dir, folder_id}, msg_id}, {{dir, folder_id}}};
 	if (!exmdb_client::read_message(par.cur.dir.c_str(), nullptr, CP_ACP,
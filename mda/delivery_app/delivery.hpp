@@ -28,7 +28,7 @@ struct MESSAGE {
 	char *envelope_from = nullptr, *envelope_rcpt = nullptr;
 };
 
-extern void message_dequeue_init(const char *path, size_t max_memory);
+extern void message_dequeue_init(const char *path, size_t max_memory, bool spool_index);
 extern int message_dequeue_run();
 extern void message_dequeue_stop();
 extern MESSAGE *message_dequeue_get();
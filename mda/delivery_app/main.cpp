@@ -53,6 +53,7 @@ static constexpr cfg_directive delivery_cfg_defaults[] = {
 	{"data_file_path", PKGDATADIR "/delivery:" PKGDATADIR},
 	{"dequeue_maximum_mem", "1G", CFG_SIZE, "1"},
 	{"dequeue_path", PKGSTATEQUEUEDIR},
+	{"dequeue_spool_index", "false", CFG_BOOL},
 	{"lda_log_file", "-"},
 	{"lda_log_level", "4" /* LV_NOTICE */},
 	{"running_identity", RUNNING_IDENTITY},
@@ -184,7 +185,8 @@ int main(int argc, const char **argv) try
 		return EXIT_FAILURE;
 	}
 
-	message_dequeue_init(g_config_file->get_value("dequeue_path"), max_mem);
+	message_dequeue_init(g_config_file->get_value("dequeue_path"), max_mem,
+		parse_bool(g_config_file->get_value("dequeue_spool_index")));
     if (0 != message_dequeue_run()) { 
 		mlog(LV_ERR, "system: failed to start message dequeue");
 		return EXIT_FAILURE;
@@ -8,22 +8,42 @@
  *  into this block; or, create a file in mess directory and write the
  *  mail into file. after mail is saved, system will send a message to
  *  message queue to indicate there's a new mail arrived!
+ *
+ *  In spool index mode, new mess IDs are instead read from the append-only
+ *  spool.idx (woken up by inotify). spool.pos records the index offset up to
+ *  which everything has been delivered, so a restart resumes from there
+ *  rather than rescanning mess/. Once drained, the index is truncated.
  */
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+#include <algorithm>
 #include <cerrno>
 #include <csignal>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 #include <dirent.h>
 #include <fcntl.h>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <poll.h>
 #include <pthread.h>
 #include <string>
 #include <unordered_map>
 #include <unistd.h>
+#include <utility>
 #include <vector>
 #include <libHX/io.h>
 #include <libHX/string.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#	include <sys/eventfd.h>
+#endif
+#include <sys/file.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#	include <sys/inotify.h>
+#endif
 #include <sys/ipc.h>
 #include <sys/mman.h>
 #include <sys/msg.h>
@@ -38,6 +58,7 @@
 #define TOKEN_MESSAGE_QUEUE		1
 #define BLOCK_SIZE				64*1024*2
 #define SLEEP_INTERVAL			50000
+#define SPOOL_WAIT_INTERVAL		1000 /* ms */
 
 using namespace std::string_literals;
 using namespace gromox;
@@ -49,6 +70,10 @@ struct MSG_BUFF {
 	int msg_content;
 };
 
+enum class mdq_load {
+	ok, skipped, nomem,
+};
+
 }
 
 static std::string g_path, g_path_mess, g_path_save;
@@ -58,11 +83,19 @@ static size_t			g_max_memory;   /* maximum allocated memory for mess*/
 static size_t			g_current_mem;  /*current allocated memory */
 static std::unique_ptr<MESSAGE[]> g_message_ptr;
 static std::unordered_map<int, MESSAGE *> g_mess_hash;
-static std::vector<MESSAGE *> g_free_list, g_used_list;
+static std::vector<MESSAGE *> g_free_list;
+static std::deque<MESSAGE *> g_used_list;
 static std::mutex g_hash_mutex, g_used_mutex, g_free_mutex, g_mess_mutex;
 static pthread_t		g_thread_id;
 static gromox::atomic_bool g_notify_stop;
 static int				g_dequeued_num;
+static bool g_spool_index;
+static std::string g_spool_idx_path, g_spool_pos_path;
+static int g_spool_wake = -1, g_spool_inotify = -1;
+static uint64_t g_spool_rdpos, g_spool_lowmark = UINT64_MAX;
+static std::deque<std::pair<uint64_t, int>> g_spool_pending; /* (index offset, mess ID) */
+static std::map<int, uint64_t> g_spool_inflight; /* mess ID -> index offset */
+static std::mutex g_spool_mutex; /* protects g_spool_inflight */
 
 static BOOL message_dequeue_check();
 static MESSAGE *message_dequeue_get_from_free(int message_option, size_t size);
@@ -70,20 +103,26 @@ static MESSAGE *message_dequeue_get_from_free(int message_option, size_t size);
 static void message_dequeue_put_to_free(MESSAGE *pmessage);
 
 static void message_dequeue_put_to_used(MESSAGE *pmessage);
-static void message_dequeue_load_from_mess(int mess);
+static mdq_load message_dequeue_load_from_mess(int mess);
 static void message_dequeue_collect_resource();
 static void *mdq_thrwork(void *);
+static void *mdq_spool_thrwork(void *);
 
 /* 
  *	@param
  *		path [in]	path of directory
  *		max_memory	maximum memory system allowed concurrently
  */
-void message_dequeue_init(const char *path, size_t max_memory)
+void message_dequeue_init(const char *path, size_t max_memory, bool spool_index)
 {	
 	g_path = path;
 	g_path_mess = path + "/mess"s;
 	g_path_save = path + "/save"s;
+	g_spool_index = spool_index;
+	g_spool_idx_path = path + "/spool.idx"s;
+	g_spool_pos_path = path + "/spool.pos"s;
+	g_spool_rdpos = 0;
+	g_spool_lowmark = UINT64_MAX;
 	g_max_memory = ((max_memory-1)/(BLOCK_SIZE/2) + 1) * (BLOCK_SIZE/2);
 	g_current_mem = 0;
 	g_msg_id = -1;
@@ -137,6 +176,51 @@ static void message_dequeue_collect_resource()
 {
 	g_message_ptr.reset();
 	g_mess_hash.clear();
+	g_free_list.clear();
+	g_used_list.clear();
+	g_spool_pending.clear();
+	g_spool_inflight.clear();
+	if (g_spool_wake >= 0) {
+		close(g_spool_wake);
+		g_spool_wake = -1;
+	}
+	if (g_spool_inotify >= 0) {
+		close(g_spool_inotify);
+		g_spool_inotify = -1;
+	}
+}
+
+/*
+ * Set up the wakeup sources for spool index mode: inotify on spool.idx for
+ * new mails, and an eventfd for "memory was released, retry pending".
+ * Without either, the dequeue thread simply polls the index periodically.
+ */
+static int message_dequeue_spool_setup()
+{
+	wrapfd fd = open(g_spool_idx_path.c_str(), O_WRONLY | O_APPEND | O_CREAT, FMODE_PRIVATE);
+	if (fd.get() < 0) {
+		mlog(LV_ERR, "mdq: open %s: %s", g_spool_idx_path.c_str(), strerror(errno));
+		return -1;
+	}
+#ifdef HAVE_SYS_EVENTFD_H
+	g_spool_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (g_spool_wake < 0)
+		mlog(LV_WARN, "mdq: eventfd: %s", strerror(errno));
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+	g_spool_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (g_spool_inotify < 0) {
+		mlog(LV_WARN, "mdq: inotify_init: %s", strerror(errno));
+	} else if (inotify_add_watch(g_spool_inotify, g_spool_idx_path.c_str(),
+	    IN_MODIFY) < 0) {
+		mlog(LV_WARN, "mdq: inotify_add_watch %s: %s",
+			g_spool_idx_path.c_str(), strerror(errno));
+		close(g_spool_inotify);
+		g_spool_inotify = -1;
+	}
+#endif
+	mlog(LV_INFO, "mdq: using spool index %s", g_spool_idx_path.c_str());
+	return 0;
 }
 
 int message_dequeue_run()
@@ -164,15 +248,17 @@ int message_dequeue_run()
 		mlog(LV_ERR, "mdq: msgget: %s", strerror(errno));
 		return -6;
 	}
+	if (g_spool_index && message_dequeue_spool_setup() != 0)
+		return -7;
 	g_message_units = g_max_memory/(BLOCK_SIZE/2);
 	g_message_ptr = std::make_unique<MESSAGE[]>(g_message_units);
 	g_free_list.reserve(g_message_units);
-	g_used_list.reserve(g_message_units);
 	/* append rest of message node into free list */
 	for (size_t i = 0; i < g_message_units; ++i) {
 		g_free_list.push_back(&g_message_ptr[i]);
 	}
-	auto ret = pthread_create4(&g_thread_id, nullptr, mdq_thrwork, nullptr);
+	auto ret = pthread_create4(&g_thread_id, nullptr, g_spool_index ?
+	           mdq_spool_thrwork : mdq_thrwork, nullptr);
 	if (ret != 0) {
 		mlog(LV_ERR, "mdq: failed to create message dequeue thread: %s", strerror(ret));
 		message_dequeue_collect_resource();
@@ -193,7 +279,7 @@ MESSAGE* message_dequeue_get()
 	if (g_used_list.size() == 0)
 		return NULL;
 	auto msg = g_used_list.front();
-	g_used_list.erase(g_used_list.begin());
+	g_used_list.pop_front();
 	return msg;
 }
 
@@ -209,11 +295,25 @@ void message_dequeue_put(MESSAGE *pmessage) try
 	auto name = g_path_mess + "/" + std::to_string(pmessage->message_data);
 	if (remove(name.c_str()) < 0 && errno != ENOENT)
 		mlog(LV_WARN, "W-1352: remove %s: %s", name.c_str(), strerror(errno));
+	auto mess_id = pmessage->message_data;
 	std::unique_lock h(g_hash_mutex);
-	g_mess_hash.erase(pmessage->message_data);
+	g_mess_hash.erase(mess_id);
 	h.unlock();
+	if (g_spool_index) {
+		/* before the node can be reused for another message */
+		std::unique_lock sp_hold(g_spool_mutex);
+		g_spool_inflight.erase(mess_id);
+	}
 	message_dequeue_put_to_free(pmessage);
 	g_dequeued_num ++;
+	if (g_spool_index) {
+		/* memory became available and the low watermark may have moved */
+		if (g_spool_wake >= 0) {
+			uint64_t one = 1;
+			if (write(g_spool_wake, &one, sizeof(one)) != sizeof(one))
+				/* ignore */;
+		}
+	}
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "mdq: MDQ-254");
 }
@@ -276,8 +376,8 @@ static MESSAGE *message_dequeue_get_from_free(int message_option, size_t size)
 		mlog(LV_DEBUG, "error in %s", __PRETTY_FUNCTION__);
 		return NULL;
 	}
-	auto pmessage = g_free_list.front();
-	g_free_list.erase(g_free_list.begin());
+	auto pmessage = g_free_list.back();
+	g_free_list.pop_back();
 	fr_hold.unlock();
 	pmessage->message_option = message_option;
 	if (MESSAGE_MESS == message_option) {
@@ -326,8 +426,11 @@ static void message_dequeue_put_to_used(MESSAGE *pmessage)
  *	get message from used list
  *	@param
  *		mess			mess ID
+ *	@return
+ *		mdq_load::nomem when the memory limit was hit and the caller
+ *		should retry later
  */
-static void message_dequeue_load_from_mess(int mess) try
+static mdq_load message_dequeue_load_from_mess(int mess) try
 {
 	struct stat node_stat;
 
@@ -335,16 +438,16 @@ static void message_dequeue_load_from_mess(int mess) try
 	auto msg_iter = g_mess_hash.find(mess);
 	h.unlock();
 	if (msg_iter != g_mess_hash.end())
-		return;
+		return mdq_load::skipped;
 	auto name = g_path_mess + "/"s + std::to_string(mess);
 	wrapfd fd = open(name.c_str(), O_RDONLY);
 	if (fd.get() < 0 || fstat(fd.get(), &node_stat) != 0 ||
 	    !S_ISREG(node_stat.st_mode))
-		return;
+		return mdq_load::skipped;
 	uint64_t size = ((node_stat.st_size - 1) / (64 * 1024) + 1) * 64 * 1024;
 	auto pmessage = message_dequeue_get_from_free(MESSAGE_MESS, size);
 	if (NULL == pmessage) {
-		return;
+		return mdq_load::nomem;
 	}
 	pmessage->message_data = mess;
 	std::unique_ptr<char[]> ptr;
@@ -352,18 +455,18 @@ static void message_dequeue_load_from_mess(int mess) try
 		ptr = std::make_unique<char[]>(size + 1);
 	} catch (const std::bad_alloc &) {
 		message_dequeue_put_to_free(pmessage);
-	        return;
+		return mdq_load::nomem;
 	}
 	auto rdret = read(fd.get(), ptr.get(), node_stat.st_size);
 	if (rdret < 0 || rdret != node_stat.st_size) {
 		message_dequeue_put_to_free(pmessage);
-        return;
+		return mdq_load::skipped;
 	}
 	ptr[rdret] = '\0';
 	/* check if it is an incomplete message */
 	if (le64p_to_cpu(ptr.get()) == 0) {
 		message_dequeue_put_to_free(pmessage);
-		return;	
+		return mdq_load::skipped;
 	}
 	message_dequeue_retrieve_to_message(pmessage, std::move(ptr));
 	message_dequeue_put_to_used(pmessage);
@@ -374,16 +477,55 @@ static void message_dequeue_load_from_mess(int mess) try
 		        2 * g_message_units);
 	else
 		g_mess_hash.emplace(mess, pmessage);
+	return mdq_load::ok;
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-1940: ENOMEM");
-	return;
+	return mdq_load::nomem;
+}
+
+/*
+ *	load every complete mess file found in the mess directory
+ *	@return
+ *		false if the memory limit cut the scan short
+ */
+static bool message_dequeue_scan_mess(DIR *dirp)
+{
+	struct dirent *direntp;
+
+	seekdir(dirp, 0);
+	while ((direntp = readdir(dirp)) != NULL) {
+		if (0 == strcmp(direntp->d_name, ".") ||
+		    0 == strcmp(direntp->d_name, "..")) {
+			continue;
+		}
+		if (g_current_mem == g_max_memory) {
+			return false;
+		}
+		std::string file_name;
+		try {
+			file_name = g_path_mess + "/" + direntp->d_name;
+		} catch (const std::bad_alloc &) {
+			continue;
+		}
+		auto mess_fd = open(file_name.c_str(), O_RDONLY);
+		if (-1 == mess_fd) {
+			continue;
+		}
+		uint64_t size;
+		ssize_t len = read(mess_fd, &size, sizeof(size));
+		close(mess_fd);
+		if (len < 0 || len != sizeof(size) || size == 0)
+			continue;
+		if (message_dequeue_load_from_mess(strtol(direntp->d_name, nullptr, 0)) == mdq_load::nomem)
+			return false;
+	}
+	return true;
 }
 
 static void *mdq_thrwork(void *arg)
 {
 	MSG_BUFF msg;
     DIR *dirp;
-    struct dirent *direntp;
 
 	while ((dirp = opendir(g_path_mess.c_str())) == nullptr) {
 		mlog(LV_ERR, "mdq: failed to open directory %s: %s",
@@ -407,33 +549,189 @@ static void *mdq_thrwork(void *arg)
 		if (g_free_list.size() != g_message_units)
 			continue;
 		/* clean up mess */
-		seekdir(dirp, 0);
-		while ((direntp = readdir(dirp)) != NULL) {
-        	if (0 == strcmp(direntp->d_name, ".") ||
-				0 == strcmp(direntp->d_name, "..")) {
-				continue;
-			}
-			if (g_current_mem == g_max_memory) {
-				break;
-			}
-			std::string file_name;
-			try {
-				file_name = g_path_mess + "/" + direntp->d_name;
-			} catch (const std::bad_alloc &) {
-				continue;
-			}
-			auto mess_fd = open(file_name.c_str(), O_RDONLY);
-			if (-1 == mess_fd) {
-				continue;
+		message_dequeue_scan_mess(dirp);
+	}
+	closedir(dirp);
+	return NULL;
+}
+
+/*
+ * Block until spool.idx grew, delivered mails released memory, or the
+ * interval expired.
+ */
+static void mdq_spool_wait()
+{
+	struct pollfd pfd[2];
+	nfds_t nfd = 0;
+	if (g_spool_inotify >= 0)
+		pfd[nfd++] = {g_spool_inotify, POLLIN};
+	if (g_spool_wake >= 0)
+		pfd[nfd++] = {g_spool_wake, POLLIN};
+	if (nfd == 0) {
+		usleep(SLEEP_INTERVAL);
+		return;
+	}
+	if (poll(pfd, nfd, SPOOL_WAIT_INTERVAL) <= 0)
+		return;
+	char buf[4096];
+	for (nfds_t i = 0; i < nfd; ++i)
+		if (pfd[i].revents & POLLIN)
+			while (read(pfd[i].fd, buf, sizeof(buf)) > 0)
+				/* drain */;
+}
+
+/* Pick up the records appended to spool.idx since the last call. */
+static void mdq_spool_read_index() try
+{
+	wrapfd fd = open(g_spool_idx_path.c_str(), O_RDONLY);
+	struct stat sb;
+	if (fd.get() < 0 || fstat(fd.get(), &sb) != 0)
+		return;
+	uint64_t end = sb.st_size / sizeof(uint32_t) * sizeof(uint32_t);
+	if (end < g_spool_rdpos) {
+		mlog(LV_WARN, "mdq: %s shrank unexpectedly, rereading", g_spool_idx_path.c_str());
+		g_spool_rdpos = 0;
+	}
+	uint32_t buf[1024];
+	while (g_spool_rdpos < end) {
+		auto want = std::min(static_cast<uint64_t>(sizeof(buf)), end - g_spool_rdpos);
+		auto ret = pread(fd.get(), buf, want, g_spool_rdpos);
+		if (ret <= 0)
+			break;
+		size_t nrec = ret / sizeof(uint32_t);
+		for (size_t i = 0; i < nrec; ++i)
+			g_spool_pending.emplace_back(g_spool_rdpos + i * sizeof(uint32_t),
+				le32_to_cpu(buf[i]));
+		g_spool_rdpos += nrec * sizeof(uint32_t);
+	}
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1941: ENOMEM");
+}
+
+/*
+ * Load as many pending mails as the memory limit allows, in index order.
+ * Each is woken up to the transporter as it is loaded, so all worker threads
+ * get busy while the rest of the batch is still being read in.
+ */
+static void mdq_spool_load_batch() try
+{
+	while (g_spool_pending.size() > 0) {
+		auto [offset, mess] = g_spool_pending.front();
+		std::unique_lock sp_hold(g_spool_mutex);
+		if (!g_spool_inflight.emplace(mess, offset).second) {
+			/* already announced earlier (e.g. via msgq) */
+			sp_hold.unlock();
+			g_spool_pending.pop_front();
+			continue;
+		}
+		sp_hold.unlock();
+		auto ret = message_dequeue_load_from_mess(mess);
+		if (ret != mdq_load::ok) {
+			sp_hold.lock();
+			g_spool_inflight.erase(mess);
+		}
+		if (ret == mdq_load::nomem)
+			return;
+		g_spool_pending.pop_front();
+	}
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1942: ENOMEM");
+}
+
+static bool mdq_spool_write_pos(uint64_t pos, bool sync = false)
+{
+	wrapfd fd = open(g_spool_pos_path.c_str(), O_WRONLY | O_CREAT, FMODE_PRIVATE);
+	if (fd.get() < 0) {
+		mlog(LV_ERR, "mdq: open %s: %s", g_spool_pos_path.c_str(), strerror(errno));
+		return false;
+	}
+	pos = cpu_to_le64(pos);
+	if (pwrite(fd.get(), &pos, sizeof(pos), 0) != sizeof(pos) ||
+	    (sync && fdatasync(fd.get()) != 0)) {
+		mlog(LV_ERR, "mdq: write %s: %s", g_spool_pos_path.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Persist the lowest index offset not yet delivered. When everything is
+ * delivered and nothing new was appended meanwhile, truncate the index so it
+ * does not grow without bound. Position 0 is made durable before the
+ * truncation: a crash in between then merely re-reads entries whose mails
+ * are gone, whereas a stale high position over an emptied index would skip
+ * everything appended after the restart.
+ */
+static void mdq_spool_checkpoint()
+{
+	uint64_t low = g_spool_pending.size() > 0 ?
+	               g_spool_pending.front().first : g_spool_rdpos;
+	std::unique_lock sp_hold(g_spool_mutex);
+	for (const auto &pair : g_spool_inflight)
+		low = std::min(low, pair.second);
+	sp_hold.unlock();
+	if (low == g_spool_rdpos && g_spool_rdpos > 0) {
+		wrapfd fd = open(g_spool_idx_path.c_str(), O_WRONLY);
+		struct stat sb;
+		if (fd.get() >= 0 && flock(fd.get(), LOCK_EX) == 0 &&
+		    fstat(fd.get(), &sb) == 0 &&
+		    static_cast<uint64_t>(sb.st_size) == g_spool_rdpos &&
+		    mdq_spool_write_pos(0, true)) {
+			g_spool_lowmark = 0;
+			if (ftruncate(fd.get(), 0) == 0) {
+				g_spool_rdpos = low = 0;
+				/* IN_MODIFY from our own truncation is harmless */
 			}
-			uint64_t size;
-			ssize_t len = read(mess_fd, &size, sizeof(size));
-			close(mess_fd);
-			if (len < 0 || len != sizeof(size) || size == 0)
-				continue;
-			message_dequeue_load_from_mess(strtol(direntp->d_name, nullptr, 0));
 		}
 	}
+	if (low == g_spool_lowmark)
+		return;
+	mdq_spool_write_pos(low);
+	g_spool_lowmark = low;
+}
+
+static void *mdq_spool_thrwork(void *arg)
+{
+	MSG_BUFF msg;
+	DIR *dirp;
+
+	while ((dirp = opendir(g_path_mess.c_str())) == nullptr) {
+		mlog(LV_ERR, "mdq: failed to open directory %s: %s",
+		       g_path_mess.c_str(), strerror(errno));
+		sleep(1);
+	}
+	/*
+	 * Without a recorded position (first start in this mode), mess/ may
+	 * still hold mails announced through the SysV queue; pick those up by
+	 * directory scans until one completes.
+	 */
+	bool need_scan = true;
+	wrapfd pfd = open(g_spool_pos_path.c_str(), O_RDONLY);
+	if (pfd.get() >= 0) {
+		uint64_t pos = 0;
+		if (read(pfd.get(), &pos, sizeof(pos)) == sizeof(pos)) {
+			g_spool_rdpos = le64_to_cpu(pos) / sizeof(uint32_t) * sizeof(uint32_t);
+			need_scan = false;
+		}
+		pfd.close_rd();
+	}
+	if (!need_scan)
+		mlog(LV_INFO, "mdq: resuming spool index at offset %llu",
+			static_cast<unsigned long long>(g_spool_rdpos));
+
+	while (!g_notify_stop) {
+		mdq_spool_read_index();
+		/* the SysV queue is still drained for enqueuers not using the index */
+		while (msgrcv(g_msg_id, &msg, sizeof(uint32_t), 0, IPC_NOWAIT) != -1)
+			if (msg.msg_type == MESSAGE_MESS)
+				g_spool_pending.emplace_back(g_spool_rdpos, msg.msg_content);
+		mdq_spool_load_batch();
+		if (need_scan && g_spool_pending.empty() &&
+		    g_free_list.size() == g_message_units)
+			need_scan = !message_dequeue_scan_mess(dirp);
+		mdq_spool_checkpoint();
+		mdq_spool_wait();
+	}
 	closedir(dirp);
 	return NULL;
 }
@@ -6,6 +6,10 @@
  *	is put into mail queue, and create a file in mess directory and write the
  *  mail into file. after mail is saved, system will send a message to
  *  message queue to indicate there's a new mail arrived!
+ *
+ *  With enqueue_spool_index, the SysV message is replaced by appending the
+ *  mess ID (le32) to the spool.idx file, which delivery watches with inotify
+ *  and also uses to find pending mails after a restart.
  */
 #include <cerrno>
 #include <csignal>
@@ -20,6 +24,7 @@
 #include <sys/ipc.h>
 #include <sys/mman.h>
 #include <sys/msg.h>
+#include <sys/file.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -68,6 +73,7 @@ static char         g_path[256];
 static int			g_msg_id;
 static int			g_last_flush_ID;
 static int			g_last_pos;
+static bool g_spool_index;
 
 /*
  *    @param
@@ -119,7 +125,8 @@ static int message_enqueue_run()
 static void message_enqueue_cancel(FLUSH_ENTITY *pentity) try
 {
 	auto file_name = g_path + "/mess/"s + std::to_string(pentity->pflusher->flush_ID);
-    fclose((FILE*)pentity->pflusher->flush_ptr);
+	if (pentity->pflusher->flush_ptr != nullptr)
+		fclose(static_cast<FILE *>(pentity->pflusher->flush_ptr));
     pentity->pflusher->flush_ptr = NULL;
 	if (remove(file_name.c_str()) < 0 && errno != ENOENT)
 		mlog(LV_WARN, "W-1399: remove %s: %s", file_name.c_str(), strerror(errno));
@@ -179,13 +186,42 @@ static BOOL message_enqueue_check() try
 	return false;
 }
 
+/*
+ * Append the mess ID to the spool index. The lock serializes with the
+ * compaction (truncation) done by delivery once it has drained the index.
+ */
+static bool message_enqueue_spool_append(uint32_t mess_id) try
+{
+	auto name = g_path + "/spool.idx"s;
+	wrapfd fd = open(name.c_str(), O_WRONLY | O_APPEND | O_CREAT, FMODE_PRIVATE);
+	if (fd.get() < 0) {
+		mlog(LV_ERR, "message_enqueue: open %s: %s", name.c_str(), strerror(errno));
+		return false;
+	}
+	if (flock(fd.get(), LOCK_EX) != 0) {
+		mlog(LV_ERR, "message_enqueue: flock %s: %s", name.c_str(), strerror(errno));
+		return false;
+	}
+	mess_id = cpu_to_le32(mess_id);
+	if (write(fd.get(), &mess_id, sizeof(mess_id)) != sizeof(mess_id)) {
+		mlog(LV_ERR, "message_enqueue: write %s: %s", name.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1533: ENOMEM");
+	return false;
+}
+
 void message_enqueue_handle_workitem(FLUSH_ENTITY &e)
 {
 	if (!message_enqueue_try_save_mess(&e)) {
 		e.pflusher->flush_result = FLUSH_TEMP_FAIL;
 		return;
 	}
-	if (e.pflusher->flush_action == FLUSH_WHOLE_MAIL) {
+	if (e.pflusher->flush_action == FLUSH_WHOLE_MAIL && (!g_spool_index ||
+	    !message_enqueue_spool_append(e.pflusher->flush_ID))) {
+		/* the SysV queue remains the fallback when the index is unwritable */
 		MSG_BUFF msg;
 		msg.msg_type = MESSAGE_MESS;
 		msg.msg_content = e.pflusher->flush_ID;
@@ -258,6 +294,17 @@ BOOL message_enqueue_try_save_mess(FLUSH_ENTITY *pentity)
 		fp = (FILE*)pentity->pflusher->flush_ptr;
 	}
 	/* write stream into mess file */
+	if (pentity->is_raw) {
+		/* BDAT chunks: no line structure to honor, copy blocks as-is */
+		size = STREAM_BLOCK_SIZE;
+		void *pbuff;
+		while ((pbuff = pentity->pstream->get_read_buf(&size)) != nullptr) {
+			if (fwrite(pbuff, 1, size, fp) != size)
+				goto REMOVE_MESS;
+			size = STREAM_BLOCK_SIZE;
+		}
+		goto FINISH_MESS;
+	}
 	int copy_result;
 	while (true) {
 		size = MAX_LINE_LENGTH;
@@ -279,6 +326,7 @@ BOOL message_enqueue_try_save_mess(FLUSH_ENTITY *pentity)
 		if (write_len != size)
 			goto REMOVE_MESS;
 	}
+ FINISH_MESS:
 	if (pentity->pflusher->flush_action != FLUSH_WHOLE_MAIL)
 		return TRUE;
 	mess_len = ftell(fp);
@@ -374,6 +422,9 @@ BOOL FLH_LibMain(int reason)
 		if (queue_path == nullptr)
 			queue_path = PKGSTATEQUEUEDIR;
 		mlog(LV_INFO, "message_enqueue: enqueue path is %s", queue_path);
+		g_spool_index = parse_bool(g_config_file->get_value("enqueue_spool_index"));
+		if (g_spool_index)
+			mlog(LV_INFO, "message_enqueue: announcing mails through %s/spool.idx", queue_path);
 
 		message_enqueue_init(queue_path);
 		if (message_enqueue_run() != 0) {
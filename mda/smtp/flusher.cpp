@@ -97,6 +97,7 @@ BOOL flusher_put_to_queue(SMTP_CONTEXT *pcontext) try
 	e.context_ID     = pcontext->context_id;
 	e.pcontext       = pcontext;
 	e.command_protocol = pcontext->command_protocol;
+	e.is_raw         = pcontext->last_cmd == T_BDAT_CMD || pcontext->bdat_last;
 	message_enqueue_handle_workitem(e);
 	return true;
 } catch (const std::bad_alloc &) {
@@ -1,4 +1,5 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+#include <algorithm>
 #include <cerrno>
 #include <chrono>
 #include <csignal>
@@ -49,14 +50,21 @@ E(check_user)
 gromox::atomic_bool g_notify_stop;
 std::shared_ptr<CONFIG_FILE> g_config_file;
 std::string g_rcpt_delimiter;
+namespace {
+struct acceptor {
+	int sockd = -1;
+	bool use_tls = false;
+	pthread_t thr_id{};
+};
+}
+
 static char *opt_config_file;
 static gromox::atomic_bool g_hup_signalled;
-static pthread_t g_thr_id;
 static gromox::atomic_bool g_stop_accept;
 static std::string g_listener_addr;
-static int g_listener_sock = -1, g_listener_ssl_sock = -1;
+static std::vector<acceptor> g_acceptors;
+static unsigned int g_acceptor_num = 1;
 uint16_t g_listener_port, g_listener_ssl_port;
-static pthread_t g_ssl_thr_id;
 
 static struct HXoption g_options_table[] = {
 	{nullptr, 'c', HXTYPE_STRING, &opt_config_file, nullptr, nullptr, 0, "Config file to read", "FILE"},
@@ -77,7 +85,10 @@ static constexpr cfg_directive smtp_cfg_defaults[] = {
 	{"config_file_path", PKGSYSCONFDIR "/smtp:" PKGSYSCONFDIR},
 	{"context_average_mem", "256K", CFG_SIZE, "64K"},
 	{"context_max_mem", "2M", CFG_SIZE},
+	{"context_reactors", "1", CFG_SIZE},
 	{"data_file_path", PKGDATADIR "/smtp:" PKGDATADIR},
+	{"enqueue_spool_index", "false", CFG_BOOL},
+	{"lda_listen_acceptors", "1", CFG_SIZE, "1"},
 	{"lda_listen_addr", "::"},
 	{"lda_listen_port", "25"},
 	{"lda_listen_tls_port", "0"},
@@ -91,12 +102,16 @@ static constexpr cfg_directive smtp_cfg_defaults[] = {
 	{"running_identity", RUNNING_IDENTITY},
 	{"smtp_conn_timeout", "3min", CFG_TIME, "1s"},
 	{"smtp_force_starttls", "false", CFG_BOOL},
+	{"smtp_support_chunking", "true", CFG_BOOL},
 	{"smtp_support_pipeline", "true", CFG_BOOL},
 	{"smtp_support_starttls", "false", CFG_BOOL},
 	{"state_path", PKGSTATEDIR},
 	{"thread_charge_num", "lda_thread_charge_num", CFG_ALIAS},
 	{"thread_init_num", "lda_thread_init_num", CFG_ALIAS},
 	{"tls_min_proto", "tls1.2"},
+	{"tls_session_cache_size", "20480", CFG_SIZE},
+	{"tls_session_timeout", "1h", CFG_TIME, "1min"},
+	{"tls_ticket_key_file", ""},
 	CFG_TABLE_END,
 };
 
@@ -150,15 +165,16 @@ static void system_services_stop()
 
 static void *smls_thrwork(void *arg)
 {
-	const bool use_tls = reinterpret_cast<uintptr_t>(arg);
+	const auto &acc = *static_cast<const acceptor *>(arg);
+	const bool use_tls = acc.use_tls;
 	
 	while (true) {
 		struct sockaddr_storage fact_addr, client_peer;
 		socklen_t addrlen = sizeof(client_peer);
-		char client_hostip[40], client_txtport[8], server_hostip[40];
+		char client_hostip[40], server_hostip[40];
 		/* wait for an incoming connection */
-		auto sockd2 = accept(use_tls ? g_listener_ssl_sock : g_listener_sock,
-		              reinterpret_cast<struct sockaddr *>(&client_peer), &addrlen);
+		auto sockd2 = accept4(acc.sockd, reinterpret_cast<struct sockaddr *>(&client_peer),
+		              &addrlen, SOCK_NONBLOCK);
 		if (g_stop_accept) {
 			if (sockd2 >= 0)
 				close(sockd2);
@@ -166,33 +182,24 @@ static void *smls_thrwork(void *arg)
 		}
 		if (sockd2 == -1)
 			continue;
-		auto ret = getnameinfo(reinterpret_cast<sockaddr *>(&client_peer),
-		           addrlen, client_hostip, sizeof(client_hostip),
-		           client_txtport, sizeof(client_txtport),
-		           NI_NUMERICHOST | NI_NUMERICSERV);
-		if (ret != 0) {
-			mlog(LV_ERR, "getnameinfo: %s", gai_strerror(ret));
+		uint16_t client_port = 0;
+		if (!gx_sockaddr_text(client_peer, client_hostip,
+		    std::size(client_hostip), &client_port)) {
 			close(sockd2);
 			continue;
 		}
 		addrlen = sizeof(fact_addr);
-		ret = getsockname(sockd2, reinterpret_cast<sockaddr *>(&fact_addr), &addrlen);
+		auto ret = getsockname(sockd2, reinterpret_cast<sockaddr *>(&fact_addr), &addrlen);
 		if (ret != 0) {
 			mlog(LV_ERR, "getsockname: %s", strerror(errno));
 			close(sockd2);
 			continue;
 		}
-		ret = getnameinfo(reinterpret_cast<sockaddr *>(&fact_addr),
-		      addrlen, server_hostip, sizeof(server_hostip),
-		      nullptr, 0, NI_NUMERICHOST | NI_NUMERICSERV);
-		if (ret != 0) {
-			mlog(LV_ERR, "getnameinfo: %s", gai_strerror(ret));
+		if (!gx_sockaddr_text(fact_addr, server_hostip,
+		    std::size(server_hostip), nullptr)) {
 			close(sockd2);
 			continue;
 		}
-		uint16_t client_port = strtoul(client_txtport, nullptr, 0);
-		if (fcntl(sockd2, F_SETFL, O_NONBLOCK) < 0)
-			mlog(LV_WARN, "W-1412: fcntl: %s", strerror(errno));
 		static constexpr int flag = 1;
 		if (setsockopt(sockd2, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0)
 			mlog(LV_WARN, "W-1413: setsockopt: %s", strerror(errno));
@@ -243,52 +250,45 @@ static void *smls_thrwork(void *arg)
 	return nullptr;
 }
 
-static void listener_init(const char *addr, uint16_t port, uint16_t ssl_port)
+static void listener_init(const char *addr, uint16_t port, uint16_t ssl_port,
+    unsigned int acceptors)
 {
 	g_listener_addr = addr;
 	g_listener_port = port;
 	g_listener_ssl_port = ssl_port;
+	g_acceptor_num = std::max(acceptors, 1U);
 	g_stop_accept = false;
 }
 
 static int listener_run()
 {
-	g_listener_sock = HX_inet_listen(g_listener_addr.c_str(), g_listener_port);
-	if (g_listener_sock < 0) {
-		mlog(LV_ERR, "listener: failed to create socket [*]:%hu: %s",
-		       g_listener_port, strerror(-g_listener_sock));
-		return -1;
-	}
-	gx_reexec_record(g_listener_sock);
-	if (g_listener_ssl_port > 0) {
-		g_listener_ssl_sock = HX_inet_listen(g_listener_addr.c_str(), g_listener_ssl_port);
-		if (g_listener_ssl_sock < 0) {
+	for (auto tls : {false, true}) {
+		auto port = tls ? g_listener_ssl_port : g_listener_port;
+		if (tls && port == 0)
+			continue;
+		std::vector<int> fds;
+		auto err = gx_inet_listen_multi(g_listener_addr.c_str(), port,
+		           g_acceptor_num, fds);
+		if (err != 0) {
 			mlog(LV_ERR, "listener: failed to create socket [*]:%hu: %s",
-			       g_listener_ssl_port, strerror(-g_listener_ssl_sock));
+			       port, strerror(err));
 			return -1;
 		}
-		gx_reexec_record(g_listener_ssl_sock);
+		for (auto fd : fds)
+			g_acceptors.push_back(acceptor{fd, tls});
 	}
 	return 0;
 }
 
 static int listener_trigger_accept()
 {
-	auto ret = pthread_create4(&g_thr_id, nullptr, smls_thrwork,
-	           reinterpret_cast<void *>(uintptr_t(false)));
-	if (ret != 0) {
-		mlog(LV_ERR, "listener: failed to create listener thread: %s", strerror(ret));
-		return -1;
-	}
-	pthread_setname_np(g_thr_id, "accept");
-	if (g_listener_ssl_port > 0) {
-		ret = pthread_create4(&g_ssl_thr_id, nullptr, smls_thrwork,
-		      reinterpret_cast<void *>(uintptr_t(true)));
+	for (auto &acc : g_acceptors) {
+		auto ret = pthread_create4(&acc.thr_id, nullptr, smls_thrwork, &acc);
 		if (ret != 0) {
 			mlog(LV_ERR, "listener: failed to create listener thread: %s", strerror(ret));
-			return -2;
+			return acc.use_tls ? -2 : -1;
 		}
-		pthread_setname_np(g_ssl_thr_id, "tls_accept");
+		pthread_setname_np(acc.thr_id, acc.use_tls ? "tls_accept" : "accept");
 	}
 	return 0;
 }
@@ -296,30 +296,23 @@ static int listener_trigger_accept()
 static void listener_stop_accept()
 {
 	g_stop_accept = true;
-	if (g_listener_sock >= 0)
-		shutdown(g_listener_sock, SHUT_RDWR); /* closed in listener_stop */
-	if (!pthread_equal(g_thr_id, {})) {
-		pthread_kill(g_thr_id, SIGALRM);
-		pthread_join(g_thr_id, nullptr);
-	}
-	if (g_listener_ssl_sock >= 0)
-		shutdown(g_listener_ssl_sock, SHUT_RDWR);
-	if (!pthread_equal(g_ssl_thr_id, {})) {
-		pthread_kill(g_ssl_thr_id, SIGALRM);
-		pthread_join(g_ssl_thr_id, nullptr);
+	for (auto &acc : g_acceptors) {
+		if (acc.sockd >= 0)
+			shutdown(acc.sockd, SHUT_RDWR); /* closed in listener_stop */
+		if (!pthread_equal(acc.thr_id, {})) {
+			pthread_kill(acc.thr_id, SIGALRM);
+			pthread_join(acc.thr_id, nullptr);
+			acc.thr_id = {};
+		}
 	}
 }
 
 static void listener_stop()
 {
-	if (g_listener_sock >= 0) {
-		close(g_listener_sock);
-		g_listener_sock = -1;
-	}
-	if (g_listener_ssl_sock >= 0) {
-		close(g_listener_ssl_sock);
-		g_listener_ssl_sock = -1;
-	}
+	for (const auto &acc : g_acceptors)
+		if (acc.sockd >= 0)
+			close(acc.sockd);
+	g_acceptors.clear();
 }
 
 int main(int argc, const char **argv) try
@@ -415,6 +408,7 @@ int main(int argc, const char **argv) try
 	mlog(LV_INFO, "dq: SMTP socket read write timeout is %s", temp_buff);
 
 	scfg.support_pipeline = parse_bool(g_config_file->get_value("smtp_support_pipeline"));
+	scfg.support_chunking = parse_bool(g_config_file->get_value("smtp_support_chunking"));
 	scfg.support_starttls = parse_bool(g_config_file->get_value("smtp_support_starttls")) ? TRUE : false;
 	str_val = g_config_file->get_value("smtp_certificate_path");
 	if (str_val != nullptr)
@@ -462,7 +456,8 @@ int main(int argc, const char **argv) try
 		scfg.cmd_prot = 0;
 
 	listener_init(g_config_file->get_value("lda_listen_addr"),
-		listen_port, listen_tls_port);
+		listen_port, listen_tls_port,
+		g_config_file->get_ll("lda_listen_acceptors"));
 	if (0 != listener_run()) {
 		mlog(LV_ERR, "system: failed to start listener");
 		return EXIT_FAILURE;
@@ -520,7 +515,8 @@ int main(int argc, const char **argv) try
 	contexts_pool_init(smtp_parser_get_contexts_list(), scfg.context_num,
 		smtp_parser_get_context_socket,
 		smtp_parser_get_context_timestamp,
-		thread_charge_num, scfg.timeout);
+		thread_charge_num, scfg.timeout,
+		g_config_file->get_ll("context_reactors"));
  
 	if (0 != contexts_pool_run()) { 
 		mlog(LV_ERR, "system: failed to start context pool");
@@ -1,10 +1,14 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 /* collection of functions for handling the smtp command
  */ 
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <unistd.h>
 #include <utility>
+#include <libHX/ctype_helper.h>
 #include <libHX/string.h>
 #include <gromox/config_file.hpp>
 #include <gromox/defs.h>
@@ -76,6 +80,9 @@ static int smtp_cmd_handler_xhlo(const char *cmd_line, int line_length,
 	if (g_param.support_starttls)
 		string_length += sprintf(buff + string_length,
 							"250-STARTTLS\r\n");
+	if (g_param.support_chunking)
+		string_length += sprintf(buff + string_length,
+		                 "250-CHUNKING\r\n");
     
     string_length += sprintf(buff + string_length, 
         "250-HELP\r\n"
@@ -306,6 +313,110 @@ int smtp_cmd_handler_data(const char* cmd_line, int line_length,
 	return DISPATCH_BREAK;
 }    
 
+/*
+ * Move up to @chunk_size octets of what is left in the stream into @chunk
+ * (or drop them if @chunk is nullptr) and park whatever the client
+ * pipelined beyond the chunk in stream_second. bdat_remain receives the
+ * number of chunk octets that are still to come from the socket.
+ */
+static int smtp_cmd_handler_bdat_split(SMTP_CONTEXT *pcontext,
+    size_t chunk_size, STREAM *chunk)
+{
+	pcontext->bdat_remain = chunk_size;
+	unsigned int size = STREAM_BLOCK_SIZE;
+	void *pbuff;
+	while ((pbuff = pcontext->stream.get_read_buf(&size)) != nullptr) {
+		size_t used = std::min(static_cast<size_t>(size), pcontext->bdat_remain);
+		if (used > 0 && chunk != nullptr &&
+		    chunk->write(pbuff, used) != STREAM_WRITE_OK)
+			return 416 | DISPATCH_SHOULD_CLOSE;
+		pcontext->bdat_remain -= used;
+		if (used < size) {
+			if (!pcontext->stream_second.has_value())
+				pcontext->stream_second.emplace(&g_blocks_allocator);
+			if (pcontext->stream_second->write(static_cast<char *>(pbuff) + used,
+			    size - used) != STREAM_WRITE_OK)
+				return 416 | DISPATCH_SHOULD_CLOSE;
+		}
+		size = STREAM_BLOCK_SIZE;
+	}
+	pcontext->stream.clear();
+	return 0;
+}
+
+/*
+ * RFC 3030: BDAT <chunk-size> [LAST]. The octets following the command line
+ * are taken verbatim (no dot-stuffing, no EOM search); whatever the client
+ * pipelined beyond the chunk is parked in stream_second until the chunk has
+ * been handed to the flusher.
+ *
+ * The client sends the chunk regardless of the reply, so a rejected chunk
+ * is still read off the connection (and dropped, bdat_discard) before
+ * command parsing resumes. When the size itself cannot be parsed, there is
+ * no way to find the next command and the session is closed.
+ */
+int smtp_cmd_handler_bdat(const char *cmd_line, int line_length,
+    SMTP_CONTEXT *pcontext)
+{
+	char buff[1024];
+
+	if (line_length <= 5 || cmd_line[4] != ' ')
+		return 505 | DISPATCH_SHOULD_CLOSE;
+	memcpy(buff, cmd_line + 5, line_length - 5);
+	buff[line_length-5] = '\0';
+	HX_strltrim(buff);
+	HX_strrtrim(buff);
+	if (!HX_isdigit(*buff))
+		return 505 | DISPATCH_SHOULD_CLOSE;
+	char *end = nullptr;
+	errno = 0;
+	size_t chunk_size = strtoull(buff, &end, 10);
+	if (errno == ERANGE)
+		return 521 | DISPATCH_SHOULD_CLOSE;
+	bool last = false;
+	while (*end == ' ')
+		++end;
+	if (strcasecmp(end, "LAST") == 0)
+		last = true;
+	else if (*end != '\0')
+		return 505 | DISPATCH_SHOULD_CLOSE;
+
+	int reject = 0;
+	if (!g_param.support_chunking)
+		reject = 506;
+	else if (pcontext->last_cmd != T_RCPT_CMD && pcontext->last_cmd != T_BDAT_CMD)
+		reject = 509;
+	else if (g_param.support_starttls && g_param.force_starttls &&
+	    pcontext->connection.ssl == nullptr)
+		reject = 520;
+	if (reject != 0) {
+		auto ret = smtp_cmd_handler_bdat_split(pcontext, chunk_size, nullptr);
+		if (ret != 0)
+			return ret;
+		pcontext->bdat_discard = true;
+		return reject | DISPATCH_BREAK;
+	}
+	/*
+	 * The chunk octets are already on their way; an oversized message
+	 * is dropped like an oversized DATA transfer.
+	 */
+	if (chunk_size >= g_param.max_mail_length - std::min(pcontext->total_length,
+	    g_param.max_mail_length)) {
+		smtp_parser_log_info(pcontext, LV_NOTICE, "closing session because maximum message size exceeded");
+		return 521 | DISPATCH_SHOULD_CLOSE;
+	}
+	pcontext->last_cmd = T_BDAT_CMD;
+	pcontext->bdat_last = last;
+
+	/* split what is left in the stream into chunk data and pipelined rest */
+	STREAM stream(&g_blocks_allocator);
+	auto ret = smtp_cmd_handler_bdat_split(pcontext, chunk_size, &stream);
+	if (ret != 0)
+		return ret;
+	pcontext->stream = std::move(stream);
+	return DISPATCH_BREAK;
+}
+
 int smtp_cmd_handler_quit(const char* cmd_line, int line_length,
     SMTP_CONTEXT *pcontext)
 {
@@ -328,6 +439,13 @@ int smtp_cmd_handler_rset(const char* cmd_line, int line_length,
 {
 	if (!smtp_cmd_handler_check_onlycmd(cmd_line, line_length, pcontext))
 		return DISPATCH_CONTINUE;
+	if (pcontext->last_cmd == T_BDAT_CMD) {
+		/* discard the chunks spooled so far */
+		if (pcontext->flusher.flush_ID != 0)
+			flusher_cancel(pcontext);
+		pcontext->total_length = 0;
+		pcontext->bdat_last = false;
+	}
     pcontext->last_cmd = T_RSET_CMD;
 	pcontext->menv.clear();
     /* 250 OK */
@@ -28,6 +28,7 @@ int smtp_cmd_handler_rcpt(const char* cmd_line, int line_length,
     SMTP_CONTEXT *pcontext);
 int smtp_cmd_handler_data(const char* cmd_line, int line_length,
     SMTP_CONTEXT *pcontext);
+extern int smtp_cmd_handler_bdat(const char *line, int len, SMTP_CONTEXT *);
 int smtp_cmd_handler_quit(const char* cmd_line, int line_length,
     SMTP_CONTEXT *pcontext);
 int smtp_cmd_handler_rset(const char* cmd_line, int line_length,
@@ -55,6 +55,7 @@ static void smtp_parser_context_clear(SMTP_CONTEXT *pcontext);
 
 static void smtp_parser_reset_context_session(SMTP_CONTEXT *pcontext);
 static tproc_status smtp_parser_try_flush_mail(smtp_context *, BOOL is_whole);
+static tproc_status smtp_parser_bdat_process(smtp_context *);
 static void smtp_parser_reset_stream_reading(SMTP_CONTEXT *pcontext);
 
 static std::unique_ptr<SMTP_CONTEXT[]> g_context_list;
@@ -137,6 +138,13 @@ int smtp_parser_run()
 			return -4;
 		}
 		tls_set_renego(g_ssl_ctx);
+		if (tls_set_resumption(g_ssl_ctx, "gromox-smtp",
+		    g_config_file->get_ll("tls_session_cache_size"),
+		    g_config_file->get_ll("tls_session_timeout"),
+		    g_config_file->get_value("tls_ticket_key_file")) != 0) {
+			mlog(LV_ERR, "smtp_parser: failed to set up TLS session resumption");
+			return -4;
+		}
 		try {
 			g_ssl_mutex_buf = std::make_unique<std::mutex[]>(CRYPTO_num_locks());
 		} catch (const std::bad_alloc &) {
@@ -167,6 +175,7 @@ void smtp_parser_stop()
 	g_context_list2.clear();
 	g_context_list.reset();
 	if (g_param.support_starttls && g_ssl_ctx != nullptr) {
+		tls_resumption_report(g_ssl_ctx);
 		SSL_CTX_free(g_ssl_ctx);
 		g_ssl_ctx = NULL;
 	}
@@ -263,6 +272,23 @@ tproc_status smtp_parser_process(schedule_context *vcontext)
 			return tproc_status::cont;
 		}
 
+		if (pcontext->last_cmd == T_BDAT_CMD) {
+			/* chunk data went verbatim, no boundary bytes to carry over */
+			pcontext->stream.clear();
+			pcontext->flusher.flush_result = FLUSH_NONE;
+			if (pcontext->bdat_remain == 0) {
+				/* 250 OK */
+				auto smtp_reply_str = resource_get_smtp_code(205, 1, &string_length);
+				pcontext->connection.write(smtp_reply_str, string_length);
+				if (pcontext->stream_second.has_value()) {
+					pcontext->stream = std::move(*pcontext->stream_second);
+					pcontext->stream_second.reset();
+					goto CMD_PROCESS;
+				}
+				return tproc_status::cont;
+			}
+			goto READ_SOCKET;
+		}
 		pcontext->stream.clear();
 		size = STREAM_BLOCK_SIZE;
 		pbuff = static_cast<char *>(pcontext->stream.get_write_buf(reinterpret_cast<unsigned int *>(&size)));
@@ -352,6 +378,7 @@ tproc_status smtp_parser_process(schedule_context *vcontext)
 	}
 
 	/* read buffer from socket into stream */
+ READ_SOCKET:
 	pbuff = static_cast<char *>(pcontext->stream.get_write_buf(reinterpret_cast<unsigned int *>(&size)));
 	if (NULL == pbuff) {
 		auto smtp_reply_str = resource_get_smtp_code(416, 1, &string_length);
@@ -364,6 +391,11 @@ tproc_status smtp_parser_process(schedule_context *vcontext)
 		smtp_parser_context_clear(pcontext);
 		return tproc_status::close;
 	}
+	/* never read past the end of a BDAT chunk */
+	if ((pcontext->last_cmd == T_BDAT_CMD || pcontext->bdat_discard) &&
+	    pcontext->bdat_remain > 0 &&
+	    static_cast<size_t>(size) > pcontext->bdat_remain)
+		size = pcontext->bdat_remain;
 	if (NULL != pcontext->connection.ssl) {
 		actual_read = SSL_read(pcontext->connection.ssl, pbuff, size);
 	} else {
@@ -382,6 +414,18 @@ tproc_status smtp_parser_process(schedule_context *vcontext)
 	} else if (actual_read > 0) {
 		pcontext->connection.last_timestamp = current_time;
 		pcontext->stream.fwd_write_ptr(actual_read);
+		if (pcontext->bdat_discard) {
+			/* octets of a rejected chunk */
+			pcontext->bdat_remain -= actual_read;
+			pcontext->stream.clear();
+			if (pcontext->bdat_remain == 0)
+				pcontext->bdat_discard = false;
+			return tproc_status::cont;
+		}
+		if (pcontext->last_cmd == T_BDAT_CMD && pcontext->bdat_remain > 0) {
+			pcontext->bdat_remain -= actual_read;
+			return smtp_parser_bdat_process(pcontext);
+		}
 	} else {
 		if (EAGAIN != errno) {
 			goto LOST_READ;
@@ -424,12 +468,39 @@ tproc_status smtp_parser_process(schedule_context *vcontext)
 					switch (smtp_parser_dispatch_cmd(line, line_length, 
 							pcontext)) {
 					case DISPATCH_SHOULD_CLOSE:
+						if (pcontext->flusher.flush_ID != 0)
+							flusher_cancel(pcontext);
 						pcontext->connection.reset(SLEEP_BEFORE_CLOSE);
 						smtp_parser_context_clear(pcontext);
 						return tproc_status::close;
 					case DISPATCH_CONTINUE:
 						break;
 					case DISPATCH_BREAK:
+						if (pcontext->bdat_discard) {
+							/* rejected chunk, buffered part already dropped */
+							if (pcontext->bdat_remain > 0)
+								return tproc_status::cont;
+							pcontext->bdat_discard = false;
+							if (!pcontext->stream_second.has_value())
+								return tproc_status::cont;
+							pcontext->stream = std::move(*pcontext->stream_second);
+							pcontext->stream_second.reset();
+							goto CMD_PROCESS;
+						}
+						if (pcontext->last_cmd == T_BDAT_CMD &&
+						    pcontext->bdat_remain == 0 && !pcontext->bdat_last &&
+						    pcontext->stream.get_total_length() == 0) {
+							/* empty intermediate chunk, nothing to spool; 250 OK */
+							auto smtp_reply_str = resource_get_smtp_code(205, 1, &string_length);
+							pcontext->connection.write(smtp_reply_str, string_length);
+							if (!pcontext->stream_second.has_value())
+								return tproc_status::cont;
+							pcontext->stream = std::move(*pcontext->stream_second);
+							pcontext->stream_second.reset();
+							goto CMD_PROCESS;
+						}
+						if (pcontext->last_cmd == T_BDAT_CMD)
+							return smtp_parser_bdat_process(pcontext);
 						/*
 						 * Caution: The stream object is different, so we
 						 should get the pbuff from the new stream object and 
@@ -501,13 +572,33 @@ smtp_parser_try_flush_mail(smtp_context *pcontext, BOOL is_whole)
 	 unfinished line into the clear stream. under the other conditions, always 
 	 ignore the last 4 bytes.
 	 */
-	if (!is_whole) {
+	if (!is_whole && pcontext->last_cmd != T_BDAT_CMD) {
 			pcontext->stream.rewind_write_ptr(4);
 	}    
 	flusher_put_to_queue(pcontext);
 	return tproc_status::cont;
 }
 
+/*
+ * BDAT chunk octets are in the stream. Spool them into the queue file once
+ * the chunk is complete or the stream has grown to flushing_size, so that
+ * memory per context stays bounded by context_max_mem regardless of the
+ * chunk size the client picked.
+ */
+static tproc_status smtp_parser_bdat_process(smtp_context *pcontext)
+{
+	if (pcontext->bdat_remain == 0 && pcontext->bdat_last) {
+		/* transaction is over, like EOM for DATA */
+		pcontext->last_cmd = T_END_MAIL;
+		return smtp_parser_try_flush_mail(pcontext, TRUE);
+	}
+	if (pcontext->bdat_remain == 0)
+		return smtp_parser_try_flush_mail(pcontext, false);
+	if (pcontext->stream.get_total_length() >= g_param.flushing_size)
+		return smtp_parser_try_flush_mail(pcontext, false);
+	return tproc_status::cont;
+}
+
 /* 
  *    get contexts list for contexts pool
  *    @return
@@ -557,6 +648,8 @@ static int smtp_parser_dispatch_cmd2(const char *cmd_line, int line_length,
 		return smtp_cmd_handler_rcpt(cmd_line, line_length, pcontext);    
 	} else if (0 == strncasecmp(cmd_line, "DATA", 4)) {
 		return smtp_cmd_handler_data(cmd_line, line_length, pcontext);    
+	} else if (0 == strncasecmp(cmd_line, "BDAT", 4)) {
+		return smtp_cmd_handler_bdat(cmd_line, line_length, pcontext);
 	} else if (0 == strncasecmp(cmd_line, "RSET", 4)) {
 		return smtp_cmd_handler_rset(cmd_line, line_length, pcontext);    
 	} else if (0 == strncasecmp(cmd_line, "NOOP", 4)) {
@@ -622,6 +715,9 @@ static void smtp_parser_reset_context_session(SMTP_CONTEXT *pcontext)
 	pcontext->is_spam                      = FALSE;
 	pcontext->total_length                 = 0;
 	pcontext->pre_rstlen                   = 0;
+	pcontext->bdat_remain                  = 0;
+	pcontext->bdat_last                    = false;
+	pcontext->bdat_discard                 = false;
 	pcontext->stream.clear();
 	pcontext->menv.clear();
 	memset(&pcontext->menv.hello_domain, '\0', std::size(pcontext->menv.hello_domain));
@@ -40,6 +40,7 @@ enum{
     T_ETRN_CMD,
     T_DATA_CMD,
     T_END_MAIL,    
+	T_BDAT_CMD,
     TYPE_NUM
 };
 
@@ -73,13 +74,16 @@ struct smtp_context final : public schedule_context {
 	size_t total_length = 0; /* mail total length */
 	char last_bytes[4]{}; /* last bytes for part mail */
 	int pre_rstlen{}; /* previous bytes rested by last flushing */
+	size_t bdat_remain = 0; /* octets of the current BDAT chunk still to be read */
+	bool bdat_last = false; /* current BDAT chunk carries the LAST flag */
+	bool bdat_discard = false; /* current BDAT chunk was rejected, drop its octets */
 	EXT_DATA ext_data{};
 };
 using SMTP_CONTEXT = smtp_context;
 
 struct smtp_param {
 	unsigned int context_num = 0;
-	BOOL support_pipeline = TRUE;
+	BOOL support_pipeline = TRUE, support_chunking = TRUE;
 	BOOL support_starttls = false, force_starttls = false;
 	size_t max_mail_length = 64ULL * 1024 * 1024;
 	size_t flushing_size = 0;
@@ -180,6 +180,16 @@ int imap_parser_run()
 			return -4;
 		}
 		tls_set_renego(g_ssl_ctx);
+		if (parse_bool(g_config_file->get_value("tls_ktls")) &&
+		    tls_set_ktls(g_ssl_ctx) != 0)
+			fprintf(stderr, "[imap_parser]: tls_ktls: OpenSSL was built without kTLS support, continuing without\n");
+		if (tls_set_resumption(g_ssl_ctx, "gromox-imap",
+		    g_config_file->get_ll("tls_session_cache_size"),
+		    g_config_file->get_ll("tls_session_timeout"),
+		    g_config_file->get_value("tls_ticket_key_file")) != 0) {
+			fprintf(stderr, "[imap_parser]: failed to set up TLS session resumption\n");
+			return -4;
+		}
 		try {
 			g_ssl_mutex_buf = std::make_unique<std::mutex[]>(CRYPTO_num_locks());
 		} catch (const std::bad_alloc &) {
@@ -255,6 +265,7 @@ void imap_parser_stop()
 	g_context_list.reset();
 	g_select_hash.clear();
 	if (g_support_tls && g_ssl_ctx != nullptr) {
+		tls_resumption_report(g_ssl_ctx);
 		SSL_CTX_free(g_ssl_ctx);
 		g_ssl_ctx = NULL;
 	}
@@ -1,4 +1,5 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+#include <algorithm>
 #include <cerrno>
 #include <chrono>
 #include <csignal>
@@ -79,14 +80,22 @@ E(broadcast_unselect)
 bool g_rfc9051_enable;
 gromox::atomic_bool g_notify_stop;
 std::shared_ptr<CONFIG_FILE> g_config_file;
+namespace {
+struct acceptor {
+	int sockd = -1;
+	bool use_tls = false;
+	pthread_t thr_id{};
+};
+}
+
 static char *opt_config_file;
 static gromox::atomic_bool g_hup_signalled;
 static thread_local std::unique_ptr<alloc_context> g_alloc_mgr;
 static thread_local unsigned int g_amgr_refcount;
-static pthread_t g_thr_id, g_ssl_thr_id;
 static gromox::atomic_bool g_stop_accept;
 static std::string g_listener_addr;
-static int g_listener_sock = -1, g_listener_ssl_sock = -1;
+static std::vector<acceptor> g_acceptors;
+static unsigned int g_acceptor_num = 1;
 static uint16_t g_listener_port;
 uint16_t g_listener_ssl_port;
 
@@ -114,6 +123,7 @@ static constexpr cfg_directive imap_cfg_defaults[] = {
 	{"context_average_mitem", "64K", CFG_SIZE, "1"},
 	{"context_max_mem", "2M", CFG_SIZE},
 	{"context_num", "400", CFG_SIZE},
+	{"context_reactors", "1", CFG_SIZE},
 	{"data_file_path", PKGDATADIR "/imap:" PKGDATADIR},
 	{"default_lang", "en"},
 	{"imap_auth_times", "10", CFG_SIZE, "1"},
@@ -122,6 +132,7 @@ static constexpr cfg_directive imap_cfg_defaults[] = {
 	{"imap_conn_timeout", "3min", CFG_TIME, "1s"},
 	{"imap_force_starttls", "imap_force_tls", CFG_ALIAS},
 	{"imap_force_tls", "false", CFG_BOOL},
+	{"imap_listen_acceptors", "1", CFG_SIZE, "1"},
 	{"imap_listen_addr", "::"},
 	{"imap_listen_port", "143"},
 	{"imap_listen_tls_port", "0"},
@@ -138,7 +149,11 @@ static constexpr cfg_directive imap_cfg_defaults[] = {
 	{"state_path", PKGSTATEDIR},
 	{"thread_charge_num", "imap_thread_charge_num", CFG_ALIAS},
 	{"thread_init_num", "imap_thread_init_num", CFG_ALIAS},
+	{"tls_ktls", "0", CFG_BOOL},
 	{"tls_min_proto", "tls1.2"},
+	{"tls_session_cache_size", "20480", CFG_SIZE},
+	{"tls_session_timeout", "1h", CFG_TIME, "1min"},
+	{"tls_ticket_key_file", ""},
 	CFG_TABLE_END,
 };
 static void term_handler(int signo);
@@ -241,14 +256,15 @@ static void system_services_stop()
 
 static void *imls_thrwork(void *arg)
 {
-	const bool use_tls = reinterpret_cast<uintptr_t>(arg);
+	const auto &acc = *static_cast<const acceptor *>(arg);
+	const bool use_tls = acc.use_tls;
 	while (true) {
 		struct sockaddr_storage fact_addr, client_peer;
 		socklen_t addrlen = sizeof(client_peer);
-		char client_hostip[40], client_txtport[8], server_hostip[40];
+		char client_hostip[40], server_hostip[40];
 		/* wait for an incoming connection */
-		auto sockd2 = accept(use_tls ? g_listener_ssl_sock : g_listener_sock,
-		              reinterpret_cast<struct sockaddr *>(&client_peer), &addrlen);
+		auto sockd2 = accept4(acc.sockd, reinterpret_cast<struct sockaddr *>(&client_peer),
+		              &addrlen, SOCK_NONBLOCK);
 		if (g_stop_accept) {
 			if (sockd2 >= 0)
 				close(sockd2);
@@ -256,33 +272,24 @@ static void *imls_thrwork(void *arg)
 		}
 		if (sockd2 == -1)
 			continue;
-		auto ret = getnameinfo(reinterpret_cast<sockaddr *>(&client_peer),
-		           addrlen, client_hostip, sizeof(client_hostip),
-		           client_txtport, sizeof(client_txtport),
-		           NI_NUMERICHOST | NI_NUMERICSERV);
-		if (ret != 0) {
-			printf("getnameinfo: %s\n", gai_strerror(ret));
+		uint16_t client_port = 0;
+		if (!gx_sockaddr_text(client_peer, client_hostip,
+		    std::size(client_hostip), &client_port)) {
 			close(sockd2);
 			continue;
 		}
 		addrlen = sizeof(fact_addr);
-		ret = getsockname(sockd2, reinterpret_cast<sockaddr *>(&fact_addr), &addrlen);
+		auto ret = getsockname(sockd2, reinterpret_cast<sockaddr *>(&fact_addr), &addrlen);
 		if (ret != 0) {
 			printf("getsockname: %s\n", strerror(errno));
 			close(sockd2);
 			continue;
 		}
-		ret = getnameinfo(reinterpret_cast<sockaddr *>(&fact_addr),
-		      addrlen, server_hostip, sizeof(server_hostip),
-		      nullptr, 0, NI_NUMERICHOST | NI_NUMERICSERV);
-		if (ret != 0) {
-			printf("getnameinfo: %s\n", gai_strerror(ret));
+		if (!gx_sockaddr_text(fact_addr, server_hostip,
+		    std::size(server_hostip), nullptr)) {
 			close(sockd2);
 			continue;
 		}
-		uint16_t client_port = strtoul(client_txtport, nullptr, 0);
-		if (fcntl(sockd2, F_SETFL, O_NONBLOCK) < 0)
-			mlog(LV_WARN, "W-1416: fcntl: %s", strerror(errno));
 		static constexpr int flag = 1;
 		if (setsockopt(sockd2, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0)
 			mlog(LV_WARN, "W-1417: setsockopt: %s", strerror(errno));
@@ -346,52 +353,45 @@ static void *imls_thrwork(void *arg)
 	return nullptr;
 }
 
-static void listener_init(const char *addr, uint16_t port, uint16_t ssl_port)
+static void listener_init(const char *addr, uint16_t port, uint16_t ssl_port,
+    unsigned int acceptors)
 {
 	g_listener_addr = addr;
 	g_listener_port = port;
 	g_listener_ssl_port = ssl_port;
+	g_acceptor_num = std::max(acceptors, 1U);
 	g_stop_accept = false;
 }
 
 static int listener_run()
 {
-	g_listener_sock = HX_inet_listen(g_listener_addr.c_str(), g_listener_port);
-	if (g_listener_sock < 0) {
-		printf("[listener]: failed to create socket [*]:%hu: %s\n",
-		       g_listener_port, strerror(-g_listener_sock));
-		return -1;
-	}
-	gx_reexec_record(g_listener_sock);
-	if (g_listener_ssl_port > 0) {
-		g_listener_ssl_sock = HX_inet_listen(g_listener_addr.c_str(), g_listener_ssl_port);
-		if (g_listener_ssl_sock < 0) {
+	for (auto tls : {false, true}) {
+		auto port = tls ? g_listener_ssl_port : g_listener_port;
+		if (tls && port == 0)
+			continue;
+		std::vector<int> fds;
+		auto err = gx_inet_listen_multi(g_listener_addr.c_str(), port,
+		           g_acceptor_num, fds);
+		if (err != 0) {
 			printf("[listener]: failed to create socket [*]:%hu: %s\n",
-			       g_listener_ssl_port, strerror(-g_listener_ssl_sock));
+			       port, strerror(err));
 			return -1;
 		}
-		gx_reexec_record(g_listener_ssl_sock);
+		for (auto fd : fds)
+			g_acceptors.push_back(acceptor{fd, tls});
 	}
 	return 0;
 }
 
 static int listener_trigger_accept()
 {
-	auto ret = pthread_create4(&g_thr_id, nullptr, imls_thrwork,
-	           reinterpret_cast<void *>(uintptr_t(false)));
-	if (ret != 0) {
-		printf("[listener]: failed to create listener thread: %s\n", strerror(ret));
-		return -1;
-	}
-	pthread_setname_np(g_thr_id, "accept");
-	if (g_listener_ssl_port > 0) {
-		ret = pthread_create4(&g_ssl_thr_id, nullptr, imls_thrwork,
-		      reinterpret_cast<void *>(uintptr_t(true)));
+	for (auto &acc : g_acceptors) {
+		auto ret = pthread_create4(&acc.thr_id, nullptr, imls_thrwork, &acc);
 		if (ret != 0) {
 			printf("[listener]: failed to create listener thread: %s\n", strerror(ret));
-			return -2;
+			return acc.use_tls ? -2 : -1;
 		}
-		pthread_setname_np(g_ssl_thr_id, "tls_accept");
+		pthread_setname_np(acc.thr_id, acc.use_tls ? "tls_accept" : "accept");
 	}
 	return 0;
 }
@@ -399,17 +399,14 @@ static int listener_trigger_accept()
 static void listener_stop_accept()
 {
 	g_stop_accept = true;
-	if (g_listener_sock >= 0)
-		shutdown(g_listener_sock, SHUT_RDWR); /* closed in listener_stop */
-	if (!pthread_equal(g_thr_id, {})) {
-		pthread_kill(g_thr_id, SIGALRM);
-		pthread_join(g_thr_id, nullptr);
-	}
-	if (g_listener_ssl_sock >= 0)
-		shutdown(g_listener_ssl_sock, SHUT_RDWR);
-	if (!pthread_equal(g_ssl_thr_id, {})) {
-		pthread_kill(g_ssl_thr_id, SIGALRM);
-		pthread_join(g_ssl_thr_id, nullptr);
+	for (auto &acc : g_acceptors) {
+		if (acc.sockd >= 0)
+			shutdown(acc.sockd, SHUT_RDWR); /* closed in listener_stop */
+		if (!pthread_equal(acc.thr_id, {})) {
+			pthread_kill(acc.thr_id, SIGALRM);
+			pthread_join(acc.thr_id, nullptr);
+			acc.thr_id = {};
+		}
 	}
 }
 
@@ -430,14 +427,10 @@ char *capability_list(char *dst, size_t z, IMAP_CONTEXT *ctx)
 
 static void listener_stop()
 {
-	if (g_listener_sock >= 0) {
-		close(g_listener_sock);
-		g_listener_sock = -1;
-	}
-	if (g_listener_ssl_sock >= 0) {
-		close(g_listener_ssl_sock);
-		g_listener_ssl_sock = -1;
-	}
+	for (const auto &acc : g_acceptors)
+		if (acc.sockd >= 0)
+			close(acc.sockd);
+	g_acceptors.clear();
 }
 
 void imrpc_build_env()
@@ -594,7 +587,8 @@ int main(int argc, const char **argv) try
 	}
 	auto cleanup_2 = make_scope_exit(resource_stop);
 	listener_init(g_config_file->get_value("imap_listen_addr"),
-		listen_port, listen_tls_port);
+		listen_port, listen_tls_port,
+		g_config_file->get_ll("imap_listen_acceptors"));
 	if (0 != listener_run()) {
 		printf("[system]: fail to start listener\n");
 		return EXIT_FAILURE;
@@ -655,7 +649,8 @@ int main(int argc, const char **argv) try
 		context_num,
 		imap_parser_get_context_socket,
 		imap_parser_get_context_timestamp,
-		thread_charge_num, imap_conn_timeout); 
+		thread_charge_num, imap_conn_timeout,
+		g_config_file->get_ll("context_reactors"));
  
 	if (0 != contexts_pool_run()) { 
 		printf("[system]: failed to run contexts pool\n");
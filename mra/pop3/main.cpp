@@ -1,4 +1,5 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+#include <algorithm>
 #include <cerrno>
 #include <chrono>
 #include <csignal>
@@ -54,16 +55,23 @@ E(broadcast_event)
 
 gromox::atomic_bool g_notify_stop;
 std::shared_ptr<CONFIG_FILE> g_config_file;
+namespace {
+struct acceptor {
+	int sockd = -1;
+	bool use_tls = false;
+	pthread_t thr_id{};
+};
+}
+
 static char *opt_config_file;
 static gromox::atomic_bool g_hup_signalled;
 static thread_local std::unique_ptr<alloc_context> g_alloc_mgr;
 static thread_local unsigned int g_amgr_refcount;
-static pthread_t g_thr_id;
 static gromox::atomic_bool g_stop_accept;
 static std::string g_listener_addr;
-static int g_listener_sock = -1, g_listener_ssl_sock = -1;
+static std::vector<acceptor> g_acceptors;
+static unsigned int g_acceptor_num = 1;
 uint16_t g_listener_port, g_listener_ssl_port;
-static pthread_t g_ssl_thr_id;
 
 static struct HXoption g_options_table[] = {
 	{nullptr, 'c', HXTYPE_STRING, &opt_config_file, nullptr, nullptr, 0, "Config file to read", "FILE"},
@@ -88,6 +96,7 @@ static constexpr cfg_directive pop3_cfg_defaults[] = {
 	{"context_average_units", "5000", CFG_SIZE, "1"},
 	{"context_max_mem", "2M", CFG_SIZE},
 	{"context_num", "400", CFG_SIZE, "1"},
+	{"context_reactors", "1", CFG_SIZE},
 	{"data_file_path", PKGDATADIR "/pop3:" PKGDATADIR},
 	{"listen_port", "pop3_listen_port", CFG_ALIAS},
 	{"listen_ssl_port", "pop3_listen_tls_port", CFG_ALIAS},
@@ -96,6 +105,7 @@ static constexpr cfg_directive pop3_cfg_defaults[] = {
 	{"pop3_conn_timeout", "3min", CFG_TIME, "1s"},
 	{"pop3_force_stls", "pop3_force_stls", CFG_ALIAS},
 	{"pop3_force_tls", "false", CFG_BOOL},
+	{"pop3_listen_acceptors", "1", CFG_SIZE, "1"},
 	{"pop3_listen_addr", "::"},
 	{"pop3_listen_port", "110"},
 	{"pop3_listen_tls_port", "0"},
@@ -109,7 +119,11 @@ static constexpr cfg_directive pop3_cfg_defaults[] = {
 	{"state_path", PKGSTATEDIR},
 	{"thread_charge_num", "pop3_thread_charge_num", CFG_ALIAS},
 	{"thread_init_num", "pop3_threaD_init_num", CFG_ALIAS},
+	{"tls_ktls", "0", CFG_BOOL},
 	{"tls_min_proto", "tls1.2"},
+	{"tls_session_cache_size", "20480", CFG_SIZE},
+	{"tls_session_timeout", "1h", CFG_TIME, "1min"},
+	{"tls_ticket_key_file", ""},
 	CFG_TABLE_END,
 };
 
@@ -171,15 +185,16 @@ static void system_services_stop()
 
 static void *p3ls_thrwork(void *arg)
 {
-	const bool use_tls = reinterpret_cast<uintptr_t>(arg);
+	const auto &acc = *static_cast<const acceptor *>(arg);
+	const bool use_tls = acc.use_tls;
 	
 	while (true) {
 		struct sockaddr_storage fact_addr, client_peer;
 		socklen_t addrlen = sizeof(client_peer);
-		char client_hostip[40], client_txtport[8], server_hostip[40];
+		char client_hostip[40], server_hostip[40];
 		/* wait for an incoming connection */
-		auto sockd2 = accept(use_tls ? g_listener_ssl_sock : g_listener_sock,
-		              reinterpret_cast<struct sockaddr *>(&client_peer), &addrlen);
+		auto sockd2 = accept4(acc.sockd, reinterpret_cast<struct sockaddr *>(&client_peer),
+		              &addrlen, SOCK_NONBLOCK);
 		if (g_stop_accept) {
 			if (sockd2 >= 0)
 				close(sockd2);
@@ -187,33 +202,24 @@ static void *p3ls_thrwork(void *arg)
 		}
 		if (sockd2 == -1)
 			continue;
-		int ret = getnameinfo(reinterpret_cast<sockaddr *>(&client_peer),
-		          addrlen, client_hostip, sizeof(client_hostip),
-		          client_txtport, sizeof(client_txtport),
-		          NI_NUMERICHOST | NI_NUMERICSERV);
-		if (ret != 0) {
-			printf("getnameinfo: %s\n", gai_strerror(ret));
+		uint16_t client_port = 0;
+		if (!gx_sockaddr_text(client_peer, client_hostip,
+		    std::size(client_hostip), &client_port)) {
 			close(sockd2);
 			continue;
 		}
-		addrlen = sizeof(fact_addr); 
-		ret = getsockname(sockd2, reinterpret_cast<sockaddr *>(&fact_addr), &addrlen);
+		addrlen = sizeof(fact_addr);
+		auto ret = getsockname(sockd2, reinterpret_cast<sockaddr *>(&fact_addr), &addrlen);
 		if (ret != 0) {
 			printf("getsockname: %s\n", strerror(errno));
 			close(sockd2);
 			continue;
 		}
-		ret = getnameinfo(reinterpret_cast<sockaddr *>(&fact_addr),
-		      addrlen, server_hostip, sizeof(server_hostip),
-		      nullptr, 0, NI_NUMERICHOST | NI_NUMERICSERV);
-		if (ret != 0) {
-			printf("getnameinfo: %s\n", gai_strerror(ret));
+		if (!gx_sockaddr_text(fact_addr, server_hostip,
+		    std::size(server_hostip), nullptr)) {
 			close(sockd2);
 			continue;
 		}
-		uint16_t client_port = strtoul(client_txtport, nullptr, 0);
-		if (fcntl(sockd2, F_SETFL, O_NONBLOCK) < 0)
-			mlog(LV_WARN, "W-1405: fctnl: %s", strerror(errno));
 		static constexpr int flag = 1;
 		if (setsockopt(sockd2, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0)
 			mlog(LV_WARN, "W-1339: setsockopt: %s", strerror(errno));
@@ -285,52 +291,45 @@ static void *p3ls_thrwork(void *arg)
 	return nullptr;
 }
 
-static void listener_init(const char *addr, uint16_t port, uint16_t ssl_port)
+static void listener_init(const char *addr, uint16_t port, uint16_t ssl_port,
+    unsigned int acceptors)
 {
 	g_listener_addr = addr;
 	g_listener_port = port;
 	g_listener_ssl_port = ssl_port;
+	g_acceptor_num = std::max(acceptors, 1U);
 	g_stop_accept = false;
 }
 
 static int listener_run()
 {
-	g_listener_sock = HX_inet_listen(g_listener_addr.c_str(), g_listener_port);
-	if (g_listener_sock < 0) {
-		printf("[listener]: failed to create socket [*]:%hu: %s\n",
-		       g_listener_port, strerror(-g_listener_sock));
-		return -1;
-	}
-	gx_reexec_record(g_listener_sock);
-	if (g_listener_ssl_port > 0) {
-		g_listener_ssl_sock = HX_inet_listen(g_listener_addr.c_str(), g_listener_ssl_port);
-		if (g_listener_ssl_sock < 0) {
+	for (auto tls : {false, true}) {
+		auto port = tls ? g_listener_ssl_port : g_listener_port;
+		if (tls && port == 0)
+			continue;
+		std::vector<int> fds;
+		auto err = gx_inet_listen_multi(g_listener_addr.c_str(), port,
+		           g_acceptor_num, fds);
+		if (err != 0) {
 			printf("[listener]: failed to create socket [*]:%hu: %s\n",
-			       g_listener_ssl_port, strerror(-g_listener_ssl_sock));
+			       port, strerror(err));
 			return -1;
 		}
-		gx_reexec_record(g_listener_ssl_sock);
+		for (auto fd : fds)
+			g_acceptors.push_back(acceptor{fd, tls});
 	}
 	return 0;
 }
 
 static int listener_trigger_accept()
 {
-	auto ret = pthread_create4(&g_thr_id, nullptr, p3ls_thrwork,
-	           reinterpret_cast<void *>(uintptr_t(false)));
-	if (ret != 0) {
-		printf("[listener]: failed to create listener thread: %s\n", strerror(ret));
-		return -1;
-	}
-	pthread_setname_np(g_thr_id, "accept");
-	if (g_listener_ssl_port > 0) {
-		ret = pthread_create4(&g_ssl_thr_id, nullptr, p3ls_thrwork,
-		      reinterpret_cast<void *>(uintptr_t(true)));
+	for (auto &acc : g_acceptors) {
+		auto ret = pthread_create4(&acc.thr_id, nullptr, p3ls_thrwork, &acc);
 		if (ret != 0) {
 			printf("[listener]: failed to create listener thread: %s\n", strerror(ret));
-			return -2;
+			return acc.use_tls ? -2 : -1;
 		}
-		pthread_setname_np(g_ssl_thr_id, "tls_accept");
+		pthread_setname_np(acc.thr_id, acc.use_tls ? "tls_accept" : "accept");
 	}
 	return 0;
 }
@@ -338,30 +337,23 @@ static int listener_trigger_accept()
 static void listener_stop_accept()
 {
 	g_stop_accept = true;
-	if (g_listener_sock >= 0)
-		shutdown(g_listener_sock, SHUT_RDWR); /* closed in listener_stop */
-	if (!pthread_equal(g_thr_id, {})) {
-		pthread_kill(g_thr_id, SIGALRM);
-		pthread_join(g_thr_id, NULL);
-	}
-	if (g_listener_ssl_sock >= 0)
-		shutdown(g_listener_ssl_sock, SHUT_RDWR);
-	if (!pthread_equal(g_ssl_thr_id, {})) {
-		pthread_kill(g_ssl_thr_id, SIGALRM);
-		pthread_join(g_ssl_thr_id, NULL);
+	for (auto &acc : g_acceptors) {
+		if (acc.sockd >= 0)
+			shutdown(acc.sockd, SHUT_RDWR); /* closed in listener_stop */
+		if (!pthread_equal(acc.thr_id, {})) {
+			pthread_kill(acc.thr_id, SIGALRM);
+			pthread_join(acc.thr_id, nullptr);
+			acc.thr_id = {};
+		}
 	}
 }
 
 static void listener_stop()
 {
-	if (g_listener_sock >= 0) {
-		close(g_listener_sock);
-		g_listener_sock = -1;
-	}
-	if (g_listener_ssl_sock >= 0) {
-		close(g_listener_ssl_sock);
-		g_listener_ssl_sock = -1;
-	}
+	for (const auto &acc : g_acceptors)
+		if (acc.sockd >= 0)
+			close(acc.sockd);
+	g_acceptors.clear();
 }
 
 void xrpc_build_env()
@@ -514,7 +506,8 @@ int main(int argc, const char **argv) try
 	auto cleanup_2 = make_scope_exit(resource_stop);
 	uint16_t listen_port = g_config_file->get_ll("pop3_listen_port");
 	listener_init(g_config_file->get_value("pop3_listen_addr"),
-		listen_port, listen_tls_port);
+		listen_port, listen_tls_port,
+		g_config_file->get_ll("pop3_listen_acceptors"));
 	if (0 != listener_run()) {
 		printf("[system]: fail to start listener\n");
 		return EXIT_FAILURE;
@@ -574,7 +567,8 @@ int main(int argc, const char **argv) try
 	contexts_pool_init(pop3_parser_get_contexts_list(), context_num,
 		pop3_parser_get_context_socket,
 		pop3_parser_get_context_timestamp,
-		thread_charge_num, pop3_conn_timeout); 
+		thread_charge_num, pop3_conn_timeout,
+		g_config_file->get_ll("context_reactors"));
  
 	if (0 != contexts_pool_run()) { 
 		printf("[system]: failed to run contexts pool\n");
@@ -13,6 +13,7 @@ using namespace gromox;
 [[noreturn]] static void usage()
 {
 	fprintf(stderr, "Usage: test -d x.zst\n");
+	fprintf(stderr, "       test -r x.zst offset length  (seekable files only)\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -49,6 +50,23 @@ static int comp(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+static int range(int argc, char **argv)
+{
+	if (argc < 4)
+		usage();
+	BINARY bin{};
+	auto ret = gx_decompress_range(argv[1], strtoull(argv[2], nullptr, 0),
+	           strtoul(argv[3], nullptr, 0), bin, malloc);
+	if (ret != 0) {
+		fprintf(stderr, "gx_decompress_range %s: %s\n", argv[1], strerror(ret));
+		free(bin.pv);
+		return EXIT_FAILURE;
+	}
+	fwrite(bin.pv, bin.cb, 1, stdout);
+	free(bin.pv);
+	return EXIT_SUCCESS;
+}
+
 static int detsize(int argc, char **argv)
 {
 	while (*++argv != nullptr)
@@ -62,6 +80,8 @@ int main(int argc, char **argv)
 		usage();
 	if (strcmp(argv[1], "-d") == 0)
 		return decomp(argc - 1, argv + 1);
+	if (strcmp(argv[1], "-r") == 0)
+		return range(argc - 1, argv + 1);
 	if (strcmp(argv[1], "-s") == 0)
 		return detsize(argc - 1, argv + 1);
 	if (strcmp(argv[1], "-z") == 0)
@@ -0,0 +1,330 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * HPACK against the examples of RFC 7541 Appendix C, plus malformed header
+ * blocks, field lists and frames.
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "../exch/http/h2codec.hpp"
+#undef assert
+#define assert(x) do { if (!(x)) { printf("%s:%d: %s failed\n", __FILE__, __LINE__, #x); return EXIT_FAILURE; } } while (false)
+
+using hdr_list = hpack_decoder::hdr_list;
+using namespace std::string_view_literals;
+
+static std::string unhex(const char *s)
+{
+	std::string out;
+	for (; s[0] != '\0' && s[1] != '\0'; s += 2)
+		out += static_cast<char>(std::stoi(std::string(s, 2), nullptr, 16));
+	return out;
+}
+
+static int decode(hpack_decoder &d, const std::string &blk, hdr_list &hl)
+{
+	hl.clear();
+	return d.decode(reinterpret_cast<const uint8_t *>(blk.data()), blk.size(), hl);
+}
+
+static int t_int()
+{
+	/* C.1 */
+	std::string o;
+	hpack_put_int(o, 0x00, 5, 10);
+	assert(o == "\x0a");
+	o.clear();
+	hpack_put_int(o, 0x00, 5, 1337);
+	assert(o == unhex("1f9a0a"));
+	o.clear();
+	hpack_put_int(o, 0x00, 8, 42);
+	assert(o == "\x2a");
+
+	uint64_t v = 0;
+	o = unhex("1f9a0a");
+	auto p = reinterpret_cast<const uint8_t *>(o.data());
+	assert(hpack_get_int(p, p + o.size(), 5, v) && v == 1337);
+	assert(p == reinterpret_cast<const uint8_t *>(o.data() + o.size()));
+	/* truncated continuation */
+	p = reinterpret_cast<const uint8_t *>(o.data());
+	assert(!hpack_get_int(p, p + 2, 5, v));
+	/* more continuation bytes than fit in 64 bits */
+	o = unhex("1fffffffffffffffffffff01");
+	p = reinterpret_cast<const uint8_t *>(o.data());
+	assert(!hpack_get_int(p, p + o.size(), 5, v));
+	return EXIT_SUCCESS;
+}
+
+static int t_huff()
+{
+	std::string s, o = unhex("f1e3c2e5f23a6ba0ab90f4ff");
+	assert(hpack_huff_decode(reinterpret_cast<const uint8_t *>(o.data()), o.size(), s));
+	assert(s == "www.example.com");
+	/* padding longer than 7 bits */
+	o += '\xff';
+	s.clear();
+	assert(!hpack_huff_decode(reinterpret_cast<const uint8_t *>(o.data()), o.size(), s));
+	/* EOS inside the string */
+	o = unhex("ffffffff");
+	s.clear();
+	assert(!hpack_huff_decode(reinterpret_cast<const uint8_t *>(o.data()), o.size(), s));
+	/* padding that is not a prefix of EOS: '0' (00000) + 000 */
+	o = unhex("00");
+	s.clear();
+	assert(!hpack_huff_decode(reinterpret_cast<const uint8_t *>(o.data()), o.size(), s));
+	/* string length beyond the block */
+	o = unhex("8af1e3");
+	auto p = reinterpret_cast<const uint8_t *>(o.data());
+	assert(!hpack_get_str(p, p + o.size(), s));
+	return EXIT_SUCCESS;
+}
+
+static int t_literal()
+{
+	/* C.2.1 - C.2.4 */
+	static const struct {
+		const char *blk, *name, *value;
+		size_t tsize;
+	} vec[] = {
+		{"400a637573746f6d2d6b65790d637573746f6d2d686561646572", "custom-key", "custom-header", 55},
+		{"040c2f73616d706c652f70617468", ":path", "/sample/path", 0},
+		{"100870617373776f726406736563726574", "password", "secret", 0},
+		{"82", ":method", "GET", 0},
+	};
+	for (const auto &e : vec) {
+		hpack_decoder d;
+		hdr_list hl;
+		assert(decode(d, unhex(e.blk), hl) == 1);
+		assert(hl.size() == 1 && hl[0].first == e.name && hl[0].second == e.value);
+		assert(d.table_size() == e.tsize);
+	}
+	return EXIT_SUCCESS;
+}
+
+static int t_sequence(size_t table_max, const char *const *blk,
+    const hdr_list *want, const size_t *tsize)
+{
+	hpack_decoder d(table_max);
+	for (unsigned int i = 0; i < 3; ++i) {
+		hdr_list hl;
+		assert(decode(d, unhex(blk[i]), hl) == 1);
+		assert(hl == want[i]);
+		assert(d.table_size() == tsize[i]);
+	}
+	return EXIT_SUCCESS;
+}
+
+static int t_requests()
+{
+	/* C.3 (plain) and C.4 (Huffman) */
+	static const char *const c3[] = {
+		"828684410f7777772e6578616d706c652e636f6d",
+		"828684be58086e6f2d6361636865",
+		"828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565",
+	}, *const c4[] = {
+		"828684418cf1e3c2e5f23a6ba0ab90f4ff",
+		"828684be5886a8eb10649cbf",
+		"828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf",
+	};
+	const hdr_list want[] = {
+		{{":method", "GET"}, {":scheme", "http"}, {":path", "/"},
+		 {":authority", "www.example.com"}},
+		{{":method", "GET"}, {":scheme", "http"}, {":path", "/"},
+		 {":authority", "www.example.com"}, {"cache-control", "no-cache"}},
+		{{":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"},
+		 {":authority", "www.example.com"}, {"custom-key", "custom-value"}},
+	};
+	static const size_t tsize[] = {57, 110, 164};
+	if (t_sequence(4096, c3, want, tsize) != EXIT_SUCCESS ||
+	    t_sequence(4096, c4, want, tsize) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+static int t_responses()
+{
+	/* C.5 (plain) and C.6 (Huffman), with a 256-byte table and eviction */
+	static const char *const c5[] = {
+		"4803333032580770726976617465611d4d6f6e2c203231204f637420323031332032303a31333a323120474d546e1768747470733a2f2f7777772e6578616d706c652e636f6d",
+		"4803333037c1c0bf",
+		"88c1611d4d6f6e2c203231204f637420323031332032303a31333a323220474d54c05a04677a69707738666f6f3d4153444a4b48514b425a584f5157454f50495541585157454f49553b206d61782d6167653d333630303b2076657273696f6e3d31",
+	}, *const c6[] = {
+		"488264025885aec3771a4b6196d07abe941054d444a8200595040b8166e082a62d1bff6e919d29ad171863c78f0b97c8e9ae82ae43d3",
+		"4883640effc1c0bf",
+		"88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a839bd9ab77ad94e7821dd7f2e6c7b335dfdfcd5b3960d5af27087f3672c1ab270fb5291f9587316065c003ed4ee5b1063d5007",
+	};
+	const hdr_list want[] = {
+		{{":status", "302"}, {"cache-control", "private"},
+		 {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+		 {"location", "https://www.example.com"}},
+		{{":status", "307"}, {"cache-control", "private"},
+		 {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+		 {"location", "https://www.example.com"}},
+		{{":status", "200"}, {"cache-control", "private"},
+		 {"date", "Mon, 21 Oct 2013 20:13:22 GMT"},
+		 {"location", "https://www.example.com"},
+		 {"content-encoding", "gzip"},
+		 {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}},
+	};
+	static const size_t tsize[] = {222, 222, 215};
+	if (t_sequence(256, c5, want, tsize) != EXIT_SUCCESS ||
+	    t_sequence(256, c6, want, tsize) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+static int t_badblock()
+{
+	hpack_decoder d;
+	hdr_list hl;
+	/* index 0, index beyond static+dynamic table */
+	assert(decode(d, unhex("80"), hl) < 0);
+	assert(decode(d, unhex("ff00"), hl) < 0);
+	/* table size update above our SETTINGS, and after a field */
+	std::string blk;
+	hpack_put_int(blk, 0x20, 5, 4097);
+	assert(decode(d, blk, hl) < 0);
+	blk.clear();
+	hpack_put_int(blk, 0x20, 5, 4096);
+	assert(decode(d, blk, hl) == 1);
+	blk = unhex("82");
+	hpack_put_int(blk, 0x20, 5, 0);
+	hpack_decoder d2;
+	assert(decode(d2, blk, hl) < 0);
+	/* literal value running past the block */
+	assert(decode(d2, unhex("0003616263"), hl) < 0);
+	return EXIT_SUCCESS;
+}
+
+static int t_listlimit()
+{
+	/*
+	 * One 900-byte table entry, then referenced over and over: must stop
+	 * collecting at the limit, yet keep the table usable.
+	 */
+	hpack_decoder d(4096, 4000);
+	hdr_list hl;
+	std::string blk = "\x40";
+	hpack_put_str(blk, "x");
+	hpack_put_str(blk, std::string(900, 'a'));
+	blk.append(1000, '\xbe');
+	assert(decode(d, blk, hl) == 0);
+	assert(hl.size() == 4);
+	assert(decode(d, "\xbe", hl) == 1);
+	assert(hl.size() == 1 && hl[0].first == "x" && hl[0].second.size() == 900);
+	return EXIT_SUCCESS;
+}
+
+static int t_fields()
+{
+	const hdr_list good = {{":method", "GET"}, {":scheme", "https"},
+		{":path", "/x"}, {":authority", "a"}, {"te", "trailers"},
+		{"accept", "*/*"}, {"x-empty", ""}};
+	assert(h2_fields_valid(good, false));
+	assert(!h2_fields_valid(good, true)); /* pseudo-headers in trailers */
+	assert(h2_fields_valid({{"x-checksum", "abc"}}, true));
+	static const hdr_list bad[] = {
+		{{":method", "GET"}, {"Accept", "*/*"}},
+		{{":method", "GET"}, {"x:y", "1"}},
+		{{":method", "GET"}, {"x y", "1"}},
+		{{":method", "GET"}, {"", "1"}},
+		{{":method", "GET"}, {"x", "a\r\nInjected: 1"}},
+		{{":method", "GET"}, {"x", "a\nb"}},
+		{{":method", "GET"}, {"x", std::string("a\0b", 3)}},
+		{{":method", "GET"}, {"x", " a"}},
+		{{":method", "GET"}, {"x", "a\t"}},
+		{{":method", "GET"}, {"connection", "close"}},
+		{{":method", "GET"}, {"keep-alive", "1"}},
+		{{":method", "GET"}, {"proxy-connection", "x"}},
+		{{":method", "GET"}, {"transfer-encoding", "chunked"}},
+		{{":method", "GET"}, {"upgrade", "h2c"}},
+		{{":method", "GET"}, {"te", "gzip"}},
+		{{"accept", "*/*"}, {":method", "GET"}},
+		{{":path", "/"}, {":path", "/"}},
+		{{":status", "200"}},
+		{{":path", "/\r\n"}},
+	};
+	for (size_t i = 0; i < std::size(bad); ++i)
+		if (h2_fields_valid(bad[i], false)) {
+			printf("field list %zu accepted\n", i);
+			return EXIT_FAILURE;
+		}
+	return EXIT_SUCCESS;
+}
+
+static int t_frames()
+{
+	static const struct {
+		uint32_t cont_id;
+		uint8_t type, flags;
+		uint32_t sid;
+		std::string_view payload;
+		uint32_t err;
+	} vec[] = {
+		{0, H2_DATA, 0, 0, ""sv, H2E_PROTOCOL},
+		{0, H2_DATA, 0, 1, "abcd"sv, H2E_NO_ERROR},
+		{0, H2_DATA, H2F_PADDED, 1, "\x04""abc"sv, H2E_PROTOCOL},
+		{0, H2_DATA, H2F_PADDED, 1, "\x03""abc"sv, H2E_NO_ERROR},
+		{0, H2_DATA, H2F_PADDED, 1, ""sv, H2E_PROTOCOL},
+		{0, H2_HEADERS, 0, 2, "\x82"sv, H2E_PROTOCOL},
+		{0, H2_HEADERS, 0, 0, "\x82"sv, H2E_PROTOCOL},
+		{0, H2_HEADERS, H2F_PRIORITY, 1, "abc"sv, H2E_PROTOCOL},
+		{0, H2_HEADERS, H2F_PRIORITY | H2F_PADDED, 1, "\x01""abcde"sv, H2E_PROTOCOL},
+		{0, H2_HEADERS, H2F_PRIORITY, 1, "abcde"sv, H2E_NO_ERROR},
+		{0, H2_PRIORITY, 0, 1, "abcd"sv, H2E_FRAME_SIZE},
+		{0, H2_PRIORITY, 0, 0, "abcde"sv, H2E_PROTOCOL},
+		{0, H2_RST_STREAM, 0, 0, "abcd"sv, H2E_PROTOCOL},
+		{0, H2_RST_STREAM, 0, 1, "abc"sv, H2E_FRAME_SIZE},
+		{0, H2_SETTINGS, 0, 1, ""sv, H2E_PROTOCOL},
+		{0, H2_SETTINGS, H2F_ACK, 0, "abcdef"sv, H2E_FRAME_SIZE},
+		{0, H2_SETTINGS, 0, 0, "abcde"sv, H2E_FRAME_SIZE},
+		{0, H2_SETTINGS, 0, 0, "\x00\x02\x00\x00\x00\x02"sv, H2E_PROTOCOL},
+		{0, H2_SETTINGS, 0, 0, "\x00\x04\x80\x00\x00\x00"sv, H2E_FLOW_CONTROL},
+		{0, H2_SETTINGS, 0, 0, "\x00\x05\x00\x00\x01\x00"sv, H2E_PROTOCOL},
+		{0, H2_SETTINGS, 0, 0, "\x00\x05\x01\x00\x00\x00"sv, H2E_PROTOCOL},
+		{0, H2_SETTINGS, 0, 0, "\x00\x04\x7f\xff\xff\xff\x00\x05\x00\x00\x40\x00"sv, H2E_NO_ERROR},
+		{0, H2_PUSH_PROMISE, 0, 1, "abcd"sv, H2E_PROTOCOL},
+		{0, H2_PING, 0, 0, "abcdefg"sv, H2E_FRAME_SIZE},
+		{0, H2_PING, 0, 1, "abcdefgh"sv, H2E_PROTOCOL},
+		{0, H2_GOAWAY, 0, 0, "abcd"sv, H2E_FRAME_SIZE},
+		{0, H2_GOAWAY, 0, 1, "abcdefgh"sv, H2E_PROTOCOL},
+		{0, H2_WINDOW_UPDATE, 0, 0, "abc"sv, H2E_FRAME_SIZE},
+		{0, H2_WINDOW_UPDATE, 0, 0, "\x80\x00\x00\x00"sv, H2E_PROTOCOL},
+		{0, H2_WINDOW_UPDATE, 0, 1, "\x80\x00\x00\x00"sv, H2E_NO_ERROR},
+		{0, H2_CONTINUATION, 0, 1, "\x82"sv, H2E_PROTOCOL},
+		{3, H2_DATA, 0, 3, "abcd"sv, H2E_PROTOCOL},
+		{3, H2_CONTINUATION, 0, 5, "\x82"sv, H2E_PROTOCOL},
+		{3, H2_CONTINUATION, 0, 3, "\x82"sv, H2E_NO_ERROR},
+		{0, 0x20, 0, 0, "whatever"sv, H2E_NO_ERROR},
+	};
+	for (size_t i = 0; i < std::size(vec); ++i) {
+		const auto &e = vec[i];
+		auto ret = h2_frame_check(e.cont_id, e.type, e.flags, e.sid,
+		           reinterpret_cast<const uint8_t *>(e.payload.data()),
+		           e.payload.size());
+		if (ret != e.err) {
+			printf("frame %zu: got error %u, expected %u\n", i, ret, e.err);
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+int main()
+{
+	using fpt = decltype(&t_int);
+	fpt fct[] = {t_int, t_huff, t_literal, t_requests, t_responses,
+	             t_badblock, t_listlimit, t_fields, t_frames};
+	for (auto f : fct) {
+		auto ret = f();
+		if (ret != EXIT_SUCCESS)
+			return ret;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,195 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Compares the two ways of computing the ICS content diff: the former
+ * per-call scratch sqlite database versus sorted vectors + range_set.
+ *
+ * Usage: tests/icsbench [messages [given% [changed%]]]
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include <sqlite3.h>
+#include <gromox/range_set.hpp>
+
+using namespace gromox;
+using rs_t = range_set<uint64_t>;
+
+namespace {
+struct result {
+	std::vector<uint64_t> chg, upd, given, deleted;
+	bool operator==(const result &o) const {
+		return chg == o.chg && upd == o.upd && given == o.given && deleted == o.deleted;
+	}
+};
+}
+
+/* Per-range membership test as done by the old idset::hint */
+static bool linear_contains(const rs_t &r, uint64_t v)
+{
+	for (const auto &n : r)
+		if (n.contains(v))
+			return true;
+	return false;
+}
+
+static void sq(sqlite3 *db, const char *q)
+{
+	if (sqlite3_exec(db, q, nullptr, nullptr, nullptr) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", q, sqlite3_errmsg(db));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static result run_sqlite(const std::vector<std::pair<uint64_t, uint64_t>> &folder,
+    const rs_t &given, const rs_t &seen)
+{
+	result res;
+	sqlite3 *db = nullptr;
+	sqlite3_open_v2(":memory:", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr);
+	sq(db, "CREATE TABLE existence (message_id INTEGER PRIMARY KEY)");
+	sq(db, "CREATE TABLE changes (message_id INTEGER PRIMARY KEY)");
+	sq(db, "CREATE TABLE id_vals (id_val INTEGER PRIMARY KEY)");
+	sq(db, "BEGIN");
+	/* IDSET_CACHE: short ranges went into a table, long ones stayed in a list */
+	sqlite3_stmt *ins_id, *ins_ex, *ins_chg, *sel_id, *sel_ex;
+	sqlite3_prepare_v2(db, "INSERT INTO id_vals VALUES (?)", -1, &ins_id, nullptr);
+	sqlite3_prepare_v2(db, "INSERT INTO existence VALUES (?)", -1, &ins_ex, nullptr);
+	sqlite3_prepare_v2(db, "INSERT INTO changes VALUES (?)", -1, &ins_chg, nullptr);
+	sqlite3_prepare_v2(db, "SELECT id_val FROM id_vals WHERE id_val=?", -1, &sel_id, nullptr);
+	sqlite3_prepare_v2(db, "SELECT message_id FROM existence WHERE message_id=?", -1, &sel_ex, nullptr);
+	rs_t long_ranges;
+	for (const auto &n : given) {
+		if (n.hi - n.lo >= 10) {
+			long_ranges.vec().push_back(n);
+			continue;
+		}
+		for (auto v = n.lo; v <= n.hi; ++v) {
+			sqlite3_reset(ins_id);
+			sqlite3_bind_int64(ins_id, 1, v);
+			sqlite3_step(ins_id);
+		}
+	}
+	auto cache_hint = [&](uint64_t v) {
+		sqlite3_reset(sel_id);
+		sqlite3_bind_int64(sel_id, 1, v);
+		if (sqlite3_step(sel_id) == SQLITE_ROW)
+			return true;
+		return linear_contains(long_ranges, v);
+	};
+	for (const auto &[mid, cn] : folder) {
+		sqlite3_reset(ins_ex);
+		sqlite3_bind_int64(ins_ex, 1, mid);
+		sqlite3_step(ins_ex);
+		if (cache_hint(mid) && linear_contains(seen, cn))
+			continue;
+		sqlite3_reset(ins_chg);
+		sqlite3_bind_int64(ins_chg, 1, mid);
+		sqlite3_step(ins_chg);
+	}
+	sq(db, "COMMIT");
+	sqlite3_stmt *st;
+	sqlite3_prepare_v2(db, "SELECT message_id FROM changes", -1, &st, nullptr);
+	while (sqlite3_step(st) == SQLITE_ROW) {
+		uint64_t mid = sqlite3_column_int64(st, 0);
+		res.chg.push_back(mid);
+		if (cache_hint(mid))
+			res.upd.push_back(mid);
+	}
+	sqlite3_finalize(st);
+	for (const auto &n : given)
+		for (auto v = n.lo; v <= n.hi; ++v) {
+			sqlite3_reset(sel_ex);
+			sqlite3_bind_int64(sel_ex, 1, v);
+			if (sqlite3_step(sel_ex) != SQLITE_ROW)
+				res.deleted.push_back(v);
+		}
+	sqlite3_prepare_v2(db, "SELECT message_id FROM existence ORDER BY message_id DESC", -1, &st, nullptr);
+	while (sqlite3_step(st) == SQLITE_ROW)
+		res.given.push_back(sqlite3_column_int64(st, 0));
+	sqlite3_finalize(st);
+	for (auto s : {ins_id, ins_ex, ins_chg, sel_id, sel_ex})
+		sqlite3_finalize(s);
+	sqlite3_close(db);
+	return res;
+}
+
+static result run_vector(const std::vector<std::pair<uint64_t, uint64_t>> &folder,
+    const rs_t &given, const rs_t &seen)
+{
+	result res;
+	std::vector<uint64_t> exist;
+	for (const auto &[mid, cn] : folder) {
+		exist.push_back(mid);
+		if (given.contains(mid) && seen.contains(cn))
+			continue;
+		res.chg.push_back(mid);
+	}
+	std::sort(exist.begin(), exist.end());
+	std::sort(res.chg.begin(), res.chg.end());
+	for (auto mid : res.chg)
+		if (given.contains(mid))
+			res.upd.push_back(mid);
+	for (const auto &n : given)
+		for (auto v = n.lo; v <= n.hi; ++v)
+			if (!std::binary_search(exist.cbegin(), exist.cend(), v))
+				res.deleted.push_back(v);
+	res.given.assign(exist.crbegin(), exist.crend());
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	size_t nmsg = argc > 1 ? strtoull(argv[1], nullptr, 0) : 50000;
+	unsigned int given_pct = argc > 2 ? strtoul(argv[2], nullptr, 0) : 90;
+	unsigned int chg_pct = argc > 3 ? strtoul(argv[3], nullptr, 0) : 2;
+	std::mt19937_64 rng(1);
+	std::uniform_int_distribution<unsigned int> pct(0, 99);
+
+	/*
+	 * Folder contents are {mid, change_number}. Message ids have holes
+	 * (deleted messages), which fragments the client's given/seen sets the
+	 * way real mailboxes do.
+	 */
+	std::vector<std::pair<uint64_t, uint64_t>> folder;
+	rs_t given, seen;
+	uint64_t mid = 0x10000, cn = 0x20000;
+	for (size_t i = 0; i < nmsg; ++i) {
+		mid += pct(rng) < 20 ? 2 : 1;
+		++cn;
+		if (pct(rng) < given_pct) {
+			given.insert(mid);
+			if (pct(rng) >= chg_pct)
+				seen.insert(cn);
+		}
+		if (pct(rng) < 3)
+			/* the client still knows about something deleted since */
+			given.insert(mid + 1);
+		folder.emplace_back(mid, cn);
+	}
+	std::shuffle(folder.begin(), folder.end(), rng);
+	printf("%zu messages, given set: %zu ranges, seen set: %zu ranges\n",
+	       folder.size(), given.size(), seen.size());
+
+	using clk = std::chrono::steady_clock;
+	auto t0 = clk::now();
+	auto r1 = run_sqlite(folder, given, seen);
+	auto t1 = clk::now();
+	auto r2 = run_vector(folder, given, seen);
+	auto t2 = clk::now();
+	auto ms = [](clk::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+	printf("scratch sqlite: %9.2f ms\n", ms(t1 - t0));
+	printf("sorted vectors: %9.2f ms\n", ms(t2 - t1));
+	printf("changes=%zu updated=%zu given=%zu deleted=%zu\n",
+	       r2.chg.size(), r2.upd.size(), r2.given.size(), r2.deleted.size());
+	if (!(r1 == r2)) {
+		fprintf(stderr, "Results differ!\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
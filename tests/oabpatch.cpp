@@ -0,0 +1,298 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2026 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Apply the binary patches from oab_make_patch with an independent
+ * MS-PATCH LZX DELTA decoder and require that the result, its CRCs and
+ * the block layout match what the client will check.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fmt/core.h>
+#include <gromox/oxoab.hpp>
+#undef assert
+#define assert(x) do { if (!(x)) { printf("%s failed\n", #x); return EXIT_FAILURE; } } while (false)
+using namespace gromox;
+
+namespace {
+
+struct bitreader {
+	bitreader(std::string_view d) : m_data(d) {}
+	uint32_t get(unsigned int bits);
+	void align() { m_nbits = 0; }
+	size_t pos() const { return m_pos; }
+
+	private:
+	std::string_view m_data;
+	size_t m_pos = 0;
+	uint64_t m_acc = 0;
+	unsigned int m_nbits = 0;
+};
+
+/* Canonical Huffman decoder, one bit at a time */
+struct huffdec {
+	huffdec(const std::vector<uint8_t> &len);
+	unsigned int sym(bitreader &) const;
+
+	private:
+	unsigned int m_count[17]{}, m_first[17]{}, m_index[17]{};
+	std::vector<unsigned int> m_syms;
+};
+
+}
+
+uint32_t bitreader::get(unsigned int bits)
+{
+	if (bits == 0)
+		return 0;
+	while (m_nbits < bits) {
+		if (m_pos + 2 > m_data.size())
+			throw std::runtime_error("read past end of block");
+		m_acc = (m_acc << 16) | static_cast<uint8_t>(m_data[m_pos]) |
+		        (static_cast<uint8_t>(m_data[m_pos+1]) << 8);
+		m_pos += 2;
+		m_nbits += 16;
+	}
+	m_nbits -= bits;
+	return (m_acc >> m_nbits) & ((1U << bits) - 1);
+}
+
+huffdec::huffdec(const std::vector<uint8_t> &len)
+{
+	for (auto l : len)
+		++m_count[l];
+	m_count[0] = 0;
+	unsigned int code = 0, idx = 0;
+	for (unsigned int l = 1; l <= 16; ++l) {
+		m_first[l] = code;
+		m_index[l] = idx;
+		code = (code + m_count[l]) << 1;
+		idx += m_count[l];
+		for (size_t s = 0; s < len.size(); ++s)
+			if (len[s] == l)
+				m_syms.push_back(s);
+	}
+}
+
+unsigned int huffdec::sym(bitreader &br) const
+{
+	unsigned int code = 0;
+	for (unsigned int l = 1; l <= 16; ++l) {
+		code = (code << 1) | br.get(1);
+		if (code - m_first[l] < m_count[l])
+			return m_syms[m_index[l] + code - m_first[l]];
+	}
+	throw std::runtime_error("invalid Huffman code");
+}
+
+static unsigned int lzx_extra(unsigned int s)
+{
+	return s < 4 ? 0 : std::min((s - 2) / 2, 17U);
+}
+
+static void read_lens(bitreader &br, std::vector<uint8_t> &len, size_t first, size_t last)
+{
+	std::vector<uint8_t> plen(20);
+	for (auto &l : plen)
+		l = br.get(4);
+	huffdec pd(plen);
+	for (size_t i = first; i < last; ) {
+		auto z = pd.sym(br);
+		size_t run = z == 17 ? br.get(4) + 4 : z == 18 ? br.get(5) + 20 : 0;
+		if (z == 19)
+			throw std::runtime_error("unexpected pretree symbol 19");
+		if (run == 0) {
+			len[i] = (len[i] + 17 - z) % 17;
+			++i;
+			continue;
+		}
+		if (i + run > last)
+			throw std::runtime_error("zero run past end of tree");
+		std::fill_n(&len[i], run, 0);
+		i += run;
+	}
+}
+
+static std::string lzxd_decode(std::string_view ref, std::string_view data, size_t tsize)
+{
+	uint32_t base[291];
+	base[0] = 0;
+	for (unsigned int s = 0; s < 290; ++s)
+		base[s+1] = base[s] + (1U << lzx_extra(s));
+	size_t wsize = ((ref.size() + 32767) & ~static_cast<size_t>(32767)) + tsize;
+	unsigned int wbits = 17;
+	while (wbits < 25 && (static_cast<size_t>(1) << wbits) < wsize)
+		++wbits;
+	unsigned int nslots = 0;
+	while (base[nslots] < (1U << wbits))
+		++nslots;
+	std::vector<uint8_t> mainlen(256 + 8 * nslots), lenlen(249);
+	std::string win(ref);
+	bitreader br(data);
+	bool first = true;
+	while (win.size() - ref.size() < tsize) {
+		auto csize = br.get(16);
+		auto start = br.pos();
+		if (first && br.get(1) != 0)
+			throw std::runtime_error("E8 translation not expected");
+		first = false;
+		if (br.get(3) != 1)
+			throw std::runtime_error("not a verbatim block");
+		size_t blen = br.get(16) << 8;
+		blen |= br.get(8);
+		read_lens(br, mainlen, 0, 256);
+		read_lens(br, mainlen, 256, mainlen.size());
+		read_lens(br, lenlen, 0, lenlen.size());
+		huffdec md(mainlen), ld(lenlen);
+		auto end = win.size() + blen;
+		while (win.size() < end) {
+			auto m = md.sym(br);
+			if (m < 256) {
+				win += static_cast<char>(m);
+				continue;
+			}
+			m -= 256;
+			auto slot = m >> 3;
+			size_t len = (m & 7) + 2;
+			if ((m & 7) == 7)
+				len += ld.sym(br);
+			size_t dist = base[slot] + br.get(lzx_extra(slot)) - 2;
+			if (dist == 0 || dist > win.size())
+				throw std::runtime_error("match distance out of range");
+			for (size_t k = 0; k < len; ++k)
+				win += win[win.size()-dist];
+		}
+		br.align();
+		if (br.pos() - start != csize)
+			throw std::runtime_error("chunk size mismatch");
+	}
+	if (win.size() - ref.size() != tsize)
+		throw std::runtime_error("frame overran target size");
+	return win.substr(ref.size());
+}
+
+static uint32_t le32(std::string_view s, size_t pos)
+{
+	auto p = reinterpret_cast<const uint8_t *>(s.data()) + pos;
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+/* Bitwise CRC, so as not to test oab_crc against itself */
+static uint32_t crc32_raw(std::string_view s)
+{
+	uint32_t crc = 0xffffffffU;
+	for (auto c : s) {
+		crc ^= static_cast<uint8_t>(c);
+		for (unsigned int k = 0; k < 8; ++k)
+			crc = crc & 1 ? 0xedb88320U ^ (crc >> 1) : crc >> 1;
+	}
+	return crc;
+}
+
+/* Apply @patch to @src into @out, checking every header field on the way */
+static int apply(std::string_view src, std::string_view patch, std::string &out) try
+{
+	assert(patch.size() >= 28);
+	assert(le32(patch, 0) == 3 && le32(patch, 4) == 2);
+	auto blockmax = le32(patch, 8);
+	assert(le32(patch, 12) == src.size());
+	assert(le32(patch, 20) == crc32_raw(src));
+	auto tsize = le32(patch, 16), tcrc = le32(patch, 24);
+	out.clear();
+	size_t pos = 28, spos = 0;
+	while (pos < patch.size()) {
+		assert(pos + 16 <= patch.size());
+		auto psize = le32(patch, pos), bt = le32(patch, pos + 4);
+		auto bs = le32(patch, pos + 8), bcrc = le32(patch, pos + 12);
+		pos += 16;
+		assert(bt <= blockmax && bs <= blockmax);
+		assert(pos + psize <= patch.size() && spos + bs <= src.size());
+		auto blk = lzxd_decode(src.substr(spos, bs), patch.substr(pos, psize), bt);
+		assert(crc32_raw(blk) == bcrc);
+		out += blk;
+		pos += psize;
+		spos += bs;
+	}
+	assert(spos == src.size());
+	assert(out.size() == tsize && crc32_raw(out) == tcrc);
+	return EXIT_SUCCESS;
+} catch (const std::runtime_error &e) {
+	printf("lzxd: %s\n", e.what());
+	return EXIT_FAILURE;
+}
+
+/* Something shaped like an OAB: sorted, mostly-textual records */
+static std::string mkrecs(unsigned int from, unsigned int to, unsigned int skip_mod = 0)
+{
+	std::string o;
+	for (unsigned int i = from; i < to; ++i) {
+		uint32_t rnd = i * 2654435761U;
+		if (skip_mod != 0 && i % skip_mod == 0)
+			continue;
+		o += fmt::format("/o=Gromox/ou=Exchange Administrative Group/cn=Recipients/cn=user{:06}",
+		     i);
+		o += '\0';
+		o += fmt::format("User {} Surname{}", i, i % 97);
+		o += '\0';
+		o += fmt::format("user{:06}@example.com", i);
+		o += '\0';
+		o += fmt::format("+49 89 {:08}", rnd >> 4 & 0xffffff);
+		o += '\0';
+	}
+	return o;
+}
+
+static int check(const char *name, std::string_view src, std::string_view dst,
+    size_t max_patch)
+{
+	auto patch = oab_make_patch(src, dst);
+	printf("%-16s %8zu -> %8zu: patch %zu\n", name, src.size(), dst.size(), patch.size());
+	std::string out;
+	if (apply(src, patch, out) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	assert(out == dst);
+	assert(patch.size() <= max_patch);
+	return EXIT_SUCCESS;
+}
+
+int main()
+{
+	auto base = mkrecs(0, 6000);
+	assert(base.size() > 2 * 0x40000);
+	if (check("identical", base, base, base.size() / 20) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	/* Many new records up front shift everything after them */
+	auto grown = mkrecs(100000, 101500) + base;
+	if (check("prepend", base, grown, base.size() / 16) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (check("remove front", grown, base, base.size() / 10) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (check("thin out", base, mkrecs(0, 6000, 7), base.size() / 10) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	auto edited = base;
+	for (size_t p = 1000; p < edited.size(); p += 9973)
+		edited[p] ^= 0x20;
+	if (check("edits", base, edited, base.size() / 10) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	auto small = mkrecs(0, 300);
+	if (check("grow", small, base, base.size()) != EXIT_SUCCESS ||
+	    check("shrink", base, small, small.size()) != EXIT_SUCCESS ||
+	    check("from empty", "", small, small.size() * 2) != EXIT_SUCCESS ||
+	    check("to empty", small, "", 64) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	std::string noise;
+	uint32_t rnd = 1;
+	for (size_t i = 0; i < 300000; ++i) {
+		rnd = rnd * 1103515245 + 12345;
+		noise += static_cast<char>(rnd >> 16);
+	}
+	if (check("noise", small, noise, noise.size() * 2) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,222 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2026 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Run res_program and a plain recursive interpreter (built from the same
+ * RESTRICTION_*::eval leaf methods that the rule and table interpreters use)
+ * over every restriction/message pair of a small corpus and require identical
+ * results.
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <vector>
+#include <gromox/mapidefs.h>
+#include <gromox/mapi_types.hpp>
+#include <gromox/mapitags.hpp>
+#include <gromox/propval.hpp>
+#include <gromox/restriction.hpp>
+
+using namespace gromox;
+
+static bool interp(const TPROPVAL_ARRAY &props, const RESTRICTION &res)
+{
+	switch (res.rt) {
+	case RES_OR:
+		for (size_t i = 0; i < res.andor->count; ++i)
+			if (interp(props, res.andor->pres[i]))
+				return true;
+		return false;
+	case RES_AND:
+		for (size_t i = 0; i < res.andor->count; ++i)
+			if (!interp(props, res.andor->pres[i]))
+				return false;
+		return true;
+	case RES_NOT:
+		return !interp(props, res.xnot->res);
+	case RES_CONTENT:
+		return res.cont->comparable() &&
+		       res.cont->eval(props.getval(res.cont->proptag));
+	case RES_PROPERTY:
+		return res.prop->comparable() &&
+		       res.prop->eval(props.getval(res.prop->proptag));
+	case RES_PROPCOMPARE: {
+		auto &p = *res.pcmp;
+		return p.comparable() && propval_compare_relop_nullok(p.relop,
+		       PROP_TYPE(p.proptag1), props.getval(p.proptag1),
+		       props.getval(p.proptag2));
+	}
+	case RES_BITMASK:
+		return res.bm->comparable() &&
+		       res.bm->eval(props.getval(res.bm->proptag));
+	case RES_SIZE:
+		return res.size->eval(props.getval(res.size->proptag));
+	case RES_EXIST:
+		return props.has(res.exist->proptag);
+	case RES_COMMENT:
+	case RES_ANNOTATION:
+		return res.comment->pres == nullptr ||
+		       interp(props, *res.comment->pres);
+	case RES_NULL:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static BOOL getprop(void *pp, uint32_t proptag, void **pvalue)
+{
+	*pvalue = static_cast<const TPROPVAL_ARRAY *>(pp)->getval(proptag);
+	return TRUE;
+}
+
+static bool fallback(void *pp, const RESTRICTION &res)
+{
+	return interp(*static_cast<const TPROPVAL_ARRAY *>(pp), res);
+}
+
+namespace {
+
+/* Owns the restriction nodes, which must not move once handed out */
+struct corpus {
+	std::deque<RESTRICTION_CONTENT> cont;
+	std::deque<RESTRICTION_PROPERTY> prop;
+	std::deque<RESTRICTION_PROPCOMPARE> pcmp;
+	std::deque<RESTRICTION_BITMASK> bm;
+	std::deque<RESTRICTION_SIZE> size;
+	std::deque<RESTRICTION_EXIST> exist;
+	std::deque<RESTRICTION_NOT> xnot;
+	std::deque<RESTRICTION_AND_OR> andor;
+	std::deque<std::vector<RESTRICTION>> kids;
+	std::vector<RESTRICTION> leaves, all;
+
+	void leaf(mapi_rtype rt, void *p) { leaves.push_back(RESTRICTION{rt, {p}}); }
+	void build();
+};
+
+}
+
+static const char *const g_strings[] = {"", "Invoice", "invoice 2026", "INVOICE", "Re: invoice", "zzz"};
+static const uint32_t g_longs[] = {0, 1, 2, 5, 0x7fffffff, 0x80000000};
+static const uint64_t g_times[] = {0, 133000000000000000ULL, 134000000000000000ULL};
+static const uint8_t g_bools[] = {0, 1};
+
+void corpus::build()
+{
+	static constexpr relop relops[] = {RELOP_LT, RELOP_LE, RELOP_GT,
+		RELOP_GE, RELOP_EQ, RELOP_NE, RELOP_RE};
+	static constexpr uint32_t fuzzy[] = {FL_FULLSTRING, FL_SUBSTRING,
+		FL_PREFIX, FL_SUBSTRING | FL_IGNORECASE, FL_PREFIX | FL_LOOSE,
+		FL_FULLSTRING | FL_IGNORECASE, FL_PREFIX_ON_ANY_WORD};
+	for (auto s : {"invoice", "Invoice", "", "2026"})
+		for (auto f : fuzzy) {
+			cont.push_back({f, PR_SUBJECT, {PR_SUBJECT, deconst(s)}});
+			leaf(RES_CONTENT, &cont.back());
+		}
+	for (auto r : relops) {
+		for (auto s : {"invoice", "Re: invoice", "a"}) {
+			prop.push_back({r, PR_SUBJECT, {PR_SUBJECT, deconst(s)}});
+			leaf(RES_PROPERTY, &prop.back());
+		}
+		for (auto &v : {g_longs[1], g_longs[2], g_longs[5]}) {
+			prop.push_back({r, PR_IMPORTANCE, {PR_IMPORTANCE, deconst(&v)}});
+			leaf(RES_PROPERTY, &prop.back());
+		}
+		prop.push_back({r, PR_MESSAGE_DELIVERY_TIME, {PR_MESSAGE_DELIVERY_TIME, deconst(&g_times[1])}});
+		leaf(RES_PROPERTY, &prop.back());
+		prop.push_back({r, PR_READ, {PR_READ, deconst(&g_bools[1])}});
+		leaf(RES_PROPERTY, &prop.back());
+		/* type mismatch: not comparable */
+		prop.push_back({r, PR_IMPORTANCE, {PR_SUBJECT, deconst("1")}});
+		leaf(RES_PROPERTY, &prop.back());
+		pcmp.push_back({r, PR_IMPORTANCE, PR_SENSITIVITY});
+		leaf(RES_PROPCOMPARE, &pcmp.back());
+		size.push_back({r, PR_SUBJECT, 8});
+		leaf(RES_SIZE, &size.back());
+	}
+	for (auto m : {0x1U, 0x2U, 0x5U}) {
+		bm.push_back({BMR_EQZ, PR_MESSAGE_FLAGS, m});
+		leaf(RES_BITMASK, &bm.back());
+		bm.push_back({BMR_NEZ, PR_MESSAGE_FLAGS, m});
+		leaf(RES_BITMASK, &bm.back());
+	}
+	for (auto t : {PR_SUBJECT, PR_IMPORTANCE, PR_BODY}) {
+		exist.push_back({t});
+		leaf(RES_EXIST, &exist.back());
+	}
+	leaves.push_back(RESTRICTION{RES_NULL, {nullptr}});
+
+	all = leaves;
+	for (auto &l : leaves) {
+		xnot.push_back({l});
+		all.push_back(RESTRICTION{RES_NOT, {&xnot.back()}});
+	}
+	/* Pairs, with a stride so that the corpus stays small */
+	for (size_t i = 0; i < leaves.size(); i += 3)
+		for (size_t j = 1; j < leaves.size(); j += 5) {
+			kids.push_back({leaves[i], all[leaves.size() + j]});
+			andor.push_back({2, kids.back().data()});
+			all.push_back(RESTRICTION{RES_AND, {&andor.back()}});
+			all.push_back(RESTRICTION{RES_OR, {&andor.back()}});
+		}
+}
+
+static std::vector<TPROPVAL_ARRAY> make_messages(std::deque<TAGGED_PROPVAL> &store)
+{
+	static const uint32_t flags[] = {0, 1, 3, 4};
+	std::vector<TPROPVAL_ARRAY> msgs;
+	for (size_t k = 0; k < 48; ++k) {
+		auto first = store.size();
+		if (k % 7 != 0)
+			store.push_back({PR_SUBJECT, deconst(g_strings[k % std::size(g_strings)])});
+		if (k % 5 != 0)
+			store.push_back({PR_IMPORTANCE, deconst(&g_longs[k % std::size(g_longs)])});
+		if (k % 3 != 0)
+			store.push_back({PR_SENSITIVITY, deconst(&g_longs[(k / 3) % std::size(g_longs)])});
+		if (k % 4 != 1)
+			store.push_back({PR_MESSAGE_FLAGS, deconst(&flags[k % std::size(flags)])});
+		if (k % 2 == 0)
+			store.push_back({PR_MESSAGE_DELIVERY_TIME, deconst(&g_times[k % std::size(g_times)])});
+		if (k % 6 < 4)
+			store.push_back({PR_READ, deconst(&g_bools[k % 2])});
+		/* TPROPVAL_ARRAY wants a contiguous array */
+		auto v = new TAGGED_PROPVAL[store.size() - first];
+		std::copy(store.begin() + first, store.end(), v);
+		msgs.push_back(TPROPVAL_ARRAY{static_cast<uint16_t>(store.size() - first), v});
+	}
+	return msgs;
+}
+
+int main()
+{
+	corpus c;
+	c.build();
+	std::deque<TAGGED_PROPVAL> store;
+	auto msgs = make_messages(store);
+	unsigned int mismatches = 0;
+	size_t checks = 0;
+	for (const auto &r : c.all) {
+		res_program prog;
+		if (!prog.compile(r) || !prog.compiled()) {
+			fprintf(stderr, "compile failed: %s\n", r.repr().c_str());
+			return EXIT_FAILURE;
+		}
+		for (size_t k = 0; k < msgs.size(); ++k) {
+			auto &m = msgs[k];
+			bool want = interp(m, r);
+			bool got  = prog.eval(deconst(&m), getprop, fallback);
+			++checks;
+			if (want == got)
+				continue;
+			if (++mismatches <= 20)
+				fprintf(stderr, "mismatch: %s on message %zu: interpreter %d, program %d\n",
+				        r.repr().c_str(), k, want, got);
+		}
+	}
+	for (auto &m : msgs)
+		delete[] m.ppropval;
+	printf("%zu restrictions, %zu messages, %zu checks, %u mismatches\n",
+	       c.all.size(), msgs.size(), checks, mismatches);
+	return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
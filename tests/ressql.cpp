@@ -0,0 +1,356 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2026 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Run every restriction of a small corpus that res_sql can push down as an
+ * SQL query over a mailbox database, and require the same result as
+ * res_program evaluating it on the property values exmdb would produce for
+ * each message (i.e. what the content table does with the residual
+ * restriction). This is done on a freshly created database and on one
+ * upgraded from schema 0, whose hot columns come from the upgrade.
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <string>
+#include <vector>
+#include <sqlite3.h>
+#include <gromox/dbop.h>
+#include <gromox/mapidefs.h>
+#include <gromox/mapi_types.hpp>
+#include <gromox/mapitags.hpp>
+#include <gromox/restriction.hpp>
+#undef assert
+#define assert(x) do { if (!(x)) { printf("%s failed\n", #x); return EXIT_FAILURE; } } while (false)
+
+using namespace gromox;
+
+namespace {
+
+/* Owns the restriction nodes, which must not move once handed out */
+struct corpus {
+	std::deque<RESTRICTION_CONTENT> cont;
+	std::deque<RESTRICTION_PROPERTY> prop;
+	std::deque<RESTRICTION_BITMASK> bm;
+	std::deque<RESTRICTION_EXIST> exist;
+	std::deque<RESTRICTION_NOT> xnot;
+	std::deque<RESTRICTION_AND_OR> andor;
+	std::deque<std::vector<RESTRICTION>> kids;
+	std::vector<RESTRICTION> leaves, all;
+
+	void leaf(mapi_rtype rt, void *p) { leaves.push_back(RESTRICTION{rt, {p}}); }
+	void build();
+};
+
+/* One message: what is stored, and what cu_get_properties makes of it */
+struct msgview {
+	std::deque<TAGGED_PROPVAL> stored, view;
+	std::vector<TAGGED_PROPVAL> view_arr;
+	uint8_t read = 0;
+	TPROPVAL_ARRAY props() { return {static_cast<uint16_t>(view_arr.size()), view_arr.data()}; }
+};
+
+}
+
+static const char *const g_classes[] = {"IPM.Note", "ipm.note", "IPM.Appointment", "IPM.Note.Rules", "REPORT.IPM.Note.NDR"};
+static const char *const g_subjects[] = {"", "Invoice", "invoice 2026", "INVOICE", "zzz"};
+static const uint32_t g_longs[] = {0, 1, 2, 0x7fffffff, 0x80000000};
+static const uint64_t g_times[] = {0, 133000000000000000ULL, 134000000000000000ULL};
+static const uint8_t g_bools[] = {0, 1};
+static const uint32_t g_flags[] = {0, MSGFLAG_UNMODIFIED, MSGFLAG_UNSENT, MSGFLAG_UNMODIFIED | MSGFLAG_UNSENT};
+
+void corpus::build()
+{
+	static constexpr relop relops[] = {RELOP_LT, RELOP_LE, RELOP_GT,
+		RELOP_GE, RELOP_EQ, RELOP_NE};
+	static constexpr uint32_t fuzzy[] = {FL_FULLSTRING, FL_SUBSTRING,
+		FL_PREFIX, FL_SUBSTRING | FL_IGNORECASE, FL_PREFIX | FL_LOOSE,
+		FL_FULLSTRING | FL_IGNORECASE};
+	static constexpr uint32_t strtags[] = {PR_MESSAGE_CLASS,
+		PR_MESSAGE_CLASS_A, PR_NORMALIZED_SUBJECT, PR_NORMALIZED_SUBJECT_A};
+	for (auto t : strtags) {
+		for (auto s : {"IPM.Note", "ipm.note", "IPM", "invoice", ""})
+			for (auto f : fuzzy) {
+				cont.push_back({f, t, {t, deconst(s)}});
+				leaf(RES_CONTENT, &cont.back());
+			}
+		for (auto r : {RELOP_EQ, RELOP_NE})
+			for (auto s : {"IPM.Note", "ipm.NOTE", "Invoice", ""}) {
+				prop.push_back({r, t, {t, deconst(s)}});
+				leaf(RES_PROPERTY, &prop.back());
+			}
+		exist.push_back({t});
+		leaf(RES_EXIST, &exist.back());
+	}
+	for (auto r : relops) {
+		for (auto &v : {g_longs[1], g_longs[2], g_longs[4]}) {
+			prop.push_back({r, PR_IMPORTANCE, {PR_IMPORTANCE, deconst(&v)}});
+			leaf(RES_PROPERTY, &prop.back());
+		}
+		prop.push_back({r, PR_MESSAGE_DELIVERY_TIME, {PR_MESSAGE_DELIVERY_TIME, deconst(&g_times[1])}});
+		leaf(RES_PROPERTY, &prop.back());
+		prop.push_back({r, PR_READ, {PR_READ, deconst(&g_bools[1])}});
+		leaf(RES_PROPERTY, &prop.back());
+	}
+	for (auto m : {MSGFLAG_READ, MSGFLAG_UNMODIFIED, MSGFLAG_UNSENT}) {
+		bm.push_back({BMR_EQZ, PR_MESSAGE_FLAGS, m});
+		leaf(RES_BITMASK, &bm.back());
+		bm.push_back({BMR_NEZ, PR_MESSAGE_FLAGS, m});
+		leaf(RES_BITMASK, &bm.back());
+	}
+	for (auto t : {PR_IMPORTANCE, PR_MESSAGE_DELIVERY_TIME}) {
+		exist.push_back({t});
+		leaf(RES_EXIST, &exist.back());
+	}
+
+	all = leaves;
+	for (auto &l : leaves) {
+		xnot.push_back({l});
+		all.push_back(RESTRICTION{RES_NOT, {&xnot.back()}});
+	}
+	for (size_t i = 0; i < leaves.size(); i += 3)
+		for (size_t j = 1; j < leaves.size(); j += 7) {
+			kids.push_back({leaves[i], all[leaves.size() + j]});
+			andor.push_back({2, kids.back().data()});
+			all.push_back(RESTRICTION{RES_AND, {&andor.back()}});
+			all.push_back(RESTRICTION{RES_OR, {&andor.back()}});
+		}
+}
+
+/* Both string variants read the one stored value, Unicode or 8-bit */
+static void view_string(msgview &m, uint32_t wtag, const char *dflt)
+{
+	auto atag = CHANGE_PROP_TYPE(wtag, PT_STRING8);
+	const char *v = nullptr;
+	for (const auto &p : m.stored)
+		if (p.proptag == wtag || p.proptag == atag)
+			v = static_cast<const char *>(p.pvalue);
+	/* gp_msgprop_synth only knows the Unicode tag */
+	if (v != nullptr || dflt != nullptr)
+		m.view.push_back({wtag, deconst(v != nullptr ? v : dflt)});
+	if (v != nullptr)
+		m.view.push_back({atag, deconst(v)});
+}
+
+static std::vector<msgview> make_messages()
+{
+	std::vector<msgview> msgs(60);
+	for (size_t k = 0; k < msgs.size(); ++k) {
+		auto &m = msgs[k];
+		auto &st = m.stored;
+		if (k % 4 == 1)
+			st.push_back({PR_MESSAGE_CLASS, deconst(g_classes[k % std::size(g_classes)])});
+		else if (k % 4 == 2)
+			st.push_back({PR_MESSAGE_CLASS_A, deconst(g_classes[k % std::size(g_classes)])});
+		if (k % 3 == 1)
+			st.push_back({PR_NORMALIZED_SUBJECT, deconst(g_subjects[k % std::size(g_subjects)])});
+		else if (k % 3 == 2)
+			st.push_back({PR_NORMALIZED_SUBJECT_A, deconst(g_subjects[k % std::size(g_subjects)])});
+		if (k % 5 != 0)
+			st.push_back({PR_IMPORTANCE, deconst(&g_longs[k % std::size(g_longs)])});
+		if (k % 2 == 0)
+			st.push_back({PR_MESSAGE_DELIVERY_TIME, deconst(&g_times[k % std::size(g_times)])});
+		st.push_back({PR_MESSAGE_FLAGS, deconst(&g_flags[k % std::size(g_flags)])});
+		m.read = k % 6 < 3;
+
+		view_string(m, PR_MESSAGE_CLASS, "IPM.Note");
+		view_string(m, PR_NORMALIZED_SUBJECT, nullptr);
+		for (const auto &p : st)
+			if (PROP_TYPE(p.proptag) != PT_UNICODE &&
+			    PROP_TYPE(p.proptag) != PT_STRING8)
+				m.view.push_back(p);
+		/* common_util_get_message_flags and PR_READ from read_state */
+		for (auto &p : m.view)
+			if (p.proptag == PR_MESSAGE_FLAGS)
+				p.pvalue = new uint32_t(*static_cast<const uint32_t *>(p.pvalue) |
+				           (m.read ? MSGFLAG_READ : 0));
+		m.view.push_back({PR_READ, deconst(&g_bools[m.read])});
+		m.view_arr.assign(m.view.begin(), m.view.end());
+	}
+	return msgs;
+}
+
+static int store_messages(sqlite3 *db, std::vector<msgview> &msgs)
+{
+	sqlite3_stmt *ins_msg = nullptr, *ins_prop = nullptr;
+	assert(sqlite3_prepare_v2(db, "INSERT INTO messages (message_id,"
+	       " parent_fid, is_associated, change_number, read_state,"
+	       " message_size) VALUES (?, 1, 0, ?, ?, 0)", -1, &ins_msg,
+	       nullptr) == SQLITE_OK);
+	assert(sqlite3_prepare_v2(db, "INSERT INTO message_properties"
+	       " (message_id, proptag, propval) VALUES (?, ?, ?)", -1,
+	       &ins_prop, nullptr) == SQLITE_OK);
+	for (size_t k = 0; k < msgs.size(); ++k) {
+		sqlite3_bind_int64(ins_msg, 1, k + 1);
+		sqlite3_bind_int64(ins_msg, 2, k + 1);
+		sqlite3_bind_int64(ins_msg, 3, msgs[k].read);
+		assert(sqlite3_step(ins_msg) == SQLITE_DONE);
+		sqlite3_reset(ins_msg);
+		for (const auto &p : msgs[k].stored) {
+			sqlite3_bind_int64(ins_prop, 1, k + 1);
+			sqlite3_bind_int64(ins_prop, 2, p.proptag);
+			switch (PROP_TYPE(p.proptag)) {
+			case PT_UNICODE:
+			case PT_STRING8:
+				sqlite3_bind_text(ins_prop, 3, static_cast<const char *>(p.pvalue), -1, SQLITE_STATIC);
+				break;
+			case PT_LONG:
+				sqlite3_bind_int64(ins_prop, 3, *static_cast<const uint32_t *>(p.pvalue));
+				break;
+			case PT_SYSTIME:
+				sqlite3_bind_int64(ins_prop, 3, *static_cast<const uint64_t *>(p.pvalue));
+				break;
+			}
+			assert(sqlite3_step(ins_prop) == SQLITE_DONE);
+			sqlite3_reset(ins_prop);
+		}
+	}
+	sqlite3_finalize(ins_msg);
+	sqlite3_finalize(ins_prop);
+	return EXIT_SUCCESS;
+}
+
+static BOOL getprop(void *pp, uint32_t proptag, void **pvalue)
+{
+	*pvalue = static_cast<const TPROPVAL_ARRAY *>(pp)->getval(proptag);
+	return TRUE;
+}
+
+static bool fallback(void *, const RESTRICTION &)
+{
+	return false;
+}
+
+/* Message ids (1-based) matched by @expr */
+static int sql_select(sqlite3 *db, const std::string &expr, const res_sql &rs,
+    std::vector<bool> &hit)
+{
+	auto q = "SELECT message_id FROM messages WHERE " + expr;
+	sqlite3_stmt *stm = nullptr;
+	if (sqlite3_prepare_v2(db, q.c_str(), -1, &stm, nullptr) != SQLITE_OK) {
+		printf("%s: %s\n", q.c_str(), sqlite3_errmsg(db));
+		return EXIT_FAILURE;
+	}
+	for (size_t i = 0; i < rs.binds.size(); ++i) {
+		auto &b = rs.binds[i];
+		if (b.text)
+			sqlite3_bind_text(stm, i + 1, b.str.c_str(), -1, SQLITE_STATIC);
+		else
+			sqlite3_bind_int64(stm, i + 1, b.num);
+	}
+	int ret;
+	while ((ret = sqlite3_step(stm)) == SQLITE_ROW)
+		hit[sqlite3_column_int64(stm, 0) - 1] = true;
+	sqlite3_finalize(stm);
+	assert(ret == SQLITE_DONE);
+	return EXIT_SUCCESS;
+}
+
+static int t_pushdown(sqlite3 *db, const char *name, const corpus &c,
+    std::vector<msgview> &msgs)
+{
+	unsigned int mismatches = 0;
+	size_t pushed = 0;
+	for (const auto &r : c.all) {
+		res_program prog;
+		assert(prog.compile(r) && prog.compiled());
+		for (bool hot : {false, true}) {
+			res_sql rs;
+			rs.b_private = true;
+			rs.b_hotcols = hot;
+			std::string expr;
+			if (!rs.emit(r, expr))
+				continue;
+			++pushed;
+			std::vector<bool> hit(msgs.size());
+			if (sql_select(db, expr, rs, hit) != EXIT_SUCCESS)
+				return EXIT_FAILURE;
+			for (size_t k = 0; k < msgs.size(); ++k) {
+				auto props = msgs[k].props();
+				bool want = prog.eval(&props, getprop, fallback);
+				if (want == hit[k])
+					continue;
+				if (++mismatches <= 20)
+					printf("mismatch: %s (hotcols %d) on message %zu: in-process %d, SQL %d\n",
+					       r.repr().c_str(), hot, k, want, static_cast<bool>(hit[k]));
+			}
+		}
+	}
+	printf("%s: %zu restrictions, %zu pushed down, %zu messages, %u mismatches\n",
+	       name, c.all.size(), pushed, msgs.size(), mismatches);
+	/* Most of the corpus must be translatable, or this tests nothing */
+	assert(pushed > c.all.size());
+	return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static std::string sql_text(sqlite3 *db, const char *q)
+{
+	sqlite3_stmt *stm = nullptr;
+	std::string r;
+	if (sqlite3_prepare_v2(db, q, -1, &stm, nullptr) != SQLITE_OK)
+		return "<error>";
+	while (sqlite3_step(stm) == SQLITE_ROW) {
+		auto t = sqlite3_column_text(stm, sqlite3_column_count(stm) - 1);
+		r += t != nullptr ? reinterpret_cast<const char *>(t) : "<null>";
+		r += ';';
+	}
+	sqlite3_finalize(stm);
+	return r;
+}
+
+/* Hot columns after the schema upgrade, and the triggers maintaining them */
+static int t_migrated_hotcols(sqlite3 *db)
+{
+	assert(sql_text(db, "SELECT msg_class FROM messages WHERE message_id=1") == "IPM.Note;");
+	assert(sql_text(db, "SELECT msg_class FROM messages WHERE message_id=2") == "ipm.note;");
+	assert(sql_text(db, "SELECT msg_class FROM messages WHERE message_id=3") == "<null>;");
+	assert(sql_text(db, "SELECT subject FROM messages WHERE message_id=2") == "Invoice;");
+	assert(sql_text(db, "SELECT subject FROM messages WHERE message_id=3") == "<null>;");
+	assert(sql_text(db, "SELECT delivery_time FROM messages WHERE message_id=3") == "134000000000000000;");
+	assert(sql_text(db, "SELECT delivery_time FROM messages WHERE message_id=2") == "<null>;");
+	auto q = "UPDATE message_properties SET propval='IPM.Schedule.Meeting.Request'"
+	         " WHERE message_id=2 AND proptag=" + std::to_string(PR_MESSAGE_CLASS);
+	assert(sqlite3_exec(db, q.c_str(), nullptr, nullptr, nullptr) == SQLITE_OK);
+	assert(sql_text(db, "SELECT msg_class FROM messages WHERE message_id=2") == "IPM.Schedule.Meeting.Request;");
+	q = "DELETE FROM message_properties WHERE message_id=2 AND proptag=" +
+	    std::to_string(PR_MESSAGE_CLASS);
+	assert(sqlite3_exec(db, q.c_str(), nullptr, nullptr, nullptr) == SQLITE_OK);
+	assert(sql_text(db, "SELECT msg_class FROM messages WHERE message_id=2") == "IPM.Note;");
+	return EXIT_SUCCESS;
+}
+
+int main()
+{
+	corpus c;
+	c.build();
+	auto msgs = make_messages();
+	sqlite3 *db = nullptr;
+	assert(sqlite3_open_v2(":memory:", &db, SQLITE_OPEN_READWRITE |
+	       SQLITE_OPEN_CREATE, nullptr) == SQLITE_OK);
+	assert(dbop_sqlite_create(db, sqlite_kind::pvt, 0) == 0);
+	if (store_messages(db, msgs) != EXIT_SUCCESS ||
+	    t_pushdown(db, "new", c, msgs) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	sqlite3_close(db);
+
+	/* The same on a mailbox that was created before schema 14 */
+	assert(sqlite3_open_v2(":memory:", &db, SQLITE_OPEN_READWRITE |
+	       SQLITE_OPEN_CREATE, nullptr) == SQLITE_OK);
+	assert(dbop_sqlite_create(db, sqlite_kind::pvt, DBOP_SCHEMA_0) == 0);
+	if (store_messages(db, msgs) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	assert(dbop_sqlite_upgrade(db, "test", sqlite_kind::pvt, 0) == 0);
+	assert(dbop_sqlite_schemaversion(db, sqlite_kind::pvt) ==
+	       dbop_sqlite_recentversion(sqlite_kind::pvt));
+	if (t_pushdown(db, "upgraded", c, msgs) != EXIT_SUCCESS ||
+	    t_migrated_hotcols(db) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	sqlite3_close(db);
+
+	for (auto &m : msgs)
+		for (auto &p : m.view)
+			if (p.proptag == PR_MESSAGE_FLAGS)
+				delete static_cast<uint32_t *>(p.pvalue);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,126 @@
+#!/usr/bin/perl
+#
+# Exercise the CHUNKING/BDAT state machine of a running smtp(8gx)/delivery
+# pair. Usage: smtpbdat.pl [-H host] [-p port] -f sender -r recipient
+#
+use Getopt::Long;
+use IO::Socket::IP;
+use strict;
+use warnings;
+my($host, $port, $from, $rcpt) = ("::1", 25, undef, undef);
+&Getopt::Long::Configure(qw(bundling));
+&GetOptions("H=s" => \$host, "p=i" => \$port, "f=s" => \$from,
+	"r=s" => \$rcpt);
+if (!defined($from) || !defined($rcpt)) {
+	die "Usage: $0 [-H host] [-p port] -f sender -r recipient\n";
+}
+my $fails = 0;
+
+sub xconnect
+{
+	my $sock = IO::Socket::IP->new(PeerHost => $host, PeerPort => $port,
+	           Type => SOCK_STREAM) || die "cannot connect: $!";
+	&expect($sock, "banner", 220);
+	print $sock "EHLO bdattest\r\n";
+	my @lines = &reply($sock);
+	if (!grep { /^250[- ]CHUNKING/i } @lines) {
+		die "server does not offer CHUNKING\n";
+	}
+	return $sock;
+}
+
+# Read one (possibly multi-line) reply
+sub reply
+{
+	my $sock = shift @_;
+	my @lines;
+	while (defined(my $l = <$sock>)) {
+		$l =~ s/\r?\n$//;
+		push(@lines, $l);
+		last if ($l =~ /^\d{3} /);
+	}
+	return @lines;
+}
+
+sub expect
+{
+	my($sock, $what, $code) = @_;
+	my @lines = &reply($sock);
+	my $got = scalar(@lines) > 0 ? substr($lines[-1], 0, 3) : "EOF";
+	if ($got ne $code && substr($got, 0, 1) ne $code) {
+		print "FAIL $what: expected $code, got ", join(" / ", @lines), "\n";
+		++$fails;
+	} else {
+		print "ok   $what\n";
+	}
+}
+
+sub envelope
+{
+	my $sock = shift @_;
+	print $sock "MAIL FROM:<$from>\r\n";
+	&expect($sock, "MAIL", 250);
+	print $sock "RCPT TO:<$rcpt>\r\n";
+	&expect($sock, "RCPT", 250);
+}
+
+my $body = "Subject: bdat test\r\n\r\nchunked body\r\n";
+
+# Single LAST chunk
+my $s = &xconnect();
+&envelope($s);
+print $s "BDAT ", length($body), " LAST\r\n", $body;
+&expect($s, "BDAT LAST", 250);
+
+# Several chunks, including an empty intermediate one and an empty LAST,
+# all pipelined into one send
+&envelope($s);
+print $s "BDAT 9\r\nSubject: BDAT 0\r\nBDAT ", length($body) - 9, "\r\n",
+	substr($body, 9), "BDAT 0 LAST\r\n";
+&expect($s, "BDAT chunk 1", 250);
+&expect($s, "BDAT 0", 250);
+&expect($s, "BDAT chunk 2", 250);
+&expect($s, "BDAT 0 LAST", 250);
+
+# A rejected chunk (no transaction) must be swallowed, not parsed as commands
+my $inject = "RSET\r\nQUIT\r\n";
+print $s "BDAT ", length($inject), "\r\n", $inject;
+&expect($s, "BDAT out of sequence", 5);
+print $s "NOOP\r\n";
+&expect($s, "NOOP after rejected chunk", 250);
+
+# DATA may not follow BDAT within the same transaction
+&envelope($s);
+print $s "BDAT 3\r\nabc";
+&expect($s, "BDAT before DATA", 250);
+print $s "DATA\r\n";
+&expect($s, "DATA after BDAT", 5);
+print $s "RSET\r\n";
+&expect($s, "RSET", 250);
+
+# BDAT may not follow DATA either; the transaction completes first
+&envelope($s);
+print $s "DATA\r\n";
+&expect($s, "DATA", 354);
+print $s $body, ".\r\n";
+&expect($s, "DATA end", 250);
+print $s "BDAT 4 LAST\r\nxxxx";
+&expect($s, "BDAT after DATA", 5);
+print $s "QUIT\r\n";
+&expect($s, "QUIT", 221);
+close($s);
+
+# Unparsable size: the server cannot find the next command and closes
+$s = &xconnect();
+&envelope($s);
+print $s "BDAT twelve\r\n";
+&expect($s, "BDAT bad size", 5);
+my $rest = <$s>;
+if (defined($rest)) {
+	print "FAIL connection kept open after bad BDAT size\n";
+	++$fails;
+} else {
+	print "ok   connection closed after bad BDAT size\n";
+}
+close($s);
+exit($fails > 0 ? 1 : 0);
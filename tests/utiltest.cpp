@@ -3,15 +3,27 @@
 // This file is part of Gromox.
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+#include <zdict.h>
+#include <zstd.h>
 #include <libHX/string.h>
+#include <sys/stat.h>
 #include <gromox/endian.hpp>
 #include <gromox/ext_buffer.hpp>
+#include <gromox/fileio.h>
 #include <gromox/ical.hpp>
 #include <gromox/mapi_types.hpp>
 #include <gromox/mail_func.hpp>
 #include <gromox/propval.hpp>
 #include <gromox/resource_pool.hpp>
 #include <gromox/rop_util.hpp>
+#include <gromox/scope.hpp>
 #include <gromox/timezone.hpp>
 #include <gromox/util.hpp>
 #undef assert
@@ -356,6 +368,120 @@ static int t_utf8_prefix()
 	return EXIT_SUCCESS;
 }
 
+static size_t zdict_compress(const std::string &file, std::string_view data,
+    uint32_t dict_id)
+{
+	wrapfd fd(open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600));
+	if (fd.get() < 0 || gx_compress_tofd(data, fd.get(), 6, dict_id) != 0)
+		return 0;
+	struct stat sb;
+	return fstat(fd.get(), &sb) == 0 ? sb.st_size : 0;
+}
+
+static int t_zdict()
+{
+	std::string samples;
+	std::vector<size_t> sizes;
+	for (unsigned int i = 0; i < 512; ++i) {
+		auto s = "Dear customer " + std::to_string(i * 7919 % 1000) +
+		         ",\nyour order #" + std::to_string(i * 104729) +
+		         " has been shipped and will arrive within " +
+		         std::to_string(i % 9 + 1) + " days.\nKind regards\n";
+		samples += s;
+		sizes.push_back(s.size());
+	}
+	std::string dict(4096, '\0');
+	auto zr = ZDICT_trainFromBuffer(dict.data(), dict.size(), samples.data(),
+	          sizes.data(), sizes.size());
+	assert(!ZDICT_isError(zr));
+	dict.resize(zr);
+	auto id = ZDICT_getDictID(dict.data(), dict.size());
+	assert(id != 0);
+
+	char dir[] = "/tmp/utiltest-XXXXXX";
+	assert(mkdtemp(dir) != nullptr);
+	auto dictfile = std::string(dir) + "/" + std::to_string(id) + ".zdict";
+	auto plainfile = std::string(dir) + "/plain.zst";
+	auto zfile = std::string(dir) + "/dict.zst";
+	auto cl_0 = make_scope_exit([&]() {
+		unlink(zfile.c_str());
+		unlink(plainfile.c_str());
+		unlink(dictfile.c_str());
+		rmdir(dir);
+	});
+	{
+		wrapfd fd(open(dictfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600));
+		assert(fd.get() >= 0);
+		assert(write(fd.get(), dict.data(), dict.size()) == static_cast<ssize_t>(dict.size()));
+		assert(fd.close_wr() == 0);
+	}
+	gx_zdict_setdir(dir);
+	auto cl_1 = make_scope_exit([]() { gx_zdict_setdir(nullptr); });
+	std::string_view msg = "Dear customer 4711,\nyour order #1234567 has "
+	                       "been shipped and will arrive within 3 days.\nKind regards\n";
+	auto plain_size = zdict_compress(plainfile, msg, 0);
+	auto dict_size  = zdict_compress(zfile, msg, id);
+	assert(plain_size > 0 && dict_size > 0 && dict_size < plain_size);
+	BINARY bin{};
+	assert(gx_decompress_file(zfile.c_str(), bin, malloc, realloc) == 0);
+	auto cl_2 = make_scope_exit([&]() { free(bin.pv); });
+	assert(bin.cb == msg.size() && memcmp(bin.pv, msg.data(), bin.cb) == 0);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Only seekable (v3) CID files can be read by range. Legacy ones, a single
+ * zstd frame or uncompressed, must be refused rather than decoded in full
+ * for every range.
+ */
+static int t_cidrange()
+{
+	std::string data;
+	for (unsigned int i = 0; data.size() < 600000; ++i)
+		data += "line " + std::to_string(i * 2654435761U) + "\n";
+	char dir[] = "/tmp/utiltest-XXXXXX";
+	assert(mkdtemp(dir) != nullptr);
+	auto v3file = std::string(dir) + "/v3.zst";
+	auto zfile = std::string(dir) + "/v2.zst";
+	auto rawfile = std::string(dir) + "/v1";
+	auto cl_0 = make_scope_exit([&]() {
+		unlink(v3file.c_str());
+		unlink(zfile.c_str());
+		unlink(rawfile.c_str());
+		rmdir(dir);
+	});
+	assert(gx_compress_tofile(data, v3file.c_str(), 1) == 0);
+	std::string z(ZSTD_compressBound(data.size()), '\0');
+	auto zr = ZSTD_compress(z.data(), z.size(), data.data(), data.size(), 1);
+	assert(!ZSTD_isError(zr));
+	z.resize(zr);
+	for (const auto &[file, content] : {std::make_pair(zfile, std::string_view(z)),
+	     std::make_pair(rawfile, std::string_view(data))}) {
+		wrapfd fd(open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600));
+		assert(fd.get() >= 0);
+		assert(write(fd.get(), content.data(), content.size()) == static_cast<ssize_t>(content.size()));
+		assert(fd.close_wr() == 0);
+	}
+
+	BINARY bin{};
+	uint64_t total = 0;
+	assert(gx_decompress_range(v3file.c_str(), 300000, 70000, bin, malloc, &total) == 0);
+	auto cl_1 = make_scope_exit([&]() { free(bin.pv); });
+	assert(total == data.size());
+	assert(bin.cb == 70000 && memcmp(bin.pv, &data[300000], bin.cb) == 0);
+	total = 0;
+	BINARY bin2{};
+	assert(gx_decompress_range(zfile.c_str(), 300000, 70000, bin2, malloc, &total) == ESPIPE);
+	assert(bin2.pv == nullptr && total == 0);
+	assert(gx_decompress_range(rawfile.c_str(), 0, 70000, bin2, malloc, &total) == ESPIPE);
+	assert(bin2.pv == nullptr && total == 0);
+	/* The buffered path still reads them */
+	assert(gx_decompress_file(zfile.c_str(), bin2, malloc, realloc) == 0);
+	auto cl_2 = make_scope_exit([&]() { free(bin2.pv); });
+	assert(bin2.cb == data.size() && memcmp(bin2.pv, data.data(), bin2.cb) == 0);
+	return EXIT_SUCCESS;
+}
+
 int main()
 {
 	if (t_utf7() != 0)
@@ -397,6 +523,12 @@ int main()
 	if (ret != 0)
 		return ret;
 	ret = t_utf8_prefix();
+	if (ret != 0)
+		return ret;
+	ret = t_zdict();
+	if (ret != 0)
+		return ret;
+	ret = t_cidrange();
 	if (ret != 0)
 		return ret;
 	return EXIT_SUCCESS;
@@ -2,12 +2,17 @@
 // SPDX-FileCopyrightText: 2022 grommunio GmbH
 // This file is part of Gromox.
 #include <cerrno>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <string>
 #include <utility>
 #include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zdict.h>
+#include <zstd.h>
 #include <sys/stat.h>
 #include <libHX/ctype_helper.h>
 #include <libHX/io.h>
@@ -15,6 +20,8 @@
 #include <libHX/proc.h>
 #include <libHX/string.h>
 #include <gromox/fileio.h>
+#include <gromox/mapidefs.h>
+#include <gromox/paths.h>
 #include <gromox/scope.hpp>
 #include <gromox/util.hpp>
 
@@ -25,11 +32,16 @@ enum {
 	ARG_NONE = 0, ARG_CIDS,
 };
 static unsigned int g_arg_type, g_dry_run, g_complvl = 6;
+static unsigned int g_dict_size = 112640;
 static char g_complvl_str[10];
+static char *g_mkdict, *g_dictdir;
 static constexpr HXoption g_options_table[] = {
 	{nullptr, 'n', HXTYPE_NONE, &g_dry_run, nullptr, nullptr, 0, "Dry run"},
 	{nullptr, 'z', HXTYPE_UINT, &g_complvl, nullptr, nullptr, 0, "Compression level (default: 6)", "LEVEL"},
 	{"cid", 0, HXTYPE_VAL, &g_arg_type, nullptr, nullptr, ARG_CIDS, "Process arguments as CID directories/files"},
+	{"mkdict", 0, HXTYPE_STRING, &g_mkdict, nullptr, nullptr, 0, "Train a dictionary from the given CID directories and install it as NAME", "NAME"},
+	{"dictdir", 0, HXTYPE_STRING, &g_dictdir, nullptr, nullptr, 0, "Dictionary directory (default: " PKGSTATEDIR "/zdict)", "DIR"},
+	{"dict-size", 0, HXTYPE_UINT, &g_dict_size, nullptr, nullptr, 0, "Dictionary size in bytes (default: 112640)", "N"},
 	HXOPT_AUTOHELP,
 	HXOPT_TABLEEND,
 };
@@ -122,17 +134,189 @@ static int do_file(const std::string &file)
 	return EXIT_SUCCESS;
 }
 
+/* Samples: objects of this size range is where dictionaries help */
+static constexpr size_t DICT_SAMPLE_MIN = 64, DICT_SAMPLE_MAX = 128U << 10;
+static constexpr size_t DICT_SAMPLE_TOTAL = 256U << 20;
+
+static void cid_walk(const std::string &dir, std::vector<std::string> &files)
+{
+	auto dh = HXdir_open(dir.c_str());
+	if (dh == nullptr) {
+		fprintf(stderr, "%s: %s\n", dir.c_str(), strerror(errno));
+		return;
+	}
+	auto cl_0 = make_scope_exit([&]() { HXdir_close(dh); });
+	const char *de;
+	while ((de = HXdir_read(dh)) != nullptr) {
+		if (*de == '.')
+			continue;
+		auto path = dir + "/"s + de;
+		struct stat sb;
+		if (lstat(path.c_str(), &sb) != 0)
+			continue;
+		if (S_ISDIR(sb.st_mode))
+			cid_walk(path, files);
+		else if (S_ISREG(sb.st_mode) && sb.st_size > 0 &&
+		    static_cast<unsigned long long>(sb.st_size) <= DICT_SAMPLE_MAX)
+			files.push_back(std::move(path));
+	}
+}
+
+static bool dict_read_sample(const std::string &file, std::string &out)
+{
+	BINARY bin{};
+	auto ret = gx_decompress_file(file.c_str(), bin, malloc, realloc);
+	auto cl_0 = make_scope_exit([&]() { free(bin.pv); });
+	if (ret == 0) {
+		out.assign(bin.pc, bin.cb);
+		return true;
+	}
+	/* Uncompressed content file */
+	wrapfd fd(open(file.c_str(), O_RDONLY));
+	struct stat sb;
+	if (fd.get() < 0 || fstat(fd.get(), &sb) != 0)
+		return false;
+	out.resize(sb.st_size);
+	return read(fd.get(), out.data(), out.size()) == sb.st_size;
+}
+
+static void dict_bench(const std::vector<std::string> &holdout,
+    const std::string &dict)
+{
+	using clk = std::chrono::steady_clock;
+	auto cctx = ZSTD_createCCtx();
+	auto dctx = ZSTD_createDCtx();
+	auto cdict = ZSTD_createCDict(dict.data(), dict.size(), g_complvl);
+	auto ddict = ZSTD_createDDict(dict.data(), dict.size());
+	auto cl_0 = make_scope_exit([&]() {
+		ZSTD_freeCCtx(cctx);
+		ZSTD_freeDCtx(dctx);
+		ZSTD_freeCDict(cdict);
+		ZSTD_freeDDict(ddict);
+	});
+	if (cctx == nullptr || dctx == nullptr || cdict == nullptr || ddict == nullptr)
+		return;
+	size_t in_total = 0;
+	for (const auto &s : holdout)
+		in_total += s.size();
+	if (in_total == 0)
+		return;
+	std::string cbuf(ZSTD_compressBound(DICT_SAMPLE_MAX), '\0');
+	std::string dbuf(DICT_SAMPLE_MAX, '\0');
+	for (bool use_dict : {false, true}) {
+		size_t out_total = 0;
+		clk::duration ctime{}, dtime{};
+		for (const auto &s : holdout) {
+			auto t0 = clk::now();
+			auto zr = use_dict ?
+			          ZSTD_compress_usingCDict(cctx, cbuf.data(), cbuf.size(), s.data(), s.size(), cdict) :
+			          ZSTD_compressCCtx(cctx, cbuf.data(), cbuf.size(), s.data(), s.size(), g_complvl);
+			auto t1 = clk::now();
+			if (ZSTD_isError(zr))
+				return;
+			out_total += zr;
+			auto dr = use_dict ?
+			          ZSTD_decompress_usingDDict(dctx, dbuf.data(), dbuf.size(), cbuf.data(), zr, ddict) :
+			          ZSTD_decompressDCtx(dctx, dbuf.data(), dbuf.size(), cbuf.data(), zr);
+			auto t2 = clk::now();
+			if (ZSTD_isError(dr))
+				return;
+			ctime += t1 - t0;
+			dtime += t2 - t1;
+		}
+		auto mbs = [&](clk::duration d) {
+			auto sec = std::chrono::duration<double>(d).count();
+			return sec > 0 ? in_total / sec / 1048576 : 0;
+		};
+		printf("%-15s ratio %5.2f, compress %7.1f MB/s, decompress %7.1f MB/s\n",
+		       use_dict ? "with dictionary" : "without",
+		       static_cast<double>(in_total) / out_total, mbs(ctime), mbs(dtime));
+	}
+}
+
+static int do_mkdict(int argc, const char **argv)
+{
+	std::string dictdir = g_dictdir != nullptr ? g_dictdir : PKGSTATEDIR "/zdict";
+	std::vector<std::string> files;
+	while (*++argv != nullptr)
+		cid_walk(*argv, files);
+	std::string samples, tmp;
+	std::vector<size_t> sizes;
+	std::vector<std::string> holdout;
+	size_t nseen = 0;
+	for (size_t i = 0; i < files.size() && samples.size() < DICT_SAMPLE_TOTAL; ++i) {
+		if (!dict_read_sample(files[i], tmp) ||
+		    tmp.size() < DICT_SAMPLE_MIN || tmp.size() > DICT_SAMPLE_MAX)
+			continue;
+		/* Every tenth object is kept out of training for the benchmark */
+		if (++nseen % 10 == 0) {
+			holdout.push_back(std::move(tmp));
+			continue;
+		}
+		samples += tmp;
+		sizes.push_back(tmp.size());
+	}
+	mlog(LV_NOTICE, "%zu samples (%zu bytes) for training, %zu for evaluation",
+		sizes.size(), samples.size(), holdout.size());
+	if (sizes.size() < 100) {
+		mlog(LV_ERR, "Too few samples to train a dictionary");
+		return EXIT_FAILURE;
+	}
+	std::string dict(g_dict_size, '\0');
+	auto zr = ZDICT_trainFromBuffer(dict.data(), dict.size(), samples.data(),
+	          sizes.data(), sizes.size());
+	if (ZDICT_isError(zr)) {
+		mlog(LV_ERR, "ZDICT_trainFromBuffer: %s", ZDICT_getErrorName(zr));
+		return EXIT_FAILURE;
+	}
+	dict.resize(zr);
+	auto id = ZDICT_getDictID(dict.data(), dict.size());
+	dict_bench(holdout, dict);
+	if (g_dry_run)
+		return EXIT_SUCCESS;
+
+	auto idfile  = std::to_string(id) + ".zdict";
+	auto idpath  = dictdir + "/" + idfile;
+	auto tmppath = dictdir + "/." + idfile;
+	auto ret = HX_mkdir(dictdir.c_str(), 0755);
+	if (ret < 0) {
+		mlog(LV_ERR, "mkdir %s: %s", dictdir.c_str(), strerror(-ret));
+		return EXIT_FAILURE;
+	}
+	wrapfd fd(open(tmppath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+	if (fd.get() < 0 || HXio_fullwrite(fd.get(), dict.data(), dict.size()) < 0 ||
+	    fd.close_wr() != 0 || rename(tmppath.c_str(), idpath.c_str()) != 0) {
+		mlog(LV_ERR, "%s: %s", idpath.c_str(), strerror(errno));
+		unlink(tmppath.c_str());
+		return EXIT_FAILURE;
+	}
+	/* Objects compressed with an older dictionary still need its ID file. */
+	auto namepath = dictdir + "/" + g_mkdict + ".zdict";
+	tmppath = dictdir + "/." + g_mkdict + ".zdict";
+	unlink(tmppath.c_str());
+	if (symlink(idfile.c_str(), tmppath.c_str()) != 0 ||
+	    rename(tmppath.c_str(), namepath.c_str()) != 0) {
+		mlog(LV_ERR, "%s: %s", namepath.c_str(), strerror(errno));
+		return EXIT_FAILURE;
+	}
+	mlog(LV_NOTICE, "Installed dictionary %u as %s", id, namepath.c_str());
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, const char **argv)
 {
 	setvbuf(stdout, nullptr, _IOLBF, 0);
 	if (HX_getopt(g_options_table, &argc, &argv, HXOPT_USAGEONERR) != HXOPT_ERR_SUCCESS)
 		return EXIT_FAILURE;
-
+	/* Existing objects may have been written with a dictionary */
+	gx_zdict_setdir(g_dictdir);
+	if (g_mkdict != nullptr)
+		return do_mkdict(argc, argv);
 	std::vector<std::string> filelist;
 	if (g_arg_type == ARG_CIDS) {
 		filelist = cid_read_args(argc, argv);
 	} else {
-		mlog(LV_ERR, "A mode of operation must be specified. Available: --cid.");
+		mlog(LV_ERR, "A mode of operation must be specified. Available: --cid, --mkdict.");
 		return EXIT_FAILURE;
 	}
 	mlog(LV_NOTICE, "%zu files to compress", filelist.size());
@@ -4,6 +4,7 @@
 #define _GNU_SOURCE 1
 #include <algorithm>
 #include <cerrno>
+#include <chrono>
 #include <cmath>
 #include <cstdarg>
 #include <cstdio>
@@ -43,6 +44,15 @@ static std::string g_dstuser;
 static std::string g_storedir_s;
 const char *g_storedir;
 unsigned int g_user_id, g_show_tree, g_show_props, g_wet_run = 1, g_public_folder;
+unsigned int g_bulk_max;
+static std::vector<uint64_t> g_bulk_fids;
+static std::vector<MESSAGE_CONTENT> g_bulk_msgs;
+static size_t g_bulk_bytes;
+static constexpr size_t BULK_MAX_BYTES = 32U << 20;
+static struct {
+	uint64_t msgs = 0, bytes = 0;
+	std::chrono::steady_clock::time_point start, last_report;
+} g_bulk_stats;
 
 YError::YError(const std::string &s) : m_str(s)
 {}
@@ -494,6 +504,113 @@ int exm_create_msg(uint64_t parent_fld, MESSAGE_CONTENT *ctnt)
 	return 0;
 }
 
+static void exm_bulk_release()
+{
+	for (auto &m : g_bulk_msgs)
+		message_content_free_internal(&m);
+	g_bulk_msgs.clear();
+	g_bulk_fids.clear();
+	g_bulk_bytes = 0;
+}
+
+static void exm_bulk_report(bool final)
+{
+	auto now = std::chrono::steady_clock::now();
+	if (!final && now - g_bulk_stats.last_report < std::chrono::seconds(5))
+		return;
+	g_bulk_stats.last_report = now;
+	double secs = std::chrono::duration<double>(now - g_bulk_stats.start).count();
+	double mib  = g_bulk_stats.bytes / 1048576.0;
+	if (secs <= 0)
+		secs = 1e-9;
+	fprintf(stderr, "exm: %llu messages (%.1f MiB) imported, %.0f msg/s, %.1f MiB/s\n",
+	        static_cast<unsigned long long>(g_bulk_stats.msgs), mib,
+	        g_bulk_stats.msgs / secs, mib / secs);
+}
+
+/**
+ * Write out the pending batch. Should the server reject it (which rolls back
+ * all of it) or not support bulk writes at all, the messages are resubmitted
+ * one by one so that only the culprit is lost.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE like the other exm_* entry points
+ * used by mt2exm's main loop.
+ */
+int exm_bulk_flush(bool final)
+{
+	if (g_bulk_msgs.empty()) {
+		if (final && g_bulk_stats.msgs > 0)
+			exm_bulk_report(true);
+		return EXIT_SUCCESS;
+	}
+	auto cl_0 = make_scope_exit(exm_bulk_release);
+	size_t count = g_bulk_msgs.size();
+	ec_error_t e_result = ecRpcFailed;
+	uint32_t failed = 0;
+	int ret = EXIT_SUCCESS;
+	if (!exmdb_client::write_messages(g_storedir, g_dstuser.c_str(),
+	    CP_UTF8, count, g_bulk_fids.data(), g_bulk_msgs.data(),
+	    &e_result, &failed)) {
+		fprintf(stderr, "exm: write_messages RPC failed (server too old for bulk mode?); retrying individually\n");
+		e_result = ecRpcFailed;
+	} else if (e_result != ecSuccess) {
+		fprintf(stderr, "exm: write_messages: message %u of batch: %s; retrying individually\n",
+		        failed, mapi_strerror(e_result));
+	}
+	if (e_result != ecSuccess) {
+		count = 0;
+		for (size_t i = 0; i < g_bulk_msgs.size(); ++i) {
+			if (exm_create_msg(g_bulk_fids[i], &g_bulk_msgs[i]) != 0) {
+				fprintf(stderr, "exm: message %zu of batch could not be imported\n", i);
+				ret = EXIT_FAILURE;
+				continue;
+			}
+			++count;
+		}
+	}
+	g_bulk_stats.msgs  += count;
+	g_bulk_stats.bytes += g_bulk_bytes;
+	exm_bulk_report(final);
+	return ret;
+}
+
+/**
+ * Queue a message for exm_bulk_flush. Ownership of @ctnt's contents passes to
+ * the batch and *@ctnt is left empty. @srcsize is only used for the
+ * throughput figures and the batch size cap. Returns EXIT_SUCCESS or
+ * EXIT_FAILURE.
+ */
+int exm_bulk_add(uint64_t parent_fld, MESSAGE_CONTENT *ctnt, size_t srcsize)
+{
+	if (g_bulk_stats.msgs == 0 && g_bulk_msgs.empty())
+		g_bulk_stats.start = g_bulk_stats.last_report = std::chrono::steady_clock::now();
+	/* Identifiers are handed out by the server in the same transaction. */
+	auto props = &ctnt->proplist;
+	props->erase(PidTagMid);
+	props->erase(PidTagChangeNumber);
+	props->erase(PR_CHANGE_KEY);
+	props->erase(PR_PREDECESSOR_CHANGE_LIST);
+	if (!props->has(PR_LAST_MODIFICATION_TIME)) {
+		auto last_time = rop_util_current_nttime();
+		auto ret = props->set(PR_LAST_MODIFICATION_TIME, &last_time);
+		if (ret != 0) {
+			fprintf(stderr, "exm: tpropval: %s\n", strerror(-ret));
+			return EXIT_FAILURE;
+		}
+	}
+	g_bulk_fids.push_back(parent_fld);
+	try {
+		g_bulk_msgs.push_back(*ctnt);
+	} catch (const std::bad_alloc &) {
+		g_bulk_fids.pop_back();
+		throw;
+	}
+	*ctnt = {};
+	g_bulk_bytes += srcsize;
+	if (g_bulk_msgs.size() >= g_bulk_max || g_bulk_bytes >= BULK_MAX_BYTES)
+		return exm_bulk_flush();
+	return 0;
+}
+
 static std::string sql_escape(MYSQL *sqh, const char *in)
 {
 	std::string out;
@@ -85,6 +85,7 @@ static constexpr unsigned int DELIVERY_TWOSTEP = 0x8000;
 
 extern const char *g_storedir;
 extern unsigned int g_user_id, g_show_tree, g_show_props, g_wet_run, g_public_folder;
+extern unsigned int g_bulk_max;
 
 extern void tree(unsigned int d);
 extern void tlog(const char *f, ...) __attribute__((format(printf, 1, 2)));
@@ -103,6 +104,8 @@ extern int exm_create_folder(uint64_t parent_fld, TPROPVAL_ARRAY *props, bool o_
 extern int exm_permissions(eid_t, const std::vector<PERMISSION_DATA> &);
 extern int exm_deliver_msg(const char *target, MESSAGE_CONTENT *, unsigned int flags = 0);
 extern int exm_create_msg(uint64_t parent_fld, MESSAGE_CONTENT *);
+extern int exm_bulk_add(uint64_t parent_fld, MESSAGE_CONTENT *, size_t srcsize);
+extern int exm_bulk_flush(bool final = false);
 extern void gi_setup_early(const char *dstmbox);
 extern int gi_setup();
 extern int gi_setup_from_dir();
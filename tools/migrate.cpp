@@ -0,0 +1,328 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Runs many <extractor> | gromox-mt2exm pipelines concurrently, as listed in
+ * a mapping file. The MT stream is relayed through a fixed-size buffer so
+ * that the per-mailbox byte count is known.
+ */
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <spawn.h>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <libHX/ctype_helper.h>
+#include <libHX/io.h>
+#include <libHX/option.h>
+#include <libHX/string.h>
+#include <sys/wait.h>
+#include <gromox/fileio.h>
+#include <gromox/scope.hpp>
+
+extern "C" {
+extern char **environ;
+}
+
+using namespace gromox;
+
+namespace {
+
+struct file_actions {
+	file_actions() { posix_spawn_file_actions_init(&m_act); }
+	~file_actions() { posix_spawn_file_actions_destroy(&m_act); }
+	posix_spawn_file_actions_t *operator&() { return &m_act; }
+	posix_spawn_file_actions_t m_act;
+};
+
+struct spawn_attr {
+	spawn_attr() { posix_spawnattr_init(&m_attr); }
+	~spawn_attr() { posix_spawnattr_destroy(&m_attr); }
+	posix_spawnattr_t *operator&() { return &m_attr; }
+	posix_spawnattr_t m_attr;
+};
+
+struct mig_job {
+	unsigned int lineno = 0;
+	std::string tool, target;
+	std::vector<std::string> args;
+	/* results */
+	bool ok = false;
+	unsigned int attempts = 0;
+	uint64_t bytes = 0;
+	double secs = 0;
+};
+
+}
+
+static unsigned int g_jobs = 4, g_retry, g_bulk;
+static char *g_logdir;
+static constexpr size_t RELAY_BUFSIZE = 256 * 1024;
+static constexpr HXoption g_options_table[] = {
+	{nullptr, 'j', HXTYPE_UINT, &g_jobs, {}, {}, 0, "Number of concurrent pipelines (default: 4)", "N"},
+	{"bulk", 0, HXTYPE_UINT, &g_bulk, {}, {}, 0, "Pass --bulk=N to gromox-mt2exm", "N"},
+	{"logdir", 0, HXTYPE_STRING, &g_logdir, {}, {}, 0, "Write each pipeline's stderr to DIR/<line>-<target>.log", "DIR"},
+	{"retry", 0, HXTYPE_UINT, &g_retry, {}, {}, 0, "Rerun a failed pipeline up to N times", "N"},
+	HXOPT_AUTOHELP,
+	HXOPT_TABLEEND,
+};
+
+static bool read_mapping(const char *file, std::vector<mig_job> &jobs)
+{
+	std::unique_ptr<FILE, file_deleter> fp(strcmp(file, "-") == 0 ?
+		fdopen(dup(STDIN_FILENO), "r") : fopen(file, "r"));
+	if (fp == nullptr) {
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		return false;
+	}
+	hxmc_t *line = nullptr;
+	auto cl_0 = make_scope_exit([&]() { HXmc_free(line); });
+	unsigned int lineno = 0;
+	while (HX_getl(&line, fp.get()) != nullptr) {
+		++lineno;
+		HX_chomp(line);
+		auto hash = strchr(line, '#');
+		if (hash != nullptr)
+			*hash = '\0';
+		std::istringstream iss(line);
+		std::vector<std::string> words;
+		for (std::string w; iss >> w; )
+			words.push_back(std::move(w));
+		if (words.empty())
+			continue;
+		if (words.size() < 3) {
+			fprintf(stderr, "%s:%u: expected \"<tool> <target> <source...>\"\n", file, lineno);
+			return false;
+		}
+		mig_job j;
+		j.lineno = lineno;
+		j.tool   = std::move(words[0]);
+		j.target = std::move(words[1]);
+		j.args.assign(std::make_move_iterator(words.begin() + 2),
+			std::make_move_iterator(words.end()));
+		if (j.tool.find('/') == j.tool.npos)
+			j.tool.insert(0, "gromox-");
+		jobs.push_back(std::move(j));
+	}
+	return true;
+}
+
+static int wait_child(pid_t pid)
+{
+	int status = 0;
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return -1;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * Spawn @argv with @fd_in/@fd_out (if not -1) as stdin/stdout and all other
+ * pipe ends closed. SIGPIPE is reset to default in the child, since the
+ * driver itself ignores it.
+ */
+static pid_t mig_spawn(const std::vector<const char *> &argv, int fd_in,
+    int fd_out, int fd_err, const int (&cl)[4])
+{
+	file_actions fa;
+	spawn_attr attr;
+	sigset_t sigdef;
+	sigemptyset(&sigdef);
+	sigaddset(&sigdef, SIGPIPE);
+	if (posix_spawnattr_setsigdefault(&attr, &sigdef) != 0 ||
+	    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF) != 0)
+		return -1;
+	if (fd_in >= 0 && posix_spawn_file_actions_adddup2(&fa, fd_in, STDIN_FILENO) != 0)
+		return -1;
+	if (fd_out >= 0 && posix_spawn_file_actions_adddup2(&fa, fd_out, STDOUT_FILENO) != 0)
+		return -1;
+	if (fd_err >= 0 && posix_spawn_file_actions_adddup2(&fa, fd_err, STDERR_FILENO) != 0)
+		return -1;
+	for (auto fd : cl)
+		if (fd > STDERR_FILENO && posix_spawn_file_actions_addclose(&fa, fd) != 0)
+			return -1;
+	if (fd_err > STDERR_FILENO && posix_spawn_file_actions_addclose(&fa, fd_err) != 0)
+		return -1;
+	pid_t pid = -1;
+	auto ret = posix_spawnp(&pid, argv[0], &fa, &attr,
+	           const_cast<char **>(argv.data()), environ);
+	if (ret != 0) {
+		fprintf(stderr, "spawnp %s: %s\n", argv[0], strerror(ret));
+		return -1;
+	}
+	return pid;
+}
+
+static bool mig_run_once(mig_job &job, char *buf, int logfd)
+{
+	std::vector<const char *> xargv{job.tool.c_str()};
+	for (const auto &a : job.args)
+		xargv.push_back(a.c_str());
+	xargv.push_back(nullptr);
+	auto bulkarg = "--bulk=" + std::to_string(g_bulk);
+	std::vector<const char *> iargv{"gromox-mt2exm", "-u", job.target.c_str()};
+	if (g_bulk > 0)
+		iargv.push_back(bulkarg.c_str());
+	iargv.push_back(nullptr);
+
+	/* [0],[1]: extractor->driver; [2],[3]: driver->mt2exm */
+	int pfd[4] = {-1, -1, -1, -1};
+	auto cl_0 = make_scope_exit([&]() {
+		for (auto fd : pfd)
+			if (fd >= 0)
+				close(fd);
+	});
+	if (pipe2(&pfd[0], O_CLOEXEC) < 0 || pipe2(&pfd[2], O_CLOEXEC) < 0) {
+		fprintf(stderr, "pipe: %s\n", strerror(errno));
+		return false;
+	}
+	auto xpid = mig_spawn(xargv, -1, pfd[1], logfd, pfd);
+	if (xpid < 0)
+		return false;
+	auto ipid = mig_spawn(iargv, pfd[2], -1, logfd, pfd);
+	if (ipid < 0) {
+		close(pfd[0]);
+		pfd[0] = -1;
+		wait_child(xpid);
+		return false;
+	}
+	close(pfd[1]);
+	close(pfd[2]);
+	pfd[1] = pfd[2] = -1;
+
+	bool relay_ok = true;
+	while (true) {
+		auto rd = read(pfd[0], buf, RELAY_BUFSIZE);
+		if (rd < 0 && errno == EINTR)
+			continue;
+		if (rd < 0) {
+			relay_ok = false;
+			break;
+		}
+		if (rd == 0)
+			break;
+		if (HXio_fullwrite(pfd[3], buf, rd) < 0) {
+			/* importer went away; the extractor will get SIGPIPE */
+			relay_ok = false;
+			break;
+		}
+		job.bytes += rd;
+	}
+	close(pfd[0]);
+	close(pfd[3]);
+	pfd[0] = pfd[3] = -1;
+	auto xret = wait_child(xpid);
+	auto iret = wait_child(ipid);
+	if (xret != 0 || iret != 0)
+		fprintf(stderr, "migrate: line %u (%s): %s exit %d, mt2exm exit %d\n",
+		        job.lineno, job.target.c_str(), job.tool.c_str(), xret, iret);
+	return relay_ok && xret == 0 && iret == 0;
+}
+
+/**
+ * Log file name for @job: the mapfile line number keeps it unique, the
+ * target is only added for the reader's benefit and restricted to a safe
+ * character set so that it cannot escape the log directory.
+ */
+static std::string mig_logname(const mig_job &job)
+{
+	auto name = std::to_string(job.lineno) + "-";
+	for (auto c : job.target)
+		name += HX_isalnum(c) || c == '@' || c == '-' || c == '_' ||
+		        c == '.' || c == '+' ? c : '_';
+	return name + ".log";
+}
+
+static void mig_run(mig_job &job, char *buf)
+{
+	int logfd = -1;
+	if (g_logdir != nullptr) {
+		auto path = std::string(g_logdir) + "/" + mig_logname(job);
+		logfd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+		if (logfd < 0)
+			fprintf(stderr, "migrate: %s: %s\n", path.c_str(), strerror(errno));
+	}
+	auto cl_0 = make_scope_exit([&]() {
+		if (logfd >= 0)
+			close(logfd);
+	});
+	auto start = std::chrono::steady_clock::now();
+	for (job.attempts = 1; job.attempts <= g_retry + 1; ++job.attempts) {
+		if (job.attempts > 1) {
+			fprintf(stderr, "migrate: line %u (%s): retrying (%u/%u)\n",
+			        job.lineno, job.target.c_str(), job.attempts - 1, g_retry);
+			sleep(std::min(job.attempts * 5, 60U));
+		}
+		job.bytes = 0;
+		start = std::chrono::steady_clock::now();
+		job.ok = mig_run_once(job, buf, logfd);
+		if (job.ok)
+			break;
+	}
+	if (job.attempts > g_retry + 1)
+		job.attempts = g_retry + 1;
+	job.secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	double mib = job.bytes / 1048576.0;
+	fprintf(stderr, "migrate: %s %s: %.1f MiB in %.0f s (%.1f MiB/s), %u attempt(s)\n",
+	        job.ok ? "done" : "FAILED", job.target.c_str(), mib, job.secs,
+	        job.secs > 0 ? mib / job.secs : 0, job.attempts);
+}
+
+int main(int argc, const char **argv) try
+{
+	setvbuf(stdout, nullptr, _IOLBF, 0);
+	if (HX_getopt(g_options_table, &argc, &argv, HXOPT_USAGEONERR) != HXOPT_ERR_SUCCESS)
+		return EXIT_FAILURE;
+	if (argc != 2) {
+		fprintf(stderr, "Usage: gromox-migrate [-j N] [--retry=N] [--bulk=N] [--logdir=DIR] mapfile\n");
+		fprintf(stderr, "Documentation: man gromox-migrate\n");
+		return EXIT_FAILURE;
+	}
+	if (g_jobs == 0)
+		g_jobs = 1;
+	std::vector<mig_job> jobs;
+	if (!read_mapping(argv[1], jobs))
+		return EXIT_FAILURE;
+	if (jobs.empty())
+		return EXIT_SUCCESS;
+	signal(SIGPIPE, SIG_IGN);
+	std::atomic<size_t> next{0};
+	auto worker = [&]() {
+		std::unique_ptr<char[]> buf(new char[RELAY_BUFSIZE]);
+		for (size_t i; (i = next++) < jobs.size(); )
+			mig_run(jobs[i], buf.get());
+	};
+	std::vector<std::thread> thr;
+	auto nthr = std::min(static_cast<size_t>(g_jobs), jobs.size());
+	for (size_t i = 0; i < nthr; ++i)
+		thr.emplace_back(worker);
+	for (auto &t : thr)
+		t.join();
+
+	size_t nfail = 0;
+	uint64_t tbytes = 0;
+	for (const auto &j : jobs) {
+		tbytes += j.bytes;
+		if (!j.ok)
+			++nfail;
+	}
+	printf("%zu mailbox(es), %zu failed, %.1f MiB total\n",
+	       jobs.size(), nfail, tbytes / 1048576.0);
+	for (const auto &j : jobs)
+		if (!j.ok)
+			printf("failed: line %u: %s\n", j.lineno, j.target.c_str());
+	return nfail == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+} catch (const std::exception &e) {
+	fprintf(stderr, "migrate: %s\n", e.what());
+	return EXIT_FAILURE;
+}
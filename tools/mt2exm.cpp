@@ -81,6 +81,7 @@ static constexpr HXoption g_options_table[] = {
 	{nullptr, 't', HXTYPE_NONE, &g_show_tree, nullptr, nullptr, 0, "Show tree-based analysis of the archive"},
 	{nullptr, 'u', HXTYPE_STRING, &g_username, nullptr, nullptr, 0, "Username of store to import to", "EMAILADDR"},
 	{nullptr, 'x', HXTYPE_VAL, &g_oexcl, nullptr, nullptr, 0, "Disable O_EXCL like behavior for non-spliced folders"},
+	{"bulk", 0, HXTYPE_UINT, &g_bulk_max, {}, {}, 0, "Write up to N messages per server transaction (0=off)", "N"},
 	{"repeat", 0, HXTYPE_UINT, &g_repeat_iter, {}, {}, 0, "For testing purposes, import each message N times", "N"},
 	{"skip-notif", 0, HXTYPE_NONE, &g_skip_notif, nullptr, nullptr, 0, "Skip emission of notifications (if -D)"},
 	{"skip-rules", 0, HXTYPE_NONE, &g_skip_rules, nullptr, nullptr, 0, "Skip execution of rules (if -D)"},
@@ -321,7 +322,7 @@ static int exm_folder(const ob_desc &obd, TPROPVAL_ARRAY &props,
 	return 0;
 }
 
-static int exm_message(const ob_desc &obd, MESSAGE_CONTENT &ctnt)
+static int exm_message(const ob_desc &obd, MESSAGE_CONTENT &ctnt, size_t srcsize)
 {
 	if (g_show_tree)
 		printf("exm: Message %lxh (parent=%llxh)\n",
@@ -341,6 +342,8 @@ static int exm_message(const ob_desc &obd, MESSAGE_CONTENT &ctnt)
 		tlog("adjusted properties:\n");
 		gi_dump_msgctnt(0, ctnt);
 	}
+	if (!g_do_delivery && g_bulk_max > 0)
+		return exm_bulk_add(folder_it->second.fid_to, &ctnt, srcsize);
 	if (!g_do_delivery) {
 		for (auto i = 0U; i < g_repeat_iter; ++i) {
 			if (i > 0 && i % 1024 == 0)
@@ -424,7 +427,7 @@ static int exm_packet(const void *buf, size_t bufsize)
 		auto cl_0 = make_scope_exit([&]() { message_content_free_internal(&ctnt); });
 		if (ep.g_msgctnt(&ctnt) != EXT_ERR_SUCCESS)
 			throw YError("PG-1119");
-		return exm_message(obd, ctnt);
+		return exm_message(obd, ctnt, bufsize);
 	}
 	throw YError("PG-1117: unknown obd.mapitype %u", static_cast<unsigned int>(obd.mapitype));
 }
@@ -458,6 +461,10 @@ int main(int argc, const char **argv) try
 		g_do_delivery = true;
 	if (g_do_delivery && g_anchor_folder != 0)
 		fprintf(stderr, "mt2exm: -B option has no effect when -D is used\n");
+	if (g_bulk_max > 0 && (g_do_delivery || g_repeat_iter != 1)) {
+		fprintf(stderr, "mt2exm: --bulk has no effect with -D or --repeat\n");
+		g_bulk_max = 0;
+	}
 	if (iconv_validate() != 0)
 		return EXIT_FAILURE;
 	gi_setup_early(g_username);
@@ -486,6 +493,11 @@ int main(int argc, const char **argv) try
 			break;
 		}
 	}
+	if (iret == EXIT_SUCCESS || g_continuous_mode) {
+		auto ret = exm_bulk_flush(true);
+		if (ret != EXIT_SUCCESS)
+			iret = ret;
+	}
 	gi_dump_thru_map(g_thru_name_map);
 	return iret;
 } catch (const std::exception &e) {